@@ -3,6 +3,13 @@
 
 #include "allegro5/internal/aintern_acodec_cfg.h"
 
+ALLEGRO_FILE *_al_acodec_open_memory(const void *data, size_t size);
+void *_al_acodec_read_file(ALLEGRO_FILE *fp, size_t *size);
+int _al_acodec_get_parallel_ranges(uint64_t frames, unsigned int freq);
+bool _al_acodec_decode_parallel(uint64_t frames, int num_ranges,
+   bool (*decode)(void *userdata, uint64_t start, uint64_t end),
+   void *userdata);
+
 ALLEGRO_SAMPLE *_al_load_wav(const char *filename);
 ALLEGRO_SAMPLE *_al_load_wav_f(ALLEGRO_FILE *fp);
 ALLEGRO_AUDIO_STREAM *_al_load_wav_audio_stream(const char *filename,
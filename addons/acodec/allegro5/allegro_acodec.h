@@ -32,6 +32,13 @@ extern "C" {
 ALLEGRO_ACODEC_FUNC(bool, al_init_acodec_addon, (void));
 ALLEGRO_ACODEC_FUNC(uint32_t, al_get_allegro_acodec_version, (void));
 
+ALLEGRO_ACODEC_FUNC(ALLEGRO_SAMPLE *, al_load_cached_sample, (const char *filename));
+ALLEGRO_ACODEC_FUNC(ALLEGRO_SAMPLE *, al_load_cached_sample_f, (ALLEGRO_FILE *fp, const char *ident));
+ALLEGRO_ACODEC_FUNC(bool, al_prefetch_cached_sample, (ALLEGRO_SAMPLE *spl));
+ALLEGRO_ACODEC_FUNC(void, al_set_sample_cache_size, (size_t size));
+ALLEGRO_ACODEC_FUNC(size_t, al_get_sample_cache_size, (void));
+ALLEGRO_ACODEC_FUNC(size_t, al_get_sample_cache_usage, (void));
+
 
 #ifdef __cplusplus
 }
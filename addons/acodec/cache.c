@@ -0,0 +1,385 @@
+/*
+ * Allegro5 decoded sample cache.
+ *
+ * Cached samples keep the file's compressed bytes in memory and decode them
+ * when they are played.  The decoded data of samples which haven't been
+ * played for the longest time is freed when the total exceeds the cache size.
+ */
+
+#include <string.h>
+
+#include "allegro5/allegro.h"
+#include "allegro5/allegro_acodec.h"
+#include "allegro5/allegro_audio.h"
+#include "allegro5/internal/aintern.h"
+#include "allegro5/internal/aintern_audio.h"
+#include "allegro5/internal/aintern_thread_pool.h"
+#include "allegro5/internal/aintern_vector.h"
+#include "acodec.h"
+
+ALLEGRO_DEBUG_CHANNEL("acodec")
+
+#define DEFAULT_CACHE_SIZE    (64 * 1024 * 1024)
+
+
+typedef struct CACHE_ENTRY CACHE_ENTRY;
+
+struct CACHE_ENTRY {
+   ALLEGRO_SAMPLE *spl;       /* the sample given to the user */
+   char *ident;
+   void *data;                /* the file */
+   size_t data_size;
+
+   /* While the data is being decoded on the shared thread pool.  The task
+    * leaves its result in `decoded', which is only looked at once the group
+    * has finished.  Its buffer is NULL if decoding failed.
+    */
+   ALLEGRO_TASK_GROUP *decoding;
+   ALLEGRO_SAMPLE decoded;
+
+   /* The size of the decoded data while it is resident. */
+   size_t resident_size;
+
+   /* Resident entries, most recently played first. */
+   CACHE_ENTRY *prev, *next;
+};
+
+
+static size_t cache_size = DEFAULT_CACHE_SIZE;
+static size_t cache_usage = 0;
+static CACHE_ENTRY *lru_first = NULL;
+static CACHE_ENTRY *lru_last = NULL;
+
+/* Entries with a decode in flight. */
+static _AL_VECTOR decoding_entries = _AL_VECTOR_INITIALIZER(CACHE_ENTRY *);
+
+static bool cache_page_in(ALLEGRO_SAMPLE *spl);
+static void cache_destroy(ALLEGRO_SAMPLE *spl);
+
+static const _AL_SAMPLE_PAGER cache_pager = {
+   cache_page_in,
+   cache_destroy
+};
+
+
+/* Least recently played list. */
+
+static void lru_unlink(CACHE_ENTRY *entry)
+{
+   if (entry->prev)
+      entry->prev->next = entry->next;
+   else
+      lru_first = entry->next;
+   if (entry->next)
+      entry->next->prev = entry->prev;
+   else
+      lru_last = entry->prev;
+   entry->prev = entry->next = NULL;
+}
+
+
+static void lru_push_first(CACHE_ENTRY *entry)
+{
+   entry->prev = NULL;
+   entry->next = lru_first;
+   if (lru_first)
+      lru_first->prev = entry;
+   else
+      lru_last = entry;
+   lru_first = entry;
+}
+
+
+/* Free the decoded data of an entry, keeping its format. */
+static void page_out(CACHE_ENTRY *entry)
+{
+   ALLEGRO_SAMPLE *spl = entry->spl;
+
+   ALLEGRO_DEBUG("Evicting %lu bytes\n", (unsigned long) entry->resident_size);
+
+   if (spl->free_buf)
+      al_free(spl->buffer.ptr);
+   _al_kcm_unmap_sample(spl);
+   spl->buffer.ptr = NULL;
+   spl->free_buf = false;
+
+   cache_usage -= entry->resident_size;
+   entry->resident_size = 0;
+   lru_unlink(entry);
+}
+
+
+/* Evict the least recently played data until the cache fits, except for
+ * `keep' and data some instance still refers to.
+ */
+static void shrink_cache(CACHE_ENTRY *keep)
+{
+   CACHE_ENTRY *entry = lru_last;
+
+   while (cache_usage > cache_size && entry) {
+      CACHE_ENTRY *prev = entry->prev;
+      if (entry != keep && !_al_kcm_sample_in_use(entry->spl))
+         page_out(entry);
+      entry = prev;
+   }
+}
+
+
+static void decode_task(void *arg)
+{
+   CACHE_ENTRY *entry = arg;
+   ALLEGRO_FILE *fp = _al_acodec_open_memory(entry->data, entry->data_size);
+
+   if (fp) {
+      ALLEGRO_SAMPLE *spl = al_load_sample_f(fp, entry->ident);
+      if (spl)
+         _al_kcm_move_sample_data(&entry->decoded, spl);
+      al_fclose(fp);
+   }
+}
+
+
+static bool start_decode(CACHE_ENTRY *entry)
+{
+   ALLEGRO_THREAD_POOL *pool = _al_get_shared_thread_pool();
+   CACHE_ENTRY **slot;
+
+   ASSERT(!entry->decoding);
+
+   if (!pool)
+      return false;
+
+   slot = _al_vector_alloc_back(&decoding_entries);
+   if (!slot)
+      return false;
+   *slot = entry;
+
+   entry->decoding = al_create_task_group(pool);
+   if (!entry->decoding ||
+         !al_submit_task(pool, entry->decoding, decode_task, entry)) {
+      al_destroy_task_group(entry->decoding);
+      entry->decoding = NULL;
+      _al_vector_find_and_delete(&decoding_entries, &entry);
+      return false;
+   }
+
+   return true;
+}
+
+
+/* Move the data decoded by a finished task into the user's sample. */
+static bool finish_decode(CACHE_ENTRY *entry)
+{
+   ALLEGRO_SAMPLE *spl = entry->spl;
+   ALLEGRO_SAMPLE *decoded = &entry->decoded;
+
+   ASSERT(entry->decoding);
+   ASSERT(!spl->buffer.ptr);
+
+   al_destroy_task_group(entry->decoding);
+   entry->decoding = NULL;
+   _al_vector_find_and_delete(&decoding_entries, &entry);
+
+   if (!decoded->buffer.ptr) {
+      ALLEGRO_ERROR("Could not decode %s sample\n", entry->ident);
+      return false;
+   }
+
+   spl->depth = decoded->depth;
+   spl->chan_conf = decoded->chan_conf;
+   spl->frequency = decoded->frequency;
+   spl->len = decoded->len;
+   spl->buffer = decoded->buffer;
+   spl->free_buf = decoded->free_buf;
+   spl->mapping = decoded->mapping;
+   spl->mapping_size = decoded->mapping_size;
+   memset(decoded, 0, sizeof(*decoded));
+
+   entry->resident_size = spl->len * al_get_channel_count(spl->chan_conf) *
+      al_get_audio_depth_size(spl->depth);
+   cache_usage += entry->resident_size;
+   lru_push_first(entry);
+
+   shrink_cache(entry);
+   return true;
+}
+
+
+/* Take in the results of decodes which finished in the background. */
+static void poll_decodes(void)
+{
+   int i;
+
+   for (i = _al_vector_size(&decoding_entries) - 1; i >= 0; i--) {
+      CACHE_ENTRY **slot = _al_vector_ref(&decoding_entries, i);
+      CACHE_ENTRY *entry = *slot;
+      if (al_is_task_group_finished(entry->decoding))
+         finish_decode(entry);
+   }
+}
+
+
+static bool cache_page_in(ALLEGRO_SAMPLE *spl)
+{
+   CACHE_ENTRY *entry = spl->pager_data;
+
+   poll_decodes();
+
+   if (spl->buffer.ptr) {
+      lru_unlink(entry);
+      lru_push_first(entry);
+      return true;
+   }
+
+   if (!entry->decoding && !start_decode(entry))
+      return false;
+
+   /* The waiting thread helps with the pool's work, so the decode starts
+    * right away even if all the workers are busy.
+    */
+   al_wait_for_task_group(entry->decoding);
+   return finish_decode(entry);
+}
+
+
+static void cache_destroy(ALLEGRO_SAMPLE *spl)
+{
+   CACHE_ENTRY *entry = spl->pager_data;
+
+   if (entry->decoding) {
+      al_destroy_task_group(entry->decoding);
+      entry->decoding = NULL;
+      _al_vector_find_and_delete(&decoding_entries, &entry);
+      if (entry->decoded.free_buf)
+         al_free(entry->decoded.buffer.ptr);
+      _al_kcm_unmap_sample(&entry->decoded);
+   }
+
+   if (spl->buffer.ptr) {
+      /* al_destroy_sample frees the buffer itself. */
+      cache_usage -= entry->resident_size;
+      lru_unlink(entry);
+   }
+
+   if (_al_vector_is_empty(&decoding_entries))
+      _al_vector_free(&decoding_entries);
+
+   al_free(entry->data);
+   al_free(entry->ident);
+   al_free(entry);
+   spl->pager_data = NULL;
+}
+
+
+/* Function: al_load_cached_sample_f
+ */
+ALLEGRO_SAMPLE *al_load_cached_sample_f(ALLEGRO_FILE *fp, const char *ident)
+{
+   CACHE_ENTRY *entry;
+
+   ASSERT(fp);
+   ASSERT(ident);
+
+   entry = al_calloc(1, sizeof(*entry));
+   if (!entry)
+      return NULL;
+
+   entry->ident = al_malloc(strlen(ident) + 1);
+   if (!entry->ident)
+      goto Error;
+   strcpy(entry->ident, ident);
+
+   entry->data = _al_acodec_read_file(fp, &entry->data_size);
+   if (!entry->data) {
+      ALLEGRO_ERROR("Error reading %s file\n", ident);
+      goto Error;
+   }
+
+   entry->spl = _al_kcm_create_paged_sample(&cache_pager, entry);
+   if (!entry->spl)
+      goto Error;
+
+   return entry->spl;
+
+Error:
+   al_free(entry->data);
+   al_free(entry->ident);
+   al_free(entry);
+   return NULL;
+}
+
+
+/* Function: al_load_cached_sample
+ */
+ALLEGRO_SAMPLE *al_load_cached_sample(const char *filename)
+{
+   ALLEGRO_FILE *fp;
+   ALLEGRO_SAMPLE *spl;
+   const char *ext;
+
+   ASSERT(filename);
+
+   ext = strrchr(filename, '.');
+   if (ext == NULL)
+      return NULL;
+
+   fp = al_fopen(filename, "rb");
+   if (!fp)
+      return NULL;
+
+   spl = al_load_cached_sample_f(fp, ext);
+   al_fclose(fp);
+
+   return spl;
+}
+
+
+/* Function: al_prefetch_cached_sample
+ */
+bool al_prefetch_cached_sample(ALLEGRO_SAMPLE *spl)
+{
+   CACHE_ENTRY *entry;
+
+   ASSERT(spl);
+
+   poll_decodes();
+
+   if (spl->pager != &cache_pager)
+      return false;
+
+   entry = spl->pager_data;
+   if (spl->buffer.ptr || entry->decoding)
+      return true;
+
+   return start_decode(entry);
+}
+
+
+/* Function: al_set_sample_cache_size
+ */
+void al_set_sample_cache_size(size_t size)
+{
+   cache_size = size;
+   poll_decodes();
+   shrink_cache(NULL);
+}
+
+
+/* Function: al_get_sample_cache_size
+ */
+size_t al_get_sample_cache_size(void)
+{
+   return cache_size;
+}
+
+
+/* Function: al_get_sample_cache_usage
+ */
+size_t al_get_sample_cache_usage(void)
+{
+   poll_decodes();
+   return cache_usage;
+}
+
+
+/* vim: set sts=3 sw=3 et: */
@@ -13,7 +13,6 @@
 #include "allegro5/internal/aintern_exitfunc.h"
 #include "allegro5/internal/aintern_system.h"
 #include "acodec.h"
-#include "helper.h"
 
 #ifndef ALLEGRO_CFG_ACODEC_FLAC
    #error configuration problem, ALLEGRO_CFG_ACODEC_FLAC not set
@@ -21,6 +20,9 @@
 
 #include <FLAC/stream_decoder.h>
 #include <stdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 ALLEGRO_DEBUG_CHANNEL("acodec")
 
@@ -28,12 +30,19 @@ ALLEGRO_DEBUG_CHANNEL("acodec")
 typedef struct FLACFILE {
    FLAC__StreamDecoder *decoder;
    double sample_rate;
-   int sample_size;
+   int bits_per_sample;
    int channels;
 
+   /* The format decoded samples are converted to. */
+   ALLEGRO_AUDIO_DEPTH depth;
+   int sample_size;
+   int shift;     /* left shift to the integer depth's range */
+   float scale;   /* scale to [-1, 1) for float32 */
+
    /* The file buffer. */
    uint64_t buffer_pos, buffer_size;
    char *buffer;
+   bool fixed_buffer;   /* part of a larger buffer, must not be resized */
 
    /* Number of samples in the complete FLAC. */
    uint64_t total_samples;
@@ -77,6 +86,7 @@ static struct
    FLAC__bool (*FLAC__stream_decoder_flush)(FLAC__StreamDecoder *decoder);
    FLAC__bool (*FLAC__stream_decoder_finish)(FLAC__StreamDecoder *decoder);
 } lib;
+static bool lib_inited = false;
 
 
 #ifdef ALLEGRO_CFG_ACODEC_FLAC_DLL
@@ -86,6 +96,7 @@ static void shutdown_dynlib(void)
       _al_close_library(flac_dll);
       flac_dll = NULL;
       flac_virgin = true;
+      lib_inited = false;
    }
 }
 #endif
@@ -93,6 +104,13 @@ static void shutdown_dynlib(void)
 
 static bool init_dynlib(void)
 {
+   /* The table is filled once and never cleared while in use: loaders call
+    * this while decoder threads of other loads may be calling through it.
+    */
+   if (lib_inited) {
+      return true;
+   }
+
 #ifdef ALLEGRO_CFG_ACODEC_FLAC_DLL
    if (flac_dll) {
       return true;
@@ -125,8 +143,6 @@ static bool init_dynlib(void)
    #define INITSYM(x)   (lib.x = (x))
 #endif
 
-   memset(&lib, 0, sizeof(lib));
-
    INITSYM(FLAC__stream_decoder_new);
    INITSYM(FLAC__stream_decoder_delete);
    INITSYM(FLAC__stream_decoder_init_stream);
@@ -137,6 +153,7 @@ static bool init_dynlib(void)
    INITSYM(FLAC__stream_decoder_flush);
    INITSYM(FLAC__stream_decoder_finish);
 
+   lib_inited = true;
    return true;
 
 #undef INITSYM
@@ -235,7 +252,7 @@ static void metadata_callback(const FLAC__StreamDecoder *decoder,
       out->total_samples = metadata->data.stream_info.total_samples;
       out->sample_rate = metadata->data.stream_info.sample_rate;
       out->channels = metadata->data.stream_info.channels;
-      out->sample_size = metadata->data.stream_info.bits_per_sample / 8;
+      out->bits_per_sample = metadata->data.stream_info.bits_per_sample;
    }
 }
 
@@ -256,82 +273,157 @@ static void error_callback(const FLAC__StreamDecoder *decoder,
 }
 
 
+/* Planar to interleaved conversions for write_callback.  Stereo, by far the
+ * most common layout, gets SSE2 versions.
+ */
+
+static void interleave_uint8(FLAC__uint8 *out, const FLAC__int32 * const in[],
+   int channels, long len, int shift)
+{
+   long i;
+   int c;
+
+   for (i = 0; i < len; i++) {
+      for (c = 0; c < channels; c++)
+         *out++ = (FLAC__uint8) ((in[c][i] << shift) + 0x80);
+   }
+}
+
+
+static void interleave_int16(FLAC__int16 *out, const FLAC__int32 * const in[],
+   int channels, long len, int shift)
+{
+   long i = 0;
+   int c;
+
+#ifdef __SSE2__
+   if (channels == 2 && shift == 0) {
+      for (; i + 4 <= len; i += 4) {
+         const __m128i l = _mm_loadu_si128((const __m128i *)(in[0] + i));
+         const __m128i r = _mm_loadu_si128((const __m128i *)(in[1] + i));
+         const __m128i lr = _mm_packs_epi32(l, r);
+         _mm_storeu_si128((__m128i *)(out + 2 * i),
+            _mm_unpacklo_epi16(lr, _mm_srli_si128(lr, 8)));
+      }
+   }
+#endif
+
+   for (; i < len; i++) {
+      for (c = 0; c < channels; c++)
+         out[i * channels + c] = (FLAC__int16) (in[c][i] << shift);
+   }
+}
+
+
+static void interleave_int32(FLAC__int32 *out, const FLAC__int32 * const in[],
+   int channels, long len, int shift)
+{
+   long i = 0;
+   int c;
+
+#ifdef __SSE2__
+   if (channels == 2) {
+      for (; i + 4 <= len; i += 4) {
+         const __m128i l = _mm_slli_epi32(
+            _mm_loadu_si128((const __m128i *)(in[0] + i)), shift);
+         const __m128i r = _mm_slli_epi32(
+            _mm_loadu_si128((const __m128i *)(in[1] + i)), shift);
+         _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi32(l, r));
+         _mm_storeu_si128((__m128i *)(out + 2 * i + 4),
+            _mm_unpackhi_epi32(l, r));
+      }
+   }
+#endif
+
+   for (; i < len; i++) {
+      for (c = 0; c < channels; c++)
+         out[i * channels + c] = in[c][i] << shift;
+   }
+}
+
+
+static void interleave_float(float *out, const FLAC__int32 * const in[],
+   int channels, long len, float scale)
+{
+   long i = 0;
+   int c;
+
+#ifdef __SSE2__
+   if (channels == 2) {
+      const __m128 s = _mm_set1_ps(scale);
+      for (; i + 4 <= len; i += 4) {
+         const __m128 l = _mm_mul_ps(s, _mm_cvtepi32_ps(
+            _mm_loadu_si128((const __m128i *)(in[0] + i))));
+         const __m128 r = _mm_mul_ps(s, _mm_cvtepi32_ps(
+            _mm_loadu_si128((const __m128i *)(in[1] + i))));
+         _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(l, r));
+         _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(l, r));
+      }
+   }
+#endif
+
+   for (; i < len; i++) {
+      for (c = 0; c < channels; c++)
+         out[i * channels + c] = (float) in[c][i] * scale;
+   }
+}
+
+
 static FLAC__StreamDecoderWriteStatus write_callback(
    const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
    const FLAC__int32 * const buffer[], void *client_data)
 {
    FLACFILE *ff = (FLACFILE *) client_data;
    long len = frame->header.blocksize;
-   long bytes = len * ff->channels * ff->sample_size;
-   FLAC__uint8 *buf8;
-   FLAC__int16 *buf16;
-   float *buf32;
-   int sample_index;
-   int channel_index;
-   int out_index;
+   uint64_t bytes = (uint64_t)len * ff->channels * ff->sample_size;
+   char *out;
 
-   if (ff->buffer_pos + bytes > ff->buffer_size) {
-      ff->buffer = al_realloc(ff->buffer, ff->buffer_pos + bytes);
-      ff->buffer_size = ff->buffer_pos + bytes;
-   }
+   (void)decoder;
 
-   /* FLAC returns FLAC__int32 and I need to convert it to my own format. */
-   buf8 = (FLAC__uint8 *) (ff->buffer + ff->buffer_pos);
-   buf16 = (FLAC__int16 *) buf8;
-   buf32 = (float *) buf8;
+   if (ff->fixed_buffer) {
+      /* Keep only what fits, the rest belongs to the next range. */
+      if (ff->buffer_pos + bytes > ff->buffer_size) {
+         len = (ff->buffer_size - ff->buffer_pos) /
+            (ff->channels * ff->sample_size);
+         bytes = (uint64_t)len * ff->channels * ff->sample_size;
+      }
+   }
+   else if (ff->buffer_pos + bytes > ff->buffer_size) {
+      /* Grow geometrically, the total length is not always known. */
+      uint64_t new_size = ff->buffer_size * 2;
+      char *new_buffer;
+      if (new_size < ff->buffer_pos + bytes)
+         new_size = ff->buffer_pos + bytes;
+      new_buffer = al_realloc(ff->buffer, new_size);
+      if (!new_buffer) {
+         ALLEGRO_ERROR("Out of memory decoding FLAC\n");
+         return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+      }
+      ff->buffer = new_buffer;
+      ff->buffer_size = new_size;
+   }
 
-   (void)decoder;
-   (void)client_data;
+   out = ff->buffer + ff->buffer_pos;
 
-   /* Flatten the array */
-   /* TODO: test this array flattening process on 5.1 and higher flac files */
-   out_index = 0;
-   switch (ff->sample_size) {
-      case 1:
-         for (sample_index = 0; sample_index < len; sample_index++) {
-             for (channel_index = 0;
-                  channel_index < ff->channels;
-                  channel_index++) {
-                buf8[out_index++] =
-                   (FLAC__uint8) buffer[channel_index][sample_index];
-             }
-         }
+   switch (ff->depth) {
+      case ALLEGRO_AUDIO_DEPTH_UINT8:
+         interleave_uint8((FLAC__uint8 *)out, buffer, ff->channels, len,
+            ff->shift);
          break;
 
-      case 2:
-         for (sample_index = 0; sample_index < len; sample_index++) {
-             for (channel_index = 0; channel_index < ff->channels;
-                   channel_index++) {
-                buf16[out_index++] =
-                   (FLAC__int16) buffer[channel_index][sample_index];
-             }
-         }
+      case ALLEGRO_AUDIO_DEPTH_INT16:
+         interleave_int16((FLAC__int16 *)out, buffer, ff->channels, len,
+            ff->shift);
          break;
 
-      case 3:
-         for (sample_index = 0; sample_index < len; sample_index++) {
-             for (channel_index = 0; channel_index < ff->channels;
-                channel_index++)
-             {
-                /* Little endian */
-                /* FIXME: does this work? I only have 16-bit sound card mixer
-                 * garbages for other 24-bit codecs too.
-                 */
-                buf8[out_index++] = (FLAC__uint8) (buffer[channel_index][sample_index] & 0xFF);
-                buf8[out_index++] = (FLAC__uint8) ((buffer[channel_index][sample_index] & 0xFF00) >> 8);
-                buf8[out_index++] = (FLAC__uint8) ((buffer[channel_index][sample_index] & 0xFF0000) >> 16);
-             }
-         }
+      case ALLEGRO_AUDIO_DEPTH_INT24:
+         interleave_int32((FLAC__int32 *)out, buffer, ff->channels, len,
+            ff->shift);
          break;
 
-      case 4:
-         for (sample_index = 0; sample_index < len; sample_index++) {
-             for (channel_index = 0; channel_index < ff->channels;
-                   channel_index++) {
-                buf32[out_index++] =
-                   (float) buffer[channel_index][sample_index];
-             }
-         }
+      case ALLEGRO_AUDIO_DEPTH_FLOAT32:
+         interleave_float((float *)out, buffer, ff->channels, len,
+            ff->scale);
          break;
 
       default:
@@ -372,6 +464,7 @@ static size_t flac_stream_update(ALLEGRO_AUDIO_STREAM *stream, void *data,
    uint64_t read_samples;
    size_t written_bytes = 0;
    size_t read_bytes;
+   const char *unstreamed;
    FLACFILE *ff = (FLACFILE *)stream->extra;
 
    bytes_per_sample = ff->sample_size * ff->channels;
@@ -391,6 +484,8 @@ static size_t flac_stream_update(ALLEGRO_AUDIO_STREAM *stream, void *data,
        * buffer keeps growing - so only refill when needed.
        */
       if (!read_samples) {
+         /* Everything decoded was streamed, start the buffer over. */
+         ff->buffer_pos = 0;
          if (!lib.FLAC__stream_decoder_process_single(ff->decoder))
             break;
          read_samples = ff->decoded_samples - ff->streamed_samples;
@@ -399,17 +494,16 @@ static size_t flac_stream_update(ALLEGRO_AUDIO_STREAM *stream, void *data,
          }
       }
 
+      /* The samples not streamed yet are at the end of the buffer. */
+      unstreamed = ff->buffer + ff->buffer_pos - read_samples * bytes_per_sample;
+
       if (read_samples > wanted_samples)
          read_samples = wanted_samples;
       ff->streamed_samples += read_samples;
       wanted_samples -= read_samples;
       read_bytes = read_samples * bytes_per_sample;
       /* Copy data from the FLAC file buffer to the stream buffer. */
-      memcpy((uint8_t *)data + written_bytes, ff->buffer, read_bytes);
-      /* Make room in the FLACFILE buffer. */
-      memmove(ff->buffer, ff->buffer + read_bytes,
-         ff->buffer_pos - read_bytes);
-      ff->buffer_pos -= read_bytes;
+      memcpy((uint8_t *)data + written_bytes, unstreamed, read_bytes);
       written_bytes += read_bytes;
    }
 
@@ -420,7 +514,7 @@ static size_t flac_stream_update(ALLEGRO_AUDIO_STREAM *stream, void *data,
 static void flac_stream_close(ALLEGRO_AUDIO_STREAM *stream)
 {
    FLACFILE *ff = stream->extra;
-   _al_acodec_stop_feed_thread(stream);
+   _al_kcm_stop_stream_feeder(stream);
 
    al_fclose(ff->fh);
    flac_close(ff);
@@ -472,7 +566,11 @@ static bool flac_stream_set_loop(ALLEGRO_AUDIO_STREAM *stream, double start,
    return true;
 }
 
-static FLACFILE *flac_open(ALLEGRO_FILE* f)
+/* flac_open:
+ *  mixer_depth is the default mixer depth, taken by the caller on its own
+ *  thread, so that worker threads never look at the default mixer.
+ */
+static FLACFILE *flac_open(ALLEGRO_FILE* f, ALLEGRO_AUDIO_DEPTH mixer_depth)
 {
    FLACFILE *ff;
    FLAC__StreamDecoderInitStatus init_status;
@@ -510,14 +608,37 @@ static FLACFILE *flac_open(ALLEGRO_FILE* f)
 
    lib.FLAC__stream_decoder_process_until_end_of_metadata(ff->decoder);
 
-   if (ff->sample_size == 0) {
-      ALLEGRO_ERROR("Error: don't support sub 8-bit sizes\n");
+   if (ff->bits_per_sample == 0 || ff->channels == 0) {
+      ALLEGRO_ERROR("Error: no STREAMINFO metadata\n");
       goto error;
    }
 
+   /* Decode to floats if the mixer works in them, or if there are more
+    * bits than the integer depths can hold.  Otherwise use the smallest
+    * integer depth which fits.
+    */
+   if (ff->bits_per_sample > 24 ||
+         mixer_depth == ALLEGRO_AUDIO_DEPTH_FLOAT32) {
+      ff->depth = ALLEGRO_AUDIO_DEPTH_FLOAT32;
+      ff->scale = 1.0f / ((float)((uint64_t)1 << (ff->bits_per_sample - 1)));
+   }
+   else if (ff->bits_per_sample <= 8) {
+      ff->depth = ALLEGRO_AUDIO_DEPTH_UINT8;
+      ff->shift = 8 - ff->bits_per_sample;
+   }
+   else if (ff->bits_per_sample <= 16) {
+      ff->depth = ALLEGRO_AUDIO_DEPTH_INT16;
+      ff->shift = 16 - ff->bits_per_sample;
+   }
+   else {
+      ff->depth = ALLEGRO_AUDIO_DEPTH_INT24;
+      ff->shift = 24 - ff->bits_per_sample;
+   }
+   ff->sample_size = al_get_audio_depth_size(ff->depth);
+
    ALLEGRO_INFO("Loaded FLAC sample with properties:\n");
    ALLEGRO_INFO("    channels %d\n", ff->channels);
-   ALLEGRO_INFO("    sample_size %d\n", ff->sample_size);
+   ALLEGRO_INFO("    bits_per_sample %d\n", ff->bits_per_sample);
    ALLEGRO_INFO("    rate %.f\n", ff->sample_rate);
    ALLEGRO_INFO("    total_samples %ld\n", (long) ff->total_samples);
 
@@ -532,6 +653,105 @@ error:
    return NULL;
 }
 
+/* A file decoded by several threads at once, each working on a range of it
+ * with its own decoder.
+ */
+typedef struct FLAC_PARALLEL {
+   const void *data;
+   size_t size;
+   char *buffer;
+   int frame_size;
+   ALLEGRO_AUDIO_DEPTH depth;
+   int channels;
+} FLAC_PARALLEL;
+
+static bool decode_range(void *userdata, uint64_t start, uint64_t end)
+{
+   FLAC_PARALLEL *par = userdata;
+   char *out = par->buffer + start * par->frame_size;
+   const uint64_t size = (end - start) * par->frame_size;
+   uint64_t pos = 0;
+   ALLEGRO_FILE *f;
+   FLACFILE *ff;
+
+   /* par->depth was picked from the mixer depth already, and leads to the
+    * same choice again.
+    */
+   f = _al_acodec_open_memory(par->data, par->size);
+   ff = f ? flac_open(f, par->depth) : NULL;
+   if (ff && ff->channels * ff->sample_size == par->frame_size) {
+      ff->fixed_buffer = true;
+      ff->buffer = out;
+      ff->buffer_size = size;
+
+      /* Seeking is sample accurate, and decodes the first block of the
+       * range.
+       */
+      if (lib.FLAC__stream_decoder_seek_absolute(ff->decoder, start)) {
+         while (ff->buffer_pos < ff->buffer_size) {
+            uint64_t last_pos = ff->buffer_pos;
+            if (!lib.FLAC__stream_decoder_process_single(ff->decoder) ||
+                  ff->buffer_pos == last_pos)
+               break;
+         }
+      }
+      pos = ff->buffer_pos;
+      ff->buffer = NULL;
+   }
+   if (ff)
+      flac_close(ff);
+   if (f)
+      al_fclose(f);
+
+   if (pos < size) {
+      al_fill_silence(out + pos, (size - pos) / par->frame_size, par->depth,
+         _al_count_to_channel_conf(par->channels));
+   }
+   return pos == size;
+}
+
+/* Decode the whole file with a decoder per range.  The file is read into
+ * memory first so that the decoders don't share a file position.
+ */
+static bool decode_parallel(FLACFILE *ff, ALLEGRO_FILE *f, int64_t file_start,
+   int ranges)
+{
+   FLAC_PARALLEL par;
+
+   if (!al_fseek(f, file_start, ALLEGRO_SEEK_SET))
+      return false;
+   par.data = _al_acodec_read_file(f, &par.size);
+   if (!par.data)
+      return false;
+   par.buffer = ff->buffer;
+   par.frame_size = ff->channels * ff->sample_size;
+   par.depth = ff->depth;
+   par.channels = ff->channels;
+
+   ALLEGRO_DEBUG("Decoding in %d ranges\n", ranges);
+   if (!_al_acodec_decode_parallel(ff->total_samples, ranges, decode_range,
+         &par)) {
+      ALLEGRO_WARN("Parts of the FLAC could not be decoded\n");
+   }
+   ff->decoded_samples = ff->total_samples;
+
+   al_free((void *)par.data);
+   return true;
+}
+
+/* Put the file and the decoder back at the first frame after
+ * decode_parallel failed, having moved the file position.
+ */
+static bool rewind_decoder(FLACFILE *ff, ALLEGRO_FILE *f, int64_t file_start)
+{
+   if (!al_fseek(f, file_start, ALLEGRO_SEEK_SET))
+      return false;
+   lib.FLAC__stream_decoder_flush(ff->decoder);
+   ff->buffer_pos = 0;
+   ff->decoded_samples = 0;
+   return lib.FLAC__stream_decoder_seek_absolute(ff->decoder, 0);
+}
+
 ALLEGRO_SAMPLE *_al_load_flac(const char *filename)
 {
    ALLEGRO_FILE *f;
@@ -553,20 +773,54 @@ ALLEGRO_SAMPLE *_al_load_flac_f(ALLEGRO_FILE *f)
 {
    ALLEGRO_SAMPLE *sample;
    FLACFILE *ff;
+   int64_t file_start;
+   int ranges;
+   bool decoded = false;
 
-   ff = flac_open(f);
+   file_start = al_ftell(f);
+
+   ff = flac_open(f, _al_kcm_get_default_mixer_depth());
    if (!ff) {
       return NULL;
    }
 
+   /* Decode straight into a buffer of the final size, if it is known. */
    ff->buffer_size = ff->total_samples * ff->channels * ff->sample_size;
-   ff->buffer = al_malloc(ff->buffer_size);
+   if (ff->buffer_size > 0) {
+      ff->buffer = al_malloc(ff->buffer_size);
+      if (!ff->buffer) {
+         ALLEGRO_ERROR("Out of memory loading FLAC\n");
+         flac_close(ff);
+         return NULL;
+      }
+   }
 
-   lib.FLAC__stream_decoder_process_until_end_of_stream(ff->decoder);
+   ranges = _al_acodec_get_parallel_ranges(ff->total_samples,
+      ff->sample_rate);
+   if (ranges > 1 && file_start >= 0) {
+      decoded = decode_parallel(ff, f, file_start, ranges);
+      if (!decoded) {
+         ALLEGRO_WARN("Decoding FLAC sequentially\n");
+         if (!rewind_decoder(ff, f, file_start)) {
+            ALLEGRO_ERROR("Could not return to the start of the FLAC\n");
+            al_free(ff->buffer);
+            flac_close(ff);
+            return NULL;
+         }
+      }
+   }
+   if (!decoded) {
+      lib.FLAC__stream_decoder_process_until_end_of_stream(ff->decoder);
+   }
+
+   if (ff->decoded_samples < ff->total_samples) {
+      ALLEGRO_WARN("FLAC ended after %lu of %lu samples\n",
+         (unsigned long) ff->decoded_samples,
+         (unsigned long) ff->total_samples);
+   }
 
-   sample = al_create_sample(ff->buffer, ff->total_samples, ff->sample_rate,
-      _al_word_size_to_depth_conf(ff->sample_size),
-      _al_count_to_channel_conf(ff->channels), true);
+   sample = al_create_sample(ff->buffer, ff->decoded_samples, ff->sample_rate,
+      ff->depth, _al_count_to_channel_conf(ff->channels), true);
 
    if (!sample) {
       al_free(ff->buffer);
@@ -602,20 +856,18 @@ ALLEGRO_AUDIO_STREAM *_al_load_flac_audio_stream_f(ALLEGRO_FILE* f,
    ALLEGRO_AUDIO_STREAM *stream;
    FLACFILE *ff;
 
-   ff = flac_open(f);
+   ff = flac_open(f, _al_kcm_get_default_mixer_depth());
    if (!ff) {
       return NULL;
    }
 
    stream = al_create_audio_stream(buffer_count, samples, ff->sample_rate,
-      _al_word_size_to_depth_conf(ff->sample_size),
-      _al_count_to_channel_conf(ff->channels));
+      ff->depth, _al_count_to_channel_conf(ff->channels));
 
    if (stream) {
       stream->extra = ff;
       ff->loop_start = 0;
       ff->loop_end = ff->total_samples;
-      stream->feed_thread = al_create_thread(_al_kcm_feed_stream, stream);
       stream->feeder = flac_stream_update;
       stream->unload_feeder = flac_stream_close;
       stream->rewind_feeder = flac_stream_rewind;
@@ -623,7 +875,7 @@ ALLEGRO_AUDIO_STREAM *_al_load_flac_audio_stream_f(ALLEGRO_FILE* f,
       stream->get_feeder_position = flac_stream_get_position;
       stream->get_feeder_length = flac_stream_get_length;
       stream->set_feeder_loop = flac_stream_set_loop;
-      al_start_thread(stream->feed_thread);
+      _al_kcm_start_stream_feeder(stream);
    }
    else {
       al_fclose(ff->fh);
@@ -7,11 +7,12 @@
 #include "allegro5/allegro.h"
 #include "allegro5/allegro_acodec.h"
 #include "allegro5/allegro_audio.h"
+#include "allegro5/internal/aintern_atomicops.h"
 #include "allegro5/internal/aintern_audio.h"
 #include "allegro5/internal/aintern_exitfunc.h"
 #include "allegro5/internal/aintern_system.h"
+#include "allegro5/internal/aintern_thread_pool.h"
 #include "acodec.h"
-#include "helper.h"
 
 #ifndef ALLEGRO_CFG_ACODEC_MODAUDIO
    #error configuration problem, ALLEGRO_CFG_ACODEC_MODAUDIO not set
@@ -24,8 +25,8 @@ ALLEGRO_DEBUG_CHANNEL("acodec")
 
 
 /* forward declarations */
-static size_t modaudio_stream_update(ALLEGRO_AUDIO_STREAM *stream, void *data,
-   size_t buf_size);
+static unsigned int modaudio_stream_pull(ALLEGRO_AUDIO_STREAM *stream,
+   void *buf, unsigned int samples, void *data);
 static bool modaudio_stream_rewind(ALLEGRO_AUDIO_STREAM *stream);
 static bool modaudio_stream_seek(ALLEGRO_AUDIO_STREAM *stream, double time);
 static double modaudio_stream_get_position(ALLEGRO_AUDIO_STREAM *stream);
@@ -38,10 +39,25 @@ static void modaudio_stream_close(ALLEGRO_AUDIO_STREAM *stream);
 typedef struct MOD_FILE
 {
    DUH *duh;
-   DUH_SIGRENDERER *sig;
+   DUH_SIGRENDERER *sig;      /* only used by the mixer thread */
    ALLEGRO_FILE *fh;
    double length;
+   float delta;               /* DUMB position units per sample */
+   sample_t **render_buf;     /* for rendering in float */
+   long play_loop_end;        /* mixer thread's copy of loop_end */
+
+   /* Starting a sigrenderer anywhere but at the start of the module makes
+    * DUMB play the module up to that point, which is far too slow for the
+    * mixer thread.  Seeks and loops are prepared in other threads and
+    * handed over in the fields below, which are guarded by `busy'.
+    */
+   _AL_ATOMIC busy;
+   DUH_SIGRENDERER *seek_sig; /* to switch to on the next fragment */
+   DUH_SIGRENDERER *loop_sig; /* to switch to at the loop end */
    long loop_start, loop_end;
+   long position;             /* as of the last fragment or seek */
+   ALLEGRO_THREAD_POOL *pool;
+   ALLEGRO_TASK_GROUP *tasks; /* preparing the next loop_sig */
 } MOD_FILE;
 
 
@@ -56,6 +72,10 @@ static void *dumb_dll = NULL;
 static struct
 {
    long (*duh_render)(DUH_SIGRENDERER *, int, int, float, float, long, void *);
+   long (*duh_sigrenderer_generate_samples)(DUH_SIGRENDERER *, float, float,
+      long, sample_t **);
+   sample_t **(*allocate_sample_buffer)(int, long);
+   void (*destroy_sample_buffer)(sample_t **);
    long (*duh_sigrenderer_get_position)(DUH_SIGRENDERER *);
    void (*duh_end_sigrenderer)(DUH_SIGRENDERER *);
    void (*unload_duh)(DUH *);
@@ -103,65 +123,227 @@ static void dfs_close(void *f)
 
 /* Stream Functions */
 
-static size_t modaudio_stream_update(ALLEGRO_AUDIO_STREAM *stream, void *data,
-   size_t buf_size)
+/* The mixer thread only ever tries to take the lock, so that it never
+ * waits for another thread.  Other threads spin, but the lock is only held
+ * to exchange a few fields.
+ */
+static bool try_lock_slots(MOD_FILE *df)
 {
-   MOD_FILE *const df = stream->extra;
-   
-   /* the mod files are stereo and 16-bit */
-   const int sample_size = 4;
-   size_t written;
-   size_t i;
-   
-   written = lib.duh_render(df->sig, 16, 0, 1.0, 65536.0 / 44100.0,
-      buf_size / sample_size, data) * sample_size;
+   if (_al_fetch_and_add1(&df->busy) == 0)
+      return true;
+   _al_sub1_and_fetch(&df->busy);
+   return false;
+}
+
+static void lock_slots(MOD_FILE *df)
+{
+   while (!try_lock_slots(df))
+      al_rest(0.0);
+}
+
+static void unlock_slots(MOD_FILE *df)
+{
+   _al_sub1_and_fetch(&df->busy);
+}
+
+/* Task run in the shared thread pool after the mixer has used up loop_sig,
+ * to have another ready for the next time round.
+ */
+static void prepare_loop(void *arg)
+{
+   MOD_FILE *const df = arg;
+   DUH_SIGRENDERER *sig;
+   long start;
+
+   lock_slots(df);
+   start = df->loop_start;
+   unlock_slots(df);
+
+   sig = lib.duh_start_sigrenderer(df->duh, 0, 2, start);
+   if (!sig)
+      return;
+
+   lock_slots(df);
+   /* Don't replace one made by modaudio_stream_set_loop meanwhile. */
+   if (!df->loop_sig && df->loop_start == start) {
+      df->loop_sig = sig;
+      sig = NULL;
+   }
+   unlock_slots(df);
+
+   if (sig)
+      lib.duh_end_sigrenderer(sig);
+}
+
+/* Switch to the sigrenderer prepared at the loop start, if it is ready. */
+static bool jump_to_loop(MOD_FILE *df)
+{
+   DUH_SIGRENDERER *sig = NULL;
+
+   if (try_lock_slots(df)) {
+      sig = df->loop_sig;
+      df->loop_sig = NULL;
+      unlock_slots(df);
+   }
+   if (!sig)
+      return false;
+
+   lib.duh_end_sigrenderer(df->sig);
+   df->sig = sig;
+   al_submit_task(df->pool, df->tasks, prepare_loop, df);
+   return true;
+}
+
+/* Render up to n samples in the stream's format, returning how many. */
+static long render(MOD_FILE *df, ALLEGRO_AUDIO_DEPTH depth, void *data,
+   long n)
+{
+   sample_t *src = df->render_buf ? df->render_buf[0] : NULL;
+   float *dest = data;
+   long i;
+
+   if (depth == ALLEGRO_AUDIO_DEPTH_INT16)
+      return lib.duh_render(df->sig, 16, 0, 1.0, df->delta, n, data);
+
+   /* DUMB mixes into the buffer, in 24-bit integers. */
+   memset(src, 0, n * 2 * sizeof(*src));
+   n = lib.duh_sigrenderer_generate_samples(df->sig, 1.0, df->delta, n,
+      df->render_buf);
+   for (i = 0; i < n * 2; i++)
+      dest[i] = src[i] * (1.0f / 0x800000);
+
+   return n;
+}
+
+/* Module streams are pull streams: the module is already in memory, so
+ * it's rendered straight into each fragment in the mixer's thread.
+ */
+static unsigned int modaudio_stream_pull(ALLEGRO_AUDIO_STREAM *stream,
+   void *buf, unsigned int samples, void *data)
+{
+   MOD_FILE *const df = data;
+   const ALLEGRO_AUDIO_DEPTH depth = stream->spl.spl_data.depth;
+   const int sample_size = 2 * al_get_audio_depth_size(depth);
+   unsigned int written;
+
+   /* Pick up a seek or a new loop.  If another thread is busy with them,
+    * the next fragment will.
+    */
+   if (try_lock_slots(df)) {
+      if (df->seek_sig) {
+         lib.duh_end_sigrenderer(df->sig);
+         df->sig = df->seek_sig;
+         df->seek_sig = NULL;
+      }
+      df->play_loop_end = df->loop_end;
+      unlock_slots(df);
+   }
+
+   /* Past the loop end, go back to the loop start.  Play silence rather
+    * than wait if the sigrenderer for it isn't ready yet.
+    */
+   if (df->play_loop_end != -1 &&
+         df->play_loop_end < lib.duh_sigrenderer_get_position(df->sig)) {
+      if (!jump_to_loop(df)) {
+         al_fill_silence(buf, samples, depth, ALLEGRO_CHANNEL_CONF_2);
+         return samples;
+      }
+   }
+
+   written = render(df, depth, buf, samples);
+
+   /* At the end of the module, go back to the start if the stream loops.
+    * Unlike seeking, starting at the very beginning is cheap.
+    */
+   while (written < samples &&
+         stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONEDIR) {
+      DUH_SIGRENDERER *sig = lib.duh_start_sigrenderer(df->duh, 0, 2, 0);
+      long n;
+      if (!sig)
+         break;
+      lib.duh_end_sigrenderer(df->sig);
+      df->sig = sig;
+      n = render(df, depth, (char *)buf + written * sample_size,
+         samples - written);
+      if (n <= 0)
+         break;
+      written += n;
+   }
+
+   if (try_lock_slots(df)) {
+      if (!df->seek_sig)
+         df->position = lib.duh_sigrenderer_get_position(df->sig);
+      unlock_slots(df);
+   }
 
-   /* Fill the remainder with silence */
-   for (i = written; i < buf_size; ++i)
-      ((int *)data)[i] = 0x8000;
-   
-   /* Check to see if a loop is set */
-   if (df->loop_start != -1 && 
-      df->loop_end < lib.duh_sigrenderer_get_position(df->sig)) {
-         modaudio_stream_seek(stream, df->loop_start / 65536.0);
-   }   
-   
    return written;
 }
 
 static void modaudio_stream_close(ALLEGRO_AUDIO_STREAM *stream)
 {
    MOD_FILE *const df = stream->extra;
-   _al_acodec_stop_feed_thread(stream);
-      
+
+   /* The stream is detached, so only loop tasks may still be running. */
+   al_destroy_task_group(df->tasks);
+
    lib.duh_end_sigrenderer(df->sig);
+   if (df->seek_sig)
+      lib.duh_end_sigrenderer(df->seek_sig);
+   if (df->loop_sig)
+      lib.duh_end_sigrenderer(df->loop_sig);
    lib.unload_duh(df->duh);
+   if (df->render_buf)
+      lib.destroy_sample_buffer(df->render_buf);
    if (df->fh)
       al_fclose(df->fh);
+   al_free(df);
+   stream->extra = NULL;
+}
+
+/* Prepare a sigrenderer at `pos' in the calling thread, for the mixer to
+ * switch to on its next fragment.
+ */
+static bool hand_over_seek(MOD_FILE *df, long pos)
+{
+   DUH_SIGRENDERER *sig = lib.duh_start_sigrenderer(df->duh, 0, 2, pos);
+   DUH_SIGRENDERER *old;
+
+   if (!sig)
+      return false;
+
+   lock_slots(df);
+   old = df->seek_sig;
+   df->seek_sig = sig;
+   df->position = pos;
+   unlock_slots(df);
+
+   if (old)
+      lib.duh_end_sigrenderer(old);
+   return true;
 }
 
 static bool modaudio_stream_rewind(ALLEGRO_AUDIO_STREAM *stream)
 {
    MOD_FILE *const df = stream->extra;
-   lib.duh_end_sigrenderer(df->sig);
-   df->sig = lib.duh_start_sigrenderer(df->duh, 0, 2, 0);
-   return true;
+   return hand_over_seek(df, 0);
 }
 
 static bool modaudio_stream_seek(ALLEGRO_AUDIO_STREAM *stream, double time)
 {
    MOD_FILE *const df = stream->extra;
-   
-   lib.duh_end_sigrenderer(df->sig);
-   df->sig = lib.duh_start_sigrenderer(df->duh, 0, 2, time * 65536);
-   
-   return false;
+   return hand_over_seek(df, time * 65536);
 }
 
 static double modaudio_stream_get_position(ALLEGRO_AUDIO_STREAM *stream)
 {
    MOD_FILE *const df = stream->extra;
-   return lib.duh_sigrenderer_get_position(df->sig) / 65536.0;
+   long pos;
+
+   lock_slots(df);
+   pos = df->position;
+   unlock_slots(df);
+
+   return pos / 65536.0;
 }
 
 static double modaudio_stream_get_length(ALLEGRO_AUDIO_STREAM *stream)
@@ -174,13 +356,44 @@ static bool modaudio_stream_set_loop(ALLEGRO_AUDIO_STREAM *stream,
    double start, double end)
 {
    MOD_FILE *const df = stream->extra;
-   
-   df->loop_start = start * 65536;
+   const long loop_start = start * 65536;
+   DUH_SIGRENDERER *sig;
+   DUH_SIGRENDERER *old;
+
+   sig = lib.duh_start_sigrenderer(df->duh, 0, 2, loop_start);
+   if (!sig)
+      return false;
+
+   lock_slots(df);
+   old = df->loop_sig;
+   df->loop_sig = sig;
+   df->loop_start = loop_start;
    df->loop_end = end * 65536;
-   
+   unlock_slots(df);
+
+   if (old)
+      lib.duh_end_sigrenderer(old);
    return true;
 }
 
+/* Render at the default mixer's frequency, so that it doesn't have to
+ * resample, and in float unless the mixer is integer.  Streams attached
+ * elsewhere are converted by their mixer as usual.
+ */
+static void get_render_format(unsigned int *freq, ALLEGRO_AUDIO_DEPTH *depth)
+{
+   ALLEGRO_MIXER *mixer = al_get_default_mixer();
+
+   *freq = 44100;
+   *depth = ALLEGRO_AUDIO_DEPTH_FLOAT32;
+
+   if (mixer) {
+      *freq = al_get_mixer_frequency(mixer);
+      if (al_get_mixer_depth(mixer) == ALLEGRO_AUDIO_DEPTH_INT16)
+         *depth = ALLEGRO_AUDIO_DEPTH_INT16;
+   }
+}
+
 /* Create the Allegro stream */
 
 static ALLEGRO_AUDIO_STREAM *mod_stream_init(ALLEGRO_FILE* f,
@@ -190,7 +403,15 @@ static ALLEGRO_AUDIO_STREAM *mod_stream_init(ALLEGRO_FILE* f,
    DUMBFILE *df;
    DUH_SIGRENDERER *sig = NULL;
    DUH *duh = NULL;
+   MOD_FILE *mf = NULL;
    int64_t start_pos = -1;
+   unsigned int freq;
+   ALLEGRO_AUDIO_DEPTH depth;
+
+   /* The mixer pulls each fragment as it needs it, so nothing is buffered
+    * ahead.
+    */
+   (void)buffer_count;
    
    df = lib.dumbfile_open_ex(f, &dfs_f);
    if (!df)
@@ -208,30 +429,50 @@ static ALLEGRO_AUDIO_STREAM *mod_stream_init(ALLEGRO_FILE* f,
       goto Error;
    }
 
-   stream = al_create_audio_stream(buffer_count, samples, 44100,
-      ALLEGRO_AUDIO_DEPTH_INT16, ALLEGRO_CHANNEL_CONF_2); 
+   get_render_format(&freq, &depth);
 
-   if (stream) {
-      MOD_FILE *mf = al_malloc(sizeof(MOD_FILE));
-      mf->duh = duh;
-      mf->sig = sig;
-      mf->fh = NULL;
-      mf->length = lib.duh_get_length(duh) / 65536.0;
-      if (mf->length < 0)
-         mf->length = 0;
-      mf->loop_start = -1;
-      mf->loop_end = -1;
+   mf = al_calloc(1, sizeof(MOD_FILE));
+   if (!mf) {
+      goto Error;
+   }
+   mf->duh = duh;
+   mf->sig = sig;
+   mf->fh = NULL;
+   mf->length = lib.duh_get_length(duh) / 65536.0;
+   if (mf->length < 0)
+      mf->length = 0;
+   mf->loop_start = -1;
+   mf->loop_end = -1;
+   mf->play_loop_end = -1;
+   mf->delta = 65536.0f / freq;
+
+   mf->pool = _al_get_shared_thread_pool();
+   if (!mf->pool) {
+      goto Error;
+   }
+   mf->tasks = al_create_task_group(mf->pool);
+   if (!mf->tasks) {
+      goto Error;
+   }
 
+   if (depth == ALLEGRO_AUDIO_DEPTH_FLOAT32) {
+      mf->render_buf = lib.allocate_sample_buffer(2, samples);
+      if (!mf->render_buf) {
+         goto Error;
+      }
+   }
+
+   stream = al_create_pull_audio_stream(samples, freq, depth,
+      ALLEGRO_CHANNEL_CONF_2, modaudio_stream_pull, mf);
+
+   if (stream) {
       stream->extra = mf;
-      stream->feed_thread = al_create_thread(_al_kcm_feed_stream, stream);
-      stream->feeder = modaudio_stream_update;
       stream->unload_feeder = modaudio_stream_close;
       stream->rewind_feeder = modaudio_stream_rewind;
       stream->seek_feeder = modaudio_stream_seek;
       stream->get_feeder_position = modaudio_stream_get_position;
       stream->get_feeder_length = modaudio_stream_get_length;
       stream->set_feeder_loop = modaudio_stream_set_loop;
-      al_start_thread(stream->feed_thread);
    }
    else {
       goto Error;
@@ -241,6 +482,13 @@ static ALLEGRO_AUDIO_STREAM *mod_stream_init(ALLEGRO_FILE* f,
 
 Error:
 
+   if (mf) {
+      if (mf->render_buf)
+         lib.destroy_sample_buffer(mf->render_buf);
+      al_destroy_task_group(mf->tasks);
+      al_free(mf);
+   }
+
    if (sig) {
       lib.duh_end_sigrenderer(sig);
    }
@@ -302,6 +550,9 @@ static bool init_libdumb(void)
    memset(&lib, 0, sizeof(lib));
 
    INITSYM(duh_render);
+   INITSYM(duh_sigrenderer_generate_samples);
+   INITSYM(allocate_sample_buffer);
+   INITSYM(destroy_sample_buffer);
    INITSYM(duh_sigrenderer_get_position);
    INITSYM(duh_end_sigrenderer);
    INITSYM(unload_duh);
@@ -12,7 +12,6 @@
 #include "allegro5/internal/aintern_exitfunc.h"
 #include "allegro5/internal/aintern_system.h"
 #include "acodec.h"
-#include "helper.h"
 
 #ifndef ALLEGRO_CFG_ACODEC_VORBIS
    #error configuration problem, ALLEGRO_CFG_ACODEC_VORBIS not set
@@ -50,12 +49,14 @@ static struct
    int (*ov_clear)(OggVorbis_File *);
    ogg_int64_t (*ov_pcm_total)(OggVorbis_File *, int);
    vorbis_info *(*ov_info)(OggVorbis_File *, int);
+   int (*ov_pcm_seek)(OggVorbis_File *, ogg_int64_t);
 #ifndef TREMOR
    int (*ov_open_callbacks)(void *, OggVorbis_File *, const char *, long, ov_callbacks);
    double (*ov_time_total)(OggVorbis_File *, int);
    int (*ov_time_seek_lap)(OggVorbis_File *, double);
    double (*ov_time_tell)(OggVorbis_File *);
    long (*ov_read)(OggVorbis_File *, char *, int, int, int, int, int *);
+   long (*ov_read_float)(OggVorbis_File *, float ***, int, int *);
 #else
    int (*ov_open_callbacks)(void *, OggVorbis_File *, const char *, long, ov_callbacks);
    ogg_int64_t (*ov_time_total)(OggVorbis_File *, int);
@@ -64,6 +65,7 @@ static struct
    long (*ov_read)(OggVorbis_File *, char *, int, int *);
 #endif
 } lib;
+static bool lib_inited = false;
 
 
 #ifdef ALLEGRO_CFG_ACODEC_VORBISFILE_DLL
@@ -73,6 +75,7 @@ static void shutdown_dynlib(void)
       _al_close_library(ov_dll);
       ov_dll = NULL;
       ov_virgin = true;
+      lib_inited = false;
    }
 }
 #endif
@@ -80,6 +83,13 @@ static void shutdown_dynlib(void)
 
 static bool init_dynlib(void)
 {
+   /* The table is filled once and never cleared while in use: loaders call
+    * this while decoder threads of other loads may be calling through it.
+    */
+   if (lib_inited) {
+      return true;
+   }
+
 #ifdef ALLEGRO_CFG_ACODEC_VORBISFILE_DLL
    if (ov_dll) {
       return true;
@@ -112,17 +122,17 @@ static bool init_dynlib(void)
    #define INITSYM(x)   (lib.x = (x))
 #endif
 
-   memset(&lib, 0, sizeof(lib));
-
    INITSYM(ov_clear);
    INITSYM(ov_open_callbacks);
    INITSYM(ov_pcm_total);
    INITSYM(ov_info);
+   INITSYM(ov_pcm_seek);
 #ifndef TREMOR
    INITSYM(ov_time_total);
    INITSYM(ov_time_seek_lap);
    INITSYM(ov_time_tell);
    INITSYM(ov_read);
+   INITSYM(ov_read_float);
 #else
    INITSYM(ov_time_total);
    INITSYM(ov_time_seek);
@@ -130,6 +140,7 @@ static bool init_dynlib(void)
    INITSYM(ov_read);
 #endif
 
+   lib_inited = true;
    return true;
 
 #undef INITSYM
@@ -194,6 +205,193 @@ static ov_callbacks callbacks = {
 };
 
 
+#ifndef TREMOR
+/* Decode up to frames frames, interleaving the channels into out as
+ * floats.  Returns the number of frames decoded, fewer at the end of the
+ * stream.
+ */
+static long read_float_frames(OggVorbis_File *vf, float *out, long frames,
+   int channels, int *bitstream)
+{
+   const int packet_frames = 4096; /* suggestion for frames to read at a time */
+   long pos = 0;
+
+   while (pos < frames) {
+      float **pcm;
+      long read;
+      long i;
+      int c;
+
+      read = lib.ov_read_float(vf, &pcm, _ALLEGRO_MIN(packet_frames,
+         frames - pos), bitstream);
+      if (read == OV_HOLE)
+         continue;
+      if (read <= 0)
+         break;
+
+      if (channels == 2) {
+         const float *left = pcm[0];
+         const float *right = pcm[1];
+         float *dst = out + pos * 2;
+         for (i = 0; i < read; i++) {
+            dst[2 * i] = left[i];
+            dst[2 * i + 1] = right[i];
+         }
+      }
+      else {
+         for (c = 0; c < channels; c++) {
+            const float *src = pcm[c];
+            float *dst = out + pos * channels + c;
+            for (i = 0; i < read; i++)
+               dst[i * channels] = src[i];
+         }
+      }
+
+      pos += read;
+   }
+
+   return pos;
+}
+#endif
+
+
+/* Decode up to frames frames of 16-bit samples into out.  Returns the
+ * number of frames decoded, fewer at the end of the stream.
+ */
+static long read_int16_frames(OggVorbis_File *vf, char *out, long frames,
+   int channels, int *bitstream)
+{
+#ifdef ALLEGRO_LITTLE_ENDIAN
+   const int endian = 0; /* 0 for Little-Endian, 1 for Big-Endian */
+#else
+   const int endian = 1; /* 0 for Little-Endian, 1 for Big-Endian */
+#endif
+   const int word_size = 2; /* 1 = 8bit, 2 = 16-bit. nothing else */
+   const int signedness = 1; /* 0  for unsigned, 1 for signed */
+   const int packet_size = 4096; /* suggestion for size to read at a time */
+   const long total_size = frames * channels * word_size;
+   long pos = 0;
+
+   while (pos < total_size) {
+      const int read_size = _ALLEGRO_MIN(packet_size, total_size - pos);
+      long read;
+
+#ifndef TREMOR
+      read = lib.ov_read(vf, out + pos, read_size, endian, word_size,
+         signedness, bitstream);
+#else
+      (void)endian;
+      (void)signedness;
+      read = lib.ov_read(vf, out + pos, read_size, bitstream);
+#endif
+      if (read == OV_HOLE)
+         continue;
+      if (read <= 0)
+         break;
+      pos += read;
+   }
+
+   return pos / (channels * word_size);
+}
+
+
+/* Decode frames frames into out, as floats or as 16-bit samples depending on
+ * word_size.  Any frames missing at the end of the stream are silent.
+ * Returns the number of frames decoded.
+ */
+static long read_frames(OggVorbis_File *vf, char *out, long frames,
+   int channels, int word_size, int *bitstream)
+{
+   ALLEGRO_AUDIO_DEPTH depth = _al_word_size_to_depth_conf(word_size);
+   long pos;
+
+#ifndef TREMOR
+   if (word_size == (int)sizeof(float))
+      pos = read_float_frames(vf, (float *)out, frames, channels, bitstream);
+   else
+#endif
+      pos = read_int16_frames(vf, out, frames, channels, bitstream);
+
+   if (pos < frames) {
+      al_fill_silence(out + pos * channels * word_size, frames - pos, depth,
+         _al_count_to_channel_conf(channels));
+   }
+
+   return pos;
+}
+
+
+/* A file decoded by several threads at once, each working on a range of it
+ * with its own decoder.
+ */
+typedef struct OGG_PARALLEL {
+   const void *data;
+   size_t size;
+   char *buffer;
+   int channels;
+   int word_size;
+} OGG_PARALLEL;
+
+
+static bool decode_range(void *userdata, uint64_t start, uint64_t end)
+{
+   OGG_PARALLEL *par = userdata;
+   const long frames = end - start;
+   char *out = par->buffer + start * par->channels * par->word_size;
+   OggVorbis_File vf;
+   AL_OV_DATA ov;
+   int bitstream = -1;
+   long read = 0;
+
+   ov.file = _al_acodec_open_memory(par->data, par->size);
+   if (!ov.file)
+      return false;
+
+   if (lib.ov_open_callbacks(&ov, &vf, NULL, 0, callbacks) < 0) {
+      al_fclose(ov.file);
+      return false;
+   }
+
+   /* Seeking is sample accurate, so the ranges join up exactly. */
+   if (lib.ov_pcm_seek(&vf, start) == 0) {
+      read = read_frames(&vf, out, frames, par->channels, par->word_size,
+         &bitstream);
+   }
+   else {
+      al_fill_silence(out, frames, _al_word_size_to_depth_conf(par->word_size),
+         _al_count_to_channel_conf(par->channels));
+   }
+
+   lib.ov_clear(&vf);
+   al_fclose(ov.file);
+
+   return read == frames;
+}
+
+
+/* Decode the whole file with a decoder per range.  Each thread needs a file
+ * of its own, so the file is read into memory first.  Returns false if the
+ * file could not be read or any range failed to decode completely.
+ */
+static bool decode_parallel(ALLEGRO_FILE *file, int64_t file_start,
+   OGG_PARALLEL *par, long total_samples, int ranges)
+{
+   bool ok;
+
+   if (!al_fseek(file, file_start, ALLEGRO_SEEK_SET))
+      return false;
+   par->data = _al_acodec_read_file(file, &par->size);
+   if (!par->data)
+      return false;
+
+   ALLEGRO_DEBUG("Decoding in %d ranges\n", ranges);
+   ok = _al_acodec_decode_parallel(total_samples, ranges, decode_range, par);
+
+   al_free((void *)par->data);
+   return ok;
+}
+
+
 ALLEGRO_SAMPLE *_al_load_ogg_vorbis(const char *filename)
 {
    ALLEGRO_FILE *f;
@@ -217,21 +415,14 @@ ALLEGRO_SAMPLE *_al_load_ogg_vorbis(const char *filename)
 
 ALLEGRO_SAMPLE *_al_load_ogg_vorbis_f(ALLEGRO_FILE *file)
 {
-   /* Note: decoding library returns floats.  I always return 16-bit (most
-    * commonly supported).
+   /* Note: decoding library returns floats.  They are kept as floats if
+    * the mixer works in floats, otherwise returned as 16-bit (most commonly
+    * supported).
     */
-#ifdef ALLEGRO_LITTLE_ENDIAN
-   const int endian = 0; /* 0 for Little-Endian, 1 for Big-Endian */
-#else
-   const int endian = 1; /* 0 for Little-Endian, 1 for Big-Endian */
-#endif
    int word_size = 2; /* 1 = 8bit, 2 = 16-bit. nothing else */
-   int signedness = 1; /* 0  for unsigned, 1 for signed */
-   const int packet_size = 4096; /* suggestion for size to read at a time */
    OggVorbis_File vf;
    vorbis_info* vi;
    char *buffer;
-   long pos;
    ALLEGRO_SAMPLE *sample;
    int channels;
    long rate;
@@ -239,12 +430,16 @@ ALLEGRO_SAMPLE *_al_load_ogg_vorbis_f(ALLEGRO_FILE *file)
    int bitstream;
    long total_size;
    AL_OV_DATA ov;
-   long read;
+   int64_t file_start;
+   int ranges;
+   bool decoded = false;
 
    if (!init_dynlib()) {
       return NULL;
    }
 
+   file_start = al_ftell(file);
+
    ov.file = file;
    if (lib.ov_open_callbacks(&ov, &vf, NULL, 0, callbacks) < 0) {
       ALLEGRO_WARN("Audio file does not appear to be an Ogg bitstream.\n");
@@ -257,6 +452,10 @@ ALLEGRO_SAMPLE *_al_load_ogg_vorbis_f(ALLEGRO_FILE *file)
    rate = vi->rate;
    total_samples = lib.ov_pcm_total(&vf, -1);
    bitstream = -1;
+#ifndef TREMOR
+   if (_al_kcm_get_default_mixer_depth() == ALLEGRO_AUDIO_DEPTH_FLOAT32)
+      word_size = (int)sizeof(float);
+#endif
    total_size = total_samples * channels * word_size;
 
    ALLEGRO_DEBUG("channels %d\n", channels);
@@ -267,29 +466,37 @@ ALLEGRO_SAMPLE *_al_load_ogg_vorbis_f(ALLEGRO_FILE *file)
 
    buffer = al_malloc(total_size);
    if (!buffer) {
+      lib.ov_clear(&vf);
       return NULL;
    }
 
-   pos = 0;
-   while (pos < total_size) {
-      const int read_size = _ALLEGRO_MIN(packet_size, total_size - pos);
-      ASSERT(pos + read_size <= total_size);
-
-      /* XXX error handling */
-#ifndef TREMOR
-      read = lib.ov_read(&vf, buffer + pos, read_size, endian, word_size,
-         signedness, &bitstream);
-#else
-      (void)endian;
-      (void)signedness;
-      read = lib.ov_read(&vf, buffer + pos, read_size, &bitstream);
-#endif
-      pos += read;
-      if (read == 0)
-         break;
+   ranges = _al_acodec_get_parallel_ranges(total_samples, rate);
+   if (ranges > 1 && file_start >= 0) {
+      OGG_PARALLEL par;
+
+      par.buffer = buffer;
+      par.channels = channels;
+      par.word_size = word_size;
+
+      lib.ov_clear(&vf);
+      decoded = decode_parallel(file, file_start, &par, total_samples,
+         ranges);
+      if (!decoded) {
+         /* Parts of the buffer may not have been written, so start over. */
+         ALLEGRO_WARN("Decoding the Ogg file sequentially.\n");
+         if (!al_fseek(file, file_start, ALLEGRO_SEEK_SET) ||
+               lib.ov_open_callbacks(&ov, &vf, NULL, 0, callbacks) < 0) {
+            ALLEGRO_ERROR("Failed to reopen the Ogg file.\n");
+            al_free(buffer);
+            return NULL;
+         }
+      }
    }
 
-   lib.ov_clear(&vf);
+   if (!decoded) {
+      read_frames(&vf, buffer, total_samples, channels, word_size, &bitstream);
+      lib.ov_clear(&vf);
+   }
 
    sample = al_create_sample(buffer, total_samples, rate,
       _al_word_size_to_depth_conf(word_size),
@@ -362,7 +569,7 @@ static void ogg_stream_close(ALLEGRO_AUDIO_STREAM *stream)
 {
    AL_OV_DATA *extra = (AL_OV_DATA *) stream->extra;
 
-   _al_acodec_stop_feed_thread(stream);
+   _al_kcm_stop_stream_feeder(stream);
 
    al_fclose(extra->file);
 
@@ -433,6 +640,42 @@ static size_t ogg_stream_update(ALLEGRO_AUDIO_STREAM *stream, void *data,
 }
 
 
+#ifndef TREMOR
+/* Like ogg_stream_update, for streams of floats. */
+static size_t ogg_stream_update_float(ALLEGRO_AUDIO_STREAM *stream,
+   void *data, size_t buf_size)
+{
+   AL_OV_DATA *extra = (AL_OV_DATA *) stream->extra;
+   const int channels = extra->vi->channels;
+   const size_t frame_size = channels * sizeof(float);
+   const long buf_frames = buf_size / frame_size;
+   long frames = buf_frames;
+   long read;
+
+   if (stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONEDIR) {
+      const double ctime = lib.ov_time_tell(extra->vf);
+      const double left = (extra->loop_end - ctime) * extra->vi->rate;
+      if (left < 0)
+         return 0;
+      if (left < frames)
+         frames = left;
+   }
+
+   read = read_float_frames(extra->vf, data, frames, channels,
+      &extra->bitstream);
+
+   /* If the end was reached then silence from here to the end. */
+   if (read < frames) {
+      al_fill_silence((float *)data + read * channels, buf_frames - read,
+         ALLEGRO_AUDIO_DEPTH_FLOAT32, stream->spl.spl_data.chan_conf);
+   }
+
+   /* Return the number of useful bytes written. */
+   return read * frame_size;
+}
+#endif
+
+
 ALLEGRO_AUDIO_STREAM *_al_load_ogg_vorbis_audio_stream(const char *filename,
    size_t buffer_count, unsigned int samples)
 {
@@ -459,7 +702,14 @@ ALLEGRO_AUDIO_STREAM *_al_load_ogg_vorbis_audio_stream(const char *filename,
 ALLEGRO_AUDIO_STREAM *_al_load_ogg_vorbis_audio_stream_f(ALLEGRO_FILE *file,
    size_t buffer_count, unsigned int samples)
 {
+#ifndef TREMOR
+   /* Decode straight to floats if the mixer works in them. */
+   const bool use_float =
+      (_al_kcm_get_default_mixer_depth() == ALLEGRO_AUDIO_DEPTH_FLOAT32);
+   const int word_size = use_float ? (int)sizeof(float) : 2;
+#else
    const int word_size = 2; /* 1 = 8bit, 2 = 16-bit. nothing else */
+#endif
    OggVorbis_File* vf;
    vorbis_info* vi;
    int channels;
@@ -518,16 +768,18 @@ ALLEGRO_AUDIO_STREAM *_al_load_ogg_vorbis_audio_stream_f(ALLEGRO_FILE *file,
 
    extra->loop_start = 0.0;
    extra->loop_end = ogg_stream_get_length(stream);
-   stream->feed_thread = al_create_thread(_al_kcm_feed_stream, stream);
-   stream->quit_feed_thread = false;
+#ifndef TREMOR
+   stream->feeder = use_float ? ogg_stream_update_float : ogg_stream_update;
+#else
    stream->feeder = ogg_stream_update;
+#endif
    stream->rewind_feeder = ogg_stream_rewind;
    stream->seek_feeder = ogg_stream_seek;
    stream->get_feeder_position = ogg_stream_get_position;
    stream->get_feeder_length = ogg_stream_get_length;
    stream->set_feeder_loop = ogg_stream_set_loop;
    stream->unload_feeder = ogg_stream_close;
-   al_start_thread(stream->feed_thread);
+   _al_kcm_start_stream_feeder(stream);
 	
    return stream;
 }
@@ -0,0 +1,320 @@
+/*
+ * Allegro5 helpers for decoding files in memory, and in parallel.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "allegro5/allegro.h"
+#include "allegro5/allegro_audio.h"
+#include "allegro5/internal/aintern.h"
+#include "allegro5/internal/aintern_audio.h"
+#include "allegro5/internal/aintern_thread_pool.h"
+#include "acodec.h"
+
+ALLEGRO_DEBUG_CHANNEL("acodec")
+
+/* Ranges are at least this long, so that the cost of opening a decoder and
+ * seeking for each stays small.
+ */
+#define MIN_RANGE_SECONDS  2
+
+
+typedef struct MEMORY_FILE {
+   const char *data;
+   int64_t size;
+   int64_t pos;
+   bool eof;
+} MEMORY_FILE;
+
+
+static bool memory_fclose(ALLEGRO_FILE *fp)
+{
+   al_free(al_get_file_userdata(fp));
+   return true;
+}
+
+
+static size_t memory_fread(ALLEGRO_FILE *fp, void *ptr, size_t size)
+{
+   MEMORY_FILE *mf = al_get_file_userdata(fp);
+   size_t n = size;
+
+   if (mf->size - mf->pos < (int64_t)size) {
+      n = mf->size - mf->pos;
+      mf->eof = true;
+   }
+   memcpy(ptr, mf->data + mf->pos, n);
+   mf->pos += n;
+   return n;
+}
+
+
+static size_t memory_fwrite(ALLEGRO_FILE *fp, const void *ptr, size_t size)
+{
+   (void)fp;
+   (void)ptr;
+   (void)size;
+   al_set_errno(EPERM);
+   return 0;
+}
+
+
+static bool memory_fflush(ALLEGRO_FILE *fp)
+{
+   (void)fp;
+   return true;
+}
+
+
+static int64_t memory_ftell(ALLEGRO_FILE *fp)
+{
+   MEMORY_FILE *mf = al_get_file_userdata(fp);
+   return mf->pos;
+}
+
+
+static bool memory_fseek(ALLEGRO_FILE *fp, int64_t offset, int whence)
+{
+   MEMORY_FILE *mf = al_get_file_userdata(fp);
+   int64_t pos;
+
+   switch (whence) {
+      case ALLEGRO_SEEK_SET: pos = offset; break;
+      case ALLEGRO_SEEK_CUR: pos = mf->pos + offset; break;
+      case ALLEGRO_SEEK_END: pos = mf->size + offset; break;
+      default: return false;
+   }
+   if (pos < 0 || pos > mf->size) {
+      al_set_errno(EINVAL);
+      return false;
+   }
+   mf->pos = pos;
+   mf->eof = false;
+   return true;
+}
+
+
+static bool memory_feof(ALLEGRO_FILE *fp)
+{
+   MEMORY_FILE *mf = al_get_file_userdata(fp);
+   return mf->eof;
+}
+
+
+static int memory_ferror(ALLEGRO_FILE *fp)
+{
+   (void)fp;
+   return 0;
+}
+
+
+static const char *memory_ferrmsg(ALLEGRO_FILE *fp)
+{
+   (void)fp;
+   return "";
+}
+
+
+static void memory_fclearerr(ALLEGRO_FILE *fp)
+{
+   MEMORY_FILE *mf = al_get_file_userdata(fp);
+   mf->eof = false;
+}
+
+
+static off_t memory_fsize(ALLEGRO_FILE *fp)
+{
+   MEMORY_FILE *mf = al_get_file_userdata(fp);
+   return mf->size;
+}
+
+
+static const ALLEGRO_FILE_INTERFACE memory_vtable = {
+   NULL,    /* fopen */
+   memory_fclose,
+   memory_fread,
+   memory_fwrite,
+   memory_fflush,
+   memory_ftell,
+   memory_fseek,
+   memory_feof,
+   memory_ferror,
+   memory_ferrmsg,
+   memory_fclearerr,
+   NULL,    /* ungetc */
+   memory_fsize
+};
+
+
+/* _al_acodec_open_memory:
+ *  Open a read-only file over a block of memory, which must outlive it.
+ *  Decoders working on different parts of a file in parallel each open
+ *  their own.
+ */
+ALLEGRO_FILE *_al_acodec_open_memory(const void *data, size_t size)
+{
+   MEMORY_FILE *mf = al_calloc(1, sizeof(*mf));
+   ALLEGRO_FILE *fp;
+
+   if (!mf)
+      return NULL;
+   mf->data = data;
+   mf->size = size;
+
+   fp = al_create_file_handle(&memory_vtable, mf);
+   if (!fp)
+      al_free(mf);
+   return fp;
+}
+
+
+/* _al_acodec_read_file:
+ *  Read the rest of a file into memory, in one go if its size is known.
+ *  Returns NULL on error.
+ */
+void *_al_acodec_read_file(ALLEGRO_FILE *fp, size_t *size)
+{
+   char *data = NULL;
+   size_t capacity;
+   size_t pos = 0;
+   int64_t fsize;
+
+   fsize = al_fsize(fp);
+   if (fsize >= 0)
+      fsize -= al_ftell(fp);
+   capacity = (fsize > 0) ? (size_t)fsize : 64 * 1024;
+
+   for (;;) {
+      char *new_data = al_realloc(data, capacity);
+      if (!new_data) {
+         al_free(data);
+         return NULL;
+      }
+      data = new_data;
+      pos += al_fread(fp, data + pos, capacity - pos);
+      /* Reading exactly the remaining bytes does not set the EOF flag, so
+       * don't go looking for more when the size is known.
+       */
+      if (pos < capacity || al_feof(fp) || (fsize > 0 && pos == (size_t)fsize))
+         break;
+      capacity *= 2;
+   }
+
+   if (al_ferror(fp)) {
+      al_free(data);
+      return NULL;
+   }
+
+   *size = pos;
+   return data;
+}
+
+
+/* _al_acodec_get_parallel_ranges:
+ *  Return into how many ranges a file of `frames' frames at `freq' should be
+ *  split to decode it in parallel, or 1 to decode it in one go.  Files
+ *  shorter than [audio] parallel_decode_length seconds aren't split.
+ */
+int _al_acodec_get_parallel_ranges(uint64_t frames, unsigned int freq)
+{
+   ALLEGRO_THREAD_POOL *pool;
+   const char *value;
+   double min_length = 10.0;
+   double length;
+   int ranges;
+
+   if (freq == 0)
+      return 1;
+   length = (double)frames / freq;
+
+   value = al_get_config_value(al_get_system_config(), "audio",
+      "parallel_decode_length");
+   if (value && value[0] != '\0')
+      min_length = atof(value);
+   if (min_length <= 0.0 || length < min_length)
+      return 1;
+
+   pool = _al_get_shared_thread_pool();
+   if (!pool)
+      return 1;
+
+   /* The loading thread decodes a range too while it waits. */
+   ranges = al_get_thread_pool_size(pool) + 1;
+   if (ranges > length / MIN_RANGE_SECONDS)
+      ranges = length / MIN_RANGE_SECONDS;
+   return _ALLEGRO_MAX(ranges, 1);
+}
+
+
+typedef struct DECODE_RANGE {
+   bool (*decode)(void *userdata, uint64_t start, uint64_t end);
+   void *userdata;
+   uint64_t start, end;
+   bool ok;
+} DECODE_RANGE;
+
+
+static void decode_range_task(void *arg)
+{
+   DECODE_RANGE *range = arg;
+   range->ok = range->decode(range->userdata, range->start, range->end);
+}
+
+
+/* _al_acodec_decode_parallel:
+ *  Split `frames' into `num_ranges' ranges and call `decode' for each on the
+ *  shared thread pool.  Each call must decode frames [start, end) into its
+ *  own part of the output buffer.  Returns whether all of them succeeded.
+ */
+bool _al_acodec_decode_parallel(uint64_t frames, int num_ranges,
+   bool (*decode)(void *userdata, uint64_t start, uint64_t end),
+   void *userdata)
+{
+   ALLEGRO_THREAD_POOL *pool = _al_get_shared_thread_pool();
+   ALLEGRO_TASK_GROUP *group;
+   DECODE_RANGE *ranges;
+   bool ok = true;
+   int i;
+
+   ASSERT(num_ranges > 0);
+
+   ranges = al_calloc(num_ranges, sizeof(*ranges));
+   if (!ranges) {
+      /* Decode the ranges one after the other instead. */
+      for (i = 0; i < num_ranges; i++) {
+         if (!decode(userdata, frames * i / num_ranges,
+               frames * (i + 1) / num_ranges))
+            ok = false;
+      }
+      return ok;
+   }
+   group = pool ? al_create_task_group(pool) : NULL;
+
+   for (i = 0; i < num_ranges; i++) {
+      DECODE_RANGE *range = &ranges[i];
+      range->decode = decode;
+      range->userdata = userdata;
+      range->start = frames * i / num_ranges;
+      range->end = frames * (i + 1) / num_ranges;
+      if (!group || !al_submit_task(pool, group, decode_range_task, range))
+         decode_range_task(range);
+   }
+
+   if (group)
+      al_destroy_task_group(group);
+
+   for (i = 0; i < num_ranges; i++) {
+      if (!ranges[i].ok) {
+         ALLEGRO_ERROR("Failed to decode frames %lu to %lu\n",
+            (unsigned long) ranges[i].start, (unsigned long) ranges[i].end);
+         ok = false;
+      }
+   }
+
+   al_free(ranges);
+   return ok;
+}
+
+
+/* vim: set sts=3 sw=3 et: */
@@ -4,11 +4,11 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "allegro5/allegro_audio.h"
 #include "allegro5/internal/aintern_audio.h"
 #include "acodec.h"
-#include "helper.h"
 
 ALLEGRO_DEBUG_CHANNEL("wav")
 
@@ -267,12 +267,46 @@ static void wav_stream_close(ALLEGRO_AUDIO_STREAM *stream)
 {
    WAVFILE *wavfile = (WAVFILE *) stream->extra;
 
-   _al_acodec_stop_feed_thread(stream);
+   _al_kcm_stop_stream_feeder(stream);
    
    al_fclose(wavfile->f);
    wav_close(wavfile);
    stream->extra = NULL;
-   stream->feed_thread = NULL;
+}
+
+
+/* wav_map:
+ *  If enabled in the configuration, return a sample playing the data chunk
+ *  of the already opened file straight from a memory mapping.  The PCM data
+ *  must be usable as it is, i.e. not need byte swapping.
+ */
+static ALLEGRO_SAMPLE *wav_map(const char *filename, ALLEGRO_FILE *f)
+{
+   const char *value;
+   WAVFILE *wavfile;
+   ALLEGRO_SAMPLE *spl = NULL;
+
+   value = al_get_config_value(al_get_system_config(), "audio",
+      "memory_mapped_samples");
+   if (!value || strcmp(value, "yes") != 0)
+      return NULL;
+
+   wavfile = wav_open(f);
+   if (!wavfile)
+      return NULL;
+
+#ifdef ALLEGRO_BIG_ENDIAN
+   if (wavfile->bits == 8)
+#endif
+   {
+      spl = _al_kcm_create_mapped_sample(filename, wavfile->dpos,
+         wavfile->samples, wavfile->freq,
+         _al_word_size_to_depth_conf(wavfile->bits / 8),
+         _al_count_to_channel_conf(wavfile->channels));
+   }
+
+   wav_close(wavfile);
+   return spl;
 }
 
 
@@ -290,6 +324,13 @@ ALLEGRO_SAMPLE *_al_load_wav(const char *filename)
    if (!f)
       return NULL;
 
+   spl = wav_map(filename, f);
+   if (spl) {
+      al_fclose(f);
+      return spl;
+   }
+
+   al_fseek(f, 0, ALLEGRO_SEEK_SET);
    spl = _al_load_wav_f(f);
 
    al_fclose(f);
@@ -368,7 +409,6 @@ ALLEGRO_AUDIO_STREAM *_al_load_wav_audio_stream_f(ALLEGRO_FILE* f,
       stream->extra = wavfile;
       wavfile->loop_start = 0.0;
       wavfile->loop_end = wav_stream_get_length(stream);
-      stream->feed_thread = al_create_thread(_al_kcm_feed_stream, stream);
       stream->feeder = wav_stream_update;
       stream->unload_feeder = wav_stream_close;
       stream->rewind_feeder = wav_stream_rewind;
@@ -376,7 +416,7 @@ ALLEGRO_AUDIO_STREAM *_al_load_wav_audio_stream_f(ALLEGRO_FILE* f,
       stream->get_feeder_position = wav_stream_get_position;
       stream->get_feeder_length = wav_stream_get_length;
       stream->set_feeder_loop = wav_stream_set_loop;
-      al_start_thread(stream->feed_thread);
+      _al_kcm_start_stream_feeder(stream);
    }
    else {
       wav_close(wavfile);
@@ -413,7 +453,7 @@ bool _al_save_wav_f(ALLEGRO_FILE *pf, ALLEGRO_SAMPLE *spl)
    size_t channels, bits;
    size_t data_size;
    size_t samples;
-   size_t i, n;
+   size_t i, n, count;
 
    ASSERT(spl);
    ASSERT(pf);
@@ -481,10 +521,28 @@ bool _al_save_wav_f(ALLEGRO_FILE *pf, ALLEGRO_SAMPLE *spl)
       }
    }
    else if (spl->depth == ALLEGRO_AUDIO_DEPTH_FLOAT32) {
-      float *data = spl->buffer.f32;
-      for (i = 0; i < n; ++i) {
-         al_fwrite16le(pf, *data * 0x7FFF);
-         data++;
+      /* Convert in chunks, with the mixer's converter. */
+      int16_t chunk[4096];
+      _AL_DITHER dither;
+      const bool use_dither = _al_kcm_get_dither_config();
+      const float *data = spl->buffer.f32;
+
+      _al_kcm_init_dither(&dither);
+      for (i = 0; i < n; i += count) {
+         count = sizeof(chunk) / sizeof(chunk[0]);
+         if (count > n - i)
+            count = n - i;
+         _al_kcm_convert_from_float(chunk, ALLEGRO_AUDIO_DEPTH_INT16,
+            data + i, count, use_dither ? &dither : NULL);
+#ifdef ALLEGRO_LITTLE_ENDIAN
+         al_fwrite(pf, chunk, count * 2);
+#else
+         {
+            size_t j;
+            for (j = 0; j < count; j++)
+               al_fwrite16le(pf, chunk[j]);
+         }
+#endif
       }
    }
    else {
@@ -39,10 +39,6 @@ extern "C" {
 #endif
 
 
-/* Internal, used to communicate with acodec. */
-/* Must be in 512 <= n < 1024 */
-#define _KCM_STREAM_FEEDER_QUIT_EVENT_TYPE   (512)
-
 /* User event type emitted when a stream fragment is ready to be
  * refilled with more audio data.
  * Must be in 512 <= n < 1024
@@ -128,7 +124,22 @@ enum ALLEGRO_MIXER_QUALITY
 {
    ALLEGRO_MIXER_QUALITY_POINT   = 0x110,
    ALLEGRO_MIXER_QUALITY_LINEAR  = 0x111,
-   ALLEGRO_MIXER_QUALITY_CUBIC   = 0x112
+   ALLEGRO_MIXER_QUALITY_CUBIC   = 0x112,
+   ALLEGRO_MIXER_QUALITY_SINC    = 0x113
+};
+
+
+/* Enum: ALLEGRO_BIQUAD_TYPE
+ */
+enum ALLEGRO_BIQUAD_TYPE
+{
+   ALLEGRO_BIQUAD_LOWPASS     = 0x120,
+   ALLEGRO_BIQUAD_HIGHPASS    = 0x121,
+   ALLEGRO_BIQUAD_BANDPASS    = 0x122,
+   ALLEGRO_BIQUAD_NOTCH       = 0x123,
+   ALLEGRO_BIQUAD_PEAKING     = 0x124,
+   ALLEGRO_BIQUAD_LOW_SHELF   = 0x125,
+   ALLEGRO_BIQUAD_HIGH_SHELF  = 0x126
 };
 
 
@@ -176,11 +187,55 @@ typedef struct ALLEGRO_VOICE ALLEGRO_VOICE;
 typedef struct ALLEGRO_AUDIO_RECORDER ALLEGRO_AUDIO_RECORDER;
 
 
+/* Type: ALLEGRO_DSP_NODE
+ */
+typedef struct ALLEGRO_DSP_NODE ALLEGRO_DSP_NODE;
+
+
+/* Type: ALLEGRO_MIXER_STATS
+ */
+typedef struct ALLEGRO_MIXER_STATS ALLEGRO_MIXER_STATS;
+
+struct ALLEGRO_MIXER_STATS {
+   uint64_t renders;
+   uint64_t frames;
+   double render_time;
+   double max_render_time;
+   double load;
+};
+
+
+/* Type: ALLEGRO_AUDIO_STREAM_STATS
+ */
+typedef struct ALLEGRO_AUDIO_STREAM_STATS ALLEGRO_AUDIO_STREAM_STATS;
+
+struct ALLEGRO_AUDIO_STREAM_STATS {
+   uint64_t fragments_played;
+   uint64_t starvations;
+   unsigned int queued_fragments;
+   unsigned int min_queued_fragments;
+};
+
+
+/* Type: ALLEGRO_VOICE_STATS
+ */
+typedef struct ALLEGRO_VOICE_STATS ALLEGRO_VOICE_STATS;
+
+struct ALLEGRO_VOICE_STATS {
+   uint64_t callbacks;
+   uint64_t frames;
+   uint64_t underruns;
+   double mean_jitter;
+   double max_jitter;
+};
+
+
 #ifndef __cplusplus
 typedef enum ALLEGRO_AUDIO_DEPTH ALLEGRO_AUDIO_DEPTH;
 typedef enum ALLEGRO_CHANNEL_CONF ALLEGRO_CHANNEL_CONF;
 typedef enum ALLEGRO_PLAYMODE ALLEGRO_PLAYMODE;
 typedef enum ALLEGRO_MIXER_QUALITY ALLEGRO_MIXER_QUALITY;
+typedef enum ALLEGRO_BIQUAD_TYPE ALLEGRO_BIQUAD_TYPE;
 #endif
 
 
@@ -236,12 +291,20 @@ ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_sample, (ALLEGRO_SAMPLE_INSTANCE *spl, ALLEG
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_SAMPLE *, al_get_sample, (ALLEGRO_SAMPLE_INSTANCE *spl));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_play_sample_instance, (ALLEGRO_SAMPLE_INSTANCE *spl));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_stop_sample_instance, (ALLEGRO_SAMPLE_INSTANCE *spl));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_play_sample_instance_at, (ALLEGRO_SAMPLE_INSTANCE *spl, uint64_t frame));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_stop_sample_instance_at, (ALLEGRO_SAMPLE_INSTANCE *spl, uint64_t frame));
 
 
 /* Stream functions */
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_STREAM*, al_create_audio_stream, (size_t buffer_count,
       unsigned int samples, unsigned int freq,
       ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_STREAM*, al_create_pull_audio_stream, (
+      unsigned int samples, unsigned int freq,
+      ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf,
+      unsigned int (*callback)(ALLEGRO_AUDIO_STREAM *stream, void *buf,
+         unsigned int samples, void *data),
+      void *data));
 ALLEGRO_KCM_AUDIO_FUNC(void, al_destroy_audio_stream, (ALLEGRO_AUDIO_STREAM *stream));
 ALLEGRO_KCM_AUDIO_FUNC(void, al_drain_audio_stream, (ALLEGRO_AUDIO_STREAM *stream));
 
@@ -263,6 +326,8 @@ ALLEGRO_KCM_AUDIO_FUNC(bool, al_get_audio_stream_attached, (const ALLEGRO_AUDIO_
 ALLEGRO_KCM_AUDIO_FUNC(uint64_t, al_get_audio_stream_played_samples, (const ALLEGRO_AUDIO_STREAM *stream));
 
 ALLEGRO_KCM_AUDIO_FUNC(void *, al_get_audio_stream_fragment, (const ALLEGRO_AUDIO_STREAM *stream));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_get_audio_stream_stats, (const ALLEGRO_AUDIO_STREAM *stream, ALLEGRO_AUDIO_STREAM_STATS *stats));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_reset_audio_stream_stats, (ALLEGRO_AUDIO_STREAM *stream));
 
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_audio_stream_speed, (ALLEGRO_AUDIO_STREAM *stream, float val));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_audio_stream_gain, (ALLEGRO_AUDIO_STREAM *stream, float val));
@@ -309,6 +374,32 @@ ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_mixer_quality, (ALLEGRO_MIXER *mixer, ALLEGR
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_mixer_gain, (ALLEGRO_MIXER *mixer, float gain));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_mixer_playing, (ALLEGRO_MIXER *mixer, bool val));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_detach_mixer, (ALLEGRO_MIXER *mixer));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_mixer_parallel, (ALLEGRO_MIXER *mixer, bool val));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_get_mixer_parallel, (const ALLEGRO_MIXER *mixer));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_get_mixer_stats, (const ALLEGRO_MIXER *mixer, ALLEGRO_MIXER_STATS *stats));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_reset_mixer_stats, (ALLEGRO_MIXER *mixer));
+ALLEGRO_KCM_AUDIO_FUNC(uint64_t, al_get_mixer_frame_clock, (const ALLEGRO_MIXER *mixer));
+
+/* DSP node functions */
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_DSP_NODE *, al_create_biquad_node, (ALLEGRO_BIQUAD_TYPE type, float freq, float q, float gain_db));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_biquad_node, (ALLEGRO_DSP_NODE *node, ALLEGRO_BIQUAD_TYPE type, float freq, float q, float gain_db));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_DSP_NODE *, al_create_gain_node, (float gain));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_gain_node, (ALLEGRO_DSP_NODE *node, float gain, float ramp_time));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_DSP_NODE *, al_create_limiter_node, (float threshold, float release_time));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_limiter_node, (ALLEGRO_DSP_NODE *node, float threshold, float release_time));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_DSP_NODE *, al_create_delay_node, (float delay_time, float feedback, float mix));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_delay_node, (ALLEGRO_DSP_NODE *node, float delay_time, float feedback, float mix));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_DSP_NODE *, al_create_convolution_node, (const float *ir, unsigned int ir_len, float mix));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_convolution_node, (ALLEGRO_DSP_NODE *node, float mix));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_destroy_dsp_node, (ALLEGRO_DSP_NODE *node));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_attach_dsp_node_to_mixer, (ALLEGRO_DSP_NODE *node, ALLEGRO_MIXER *mixer));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_detach_dsp_node, (ALLEGRO_DSP_NODE *node));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_get_dsp_node_attached, (const ALLEGRO_DSP_NODE *node));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_dsp_node_bypass, (ALLEGRO_DSP_NODE *node, bool bypass));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_get_dsp_node_bypass, (const ALLEGRO_DSP_NODE *node));
+ALLEGRO_KCM_AUDIO_FUNC(double, al_get_dsp_node_cpu_time, (const ALLEGRO_DSP_NODE *node));
+ALLEGRO_KCM_AUDIO_FUNC(double, al_get_dsp_node_load, (const ALLEGRO_DSP_NODE *node));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_reset_dsp_node_cpu_time, (ALLEGRO_DSP_NODE *node));
 
 /* Voice functions */
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_VOICE*, al_create_voice, (unsigned int freq,
@@ -330,6 +421,8 @@ ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_DEPTH, al_get_voice_depth, (const ALLEGRO_V
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_get_voice_playing, (const ALLEGRO_VOICE *voice));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_voice_position, (ALLEGRO_VOICE *voice, unsigned int val));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_voice_playing, (ALLEGRO_VOICE *voice, bool val));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_get_voice_stats, (const ALLEGRO_VOICE *voice, ALLEGRO_VOICE_STATS *stats));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_reset_voice_stats, (ALLEGRO_VOICE *voice));
 
 /* Misc. audio functions */
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_install_audio, (void));
@@ -350,6 +443,9 @@ ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_default_mixer, (ALLEGRO_MIXER *mixer));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_restore_default_mixer, (void));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_play_sample, (ALLEGRO_SAMPLE *data,
       float gain, float pan, float speed, ALLEGRO_PLAYMODE loop, ALLEGRO_SAMPLE_ID *ret_id));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_play_sample_ex, (ALLEGRO_SAMPLE *data,
+      float gain, float pan, float speed, ALLEGRO_PLAYMODE loop,
+      int priority, float distance, ALLEGRO_SAMPLE_ID *ret_id));
 ALLEGRO_KCM_AUDIO_FUNC(void, al_stop_sample, (ALLEGRO_SAMPLE_ID *spl_id));
 ALLEGRO_KCM_AUDIO_FUNC(void, al_stop_samples, (void));
 
@@ -385,6 +481,8 @@ ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_STREAM *, al_load_audio_stream_f, (ALLEGRO_
 /* Recording functions */
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_RECORDER *, al_create_audio_recorder, (size_t fragment_count,
    unsigned int samples, unsigned int freq, ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_RECORDER *, al_create_pooled_audio_recorder, (size_t fragment_count,
+   unsigned int samples, unsigned int freq, ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_start_audio_recorder, (ALLEGRO_AUDIO_RECORDER *r));
 ALLEGRO_KCM_AUDIO_FUNC(void, al_stop_audio_recorder, (ALLEGRO_AUDIO_RECORDER *r));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_is_audio_recorder_recording, (ALLEGRO_AUDIO_RECORDER *r));
@@ -6,6 +6,8 @@
 #define AINTERN_AUDIO_H
 
 #include "allegro5/allegro.h"
+#include "allegro5/internal/aintern_atomicops.h"
+#include "allegro5/internal/aintern_list.h"
 #include "allegro5/internal/aintern_vector.h"
 #include "../allegro_audio.h"
 
@@ -19,7 +21,8 @@ typedef enum ALLEGRO_AUDIO_DRIVER_ENUM
    ALLEGRO_AUDIO_DRIVER_OSS        = 0x20004,
    ALLEGRO_AUDIO_DRIVER_AQUEUE     = 0x20005,
    ALLEGRO_AUDIO_DRIVER_PULSEAUDIO = 0x20006,
-   ALLEGRO_AUDIO_DRIVER_OPENSL     = 0x20007
+   ALLEGRO_AUDIO_DRIVER_OPENSL     = 0x20007,
+   ALLEGRO_AUDIO_DRIVER_NULL       = 0x20008
 } ALLEGRO_AUDIO_DRIVER_ENUM;
 
 typedef struct ALLEGRO_AUDIO_DRIVER ALLEGRO_AUDIO_DRIVER;
@@ -52,6 +55,7 @@ extern ALLEGRO_AUDIO_DRIVER *_al_kcm_driver;
 
 const void *_al_voice_update(ALLEGRO_VOICE *voice, ALLEGRO_MUTEX *mutex,
    unsigned int *samples);
+void _al_voice_note_underrun(ALLEGRO_VOICE *voice);
 bool _al_kcm_set_voice_playing(ALLEGRO_VOICE *voice, ALLEGRO_MUTEX *mutex,
    bool val);
 
@@ -86,6 +90,25 @@ struct ALLEGRO_VOICE {
 
    void                 *extra;
                         /* Extra data for use by the driver. */
+
+   _AL_LIST_ITEM        *dtor_item;
+                        /* Used to destroy the voice. */
+
+   ALLEGRO_VOICE_STATS  stats;
+   double               last_update_time;
+   double               expected_period;
+   double               jitter_sum;
+   uint64_t             jitter_count;
+                        /* Timing of the driver's calls to _al_voice_update,
+                         * updated with the voice mutex held.
+                         */
+
+   double               stats_log_interval;
+   double               next_stats_log;
+                        /* If the interval is non-zero, the statistics of the
+                         * voice and everything attached to it are logged
+                         * that often.
+                         */
 };
 
 
@@ -100,6 +123,18 @@ typedef union {
    void     *ptr;
 } any_buffer_t;
 
+/* Hooks for samples whose data is only resident some of the time. */
+typedef struct _AL_SAMPLE_PAGER {
+   /* Make the data resident and fill in the format, before the sample is
+    * set on an instance.  Returns false if that failed.
+    */
+   bool (*page_in)(ALLEGRO_SAMPLE *spl);
+   /* Release `pager_data'.  Called by al_destroy_sample, which then frees
+    * the buffer as usual.
+    */
+   void (*destroy)(ALLEGRO_SAMPLE *spl);
+} _AL_SAMPLE_PAGER;
+
 struct ALLEGRO_SAMPLE {
    ALLEGRO_AUDIO_DEPTH  depth;
    ALLEGRO_CHANNEL_CONF chan_conf;
@@ -110,6 +145,18 @@ struct ALLEGRO_SAMPLE {
                         /* Whether `buffer' needs to be freed when the sample
                          * is destroyed, or when `buffer' changes.
                          */
+   void                 *mapping;
+   uint64_t             mapping_size;
+                        /* The file mapping `buffer' points into, if any,
+                         * released when the sample is destroyed.
+                         */
+   const _AL_SAMPLE_PAGER *pager;
+   void                 *pager_data;
+                        /* Set if the data is paged in on demand, see
+                         * _al_kcm_create_paged_sample.
+                         */
+   _AL_LIST_ITEM        *dtor_item;
+                        /* Used to destroy the sample. */
 };
 
 /* Read some samples into a mixer buffer.
@@ -180,12 +227,25 @@ struct ALLEGRO_SAMPLE_INSTANCE {
                          * The gain is premultiplied in.
                          */
 
+   bool                 matrix_is_diagonal;
+                        /* True if the matrix is square and only scales each
+                         * channel, so frames can be mixed without any
+                         * channel conversion.
+                         */
+
    bool                 is_mixer;
    stream_reader_t      spl_read;
                         /* Reads sample data into the provided buffer, using
                          * the specified format, converting as necessary.
                          */
 
+   const float          *sinc_filter;
+   int                  sinc_taps;
+                        /* The filter bank for the current step and its
+                         * number of taps.  Set by the sinc reader before
+                         * each read.
+                         */
+
    ALLEGRO_MUTEX        *mutex;
                         /* Points to the parent object's mutex.  It is NULL if
                          * the sample is not directly or indirectly attached
@@ -195,14 +255,30 @@ struct ALLEGRO_SAMPLE_INSTANCE {
    sample_parent_t      parent;
                         /* The object that this sample is attached to, if any.
                          */
+
+   bool                 play_scheduled;
+   bool                 stop_scheduled;
+   uint64_t             play_frame;
+   uint64_t             stop_frame;
+                        /* Frames of the parent mixer's clock at which to
+                         * start or stop playing, if scheduled.
+                         */
+
+   _AL_LIST_ITEM        *dtor_item;
+                        /* Used to destroy the sample instance, or the mixer
+                         * deriving from it.
+                         */
 };
 
 void _al_kcm_destroy_sample(ALLEGRO_SAMPLE_INSTANCE *sample, bool unregister);
 void _al_kcm_stream_set_mutex(ALLEGRO_SAMPLE_INSTANCE *stream, ALLEGRO_MUTEX *mutex);
+void _al_kcm_log_instance_stats(ALLEGRO_SAMPLE_INSTANCE *spl, int indent);
 void _al_kcm_detach_from_parent(ALLEGRO_SAMPLE_INSTANCE *spl);
 
 
 typedef size_t (*stream_callback_t)(ALLEGRO_AUDIO_STREAM *, void *, size_t);
+typedef unsigned int (*pull_callback_t)(ALLEGRO_AUDIO_STREAM *, void *,
+   unsigned int, void *);
 typedef void (*unload_feeder_t)(ALLEGRO_AUDIO_STREAM *);
 typedef bool (*rewind_feeder_t)(ALLEGRO_AUDIO_STREAM *);
 typedef bool (*seek_feeder_t)(ALLEGRO_AUDIO_STREAM *, double);
@@ -210,6 +286,18 @@ typedef double (*get_feeder_position_t)(ALLEGRO_AUDIO_STREAM *);
 typedef double (*get_feeder_length_t)(ALLEGRO_AUDIO_STREAM *);
 typedef bool (*set_feeder_loop_t)(ALLEGRO_AUDIO_STREAM *, double, double);
 
+/* A single-producer, single-consumer ring of fragment pointers.
+ * The producer only writes 'write_pos' and the consumer only writes
+ * 'read_pos', so the two sides can run concurrently without a lock.
+ * One slot is always left empty to tell a full ring from an empty one.
+ */
+typedef struct _AL_FRAGMENT_RING {
+   void                 **bufs;
+   _AL_ATOMIC           size;
+   volatile _AL_ATOMIC  read_pos;
+   volatile _AL_ATOMIC  write_pos;
+} _AL_FRAGMENT_RING;
+
 struct ALLEGRO_AUDIO_STREAM {
    ALLEGRO_SAMPLE_INSTANCE spl;
                         /* ALLEGRO_AUDIO_STREAM is derived from
@@ -227,18 +315,21 @@ struct ALLEGRO_AUDIO_STREAM {
                          * at the start for linear/cubic interpolation.
                          */
 
-   void                 **pending_bufs;
-   void                 **used_bufs;
-                        /* Arrays of offsets into the main_buffer.
-                         * The arrays are each 'buf_count' long.
+   _AL_FRAGMENT_RING    pending_bufs;
+   _AL_FRAGMENT_RING    used_bufs;
+                        /* Rings of offsets into the main_buffer.
                          *
                          * 'pending_bufs' holds pointers to fragments supplied
                          * by the user which are yet to be handed off to the
-                         * audio driver.
+                         * audio driver.  Its first entry is the fragment
+                         * currently being played.
                          *
                          * 'used_bufs' holds pointers to fragments which
                          * have been sent to the audio driver and so are
                          * ready to receive new data.
+                         *
+                         * The user fills fragments and the mixer plays them
+                         * without sharing a lock, see _AL_FRAGMENT_RING.
                          */
 
    volatile bool         is_draining;
@@ -253,8 +344,22 @@ struct ALLEGRO_AUDIO_STREAM {
                           * the stream was started.
                           */
 
-   ALLEGRO_THREAD        *feed_thread;
-   volatile bool         quit_feed_thread;
+   ALLEGRO_AUDIO_STREAM_STATS stats;
+   bool                  starving;
+                         /* Updated by the mixer as it refills the stream.
+                          * 'starving' is set while the mixer finds no
+                          * fragment to play, so each starvation is counted
+                          * once.
+                          */
+
+   ALLEGRO_MUTEX         *feed_mutex;
+                         /* Serialises calls to the feeder callbacks, so that
+                          * decoding doesn't hold up the mixer.
+                          */
+   struct FEED_JOB       *feed_job;
+                         /* Set while the shared feeder threads refill this
+                          * stream, see _al_kcm_start_stream_feeder.
+                          */
    unload_feeder_t       unload_feeder;
    rewind_feeder_t       rewind_feeder;
    seek_feeder_t         seek_feeder;
@@ -264,8 +369,18 @@ struct ALLEGRO_AUDIO_STREAM {
    stream_callback_t     feeder;
                          /* If ALLEGRO_AUDIO_STREAM has been created by
                           * al_load_audio_stream(), the stream will be fed
-                          * by a thread using the 'feeder' callback. Such
+                          * by a feeder thread using the 'feeder' callback. Such
                           * streams don't need to be fed by the user.
+                          * Loaded pull streams, such as modules, set the other
+                          * callbacks but no 'feeder'.
+                          */
+
+   pull_callback_t       pull_callback;
+   void                  *pull_data;
+                         /* If the stream was created by
+                          * al_create_pull_audio_stream(), the mixer calls
+                          * this to fill each fragment just as it is needed.
+                          * Neither ring is used by the user then.
                           */
 
    void                  *extra;
@@ -273,11 +388,17 @@ struct ALLEGRO_AUDIO_STREAM {
 };
 
 bool _al_kcm_refill_stream(ALLEGRO_AUDIO_STREAM *stream);
+void _al_kcm_log_stream_stats(ALLEGRO_AUDIO_STREAM *stream, int indent);
 
 
 typedef void (*postprocess_callback_t)(void *buf, unsigned int samples,
    void *userdata);
 
+/* State of the random generators used to dither conversions. */
+typedef struct _AL_DITHER {
+   uint32_t state[4];
+} _AL_DITHER;
+
 /* ALLEGRO_MIXER is derived from ALLEGRO_SAMPLE_INSTANCE. Certain internal functions and
  * pointers may take either object type, and such things are explicitly noted.
  * This is never exposed to the user, though.  The sample object's read method
@@ -297,12 +418,70 @@ struct ALLEGRO_MIXER {
                            /* Vector of ALLEGRO_SAMPLE_INSTANCE*.  Holds the list of
                             * streams being mixed together.
                             */
+
+   ALLEGRO_TASK_GROUP      *task_group;
+                           /* Non-NULL if attached mixers are rendered in
+                            * parallel on the mixer thread pool.
+                            */
+
+   unsigned int            render_samples;
+   bool                    rendered;
+                           /* Request and result of a parallel render of this
+                            * mixer, set by its parent.
+                            */
+
+   _AL_VECTOR              dsp_nodes;
+                           /* Vector of ALLEGRO_DSP_NODE*, run in order on
+                            * the mixed buffer.
+                            */
+   float                   *dsp_buffer;
+   unsigned int            dsp_buffer_len;
+                           /* Floats for the DSP nodes of integer mixers. */
+
+   bool                    dither;
+   _AL_DITHER              dither_state;
+                           /* Whether output to an integer voice is
+                            * dithered.
+                            */
+
+   ALLEGRO_MIXER_STATS     stats;
+                           /* Time spent rendering, including the attached
+                            * mixers and DSP nodes.  The load is computed
+                            * when queried.
+                            */
+
+   uint64_t                frame_clock;
+                           /* Number of frames rendered so far. */
 };
 
 extern void _al_kcm_mixer_rejig_sample_matrix(ALLEGRO_MIXER *mixer,
    ALLEGRO_SAMPLE_INSTANCE *spl);
 extern void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
    ALLEGRO_AUDIO_DEPTH buffer_depth, size_t dest_maxc);
+extern void _al_kcm_init_mixer_pool(void);
+extern void _al_kcm_shutdown_mixer_pool(void);
+
+void _al_kcm_mixer_run_dsp(ALLEGRO_MIXER *mixer, unsigned int samples);
+void _al_kcm_log_mixer_stats(ALLEGRO_MIXER *mixer, int indent);
+
+ALLEGRO_KCM_AUDIO_FUNC(void, _al_kcm_init_dither, (_AL_DITHER *dither));
+ALLEGRO_KCM_AUDIO_FUNC(bool, _al_kcm_get_dither_config, (void));
+ALLEGRO_KCM_AUDIO_FUNC(void, _al_kcm_convert_from_float, (void *dest,
+   ALLEGRO_AUDIO_DEPTH depth, const float *src, unsigned int n,
+   _AL_DITHER *dither));
+void _al_kcm_mixer_free_dsp(ALLEGRO_MIXER *mixer);
+void _al_kcm_init_fft_tables(void);
+
+/* Phases of each sinc filter bank.  The mixer uses the nearest one rather
+ * than interpolating, so there are many to keep the phase error small.
+ */
+#define _AL_SINC_PHASES    1024
+#define _AL_SINC_MAX_TAPS  32
+
+bool _al_kcm_init_sinc_filters(void);
+void _al_kcm_shutdown_sinc_filters(void);
+int _al_kcm_get_sinc_taps(void);
+const float *_al_kcm_get_sinc_filter(int step, int step_denom);
 
 
 typedef enum {
@@ -315,20 +494,36 @@ typedef enum {
 extern void _al_set_error(int error, char* string);
 
 /* Supposedly internal */
-ALLEGRO_KCM_AUDIO_FUNC(void*, _al_kcm_feed_stream, (ALLEGRO_THREAD *self, void *vstream));
+ALLEGRO_KCM_AUDIO_FUNC(bool, _al_kcm_start_stream_feeder, (ALLEGRO_AUDIO_STREAM *stream));
+ALLEGRO_KCM_AUDIO_FUNC(void, _al_kcm_stop_stream_feeder, (ALLEGRO_AUDIO_STREAM *stream));
+void _al_kcm_shutdown_stream_feeders(void);
 
 /* Helper to emit an event that the stream has got a buffer ready to be refilled. */
 void _al_kcm_emit_stream_events(ALLEGRO_AUDIO_STREAM *stream);
 
 void _al_kcm_init_destructors(void);
 void _al_kcm_shutdown_destructors(void);
-void _al_kcm_register_destructor(void *object, void (*func)(void*));
-void _al_kcm_unregister_destructor(void *object);
+_AL_LIST_ITEM *_al_kcm_register_destructor(void *object, void (*func)(void*));
+void _al_kcm_unregister_destructor(_AL_LIST_ITEM *dtor_item);
 void _al_kcm_foreach_destructor(
       void (*callback)(void *object, void (*func)(void *), void *udata),
       void *userdata);
 
 ALLEGRO_KCM_AUDIO_FUNC(void, _al_kcm_shutdown_default_mixer, (void));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_DEPTH, _al_kcm_get_default_mixer_depth, (void));
+
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_SAMPLE *, _al_kcm_create_mapped_sample, (
+   const char *filename, uint64_t offset, unsigned int samples,
+   unsigned int freq, ALLEGRO_AUDIO_DEPTH depth,
+   ALLEGRO_CHANNEL_CONF chan_conf));
+ALLEGRO_KCM_AUDIO_FUNC(void, _al_kcm_unmap_sample, (ALLEGRO_SAMPLE *spl));
+
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_SAMPLE *, _al_kcm_create_paged_sample, (
+   const _AL_SAMPLE_PAGER *pager, void *pager_data));
+ALLEGRO_KCM_AUDIO_FUNC(bool, _al_kcm_page_in_sample, (ALLEGRO_SAMPLE *spl));
+ALLEGRO_KCM_AUDIO_FUNC(bool, _al_kcm_sample_in_use, (ALLEGRO_SAMPLE *spl));
+ALLEGRO_KCM_AUDIO_FUNC(void, _al_kcm_move_sample_data, (ALLEGRO_SAMPLE *dest,
+   ALLEGRO_SAMPLE *src));
 
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_CHANNEL_CONF, _al_count_to_channel_conf, (int num_channels));
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_DEPTH, _al_word_size_to_depth_conf, (int word_size));
@@ -340,6 +535,8 @@ ALLEGRO_KCM_AUDIO_FUNC(void, _al_emit_audio_event, (int event_type));
  * Recording
  */
  
+typedef struct _AL_FRAGMENT_POOL _AL_FRAGMENT_POOL;
+
 struct ALLEGRO_AUDIO_RECORDER {
   ALLEGRO_EVENT_SOURCE source;
   
@@ -374,8 +571,22 @@ struct ALLEGRO_AUDIO_RECORDER {
                               
   void                     *extra;
                            /* custom data for the driver to use as needed */
+
+  unsigned int             fragment_i;
+                           /* the fragment being recorded into */
+
+  _AL_FRAGMENT_POOL        *pool;
+  void                     *current_fragment;
+                           /* if not NULL, fragments are taken from the pool
+                              instead of the fixed ring, and handed to the
+                              user until released, see
+                              al_create_pooled_audio_recorder */
 };
 
+void *_al_kcm_get_recorder_fragment(ALLEGRO_AUDIO_RECORDER *r);
+void _al_kcm_emit_recorder_fragment(ALLEGRO_AUDIO_RECORDER *r,
+   unsigned int samples);
+
 
 #endif
 
@@ -113,9 +113,12 @@ static void alsa_close(void)
 
 
 /* Underrun and suspend recovery */
-static int xrun_recovery(snd_pcm_t *handle, int err)
+static int xrun_recovery(ALLEGRO_VOICE *voice, int err)
 {
+   snd_pcm_t *handle = ((ALSA_VOICE *)voice->extra)->pcm_handle;
+
    if (err == -EPIPE) { /* under-run */
+      _al_voice_note_underrun(voice);
       err = snd_pcm_prepare(handle);
       if (err < 0) {
          ALLEGRO_ERROR("Can't recover from underrun, prepare failed: %s\n", snd_strerror(err));
@@ -202,8 +205,9 @@ static int alsa_update_nonstream_voice(ALLEGRO_VOICE *voice, void **buf, int *by
 
 
 /* Returns true if the voice is ready for more data. */
-static int alsa_voice_is_ready(ALSA_VOICE *alsa_voice)
+static int alsa_voice_is_ready(ALLEGRO_VOICE *voice)
 {
+   ALSA_VOICE *alsa_voice = (ALSA_VOICE*)voice->extra;
    unsigned short revents;
    int err;
 
@@ -220,7 +224,7 @@ static int alsa_voice_is_ready(ALSA_VOICE *alsa_voice)
          else
             err = -ESTRPIPE;
 
-         if (xrun_recovery(alsa_voice->pcm_handle, err) < 0) {
+         if (xrun_recovery(voice, err) < 0) {
             ALLEGRO_ERROR("Write error: %s\n", snd_strerror(err));
             return -POLLERR;
          }
@@ -292,7 +296,7 @@ static void *alsa_update_mmap(ALLEGRO_THREAD *self, void *arg)
          ALLEGRO_DEBUG("snd_pcm_start returned: %d\n", rc);
       }
 
-      ret = alsa_voice_is_ready(alsa_voice);
+      ret = alsa_voice_is_ready(voice);
       if (ret < 0)
          break;
       if (ret == 0) {
@@ -304,7 +308,7 @@ static void *alsa_update_mmap(ALLEGRO_THREAD *self, void *arg)
       frames = alsa_voice->frag_len;
       ret = snd_pcm_mmap_begin(alsa_voice->pcm_handle, &areas, &offset, &frames);
       if (ret < 0) {
-         if ((ret = xrun_recovery(alsa_voice->pcm_handle, ret)) < 0) {
+         if ((ret = xrun_recovery(voice, ret)) < 0) {
             ALLEGRO_ERROR("MMAP begin avail error: %s\n", snd_strerror(ret));
          }
          break;
@@ -353,7 +357,7 @@ silence:
 
       snd_pcm_sframes_t commitres = snd_pcm_mmap_commit(alsa_voice->pcm_handle, offset, frames);
       if (commitres < 0 || (snd_pcm_uframes_t)commitres != frames) {
-         if ((ret = xrun_recovery(alsa_voice->pcm_handle, commitres >= 0 ? -EPIPE : commitres)) < 0) {
+         if ((ret = xrun_recovery(voice, commitres >= 0 ? -EPIPE : commitres)) < 0) {
             ALLEGRO_ERROR("MMAP commit error: %s\n", snd_strerror(ret));
             break;
          }
@@ -420,6 +424,7 @@ static void *alsa_update_rw(ALLEGRO_THREAD *self, void *arg)
       err = snd_pcm_avail_update(alsa_voice->pcm_handle);
       if (err < 0) {
          if (err == -EPIPE) {
+            _al_voice_note_underrun(voice);
             snd_pcm_prepare(alsa_voice->pcm_handle);
          }
          else {
@@ -460,6 +465,7 @@ silence:
       err = snd_pcm_writei(alsa_voice->pcm_handle, buf, frames);
       if (err < 0) {
          if (err == -EPIPE) {
+            _al_voice_note_underrun(voice);
             snd_pcm_prepare(alsa_voice->pcm_handle);
          }
       }
@@ -711,9 +717,7 @@ static void *alsa_update_recorder(ALLEGRO_THREAD *t, void *thread_data)
 {
    ALLEGRO_AUDIO_RECORDER *r = thread_data;
    ALSA_RECORDER_DATA *alsa = r->extra;
-   ALLEGRO_EVENT user_event;
    uint8_t *null_buffer;
-   unsigned int fragment_i = 0;
    
    null_buffer = al_malloc(1024 * r->sample_size);
    if (!null_buffer) {
@@ -734,19 +738,15 @@ static void *alsa_update_recorder(ALLEGRO_THREAD *t, void *thread_data)
          snd_pcm_readi(alsa->capture_handle, null_buffer, 1024);
       }
       else {
-         ALLEGRO_AUDIO_RECORDER_EVENT *e;
+         void *fragment = _al_kcm_get_recorder_fragment(r);
          snd_pcm_sframes_t count;
          al_unlock_mutex(r->mutex);
-         if ((count = snd_pcm_readi(alsa->capture_handle, r->fragments[fragment_i], r->samples)) > 0) {
-            user_event.user.type = ALLEGRO_EVENT_AUDIO_RECORDER_FRAGMENT;
-            e = al_get_audio_recorder_event(&user_event);
-            e->buffer = r->fragments[fragment_i];
-            e->samples = count;
-            al_emit_user_event(&r->source, &user_event, NULL);
-         
-            if (++fragment_i == r->fragment_count) {
-               fragment_i = 0;
-            }
+         if (!fragment) {
+            /* Drop the audio rather than fall behind. */
+            snd_pcm_readi(alsa->capture_handle, null_buffer, 1024);
+         }
+         else if ((count = snd_pcm_readi(alsa->capture_handle, fragment, r->samples)) > 0) {
+            _al_kcm_emit_recorder_fragment(r, count);
          }
       }
    }
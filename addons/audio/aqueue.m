@@ -398,10 +398,8 @@ typedef struct RECORDER_DATA
    uint32_t buffer_size;
 
    /* User fragment buffer information.
-    *   Which buffer are we writing into, and
-    *   how much data has already been written?
+    *   How much data has already been written into the current one?
     */
-   unsigned int fragment_i;
    unsigned int samples_written;
 
 } RECORDER_DATA;
@@ -431,9 +429,15 @@ static void _aqueue_recording_callback(void *user_data, AudioQueueRef aq,
       while (sample_count > 0) {
          unsigned int samples_left = recorder->samples - data->samples_written;
          unsigned int samples_to_write = sample_count < samples_left ? sample_count : samples_left;
+         uint8_t *fragment = _al_kcm_get_recorder_fragment(recorder);
+
+         if (!fragment) {
+            /* Drop the audio rather than fall behind. */
+            break;
+         }
          
          /* Copy the incoming data into the user's fragment buffer */
-         memcpy(recorder->fragments[data->fragment_i] + data->samples_written * recorder->sample_size,
+         memcpy(fragment + data->samples_written * recorder->sample_size,
                 input, samples_to_write * recorder->sample_size);
          
          input += samples_to_write * recorder->sample_size;
@@ -444,18 +448,7 @@ static void _aqueue_recording_callback(void *user_data, AudioQueueRef aq,
          ALLEGRO_ASSERT(recorder->samples >= data->samples_written);
          
          if (data->samples_written == recorder->samples) {
-            ALLEGRO_EVENT user_event;
-            ALLEGRO_AUDIO_RECORDER_EVENT *e;
-            user_event.user.type = ALLEGRO_EVENT_AUDIO_RECORDER_FRAGMENT;
-            e = al_get_audio_recorder_event(&user_event);
-            e->buffer = recorder->fragments[data->fragment_i];
-            e->samples = recorder->samples;
-            al_emit_user_event(&recorder->source, &user_event, NULL);
-            
-            if (++data->fragment_i == recorder->fragment_count) {
-               data->fragment_i = 0;
-            }
-            
+            _al_kcm_emit_recorder_fragment(recorder, recorder->samples);
             data->samples_written = 0;
          }
       }
@@ -46,6 +46,9 @@ ALLEGRO_AUDIO_DRIVER *_al_kcm_driver = NULL;
 #if defined(ALLEGRO_CFG_KCM_PULSEAUDIO)
    extern struct ALLEGRO_AUDIO_DRIVER _al_kcm_pulseaudio_driver;
 #endif
+#if defined(ALLEGRO_CFG_KCM_NULL)
+   extern struct ALLEGRO_AUDIO_DRIVER _al_kcm_null_driver;
+#endif
 
 /* Channel configuration helpers */
 
@@ -193,6 +196,9 @@ static ALLEGRO_AUDIO_DRIVER_ENUM get_config_audio_driver(void)
    if (0 == _al_stricmp(value, "DSOUND") || 0 == _al_stricmp(value, "DIRECTSOUND"))
       return ALLEGRO_AUDIO_DRIVER_DSOUND;
 
+   if (0 == _al_stricmp(value, "NULL"))
+      return ALLEGRO_AUDIO_DRIVER_NULL;
+
    return ALLEGRO_AUDIO_DRIVER_AUTODETECT;
 }
 
@@ -349,6 +355,19 @@ static bool do_install_audio(ALLEGRO_AUDIO_DRIVER_ENUM mode)
             return false;
          #endif
 
+      case ALLEGRO_AUDIO_DRIVER_NULL:
+         #if defined(ALLEGRO_CFG_KCM_NULL)
+            if (_al_kcm_null_driver.open() == 0) {
+               ALLEGRO_INFO("Using null driver\n");
+               _al_kcm_driver = &_al_kcm_null_driver;
+               return true;
+            }
+            return false;
+         #else
+            _al_set_error(ALLEGRO_INVALID_PARAM, "Null audio driver not compiled in");
+            return false;
+         #endif
+
       default:
          _al_set_error(ALLEGRO_INVALID_PARAM, "Invalid audio driver");
          return false;
@@ -368,6 +387,8 @@ bool al_install_audio(void)
     * because the user may still create samples.
     */
    _al_kcm_init_destructors();
+   _al_kcm_init_mixer_pool();
+   _al_kcm_init_fft_tables();
    _al_add_exit_func(al_uninstall_audio, "al_uninstall_audio");
 
    ret = do_install_audio(ALLEGRO_AUDIO_DRIVER_AUTODETECT);
@@ -387,6 +408,11 @@ void al_uninstall_audio(void)
    else {
       _al_kcm_shutdown_destructors();
    }
+
+   /* Only after the mixers using it are gone. */
+   _al_kcm_shutdown_mixer_pool();
+   _al_kcm_shutdown_sinc_filters();
+   _al_kcm_shutdown_stream_feeders();
 }
 
 /* Function: al_is_audio_installed
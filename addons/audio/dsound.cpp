@@ -648,10 +648,8 @@ static void *_dsound_update_recorder(ALLEGRO_THREAD *t, void *data)
    ALLEGRO_AUDIO_RECORDER *r = (ALLEGRO_AUDIO_RECORDER *) data;
    DSOUND_RECORD_DATA *extra = (DSOUND_RECORD_DATA *) r->extra;
    DWORD last_read_pos = 0;
-   ALLEGRO_EVENT user_event;
    bool is_dsound_recording = false;
 
-   size_t fragment_i = 0;
    size_t bytes_written = 0;
 
    ALLEGRO_INFO("Starting recorder thread\n");
@@ -698,29 +696,25 @@ static void *_dsound_update_recorder(ALLEGRO_THREAD *t, void *data)
          buffer_size = buffer1_size;
 
          while (buffer_size > 0) {
+            uint8_t *fragment = (uint8_t *) _al_kcm_get_recorder_fragment(r);
+            if (!fragment) {
+               /* Drop the audio rather than fall behind. */
+               break;
+            }
             if (bytes_written + buffer_size <= r->fragment_size) {
-               memcpy((uint8_t*) r->fragments[fragment_i] + bytes_written, buffer, buffer_size);
+               memcpy(fragment + bytes_written, buffer, buffer_size);
                bytes_written += buffer_size;
                buffer_size = 0;
             }
             else {
-               ALLEGRO_AUDIO_RECORDER_EVENT *e;
                size_t bytes_to_write = r->fragment_size - bytes_written;
-               memcpy((uint8_t*) r->fragments[fragment_i] + bytes_written, buffer, bytes_to_write);
+               memcpy(fragment + bytes_written, buffer, bytes_to_write);
 
                buffer_size -= bytes_to_write;
                buffer += bytes_to_write;
 
-               user_event.user.type = ALLEGRO_EVENT_AUDIO_RECORDER_FRAGMENT;
-               e = al_get_audio_recorder_event(&user_event);
-               e->buffer = r->fragments[fragment_i];
-               e->samples = r->samples;
-               al_emit_user_event(&r->source, &user_event, NULL);
-
                /* advance to the next fragment */
-               if (++fragment_i == r->fragment_count) {
-                  fragment_i = 0;
-               }
+               _al_kcm_emit_recorder_fragment(r, r->samples);
                bytes_written = 0;
             }
          }
@@ -0,0 +1,278 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      Conversion of mixed floats to integer sample formats.
+ *
+ *      See LICENSE.txt for copyright information.
+ */
+
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "allegro5/allegro.h"
+#include "allegro5/allegro_audio.h"
+#include "allegro5/internal/aintern.h"
+#include "allegro5/internal/aintern_audio.h"
+
+ALLEGRO_DEBUG_CHANNEL("audio")
+
+
+/* The dither is triangular (TPDF): the difference of two uniform random
+ * numbers, spanning -1 to +1 of the output's least significant bit.  Each of
+ * the four lanes has its own xorshift generator.
+ */
+
+static INLINE uint32_t xorshift(uint32_t *s)
+{
+   uint32_t x = *s;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   return *s = x;
+}
+
+
+/* Uniform in [0, 1), from the top 23 bits. */
+static INLINE float uniform(uint32_t x)
+{
+   union { uint32_t i; float f; } u;
+   u.i = (x >> 9) | 0x3F800000;
+   return u.f - 1.0f;
+}
+
+
+static INLINE float tpdf(_AL_DITHER *dither)
+{
+   const float a = uniform(xorshift(&dither->state[0]));
+   const float b = uniform(xorshift(&dither->state[0]));
+   return a - b;
+}
+
+
+/* Scale, dither, saturate and round one sample. */
+static INLINE int32_t convert_sample(float x, float scale, float lo, float hi,
+   _AL_DITHER *dither)
+{
+   x *= scale;
+   if (dither) {
+      x += tpdf(dither);
+      x = _ALLEGRO_CLAMP(lo, x, hi);
+      /* Round to nearest, or the dither would have a dead zone at 0. */
+      return (int32_t)(x < 0.0f ? x - 0.5f : x + 0.5f);
+   }
+   x = _ALLEGRO_CLAMP(lo, x, hi);
+   return (int32_t)x;
+}
+
+
+#ifdef __SSE2__
+
+static INLINE __m128i xorshift4(__m128i x)
+{
+   x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+   x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+   x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+   return x;
+}
+
+
+static INLINE __m128 uniform4(__m128i x)
+{
+   const __m128i one = _mm_set1_epi32(0x3F800000);
+   x = _mm_or_si128(_mm_srli_epi32(x, 9), one);
+   return _mm_sub_ps(_mm_castsi128_ps(x), _mm_castsi128_ps(one));
+}
+
+
+/* Converter state for four samples at a time. */
+typedef struct CONVERT4 {
+   __m128 scale, lo, hi;
+   __m128i state;
+   bool dither;
+} CONVERT4;
+
+
+static INLINE __m128i convert4(CONVERT4 *cv, const float *src)
+{
+   __m128 x = _mm_mul_ps(_mm_loadu_ps(src), cv->scale);
+
+   if (cv->dither) {
+      const __m128 sign_mask = _mm_set1_ps(-0.0f);
+      __m128 a, b;
+      cv->state = xorshift4(cv->state);
+      a = uniform4(cv->state);
+      cv->state = xorshift4(cv->state);
+      b = uniform4(cv->state);
+      x = _mm_add_ps(x, _mm_sub_ps(a, b));
+      x = _mm_min_ps(_mm_max_ps(x, cv->lo), cv->hi);
+      /* Add 0.5 with the sign of x, then truncate. */
+      x = _mm_add_ps(x,
+         _mm_or_ps(_mm_and_ps(x, sign_mask), _mm_set1_ps(0.5f)));
+      return _mm_cvttps_epi32(x);
+   }
+
+   x = _mm_min_ps(_mm_max_ps(x, cv->lo), cv->hi);
+   return _mm_cvttps_epi32(x);
+}
+
+
+static void init_convert4(CONVERT4 *cv, float scale, float lo, float hi,
+   _AL_DITHER *dither)
+{
+   cv->scale = _mm_set1_ps(scale);
+   cv->lo = _mm_set1_ps(lo);
+   cv->hi = _mm_set1_ps(hi);
+   cv->dither = (dither != NULL);
+   if (dither)
+      cv->state = _mm_loadu_si128((const __m128i *)dither->state);
+   else
+      cv->state = _mm_setzero_si128();
+}
+
+
+static void finish_convert4(CONVERT4 *cv, _AL_DITHER *dither)
+{
+   if (dither)
+      _mm_storeu_si128((__m128i *)dither->state, cv->state);
+}
+
+#endif /* __SSE2__ */
+
+
+/* _al_kcm_init_dither:
+ *  Seed the generators of a dither state.
+ */
+void _al_kcm_init_dither(_AL_DITHER *dither)
+{
+   static const uint32_t seeds[4] = {
+      0x9E3779B9, 0x243F6A88, 0xB7E15162, 0x6A09E667
+   };
+
+   ASSERT(dither);
+
+   memcpy(dither->state, seeds, sizeof(seeds));
+}
+
+
+/* _al_kcm_get_dither_config:
+ *  Return whether conversion to integer depths should be dithered, from the
+ *  dither key of the [audio] configuration section.
+ */
+bool _al_kcm_get_dither_config(void)
+{
+   ALLEGRO_CONFIG *config = al_get_system_config();
+   const char *value;
+
+   if (!config)
+      return false;
+   value = al_get_config_value(config, "audio", "dither");
+   return value && !_al_stricmp(value, "yes");
+}
+
+
+/* _al_kcm_convert_from_float:
+ *  Convert n float samples in [-1, 1) to the given depth, saturating values
+ *  out of range.  If dither is not NULL the result is dithered, otherwise it
+ *  is truncated.  dest may be the same buffer as src.
+ */
+void _al_kcm_convert_from_float(void *dest, ALLEGRO_AUDIO_DEPTH depth,
+   const float *src, unsigned int n, _AL_DITHER *dither)
+{
+   const bool is_unsigned = (depth & ALLEGRO_AUDIO_DEPTH_UNSIGNED) != 0;
+   unsigned int i = 0;
+#ifdef __SSE2__
+   CONVERT4 cv;
+#endif
+
+   switch (depth & ~ALLEGRO_AUDIO_DEPTH_UNSIGNED) {
+
+      case ALLEGRO_AUDIO_DEPTH_FLOAT32:
+         if (dest != src)
+            memmove(dest, src, n * sizeof(float));
+         break;
+
+      case ALLEGRO_AUDIO_DEPTH_INT24: {
+         const float scale = (float)0x7FFFFF + 0.5f;
+         const int32_t off = is_unsigned ? 0x800000 : 0;
+         int32_t *out = dest;
+#ifdef __SSE2__
+         const __m128i offv = _mm_set1_epi32(off);
+         init_convert4(&cv, scale, -0x800000, 0x7FFFFF, dither);
+         for (; i + 4 <= n; i += 4) {
+            const __m128i v = _mm_add_epi32(convert4(&cv, src + i), offv);
+            _mm_storeu_si128((__m128i *)(out + i), v);
+         }
+         finish_convert4(&cv, dither);
+#endif
+         for (; i < n; i++) {
+            out[i] = convert_sample(src[i], scale, -0x800000, 0x7FFFFF,
+               dither) + off;
+         }
+         break;
+      }
+
+      case ALLEGRO_AUDIO_DEPTH_INT16: {
+         const float scale = (float)0x7FFF + 0.5f;
+         const int16_t off = is_unsigned ? 0x8000 : 0;
+         int16_t *out = dest;
+#ifdef __SSE2__
+         const __m128i offv = _mm_set1_epi16(off);
+         init_convert4(&cv, scale, -0x8000, 0x7FFF, dither);
+         /* The stores stay behind the loads when converting in place. */
+         for (; i + 8 <= n; i += 8) {
+            const __m128i a = convert4(&cv, src + i);
+            const __m128i b = convert4(&cv, src + i + 4);
+            const __m128i v = _mm_xor_si128(_mm_packs_epi32(a, b), offv);
+            _mm_storeu_si128((__m128i *)(out + i), v);
+         }
+         finish_convert4(&cv, dither);
+#endif
+         for (; i < n; i++) {
+            out[i] = convert_sample(src[i], scale, -0x8000, 0x7FFF, dither)
+               ^ off;
+         }
+         break;
+      }
+
+      case ALLEGRO_AUDIO_DEPTH_INT8: {
+         const float scale = (float)0x7F + 0.5f;
+         const int8_t off = is_unsigned ? 0x80 : 0;
+         int8_t *out = dest;
+#ifdef __SSE2__
+         const __m128i offv = _mm_set1_epi8(off);
+         init_convert4(&cv, scale, -0x80, 0x7F, dither);
+         for (; i + 16 <= n; i += 16) {
+            const __m128i a = convert4(&cv, src + i);
+            const __m128i b = convert4(&cv, src + i + 4);
+            const __m128i c = convert4(&cv, src + i + 8);
+            const __m128i d = convert4(&cv, src + i + 12);
+            const __m128i v = _mm_packs_epi16(_mm_packs_epi32(a, b),
+               _mm_packs_epi32(c, d));
+            _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(v, offv));
+         }
+         finish_convert4(&cv, dither);
+#endif
+         for (; i < n; i++) {
+            out[i] = convert_sample(src[i], scale, -0x80, 0x7F, dither)
+               ^ off;
+         }
+         break;
+      }
+
+      default:
+         ASSERT(false);
+         break;
+   }
+}
+
+/* vim: set sts=3 sw=3 et: */
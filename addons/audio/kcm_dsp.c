@@ -0,0 +1,1308 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      DSP nodes: effects run in place on a mixer's buffer.
+ *
+ *      See LICENSE.txt for copyright information.
+ */
+
+/* Title: DSP node functions
+ */
+
+#include <math.h>
+#include <string.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "allegro5/allegro.h"
+#include "allegro5/allegro_audio.h"
+#include "allegro5/internal/aintern.h"
+#include "allegro5/internal/aintern_audio.h"
+
+ALLEGRO_DEBUG_CHANNEL("audio")
+
+/* The convolution works on blocks of this many frames, with FFTs of twice
+ * that.  The wet signal comes out one block late.
+ */
+#define CONV_BLOCK      256
+#define CONV_FFT        (2 * CONV_BLOCK)
+
+
+typedef struct DSP_NODE_VTABLE {
+   /* Set up the state for node->frequency and node->channels. */
+   bool (*prepare)(ALLEGRO_DSP_NODE *node);
+   void (*process)(ALLEGRO_DSP_NODE *node, float *buf, unsigned int frames);
+   /* Free what prepare allocated. */
+   void (*unprepare)(ALLEGRO_DSP_NODE *node);
+   /* Free what the constructor allocated. */
+   void (*destroy)(ALLEGRO_DSP_NODE *node);
+} DSP_NODE_VTABLE;
+
+
+typedef struct BIQUAD {
+   ALLEGRO_BIQUAD_TYPE type;
+   float freq, q, gain_db;
+   float b0, b1, b2, a1, a2;
+   float z1[ALLEGRO_MAX_CHANNELS];
+   float z2[ALLEGRO_MAX_CHANNELS];
+} BIQUAD;
+
+
+typedef struct GAIN {
+   float gain;
+   float target;
+   float step;
+   unsigned int ramp_left;    /* frames */
+} GAIN;
+
+
+typedef struct LIMITER {
+   float threshold;
+   float release_time;
+   float release_coef;
+   float envelope;
+} LIMITER;
+
+
+typedef struct DELAY {
+   float delay_time;
+   float feedback;
+   float mix;
+   float *ring;               /* frames * channels */
+   unsigned int frames;
+   unsigned int pos;
+} DELAY;
+
+
+/* Uniformly partitioned overlap-save convolution.  The impulse response is
+ * cut into blocks whose spectra are multiplied with those of the last
+ * `partitions' blocks of input, kept in a frequency domain delay line.
+ * Spectra are stored as separate real and imaginary arrays.
+ */
+typedef struct CONVOLUTION {
+   float *ir;
+   unsigned int ir_len;
+   float mix;
+
+   int partitions;
+   float *ir_re, *ir_im;      /* partitions * CONV_FFT, scaled by 1/CONV_FFT */
+   float *fdl_re, *fdl_im;    /* channels * partitions * CONV_FFT */
+   float *in;                 /* channels * CONV_FFT, the input window */
+   float *out;                /* channels * CONV_BLOCK, the wet output */
+   float *acc_re, *acc_im;    /* CONV_FFT */
+   int fdl_pos;
+   unsigned int fill;         /* frames of the current block */
+} CONVOLUTION;
+
+
+struct ALLEGRO_DSP_NODE {
+   const DSP_NODE_VTABLE *vt;
+   ALLEGRO_MIXER *mixer;
+   bool bypass;
+
+   /* What the state was prepared for, 0 if it is not. */
+   unsigned int frequency;
+   int channels;
+
+   /* Time spent processing, and the number of frames processed. */
+   double cpu_time;
+   uint64_t frames;
+
+   _AL_LIST_ITEM *dtor_item;
+
+   union {
+      BIQUAD biquad;
+      GAIN gain;
+      LIMITER limiter;
+      DELAY delay;
+      CONVOLUTION conv;
+   } u;
+};
+
+
+static void maybe_lock_mutex(ALLEGRO_MUTEX *mutex)
+{
+   if (mutex) {
+      al_lock_mutex(mutex);
+   }
+}
+
+
+static void maybe_unlock_mutex(ALLEGRO_MUTEX *mutex)
+{
+   if (mutex) {
+      al_unlock_mutex(mutex);
+   }
+}
+
+
+static ALLEGRO_MUTEX *node_mutex(const ALLEGRO_DSP_NODE *node)
+{
+   return node->mixer ? node->mixer->ss.mutex : NULL;
+}
+
+
+/* Multiply n floats by g. */
+static void scale_block(float *buf, unsigned int n, float g)
+{
+   unsigned int i = 0;
+
+#ifdef __SSE__
+   const __m128 gv = _mm_set1_ps(g);
+   for (; i + 4 <= n; i += 4)
+      _mm_storeu_ps(buf + i, _mm_mul_ps(_mm_loadu_ps(buf + i), gv));
+#endif
+   for (; i < n; i++)
+      buf[i] *= g;
+}
+
+
+static bool prepare_nothing(ALLEGRO_DSP_NODE *node)
+{
+   (void)node;
+   return true;
+}
+
+
+static void free_nothing(ALLEGRO_DSP_NODE *node)
+{
+   (void)node;
+}
+
+
+static ALLEGRO_DSP_NODE *create_node(const DSP_NODE_VTABLE *vt)
+{
+   ALLEGRO_DSP_NODE *node = al_calloc(1, sizeof(*node));
+
+   if (!node) {
+      _al_set_error(ALLEGRO_GENERIC_ERROR,
+         "Out of memory allocating DSP node");
+      return NULL;
+   }
+   node->vt = vt;
+   node->dtor_item = _al_kcm_register_destructor(node,
+      (void (*)(void *)) al_destroy_dsp_node);
+   return node;
+}
+
+
+/* Prepare the node for the mixer's format, if it isn't already. */
+static bool prepare_node(ALLEGRO_DSP_NODE *node, const ALLEGRO_MIXER *mixer)
+{
+   const unsigned int frequency = mixer->ss.spl_data.frequency;
+   const int channels = al_get_channel_count(mixer->ss.spl_data.chan_conf);
+
+   if (node->frequency == frequency && node->channels == channels)
+      return true;
+
+   if (node->frequency)
+      node->vt->unprepare(node);
+   node->frequency = frequency;
+   node->channels = channels;
+   if (!node->vt->prepare(node)) {
+      node->frequency = 0;
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ * Biquad filters, from Robert Bristow-Johnson's "Cookbook formulae for
+ * audio EQ biquad filter coefficients".
+ */
+
+static void biquad_coefficients(ALLEGRO_DSP_NODE *node)
+{
+   BIQUAD *bq = &node->u.biquad;
+   const double fs = node->frequency;
+   const double freq = _ALLEGRO_CLAMP(1.0, bq->freq, 0.499 * fs);
+   const double w0 = 2.0 * ALLEGRO_PI * freq / fs;
+   const double cs = cos(w0);
+   const double alpha = sin(w0) / (2.0 * _ALLEGRO_MAX(bq->q, 0.01f));
+   const double A = pow(10.0, bq->gain_db / 40.0);
+   const double sa = 2.0 * sqrt(A) * alpha;
+   double b0, b1, b2, a0, a1, a2;
+
+   switch (bq->type) {
+      case ALLEGRO_BIQUAD_LOWPASS:
+         b0 = (1.0 - cs) / 2.0;
+         b1 = 1.0 - cs;
+         b2 = (1.0 - cs) / 2.0;
+         a0 = 1.0 + alpha;
+         a1 = -2.0 * cs;
+         a2 = 1.0 - alpha;
+         break;
+
+      case ALLEGRO_BIQUAD_HIGHPASS:
+         b0 = (1.0 + cs) / 2.0;
+         b1 = -(1.0 + cs);
+         b2 = (1.0 + cs) / 2.0;
+         a0 = 1.0 + alpha;
+         a1 = -2.0 * cs;
+         a2 = 1.0 - alpha;
+         break;
+
+      case ALLEGRO_BIQUAD_BANDPASS:
+         b0 = alpha;
+         b1 = 0.0;
+         b2 = -alpha;
+         a0 = 1.0 + alpha;
+         a1 = -2.0 * cs;
+         a2 = 1.0 - alpha;
+         break;
+
+      case ALLEGRO_BIQUAD_NOTCH:
+         b0 = 1.0;
+         b1 = -2.0 * cs;
+         b2 = 1.0;
+         a0 = 1.0 + alpha;
+         a1 = -2.0 * cs;
+         a2 = 1.0 - alpha;
+         break;
+
+      case ALLEGRO_BIQUAD_PEAKING:
+         b0 = 1.0 + alpha * A;
+         b1 = -2.0 * cs;
+         b2 = 1.0 - alpha * A;
+         a0 = 1.0 + alpha / A;
+         a1 = -2.0 * cs;
+         a2 = 1.0 - alpha / A;
+         break;
+
+      case ALLEGRO_BIQUAD_LOW_SHELF:
+         b0 = A * ((A + 1.0) - (A - 1.0) * cs + sa);
+         b1 = 2.0 * A * ((A - 1.0) - (A + 1.0) * cs);
+         b2 = A * ((A + 1.0) - (A - 1.0) * cs - sa);
+         a0 = (A + 1.0) + (A - 1.0) * cs + sa;
+         a1 = -2.0 * ((A - 1.0) + (A + 1.0) * cs);
+         a2 = (A + 1.0) + (A - 1.0) * cs - sa;
+         break;
+
+      case ALLEGRO_BIQUAD_HIGH_SHELF:
+      default:
+         b0 = A * ((A + 1.0) + (A - 1.0) * cs + sa);
+         b1 = -2.0 * A * ((A - 1.0) + (A + 1.0) * cs);
+         b2 = A * ((A + 1.0) + (A - 1.0) * cs - sa);
+         a0 = (A + 1.0) - (A - 1.0) * cs + sa;
+         a1 = 2.0 * ((A - 1.0) - (A + 1.0) * cs);
+         a2 = (A + 1.0) - (A - 1.0) * cs - sa;
+         break;
+   }
+
+   bq->b0 = b0 / a0;
+   bq->b1 = b1 / a0;
+   bq->b2 = b2 / a0;
+   bq->a1 = a1 / a0;
+   bq->a2 = a2 / a0;
+}
+
+
+static bool biquad_prepare(ALLEGRO_DSP_NODE *node)
+{
+   BIQUAD *bq = &node->u.biquad;
+
+   memset(bq->z1, 0, sizeof(bq->z1));
+   memset(bq->z2, 0, sizeof(bq->z2));
+   biquad_coefficients(node);
+   return true;
+}
+
+
+/* Transposed direct form II.  The recursion runs along time, so the SSE
+ * path filters up to four channels of a frame at once instead.
+ */
+static void biquad_process(ALLEGRO_DSP_NODE *node, float *buf,
+   unsigned int frames)
+{
+   BIQUAD *bq = &node->u.biquad;
+   const int ch = node->channels;
+   unsigned int i;
+   int c = 0;
+
+#ifdef __SSE__
+   const __m128 b0 = _mm_set1_ps(bq->b0);
+   const __m128 b1 = _mm_set1_ps(bq->b1);
+   const __m128 b2 = _mm_set1_ps(bq->b2);
+   const __m128 a1 = _mm_set1_ps(bq->a1);
+   const __m128 a2 = _mm_set1_ps(bq->a2);
+
+   for (; c + 4 <= ch; c += 4) {
+      __m128 z1 = _mm_loadu_ps(bq->z1 + c);
+      __m128 z2 = _mm_loadu_ps(bq->z2 + c);
+      float *p = buf + c;
+      for (i = 0; i < frames; i++, p += ch) {
+         const __m128 x = _mm_loadu_ps(p);
+         const __m128 y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+         z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+         z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+         _mm_storeu_ps(p, y);
+      }
+      _mm_storeu_ps(bq->z1 + c, z1);
+      _mm_storeu_ps(bq->z2 + c, z2);
+   }
+
+   if (c + 2 <= ch) {
+      __m128 z1 = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)(bq->z1 + c));
+      __m128 z2 = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)(bq->z2 + c));
+      float *p = buf + c;
+      for (i = 0; i < frames; i++, p += ch) {
+         const __m128 x = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)p);
+         const __m128 y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+         z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+         z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+         _mm_storel_pi((__m64 *)p, y);
+      }
+      _mm_storel_pi((__m64 *)(bq->z1 + c), z1);
+      _mm_storel_pi((__m64 *)(bq->z2 + c), z2);
+      c += 2;
+   }
+#endif
+
+   for (; c < ch; c++) {
+      float z1 = bq->z1[c];
+      float z2 = bq->z2[c];
+      float *p = buf + c;
+      for (i = 0; i < frames; i++, p += ch) {
+         const float x = *p;
+         const float y = bq->b0 * x + z1;
+         z1 = bq->b1 * x - bq->a1 * y + z2;
+         z2 = bq->b2 * x - bq->a2 * y;
+         *p = y;
+      }
+      bq->z1[c] = z1;
+      bq->z2[c] = z2;
+   }
+}
+
+
+static const DSP_NODE_VTABLE biquad_vtable = {
+   biquad_prepare,
+   biquad_process,
+   free_nothing,
+   free_nothing
+};
+
+
+/* Function: al_create_biquad_node
+ */
+ALLEGRO_DSP_NODE *al_create_biquad_node(ALLEGRO_BIQUAD_TYPE type, float freq,
+   float q, float gain_db)
+{
+   ALLEGRO_DSP_NODE *node = create_node(&biquad_vtable);
+
+   if (node) {
+      node->u.biquad.type = type;
+      node->u.biquad.freq = freq;
+      node->u.biquad.q = q;
+      node->u.biquad.gain_db = gain_db;
+   }
+   return node;
+}
+
+
+/* Function: al_set_biquad_node
+ */
+bool al_set_biquad_node(ALLEGRO_DSP_NODE *node, ALLEGRO_BIQUAD_TYPE type,
+   float freq, float q, float gain_db)
+{
+   ASSERT(node);
+
+   if (node->vt != &biquad_vtable) {
+      _al_set_error(ALLEGRO_INVALID_OBJECT, "Not a biquad node");
+      return false;
+   }
+
+   maybe_lock_mutex(node_mutex(node));
+   node->u.biquad.type = type;
+   node->u.biquad.freq = freq;
+   node->u.biquad.q = q;
+   node->u.biquad.gain_db = gain_db;
+   /* The filter state carries over, so sweeps don't click. */
+   if (node->frequency)
+      biquad_coefficients(node);
+   maybe_unlock_mutex(node_mutex(node));
+
+   return true;
+}
+
+
+/*
+ * Gain with linear ramps.
+ */
+
+static void gain_process(ALLEGRO_DSP_NODE *node, float *buf,
+   unsigned int frames)
+{
+   GAIN *g = &node->u.gain;
+   const int ch = node->channels;
+   unsigned int i = 0;
+   int c;
+
+   for (; i < frames && g->ramp_left > 0; i++) {
+      if (--g->ramp_left == 0)
+         g->gain = g->target;
+      else
+         g->gain += g->step;
+      for (c = 0; c < ch; c++)
+         buf[i * ch + c] *= g->gain;
+   }
+
+   if (g->gain != 1.0f)
+      scale_block(buf + i * ch, (frames - i) * ch, g->gain);
+}
+
+
+static const DSP_NODE_VTABLE gain_vtable = {
+   prepare_nothing,
+   gain_process,
+   free_nothing,
+   free_nothing
+};
+
+
+/* Function: al_create_gain_node
+ */
+ALLEGRO_DSP_NODE *al_create_gain_node(float gain)
+{
+   ALLEGRO_DSP_NODE *node = create_node(&gain_vtable);
+
+   if (node) {
+      node->u.gain.gain = gain;
+      node->u.gain.target = gain;
+   }
+   return node;
+}
+
+
+/* Function: al_set_gain_node
+ */
+bool al_set_gain_node(ALLEGRO_DSP_NODE *node, float gain, float ramp_time)
+{
+   GAIN *g;
+
+   ASSERT(node);
+
+   if (node->vt != &gain_vtable) {
+      _al_set_error(ALLEGRO_INVALID_OBJECT, "Not a gain node");
+      return false;
+   }
+
+   maybe_lock_mutex(node_mutex(node));
+   g = &node->u.gain;
+   g->target = gain;
+   if (ramp_time < 0)
+      ramp_time = 0;
+   g->ramp_left = node->frequency ? ramp_time * node->frequency : 0;
+   if (g->ramp_left > 0)
+      g->step = (gain - g->gain) / g->ramp_left;
+   else
+      g->gain = gain;
+   maybe_unlock_mutex(node_mutex(node));
+
+   return true;
+}
+
+
+/*
+ * Peak limiter: the gain drops at once to keep every frame below the
+ * threshold, then recovers exponentially.
+ */
+
+static bool limiter_prepare(ALLEGRO_DSP_NODE *node)
+{
+   LIMITER *lim = &node->u.limiter;
+   const float release = _ALLEGRO_MAX(lim->release_time, 0.001f);
+
+   lim->release_coef = exp(-1.0 / (release * node->frequency));
+   lim->envelope = 1.0f;
+   return true;
+}
+
+
+static void limiter_process(ALLEGRO_DSP_NODE *node, float *buf,
+   unsigned int frames)
+{
+   LIMITER *lim = &node->u.limiter;
+   const int ch = node->channels;
+   const float threshold = lim->threshold;
+   const float coef = lim->release_coef;
+   float env = lim->envelope;
+   unsigned int i;
+   int c;
+
+   for (i = 0; i < frames; i++, buf += ch) {
+      float peak = 0.0f;
+      float target;
+
+      for (c = 0; c < ch; c++) {
+         const float a = fabsf(buf[c]);
+         if (a > peak)
+            peak = a;
+      }
+
+      target = (peak > threshold) ? threshold / peak : 1.0f;
+      if (target < env)
+         env = target;
+      else
+         env = target + (env - target) * coef;
+
+      if (env != 1.0f) {
+         for (c = 0; c < ch; c++)
+            buf[c] *= env;
+      }
+   }
+
+   lim->envelope = env;
+}
+
+
+static const DSP_NODE_VTABLE limiter_vtable = {
+   limiter_prepare,
+   limiter_process,
+   free_nothing,
+   free_nothing
+};
+
+
+/* Function: al_create_limiter_node
+ */
+ALLEGRO_DSP_NODE *al_create_limiter_node(float threshold, float release_time)
+{
+   ALLEGRO_DSP_NODE *node = create_node(&limiter_vtable);
+
+   if (node) {
+      node->u.limiter.threshold = threshold;
+      node->u.limiter.release_time = release_time;
+      node->u.limiter.envelope = 1.0f;
+   }
+   return node;
+}
+
+
+/* Function: al_set_limiter_node
+ */
+bool al_set_limiter_node(ALLEGRO_DSP_NODE *node, float threshold,
+   float release_time)
+{
+   LIMITER *lim;
+
+   ASSERT(node);
+
+   if (node->vt != &limiter_vtable) {
+      _al_set_error(ALLEGRO_INVALID_OBJECT, "Not a limiter node");
+      return false;
+   }
+
+   maybe_lock_mutex(node_mutex(node));
+   lim = &node->u.limiter;
+   lim->threshold = threshold;
+   lim->release_time = release_time;
+   if (node->frequency) {
+      const float release = _ALLEGRO_MAX(release_time, 0.001f);
+      lim->release_coef = exp(-1.0 / (release * node->frequency));
+   }
+   maybe_unlock_mutex(node_mutex(node));
+
+   return true;
+}
+
+
+/*
+ * Feedback delay line.
+ */
+
+static bool delay_prepare(ALLEGRO_DSP_NODE *node)
+{
+   DELAY *d = &node->u.delay;
+
+   d->frames = _ALLEGRO_MAX(1, (int)(d->delay_time * node->frequency + 0.5f));
+   d->ring = al_calloc(d->frames * node->channels, sizeof(float));
+   d->pos = 0;
+   return d->ring != NULL;
+}
+
+
+static void delay_unprepare(ALLEGRO_DSP_NODE *node)
+{
+   al_free(node->u.delay.ring);
+   node->u.delay.ring = NULL;
+}
+
+
+/* The ring holds exactly one delay's worth of frames, so each frame is read
+ * just before it is overwritten and runs up to the end of the ring are
+ * straight vector loops.
+ */
+static void delay_process(ALLEGRO_DSP_NODE *node, float *buf,
+   unsigned int frames)
+{
+   DELAY *d = &node->u.delay;
+   const int ch = node->channels;
+   const float fb = d->feedback;
+   const float wet = d->mix;
+   const float dry = 1.0f - d->mix;
+
+   while (frames > 0) {
+      const unsigned int run = _ALLEGRO_MIN(frames, d->frames - d->pos);
+      const unsigned int n = run * ch;
+      float *r = d->ring + d->pos * ch;
+      unsigned int i = 0;
+
+#ifdef __SSE__
+      const __m128 fbv = _mm_set1_ps(fb);
+      const __m128 wetv = _mm_set1_ps(wet);
+      const __m128 dryv = _mm_set1_ps(dry);
+      for (; i + 4 <= n; i += 4) {
+         const __m128 x = _mm_loadu_ps(buf + i);
+         const __m128 y = _mm_loadu_ps(r + i);
+         _mm_storeu_ps(r + i, _mm_add_ps(x, _mm_mul_ps(fbv, y)));
+         _mm_storeu_ps(buf + i,
+            _mm_add_ps(_mm_mul_ps(dryv, x), _mm_mul_ps(wetv, y)));
+      }
+#endif
+      for (; i < n; i++) {
+         const float x = buf[i];
+         const float y = r[i];
+         r[i] = x + fb * y;
+         buf[i] = dry * x + wet * y;
+      }
+
+      d->pos += run;
+      if (d->pos == d->frames)
+         d->pos = 0;
+      buf += n;
+      frames -= run;
+   }
+}
+
+
+static const DSP_NODE_VTABLE delay_vtable = {
+   delay_prepare,
+   delay_process,
+   delay_unprepare,
+   free_nothing
+};
+
+
+/* Function: al_create_delay_node
+ */
+ALLEGRO_DSP_NODE *al_create_delay_node(float delay_time, float feedback,
+   float mix)
+{
+   ALLEGRO_DSP_NODE *node = create_node(&delay_vtable);
+
+   if (node) {
+      node->u.delay.delay_time = delay_time;
+      node->u.delay.feedback = feedback;
+      node->u.delay.mix = mix;
+   }
+   return node;
+}
+
+
+/* Function: al_set_delay_node
+ */
+bool al_set_delay_node(ALLEGRO_DSP_NODE *node, float delay_time,
+   float feedback, float mix)
+{
+   DELAY *d;
+   bool ret = true;
+
+   ASSERT(node);
+
+   if (node->vt != &delay_vtable) {
+      _al_set_error(ALLEGRO_INVALID_OBJECT, "Not a delay node");
+      return false;
+   }
+
+   maybe_lock_mutex(node_mutex(node));
+   d = &node->u.delay;
+   d->feedback = feedback;
+   d->mix = mix;
+   if (d->delay_time != delay_time) {
+      d->delay_time = delay_time;
+      if (node->frequency) {
+         delay_unprepare(node);
+         if (!delay_prepare(node)) {
+            _al_set_error(ALLEGRO_GENERIC_ERROR,
+               "Out of memory allocating delay line");
+            node->frequency = 0;
+            ret = false;
+         }
+      }
+   }
+   maybe_unlock_mutex(node_mutex(node));
+
+   return ret;
+}
+
+
+/*
+ * Convolution.
+ */
+
+/* Twiddle factors for each stage of the FFT, stage after stage: the stage
+ * combining blocks of `half' entries uses half factors starting at
+ * fft_tw_re + half - 1.
+ */
+static float fft_tw_re[CONV_FFT - 1];
+static float fft_tw_im[CONV_FFT - 1];
+static unsigned short fft_bitrev[CONV_FFT];
+static bool fft_ready = false;
+
+
+/* _al_kcm_init_fft_tables:
+ *  Called by al_install_audio, so that convolution nodes created in
+ *  different threads don't fill in the tables at the same time.
+ */
+void _al_kcm_init_fft_tables(void)
+{
+   int half, j, i;
+
+   if (fft_ready)
+      return;
+
+   for (half = 1; half < CONV_FFT; half *= 2) {
+      for (j = 0; j < half; j++) {
+         const double a = -ALLEGRO_PI * j / half;
+         fft_tw_re[half - 1 + j] = cos(a);
+         fft_tw_im[half - 1 + j] = sin(a);
+      }
+   }
+
+   for (i = 0; i < CONV_FFT; i++) {
+      int r = 0, b;
+      for (b = 1; b < CONV_FFT; b *= 2) {
+         r = (r << 1) | ((i & b) ? 1 : 0);
+      }
+      fft_bitrev[i] = r;
+   }
+
+   fft_ready = true;
+}
+
+
+/* In-place forward FFT of CONV_FFT points.  Swapping the real and imaginary
+ * arrays gives the inverse, unscaled.
+ */
+static void fft(float *re, float *im)
+{
+   int i, j, half;
+
+   for (i = 0; i < CONV_FFT; i++) {
+      j = fft_bitrev[i];
+      if (i < j) {
+         float t = re[i]; re[i] = re[j]; re[j] = t;
+         t = im[i]; im[i] = im[j]; im[j] = t;
+      }
+   }
+
+   for (half = 1; half < CONV_FFT; half *= 2) {
+      const float *wr = fft_tw_re + half - 1;
+      const float *wi = fft_tw_im + half - 1;
+
+      for (i = 0; i < CONV_FFT; i += 2 * half) {
+         float *ar = re + i, *ai = im + i;
+         float *br = ar + half, *bi = ai + half;
+         j = 0;
+#ifdef __SSE__
+         for (; j + 4 <= half; j += 4) {
+            const __m128 xr = _mm_loadu_ps(br + j);
+            const __m128 xi = _mm_loadu_ps(bi + j);
+            const __m128 cr = _mm_loadu_ps(wr + j);
+            const __m128 ci = _mm_loadu_ps(wi + j);
+            const __m128 tr = _mm_sub_ps(_mm_mul_ps(xr, cr), _mm_mul_ps(xi, ci));
+            const __m128 ti = _mm_add_ps(_mm_mul_ps(xr, ci), _mm_mul_ps(xi, cr));
+            const __m128 yr = _mm_loadu_ps(ar + j);
+            const __m128 yi = _mm_loadu_ps(ai + j);
+            _mm_storeu_ps(br + j, _mm_sub_ps(yr, tr));
+            _mm_storeu_ps(bi + j, _mm_sub_ps(yi, ti));
+            _mm_storeu_ps(ar + j, _mm_add_ps(yr, tr));
+            _mm_storeu_ps(ai + j, _mm_add_ps(yi, ti));
+         }
+#endif
+         for (; j < half; j++) {
+            const float tr = br[j] * wr[j] - bi[j] * wi[j];
+            const float ti = br[j] * wi[j] + bi[j] * wr[j];
+            br[j] = ar[j] - tr;
+            bi[j] = ai[j] - ti;
+            ar[j] += tr;
+            ai[j] += ti;
+         }
+      }
+   }
+}
+
+
+/* acc += x * h, bin by bin. */
+static void complex_mac(float *acc_re, float *acc_im, const float *xr,
+   const float *xi, const float *hr, const float *hi)
+{
+   int k = 0;
+
+#ifdef __SSE__
+   for (; k + 4 <= CONV_FFT; k += 4) {
+      const __m128 a = _mm_loadu_ps(xr + k);
+      const __m128 b = _mm_loadu_ps(xi + k);
+      const __m128 c = _mm_loadu_ps(hr + k);
+      const __m128 d = _mm_loadu_ps(hi + k);
+      _mm_storeu_ps(acc_re + k, _mm_add_ps(_mm_loadu_ps(acc_re + k),
+         _mm_sub_ps(_mm_mul_ps(a, c), _mm_mul_ps(b, d))));
+      _mm_storeu_ps(acc_im + k, _mm_add_ps(_mm_loadu_ps(acc_im + k),
+         _mm_add_ps(_mm_mul_ps(a, d), _mm_mul_ps(b, c))));
+   }
+#endif
+   for (; k < CONV_FFT; k++) {
+      acc_re[k] += xr[k] * hr[k] - xi[k] * hi[k];
+      acc_im[k] += xr[k] * hi[k] + xi[k] * hr[k];
+   }
+}
+
+
+static void convolution_unprepare(ALLEGRO_DSP_NODE *node)
+{
+   CONVOLUTION *cv = &node->u.conv;
+
+   al_free(cv->ir_re);
+   al_free(cv->fdl_re);
+   al_free(cv->in);
+   al_free(cv->acc_re);
+   cv->ir_re = cv->ir_im = NULL;
+   cv->fdl_re = cv->fdl_im = NULL;
+   cv->in = cv->out = NULL;
+   cv->acc_re = cv->acc_im = NULL;
+}
+
+
+static bool convolution_prepare(ALLEGRO_DSP_NODE *node)
+{
+   CONVOLUTION *cv = &node->u.conv;
+   const int ch = node->channels;
+   const size_t spectra = (size_t)cv->partitions * CONV_FFT;
+   const float scale = 1.0f / CONV_FFT;
+   int p;
+
+   cv->ir_re = al_calloc(2 * spectra, sizeof(float));
+   cv->fdl_re = al_calloc(2 * spectra * ch, sizeof(float));
+   cv->in = al_calloc(ch * (CONV_FFT + CONV_BLOCK), sizeof(float));
+   cv->acc_re = al_calloc(2 * CONV_FFT, sizeof(float));
+   if (!cv->ir_re || !cv->fdl_re || !cv->in || !cv->acc_re) {
+      convolution_unprepare(node);
+      return false;
+   }
+   cv->ir_im = cv->ir_re + spectra;
+   cv->fdl_im = cv->fdl_re + spectra * ch;
+   cv->out = cv->in + ch * CONV_FFT;
+   cv->acc_im = cv->acc_re + CONV_FFT;
+   cv->fdl_pos = 0;
+   cv->fill = 0;
+
+   /* Each partition is zero padded to the FFT size, and scaled so that the
+    * inverse FFTs need not be.
+    */
+   for (p = 0; p < cv->partitions; p++) {
+      float *hr = cv->ir_re + p * CONV_FFT;
+      float *hi = cv->ir_im + p * CONV_FFT;
+      unsigned int start = p * CONV_BLOCK;
+      unsigned int i;
+      for (i = 0; i < CONV_BLOCK && start + i < cv->ir_len; i++)
+         hr[i] = cv->ir[start + i] * scale;
+      fft(hr, hi);
+   }
+
+   return true;
+}
+
+
+/* Convolve the block of input just completed in each channel's window. */
+static void convolve_block(ALLEGRO_DSP_NODE *node)
+{
+   CONVOLUTION *cv = &node->u.conv;
+   const int parts = cv->partitions;
+   int c, p;
+
+   for (c = 0; c < node->channels; c++) {
+      float *in = cv->in + c * CONV_FFT;
+      float *out = cv->out + c * CONV_BLOCK;
+      float *fdl_re = cv->fdl_re + (size_t)c * parts * CONV_FFT;
+      float *fdl_im = cv->fdl_im + (size_t)c * parts * CONV_FFT;
+      float *xr = fdl_re + cv->fdl_pos * CONV_FFT;
+      float *xi = fdl_im + cv->fdl_pos * CONV_FFT;
+
+      memcpy(xr, in, CONV_FFT * sizeof(float));
+      memset(xi, 0, CONV_FFT * sizeof(float));
+      fft(xr, xi);
+
+      memset(cv->acc_re, 0, CONV_FFT * sizeof(float));
+      memset(cv->acc_im, 0, CONV_FFT * sizeof(float));
+      for (p = 0; p < parts; p++) {
+         const int q = (cv->fdl_pos - p + parts) % parts;
+         complex_mac(cv->acc_re, cv->acc_im,
+            fdl_re + q * CONV_FFT, fdl_im + q * CONV_FFT,
+            cv->ir_re + p * CONV_FFT, cv->ir_im + p * CONV_FFT);
+      }
+      fft(cv->acc_im, cv->acc_re);
+
+      /* Overlap-save: only the second half is free of wrap-around. */
+      memcpy(out, cv->acc_re + CONV_BLOCK, CONV_BLOCK * sizeof(float));
+      memcpy(in, in + CONV_BLOCK, CONV_BLOCK * sizeof(float));
+   }
+
+   cv->fdl_pos = (cv->fdl_pos + 1) % parts;
+}
+
+
+static void convolution_process(ALLEGRO_DSP_NODE *node, float *buf,
+   unsigned int frames)
+{
+   CONVOLUTION *cv = &node->u.conv;
+   const int ch = node->channels;
+   const float wet = cv->mix;
+   const float dry = 1.0f - cv->mix;
+
+   while (frames > 0) {
+      const unsigned int run = _ALLEGRO_MIN(frames, CONV_BLOCK - cv->fill);
+      unsigned int i;
+      int c;
+
+      for (c = 0; c < ch; c++) {
+         float *in = cv->in + c * CONV_FFT + CONV_BLOCK + cv->fill;
+         const float *out = cv->out + c * CONV_BLOCK + cv->fill;
+         float *p = buf + c;
+         for (i = 0; i < run; i++, p += ch) {
+            in[i] = *p;
+            *p = dry * *p + wet * out[i];
+         }
+      }
+
+      cv->fill += run;
+      if (cv->fill == CONV_BLOCK) {
+         convolve_block(node);
+         cv->fill = 0;
+      }
+      buf += run * ch;
+      frames -= run;
+   }
+}
+
+
+static void convolution_destroy(ALLEGRO_DSP_NODE *node)
+{
+   al_free(node->u.conv.ir);
+}
+
+
+static const DSP_NODE_VTABLE convolution_vtable = {
+   convolution_prepare,
+   convolution_process,
+   convolution_unprepare,
+   convolution_destroy
+};
+
+
+/* Function: al_create_convolution_node
+ */
+ALLEGRO_DSP_NODE *al_create_convolution_node(const float *ir,
+   unsigned int ir_len, float mix)
+{
+   ALLEGRO_DSP_NODE *node;
+   float *copy;
+
+   ASSERT(ir);
+
+   if (ir_len == 0) {
+      _al_set_error(ALLEGRO_INVALID_PARAM, "Empty impulse response");
+      return NULL;
+   }
+
+   if (!fft_ready) {
+      _al_set_error(ALLEGRO_GENERIC_ERROR, "Audio addon not installed");
+      return NULL;
+   }
+
+   copy = al_malloc(ir_len * sizeof(float));
+   if (!copy) {
+      _al_set_error(ALLEGRO_GENERIC_ERROR,
+         "Out of memory allocating impulse response");
+      return NULL;
+   }
+   memcpy(copy, ir, ir_len * sizeof(float));
+
+   node = create_node(&convolution_vtable);
+   if (!node) {
+      al_free(copy);
+      return NULL;
+   }
+   node->u.conv.ir = copy;
+   node->u.conv.ir_len = ir_len;
+   node->u.conv.partitions = (ir_len + CONV_BLOCK - 1) / CONV_BLOCK;
+   node->u.conv.mix = mix;
+   return node;
+}
+
+
+/* Function: al_set_convolution_node
+ */
+bool al_set_convolution_node(ALLEGRO_DSP_NODE *node, float mix)
+{
+   ASSERT(node);
+
+   if (node->vt != &convolution_vtable) {
+      _al_set_error(ALLEGRO_INVALID_OBJECT, "Not a convolution node");
+      return false;
+   }
+
+   maybe_lock_mutex(node_mutex(node));
+   node->u.conv.mix = mix;
+   maybe_unlock_mutex(node_mutex(node));
+
+   return true;
+}
+
+
+/*
+ * Chains.
+ */
+
+/* Function: al_destroy_dsp_node
+ */
+void al_destroy_dsp_node(ALLEGRO_DSP_NODE *node)
+{
+   if (node) {
+      _al_kcm_unregister_destructor(node->dtor_item);
+      al_detach_dsp_node(node);
+      if (node->frequency)
+         node->vt->unprepare(node);
+      node->vt->destroy(node);
+      al_free(node);
+   }
+}
+
+
+/* Function: al_attach_dsp_node_to_mixer
+ */
+bool al_attach_dsp_node_to_mixer(ALLEGRO_DSP_NODE *node, ALLEGRO_MIXER *mixer)
+{
+   ALLEGRO_DSP_NODE **slot;
+   bool ret = false;
+
+   ASSERT(node);
+   ASSERT(mixer);
+
+   if (node->mixer) {
+      _al_set_error(ALLEGRO_INVALID_OBJECT,
+         "Attempted to attach a DSP node that is already attached");
+      return false;
+   }
+
+   maybe_lock_mutex(mixer->ss.mutex);
+
+   /* Allocate the state now rather than in the mixer thread. */
+   if (!prepare_node(node, mixer)) {
+      _al_set_error(ALLEGRO_GENERIC_ERROR,
+         "Out of memory allocating DSP node state");
+   }
+   else if (!(slot = _al_vector_alloc_back(&mixer->dsp_nodes))) {
+      _al_set_error(ALLEGRO_GENERIC_ERROR,
+         "Out of memory allocating DSP chain");
+   }
+   else {
+      *slot = node;
+      node->mixer = mixer;
+      ret = true;
+   }
+
+   maybe_unlock_mutex(mixer->ss.mutex);
+
+   return ret;
+}
+
+
+/* Function: al_detach_dsp_node
+ */
+bool al_detach_dsp_node(ALLEGRO_DSP_NODE *node)
+{
+   ALLEGRO_MIXER *mixer;
+
+   ASSERT(node);
+
+   mixer = node->mixer;
+   if (!mixer)
+      return true;
+
+   maybe_lock_mutex(mixer->ss.mutex);
+   _al_vector_find_and_delete(&mixer->dsp_nodes, &node);
+   node->mixer = NULL;
+   maybe_unlock_mutex(mixer->ss.mutex);
+
+   return true;
+}
+
+
+/* Function: al_get_dsp_node_attached
+ */
+bool al_get_dsp_node_attached(const ALLEGRO_DSP_NODE *node)
+{
+   ASSERT(node);
+
+   return node->mixer != NULL;
+}
+
+
+/* Function: al_set_dsp_node_bypass
+ */
+bool al_set_dsp_node_bypass(ALLEGRO_DSP_NODE *node, bool bypass)
+{
+   ASSERT(node);
+
+   maybe_lock_mutex(node_mutex(node));
+   node->bypass = bypass;
+   maybe_unlock_mutex(node_mutex(node));
+
+   return true;
+}
+
+
+/* Function: al_get_dsp_node_bypass
+ */
+bool al_get_dsp_node_bypass(const ALLEGRO_DSP_NODE *node)
+{
+   ASSERT(node);
+
+   return node->bypass;
+}
+
+
+/* Function: al_get_dsp_node_cpu_time
+ */
+double al_get_dsp_node_cpu_time(const ALLEGRO_DSP_NODE *node)
+{
+   double t;
+
+   ASSERT(node);
+
+   maybe_lock_mutex(node_mutex(node));
+   t = node->cpu_time;
+   maybe_unlock_mutex(node_mutex(node));
+
+   return t;
+}
+
+
+/* Function: al_get_dsp_node_load
+ */
+double al_get_dsp_node_load(const ALLEGRO_DSP_NODE *node)
+{
+   double load = 0.0;
+
+   ASSERT(node);
+
+   maybe_lock_mutex(node_mutex(node));
+   if (node->frames > 0 && node->frequency > 0)
+      load = node->cpu_time * node->frequency / node->frames;
+   maybe_unlock_mutex(node_mutex(node));
+
+   return load;
+}
+
+
+/* Function: al_reset_dsp_node_cpu_time
+ */
+void al_reset_dsp_node_cpu_time(ALLEGRO_DSP_NODE *node)
+{
+   ASSERT(node);
+
+   maybe_lock_mutex(node_mutex(node));
+   node->cpu_time = 0.0;
+   node->frames = 0;
+   maybe_unlock_mutex(node_mutex(node));
+}
+
+
+/* _al_kcm_mixer_run_dsp:
+ *  Run the mixer's chain of DSP nodes over the first `samples' frames of its
+ *  buffer.  Integer mixers are converted to floats and back around it.
+ *  Called with the mixer's mutex held.
+ */
+void _al_kcm_mixer_run_dsp(ALLEGRO_MIXER *mixer, unsigned int samples)
+{
+   const int maxc = al_get_channel_count(mixer->ss.spl_data.chan_conf);
+   const unsigned int n = samples * maxc;
+   float *buf;
+   unsigned int i;
+   int j;
+
+   if (_al_vector_is_empty(&mixer->dsp_nodes))
+      return;
+
+   if (mixer->ss.spl_data.depth == ALLEGRO_AUDIO_DEPTH_FLOAT32) {
+      buf = mixer->ss.spl_data.buffer.f32;
+   }
+   else {
+      const int16_t *s16 = mixer->ss.spl_data.buffer.s16;
+      if (mixer->dsp_buffer_len < n) {
+         al_free(mixer->dsp_buffer);
+         mixer->dsp_buffer = al_malloc(n * sizeof(float));
+         if (!mixer->dsp_buffer) {
+            mixer->dsp_buffer_len = 0;
+            return;
+         }
+         mixer->dsp_buffer_len = n;
+      }
+      buf = mixer->dsp_buffer;
+      for (i = 0; i < n; i++)
+         buf[i] = s16[i] * (1.0f / 32768.0f);
+   }
+
+   for (j = 0; j < (int)_al_vector_size(&mixer->dsp_nodes); j++) {
+      ALLEGRO_DSP_NODE **slot = _al_vector_ref(&mixer->dsp_nodes, j);
+      ALLEGRO_DSP_NODE *node = *slot;
+      double t0;
+
+      if (node->bypass || !prepare_node(node, mixer))
+         continue;
+
+      t0 = al_get_time();
+      node->vt->process(node, buf, samples);
+      node->cpu_time += al_get_time() - t0;
+      node->frames += samples;
+   }
+
+   if (mixer->ss.spl_data.depth != ALLEGRO_AUDIO_DEPTH_FLOAT32) {
+      int16_t *s16 = mixer->ss.spl_data.buffer.s16;
+      for (i = 0; i < n; i++) {
+         const float x = buf[i] * 32768.0f;
+         s16[i] = (int16_t)_ALLEGRO_CLAMP(-32768.0f, x, 32767.0f);
+      }
+   }
+}
+
+
+/* _al_kcm_mixer_free_dsp:
+ *  Detach all DSP nodes from a mixer which is being destroyed.
+ */
+void _al_kcm_mixer_free_dsp(ALLEGRO_MIXER *mixer)
+{
+   int i;
+
+   for (i = _al_vector_size(&mixer->dsp_nodes) - 1; i >= 0; i--) {
+      ALLEGRO_DSP_NODE **slot = _al_vector_ref(&mixer->dsp_nodes, i);
+      (*slot)->mixer = NULL;
+   }
+   _al_vector_free(&mixer->dsp_nodes);
+
+   al_free(mixer->dsp_buffer);
+   mixer->dsp_buffer = NULL;
+   mixer->dsp_buffer_len = 0;
+}
+
+/* vim: set sts=3 sw=3 et: */
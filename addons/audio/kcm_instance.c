@@ -61,6 +61,24 @@ void _al_kcm_stream_set_mutex(ALLEGRO_SAMPLE_INSTANCE *stream, ALLEGRO_MUTEX *mu
 }
 
 
+/* _al_kcm_log_instance_stats:
+ *  Log the statistics of a mixer or stream and of everything attached to it.
+ *  Plain sample instances keep no statistics.
+ */
+void _al_kcm_log_instance_stats(ALLEGRO_SAMPLE_INSTANCE *spl, int indent)
+{
+   ASSERT(spl);
+
+   if (spl->is_mixer) {
+      _al_kcm_log_mixer_stats((ALLEGRO_MIXER *)spl, indent);
+   }
+   else if (spl->loop == _ALLEGRO_PLAYMODE_STREAM_ONCE ||
+         spl->loop == _ALLEGRO_PLAYMODE_STREAM_ONEDIR) {
+      _al_kcm_log_stream_stats((ALLEGRO_AUDIO_STREAM *)spl, indent);
+   }
+}
+
+
 /* stream_free:
  *  This function is ALLEGRO_MIXER aware and frees the memory associated with
  *  the sample or mixer, and detaches any attached streams or mixers.
@@ -77,6 +95,11 @@ static void stream_free(ALLEGRO_SAMPLE_INSTANCE *spl)
 
          _al_kcm_stream_set_mutex(&mixer->ss, NULL);
 
+         if (mixer->task_group) {
+            al_destroy_task_group(mixer->task_group);
+            mixer->task_group = NULL;
+         }
+
          for (i = _al_vector_size(&mixer->streams) - 1; i >= 0; i--) {
             ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&mixer->streams, i);
             ALLEGRO_SAMPLE_INSTANCE *spl = *slot;
@@ -84,6 +107,7 @@ static void stream_free(ALLEGRO_SAMPLE_INSTANCE *spl)
          }
 
          _al_vector_free(&mixer->streams);
+         _al_kcm_mixer_free_dsp(mixer);
 
          if (spl->spl_data.buffer.ptr) {
             ASSERT(spl->spl_data.free_buf);
@@ -132,6 +156,10 @@ void _al_kcm_detach_from_parent(ALLEGRO_SAMPLE_INSTANCE *spl)
 
          spl->spl_read = NULL;
 
+         /* The frames were on this mixer's clock. */
+         spl->play_scheduled = false;
+         spl->stop_scheduled = false;
+
          maybe_unlock_mutex(mixer->ss.mutex);
 
          break;
@@ -140,6 +168,7 @@ void _al_kcm_detach_from_parent(ALLEGRO_SAMPLE_INSTANCE *spl)
 
    al_free(spl->matrix);
    spl->matrix = NULL;
+   spl->matrix_is_diagonal = false;
 }
 
 
@@ -156,7 +185,7 @@ ALLEGRO_SAMPLE_INSTANCE *al_create_sample_instance(ALLEGRO_SAMPLE *sample_data)
       return NULL;
    }
 
-   if (sample_data) {
+   if (sample_data && _al_kcm_page_in_sample(sample_data)) {
       spl->spl_data = *sample_data;
    }
    spl->spl_data.free_buf = false;
@@ -167,10 +196,11 @@ ALLEGRO_SAMPLE_INSTANCE *al_create_sample_instance(ALLEGRO_SAMPLE *sample_data)
    spl->pan = 0.0f;
    spl->pos = 0;
    spl->loop_start = 0;
-   spl->loop_end = sample_data ? sample_data->len : 0;
+   spl->loop_end = spl->spl_data.len;
    spl->step = 0;
 
    spl->matrix = NULL;
+   spl->matrix_is_diagonal = false;
 
    spl->is_mixer = false;
    spl->spl_read = NULL;
@@ -178,7 +208,8 @@ ALLEGRO_SAMPLE_INSTANCE *al_create_sample_instance(ALLEGRO_SAMPLE *sample_data)
    spl->mutex = NULL;
    spl->parent.u.ptr = NULL;
 
-   _al_kcm_register_destructor(spl, (void (*)(void *)) al_destroy_sample_instance);
+   spl->dtor_item = _al_kcm_register_destructor(spl,
+      (void (*)(void *)) al_destroy_sample_instance);
 
    return spl;
 }
@@ -199,7 +230,7 @@ void _al_kcm_destroy_sample(ALLEGRO_SAMPLE_INSTANCE *spl, bool unregister)
 {
    if (spl) {
       if (unregister) {
-         _al_kcm_unregister_destructor(spl);
+         _al_kcm_unregister_destructor(spl->dtor_item);
       }
 
       _al_kcm_detach_from_parent(spl);
@@ -228,6 +259,52 @@ bool al_stop_sample_instance(ALLEGRO_SAMPLE_INSTANCE *spl)
 }
 
 
+/* schedule:
+ *  Start or stop a sample instance when its mixer's clock reaches a frame.
+ */
+static bool schedule(ALLEGRO_SAMPLE_INSTANCE *spl, bool play, uint64_t frame)
+{
+   if (!spl->parent.u.ptr || spl->parent.is_voice) {
+      _al_set_error(ALLEGRO_INVALID_OBJECT,
+         "Attempted to schedule a sample not attached to a mixer");
+      return false;
+   }
+
+   maybe_lock_mutex(spl->mutex);
+   if (play) {
+      spl->play_scheduled = true;
+      spl->play_frame = frame;
+   }
+   else {
+      spl->stop_scheduled = true;
+      spl->stop_frame = frame;
+   }
+   maybe_unlock_mutex(spl->mutex);
+
+   return true;
+}
+
+
+/* Function: al_play_sample_instance_at
+ */
+bool al_play_sample_instance_at(ALLEGRO_SAMPLE_INSTANCE *spl, uint64_t frame)
+{
+   ASSERT(spl);
+
+   return schedule(spl, true, frame);
+}
+
+
+/* Function: al_stop_sample_instance_at
+ */
+bool al_stop_sample_instance_at(ALLEGRO_SAMPLE_INSTANCE *spl, uint64_t frame)
+{
+   ASSERT(spl);
+
+   return schedule(spl, false, frame);
+}
+
+
 /* Function: al_get_sample_instance_frequency
  */
 unsigned int al_get_sample_instance_frequency(const ALLEGRO_SAMPLE_INSTANCE *spl)
@@ -544,6 +621,8 @@ bool al_set_sample_instance_playing(ALLEGRO_SAMPLE_INSTANCE *spl, bool val)
 
    if (!spl->parent.u.ptr || !spl->spl_data.buffer.ptr) {
       spl->is_playing = val;
+      spl->play_scheduled = false;
+      spl->stop_scheduled = false;
       return true;
    }
 
@@ -559,6 +638,9 @@ bool al_set_sample_instance_playing(ALLEGRO_SAMPLE_INSTANCE *spl, bool val)
    spl->is_playing = val;
    if (!val)
       spl->pos = 0;
+   /* Playing or stopping now overrides any scheduled change. */
+   spl->play_scheduled = false;
+   spl->stop_scheduled = false;
    maybe_unlock_mutex(spl->mutex);
    return true;
 }
@@ -604,6 +686,10 @@ bool al_set_sample(ALLEGRO_SAMPLE_INSTANCE *spl, ALLEGRO_SAMPLE *data)
 
    /* Have data. */
 
+   if (!_al_kcm_page_in_sample(data)) {
+      return false;
+   }
+
    need_reattach = false;
    if (spl->parent.u.ptr != NULL) {
       if (spl->spl_data.frequency != data->frequency ||
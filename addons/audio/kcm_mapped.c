@@ -0,0 +1,200 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      Samples backed by a memory-mapped file.
+ *
+ *      See LICENSE.txt for copyright information.
+ */
+
+
+#include "allegro5/allegro.h"
+#include "allegro5/allegro_audio.h"
+#include "allegro5/internal/aintern.h"
+#include "allegro5/internal/aintern_audio.h"
+#include "allegro5/internal/aintern_file.h"
+
+#if defined(ALLEGRO_WINDOWS)
+   #include <windows.h>
+   #include "allegro5/internal/aintern_wunicode.h"
+   #define MAPPING_SUPPORTED
+#elif defined(ALLEGRO_HAVE_MMAP)
+   #include <fcntl.h>
+   #include <unistd.h>
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #define MAPPING_SUPPORTED
+#endif
+
+ALLEGRO_DEBUG_CHANNEL("audio")
+
+
+#ifdef MAPPING_SUPPORTED
+
+#if defined(ALLEGRO_WINDOWS)
+
+static void *map_file(const char *filename, uint64_t *size)
+{
+   wchar_t *wname;
+   HANDLE file, mapping;
+   LARGE_INTEGER file_size;
+   void *view = NULL;
+
+   wname = _al_win_utf16(filename);
+   if (!wname)
+      return NULL;
+   file = CreateFileW(wname, GENERIC_READ, FILE_SHARE_READ, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   al_free(wname);
+   if (file == INVALID_HANDLE_VALUE)
+      return NULL;
+
+   if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+      mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (mapping) {
+         view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+         /* The view keeps the mapping alive. */
+         CloseHandle(mapping);
+      }
+      *size = file_size.QuadPart;
+   }
+   CloseHandle(file);
+   return view;
+}
+
+
+static void unmap_file(void *base, uint64_t size)
+{
+   (void)size;
+   UnmapViewOfFile(base);
+}
+
+#else
+
+static void *map_file(const char *filename, uint64_t *size)
+{
+   struct stat st;
+   void *base = NULL;
+   int fd;
+
+   fd = open(filename, O_RDONLY);
+   if (fd < 0)
+      return NULL;
+
+   if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+         (uint64_t)st.st_size == (size_t)st.st_size) {
+      base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (base == MAP_FAILED)
+         base = NULL;
+      *size = st.st_size;
+   }
+   /* The mapping keeps the file alive. */
+   close(fd);
+   return base;
+}
+
+
+static void unmap_file(void *base, uint64_t size)
+{
+   munmap(base, size);
+}
+
+#endif
+
+#endif /* MAPPING_SUPPORTED */
+
+
+/* _al_kcm_create_mapped_sample:
+ *  Create a sample whose data is read in place from a memory-mapped file,
+ *  starting at `offset' bytes in.  Nothing is read until the mixer touches
+ *  it, and the system may page the data out again while the sample is idle.
+ *  The data must be in the host's byte order, and the sample is read-only.
+ *
+ *  Returns NULL if the file can't be mapped, for example if the current
+ *  file interface is not the standard one.  The caller should then load
+ *  the sample into memory as usual.
+ */
+ALLEGRO_SAMPLE *_al_kcm_create_mapped_sample(const char *filename,
+   uint64_t offset, unsigned int samples, unsigned int freq,
+   ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf)
+{
+#ifdef MAPPING_SUPPORTED
+   const int frame_size = al_get_channel_count(chan_conf) *
+      al_get_audio_depth_size(depth);
+   ALLEGRO_SAMPLE *spl;
+   uint64_t size = 0;
+   char *base;
+
+   ASSERT(filename);
+
+   /* Other file interfaces don't name files on the native filesystem. */
+   if (al_get_new_file_interface() != &_al_file_interface_stdio)
+      return NULL;
+
+   if (offset % al_get_audio_depth_size(depth) != 0) {
+      ALLEGRO_DEBUG("%s: unaligned sample data, not mapping\n", filename);
+      return NULL;
+   }
+
+   base = map_file(filename, &size);
+   if (!base) {
+      ALLEGRO_DEBUG("%s: could not be mapped\n", filename);
+      return NULL;
+   }
+
+   if (offset >= size) {
+      unmap_file(base, size);
+      return NULL;
+   }
+   if (samples > (size - offset) / frame_size) {
+      ALLEGRO_WARN("%s: truncated, %u of %u samples mapped\n", filename,
+         (unsigned int) ((size - offset) / frame_size), samples);
+      samples = (size - offset) / frame_size;
+   }
+
+   spl = al_create_sample(base + offset, samples, freq, depth, chan_conf,
+      false);
+   if (!spl) {
+      unmap_file(base, size);
+      return NULL;
+   }
+   spl->mapping = base;
+   spl->mapping_size = size;
+
+   ALLEGRO_INFO("%s: mapped %u samples\n", filename, samples);
+   return spl;
+#else
+   (void)filename;
+   (void)offset;
+   (void)samples;
+   (void)freq;
+   (void)depth;
+   (void)chan_conf;
+   return NULL;
+#endif
+}
+
+
+/* _al_kcm_unmap_sample:
+ *  Release the mapping behind a sample made by _al_kcm_create_mapped_sample.
+ */
+void _al_kcm_unmap_sample(ALLEGRO_SAMPLE *spl)
+{
+   ASSERT(spl);
+
+#ifdef MAPPING_SUPPORTED
+   if (spl->mapping) {
+      unmap_file(spl->mapping, spl->mapping_size);
+      spl->mapping = NULL;
+      spl->mapping_size = 0;
+   }
+#endif
+}
+
+/* vim: set sts=3 sw=3 et: */
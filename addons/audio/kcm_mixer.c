@@ -8,11 +8,18 @@
 /* Title: Mixer functions
  */
 
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 #include "allegro5/allegro_audio.h"
 #include "allegro5/internal/aintern.h"
+#include "allegro5/internal/aintern_thread.h"
+#include "allegro5/internal/aintern_thread_pool.h"
 #include "allegro5/internal/aintern_audio.h"
 #include "allegro5/internal/aintern_audio_cfg.h"
 
@@ -154,9 +161,13 @@ void _al_kcm_mixer_rejig_sample_matrix(ALLEGRO_MIXER *mixer,
    if (!spl->matrix)
       spl->matrix = al_calloc(1, src_chans * dst_chans * sizeof(float));
 
+   spl->matrix_is_diagonal = (src_chans == dst_chans);
+
    for (i = 0; i < dst_chans; i++) {
       for (j = 0; j < src_chans; j++) {
          spl->matrix[i*src_chans + j] = mat[i*ALLEGRO_MAX_CHANNELS + j];
+         if (i != j && spl->matrix[i*src_chans + j] != 0.0f)
+            spl->matrix_is_diagonal = false;
       }
    }
 }
@@ -246,22 +257,6 @@ static bool fix_looped_position(ALLEGRO_SAMPLE_INSTANCE *spl)
 #include "kcm_mixer_helpers.inc"
 
 
-static INLINE int32_t clamp(int32_t val, int32_t min, int32_t max)
-{
-   /* Clamp to min */
-   val -= min;
-   val &= (~val) >> 31;
-   val += min;
-
-   /* Clamp to max */
-   val -= max;
-   val &= val >> 31;
-   val += max;
-
-   return val;
-}
-
-
 /* Mix as many sample values as possible from the source sample into a mixer
  * buffer.  Implements stream_reader_t.
  *
@@ -336,32 +331,1074 @@ static void NAME(void *source, void **vbuf, unsigned int *samples,            \
    (void)buffer_depth;                                                        \
 }
 
-MAKE_MIXER(read_to_mixer_point_float_32, point_spl32, float)
-MAKE_MIXER(read_to_mixer_linear_float_32, linear_spl32, float)
-MAKE_MIXER(read_to_mixer_cubic_float_32, cubic_spl32, float)
-MAKE_MIXER(read_to_mixer_point_int16_t_16, point_spl16, int16_t)
-MAKE_MIXER(read_to_mixer_linear_int16_t_16, linear_spl16, int16_t)
+MAKE_MIXER(read_to_mixer_point_int16_t_16, point_spl16, int16_t)
+MAKE_MIXER(read_to_mixer_linear_int16_t_16, linear_spl16, int16_t)
+
+#undef MAKE_MIXER
+
+
+/* Block mixing for float mixers.
+ *
+ * Instead of checking for loop points and converting one frame at a time,
+ * work out how many frames can be produced before the next loop or buffer
+ * boundary, interpolate that many into a float scratch buffer, then apply
+ * the channel matrix to the whole block at once.
+ */
+
+/* Number of frames rendered into the scratch buffer at a time. */
+#define MIX_BLOCK_FRAMES   128
+
+typedef const void *(*next_sample_t)(SAMP_BUF *samp_buf,
+   const ALLEGRO_SAMPLE_INSTANCE *spl, unsigned int maxc);
+
+/* Renders as many of the n frames as it has a fast path for, returning the
+ * count.  The position is advanced past the rendered frames.
+ */
+typedef int (*block_render_t)(ALLEGRO_SAMPLE_INSTANCE *spl, float *out,
+   int n, int maxc, int delta, int delta_error);
+
+
+#define ADVANCE_POSITION                                                      \
+   do {                                                                       \
+      pos += delta;                                                           \
+      err += delta_error;                                                     \
+      if (err >= step_denom) {                                                \
+         pos++;                                                               \
+         err -= step_denom;                                                   \
+      }                                                                       \
+   } while (0)
+
+
+/* frames_within:
+ *  Return how many frames, at most max, the sample can produce starting from
+ *  the current position before the position leaves [start, end) in the
+ *  direction of play.
+ */
+static int frames_within(const ALLEGRO_SAMPLE_INSTANCE *spl, int start,
+   int end, int max)
+{
+   const int64_t p0 = (int64_t)spl->pos * spl->step_denom +
+      spl->pos_bresenham_error;
+   int64_t n;
+
+   if (spl->step > 0) {
+      const int64_t e = (int64_t)end * spl->step_denom;
+      if (p0 >= e)
+         return 0;
+      n = (e - p0 - 1) / spl->step + 1;
+   }
+   else if (spl->step < 0) {
+      const int64_t b = (int64_t)start * spl->step_denom;
+      if (p0 < b)
+         return 0;
+      n = (p0 - b) / -spl->step + 1;
+   }
+   else {
+      return max;
+   }
+
+   return (n < max) ? (int)n : max;
+}
+
+
+/* frames_before_boundary:
+ *  Return how many frames, at most max, can be produced before
+ *  fix_looped_position would have to adjust the position.
+ */
+static int frames_before_boundary(const ALLEGRO_SAMPLE_INSTANCE *spl, int max)
+{
+   switch (spl->loop) {
+      case ALLEGRO_PLAYMODE_LOOP:
+      case ALLEGRO_PLAYMODE_BIDIR:
+         if (spl->loop_end - spl->loop_start != 0)
+            return frames_within(spl, spl->loop_start, spl->loop_end, max);
+         break;
+
+      case ALLEGRO_PLAYMODE_ONCE:
+      case _ALLEGRO_PLAYMODE_STREAM_ONCE:
+      case _ALLEGRO_PLAYMODE_STREAM_ONEDIR:
+         break;
+   }
+
+   return frames_within(spl, 0, spl->spl_data.len, max);
+}
+
+
+/* render_generic:
+ *  Render frames one at a time through a per-frame interpolator.
+ */
+static void render_generic(ALLEGRO_SAMPLE_INSTANCE *spl, float *out, int n,
+   int maxc, int delta, int delta_error, next_sample_t next)
+{
+   SAMP_BUF samp_buf;
+   int i, c;
+
+   for (i = 0; i < n; i++) {
+      const float *s = next(&samp_buf, spl, maxc);
+      for (c = 0; c < maxc; c++)
+         out[c] = s[c];
+      out += maxc;
+
+      spl->pos += delta;
+      spl->pos_bresenham_error += delta_error;
+      if (spl->pos_bresenham_error >= spl->step_denom) {
+         spl->pos++;
+         spl->pos_bresenham_error -= spl->step_denom;
+      }
+   }
+}
+
+
+/* render_point_block:
+ *  Point sampling of 16-bit and float samples.
+ */
+static int render_point_block(ALLEGRO_SAMPLE_INSTANCE *spl, float *out,
+   int n, int maxc, int delta, int delta_error)
+{
+   const int step_denom = spl->step_denom;
+   int pos = spl->pos;
+   int err = spl->pos_bresenham_error;
+   int i, c;
+
+   switch (spl->spl_data.depth) {
+      case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
+         const float *buf = spl->spl_data.buffer.f32;
+         for (i = 0; i < n; i++) {
+            const float *src = buf + pos * maxc;
+            for (c = 0; c < maxc; c++)
+               out[c] = src[c];
+            out += maxc;
+            ADVANCE_POSITION;
+         }
+         break;
+      }
+
+      case ALLEGRO_AUDIO_DEPTH_INT16: {
+         const int16_t *buf = spl->spl_data.buffer.s16;
+         const float scale = 1.0f / ((float)0x7FFF + 0.5f);
+         for (i = 0; i < n; i++) {
+            const int16_t *src = buf + pos * maxc;
+            for (c = 0; c < maxc; c++)
+               out[c] = (float)src[c] * scale;
+            out += maxc;
+            ADVANCE_POSITION;
+         }
+         break;
+      }
+
+      default:
+         return 0;
+   }
+
+   spl->pos = pos;
+   spl->pos_bresenham_error = err;
+   return n;
+}
+
+
+/* render_linear_block:
+ *  Linear interpolation of 16-bit and float samples played forwards, for
+ *  the frames whose following frame needs no wrapping.
+ */
+static int render_linear_block(ALLEGRO_SAMPLE_INSTANCE *spl, float *out,
+   int n, int maxc, int delta, int delta_error)
+{
+   const int step_denom = spl->step_denom;
+   const float inv_denom = 1.0f / step_denom;
+   int pos = spl->pos;
+   int err = spl->pos_bresenham_error;
+   int lag = 0;
+   int i, c;
+
+   if (spl->step <= 0)
+      return 0;
+
+   switch (spl->loop) {
+      case ALLEGRO_PLAYMODE_ONCE:
+         n = frames_within(spl, 0, spl->spl_data.len - 1, n);
+         break;
+      case ALLEGRO_PLAYMODE_LOOP:
+      case ALLEGRO_PLAYMODE_BIDIR:
+         n = frames_within(spl, spl->loop_start, spl->loop_end - 1, n);
+         break;
+      case _ALLEGRO_PLAYMODE_STREAM_ONCE:
+      case _ALLEGRO_PLAYMODE_STREAM_ONEDIR:
+         /* Streams keep the previous frame in front of the buffer. */
+         lag = 1;
+         break;
+   }
+
+   switch (spl->spl_data.depth) {
+      case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
+         const float *buf = spl->spl_data.buffer.f32 - lag * maxc;
+         for (i = 0; i < n; i++) {
+            const float t = (float)err * inv_denom;
+            const float *x0 = buf + pos * maxc;
+            const float *x1 = x0 + maxc;
+            for (c = 0; c < maxc; c++)
+               out[c] = (x0[c] * (1.0f - t)) + (x1[c] * t);
+            out += maxc;
+            ADVANCE_POSITION;
+         }
+         break;
+      }
+
+      case ALLEGRO_AUDIO_DEPTH_INT16: {
+         const int16_t *buf = spl->spl_data.buffer.s16 - lag * maxc;
+         const float scale = 1.0f / ((float)0x7FFF + 0.5f);
+         for (i = 0; i < n; i++) {
+            const float t = (float)err * inv_denom;
+            const int16_t *x0 = buf + pos * maxc;
+            const int16_t *x1 = x0 + maxc;
+            for (c = 0; c < maxc; c++) {
+               out[c] = ((float)x0[c] * (1.0f - t) + (float)x1[c] * t)
+                  * scale;
+            }
+            out += maxc;
+            ADVANCE_POSITION;
+         }
+         break;
+      }
+
+      default:
+         return 0;
+   }
+
+   spl->pos = pos;
+   spl->pos_bresenham_error = err;
+   return n;
+}
+
+
+/* render_cubic_block:
+ *  Cubic interpolation of float samples played forwards, for the frames
+ *  whose neighbours need no clamping.
+ */
+static int render_cubic_block(ALLEGRO_SAMPLE_INSTANCE *spl, float *out,
+   int n, int maxc, int delta, int delta_error)
+{
+   const int step_denom = spl->step_denom;
+   const float inv_denom = 1.0f / step_denom;
+   const float *buf;
+   int pos, err;
+   int start = INT_MIN;
+   int end = INT_MAX;
+   int lag = 0;
+   int done = 0;
+   int i, c;
+
+   if (spl->step <= 0 || spl->spl_data.depth != ALLEGRO_AUDIO_DEPTH_FLOAT32)
+      return 0;
+
+   switch (spl->loop) {
+      case ALLEGRO_PLAYMODE_ONCE:
+         start = 0;
+         end = spl->spl_data.len;
+         break;
+      case ALLEGRO_PLAYMODE_LOOP:
+      case ALLEGRO_PLAYMODE_BIDIR:
+         start = spl->loop_start;
+         end = spl->loop_end;
+         break;
+      case _ALLEGRO_PLAYMODE_STREAM_ONCE:
+      case _ALLEGRO_PLAYMODE_STREAM_ONEDIR:
+         /* Streams lag by three frames in total. */
+         lag = 2;
+         break;
+   }
+
+   /* Right after the loop start the previous frame comes from the end. */
+   while (done < n && spl->pos < start + 1) {
+      render_generic(spl, out, 1, maxc, delta, delta_error, cubic_spl32);
+      out += maxc;
+      done++;
+   }
+
+   if (end != INT_MAX)
+      n = done + frames_within(spl, start, end - 2, n - done);
+
+   pos = spl->pos;
+   err = spl->pos_bresenham_error;
+   buf = spl->spl_data.buffer.f32 - lag * maxc;
+
+   for (i = done; i < n; i++) {
+      const float t = (float)err * inv_denom;
+      const float *x1 = buf + pos * maxc;
+      const float *x0 = x1 - maxc;
+      const float *x2 = x1 + maxc;
+      const float *x3 = x2 + maxc;
+      for (c = 0; c < maxc; c++) {
+         const float c0 = x1[c];
+         const float c1 = 0.5f * (x2[c] - x0[c]);
+         const float c2 = x0[c] - (2.5f * x1[c]) + (2.0f * x2[c]) -
+            (0.5f * x3[c]);
+         const float c3 = (0.5f * (x3[c] - x0[c])) + (1.5f * (x1[c] - x2[c]));
+         out[c] = (((((c3 * t) + c2) * t) + c1) * t) + c0;
+      }
+      out += maxc;
+      ADVANCE_POSITION;
+   }
+
+   spl->pos = pos;
+   spl->pos_bresenham_error = err;
+   return n;
+}
+
+
+/* Windowed-sinc interpolation.
+ *
+ * Each output frame is the dot product of taps input frames around the
+ * position with a filter picked from a precomputed polyphase bank, see
+ * kcm_sinc.c.  The phase nearest the fractional position is used.
+ * Streams lag by half the taps, so that every frame needed is already in
+ * the fragment or the history kept in front of it.
+ */
+
+/* Input frames converted to float at a time by render_sinc_block. */
+#define SINC_SCRATCH_FRAMES   256
+
+
+static float sample_as_float(const ALLEGRO_SAMPLE_INSTANCE *spl, int i)
+{
+   switch (spl->spl_data.depth) {
+      case ALLEGRO_AUDIO_DEPTH_FLOAT32:
+         return spl->spl_data.buffer.f32[i];
+      case ALLEGRO_AUDIO_DEPTH_INT24:
+         return (float)spl->spl_data.buffer.s24[i] / ((float)0x7FFFFF + 0.5f);
+      case ALLEGRO_AUDIO_DEPTH_UINT24:
+         return (float)spl->spl_data.buffer.u24[i] / ((float)0x7FFFFF + 0.5f)
+            - 1.0f;
+      case ALLEGRO_AUDIO_DEPTH_INT16:
+         return (float)spl->spl_data.buffer.s16[i] / ((float)0x7FFF + 0.5f);
+      case ALLEGRO_AUDIO_DEPTH_UINT16:
+         return (float)spl->spl_data.buffer.u16[i] / ((float)0x7FFF + 0.5f)
+            - 1.0f;
+      case ALLEGRO_AUDIO_DEPTH_INT8:
+         return (float)spl->spl_data.buffer.s8[i] / ((float)0x7F + 0.5f);
+      case ALLEGRO_AUDIO_DEPTH_UINT8:
+         return (float)spl->spl_data.buffer.u8[i] / ((float)0x7F + 0.5f)
+            - 1.0f;
+   }
+   return 0.0f;
+}
+
+
+static INLINE float dot_product(const float *a, const float *b, int n)
+{
+   float sum;
+   int i = 0;
+
+#ifdef __SSE__
+   __m128 acc = _mm_setzero_ps();
+   for (; i + 4 <= n; i += 4)
+      acc = _mm_add_ps(acc,
+         _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+   acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+   acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+   sum = _mm_cvtss_f32(acc);
+#else
+   sum = 0.0f;
+#endif
+   for (; i < n; i++)
+      sum += a[i] * b[i];
+   return sum;
+}
+
+
+#ifdef __SSE__
+/* Four dot products of taps floats at once, summed across in one go.  The
+ * number of taps is a multiple of four.
+ */
+static INLINE __m128 dot_product4(const float * const *a, const float *b,
+   const int *offset, int n)
+{
+   const float *b0 = b + offset[0];
+   const float *b1 = b + offset[1];
+   const float *b2 = b + offset[2];
+   const float *b3 = b + offset[3];
+   __m128 acc0 = _mm_setzero_ps();
+   __m128 acc1 = _mm_setzero_ps();
+   __m128 acc2 = _mm_setzero_ps();
+   __m128 acc3 = _mm_setzero_ps();
+   int i;
+
+   for (i = 0; i < n; i += 4) {
+      acc0 = _mm_add_ps(acc0,
+         _mm_mul_ps(_mm_loadu_ps(a[0] + i), _mm_loadu_ps(b0 + i)));
+      acc1 = _mm_add_ps(acc1,
+         _mm_mul_ps(_mm_loadu_ps(a[1] + i), _mm_loadu_ps(b1 + i)));
+      acc2 = _mm_add_ps(acc2,
+         _mm_mul_ps(_mm_loadu_ps(a[2] + i), _mm_loadu_ps(b2 + i)));
+      acc3 = _mm_add_ps(acc3,
+         _mm_mul_ps(_mm_loadu_ps(a[3] + i), _mm_loadu_ps(b3 + i)));
+   }
+
+   _MM_TRANSPOSE4_PS(acc0, acc1, acc2, acc3);
+   return _mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3));
+}
+#endif
+
+
+/* The filter for the fractional position err / step_denom, where
+ * phase_scale is _AL_SINC_PHASES / step_denom.
+ */
+static INLINE const float *sinc_row(const float *bank, int taps, int err,
+   float phase_scale)
+{
+   return bank + (int)((float)err * phase_scale + 0.5f) * taps;
+}
+
+
+/* Map a frame index outside of the playing region, returning -1 for
+ * silence.
+ */
+static int sinc_frame_index(const ALLEGRO_SAMPLE_INSTANCE *spl, int i)
+{
+   const int loop_len = spl->loop_end - spl->loop_start;
+
+   switch (spl->loop) {
+      case ALLEGRO_PLAYMODE_LOOP:
+         if (loop_len > 0) {
+            if (i >= (int)spl->loop_end)
+               i = spl->loop_start + (i - spl->loop_start) % loop_len;
+            else if (i < (int)spl->loop_start && spl->pos >= spl->loop_start)
+               i = spl->loop_end - 1 - (spl->loop_start - 1 - i) % loop_len;
+         }
+         break;
+      case ALLEGRO_PLAYMODE_BIDIR:
+         if (loop_len > 0) {
+            if (i >= (int)spl->loop_end)
+               i = spl->loop_end - 1 - (i - spl->loop_end) % loop_len;
+            else if (i < (int)spl->loop_start && spl->pos >= spl->loop_start)
+               i = spl->loop_start + (spl->loop_start - 1 - i) % loop_len;
+         }
+         break;
+      case ALLEGRO_PLAYMODE_ONCE:
+         break;
+      case _ALLEGRO_PLAYMODE_STREAM_ONCE:
+      case _ALLEGRO_PLAYMODE_STREAM_ONEDIR:
+         /* The history in front of the fragment makes every index valid. */
+         return i;
+   }
+
+   if (i < 0 || i >= (int)spl->spl_data.len)
+      return -1;
+   return i;
+}
+
+
+/* sinc_spl32:
+ *  Sinc interpolation of a single frame of any depth, wrapping around loop
+ *  points.  Implements next_sample_t.
+ */
+static const void *sinc_spl32(SAMP_BUF *samp_buf,
+   const ALLEGRO_SAMPLE_INSTANCE *spl, unsigned int maxc)
+{
+   const int taps = spl->sinc_taps;
+   const float *coef;
+   int first = spl->pos - taps/2 + 1;
+   unsigned int c;
+   int k;
+
+   if (spl->loop == _ALLEGRO_PLAYMODE_STREAM_ONCE ||
+         spl->loop == _ALLEGRO_PLAYMODE_STREAM_ONEDIR) {
+      first -= taps/2;
+   }
+
+   coef = sinc_row(spl->sinc_filter, taps, spl->pos_bresenham_error,
+      (float)_AL_SINC_PHASES / spl->step_denom);
+
+   for (c = 0; c < maxc; c++)
+      samp_buf->f32[c] = 0.0f;
+
+   for (k = 0; k < taps; k++) {
+      const int i = sinc_frame_index(spl, first + k);
+      if (i < 0)
+         continue;
+      for (c = 0; c < maxc; c++)
+         samp_buf->f32[c] += coef[k] * sample_as_float(spl, i * maxc + c);
+   }
+
+   return samp_buf->f32;
+}
+
+
+/* Convert count frames starting at first to planar float. */
+static void sinc_load_frames(const ALLEGRO_SAMPLE_INSTANCE *spl,
+   float scratch[][SINC_SCRATCH_FRAMES], int first, int count, int maxc)
+{
+   int i, c;
+
+   switch (spl->spl_data.depth) {
+      case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
+         const float *src = spl->spl_data.buffer.f32 + first * maxc;
+         for (i = 0; i < count; i++) {
+            for (c = 0; c < maxc; c++)
+               scratch[c][i] = src[c];
+            src += maxc;
+         }
+         break;
+      }
+
+      case ALLEGRO_AUDIO_DEPTH_INT16: {
+         const int16_t *src = spl->spl_data.buffer.s16 + first * maxc;
+         const float scale = 1.0f / ((float)0x7FFF + 0.5f);
+         for (i = 0; i < count; i++) {
+            for (c = 0; c < maxc; c++)
+               scratch[c][i] = (float)src[c] * scale;
+            src += maxc;
+         }
+         break;
+      }
+
+      default:
+         for (i = 0; i < count; i++) {
+            for (c = 0; c < maxc; c++)
+               scratch[c][i] = sample_as_float(spl, (first + i) * maxc + c);
+         }
+         break;
+   }
+}
+
+
+/* render_sinc_block:
+ *  Sinc interpolation of samples played forwards, for the frames whose
+ *  filter needs no wrapping.  The input is converted to float once, a
+ *  stretch at a time, and each channel filtered with SIMD dot products,
+ *  four output frames at a time.
+ */
+static int render_sinc_block(ALLEGRO_SAMPLE_INSTANCE *spl, float *out,
+   int n, int maxc, int delta, int delta_error)
+{
+   const int step_denom = spl->step_denom;
+   const int taps = spl->sinc_taps;
+   const int half = taps / 2;
+   const int span = SINC_SCRATCH_FRAMES - taps;
+   const float phase_scale = (float)_AL_SINC_PHASES / step_denom;
+   const float *bank = spl->sinc_filter;
+   float scratch[ALLEGRO_MAX_CHANNELS][SINC_SCRATCH_FRAMES];
+   int start = INT_MIN;
+   int end = INT_MAX;
+   int lag = 0;
+   int done = 0;
+   int c;
+
+   if (spl->step <= 0)
+      return 0;
+
+   switch (spl->loop) {
+      case ALLEGRO_PLAYMODE_ONCE:
+         start = 0;
+         end = spl->spl_data.len;
+         break;
+      case ALLEGRO_PLAYMODE_LOOP:
+      case ALLEGRO_PLAYMODE_BIDIR:
+         start = spl->loop_start;
+         end = spl->loop_end;
+         break;
+      case _ALLEGRO_PLAYMODE_STREAM_ONCE:
+      case _ALLEGRO_PLAYMODE_STREAM_ONEDIR:
+         lag = half;
+         break;
+   }
+
+   /* Frames whose filter reaches back past the start. */
+   while (done < n && spl->pos < start + half - 1) {
+      render_generic(spl, out, 1, maxc, delta, delta_error, sinc_spl32);
+      out += maxc;
+      done++;
+   }
+
+   if (end != INT_MAX)
+      n = done + frames_within(spl, start, end - half, n - done);
+
+   while (done < n) {
+      const int pos0 = spl->pos;
+      const int chunk = frames_within(spl, pos0, pos0 + span, n - done);
+      const int first = pos0 - lag - half + 1;
+      int pos = pos0;
+      int err = spl->pos_bresenham_error;
+      int last, i;
+
+      /* Position of the last frame of the chunk. */
+      last = pos0 + (int)(((int64_t)(chunk - 1) * spl->step + err) /
+         step_denom);
+      sinc_load_frames(spl, scratch, first, last - pos0 + taps, maxc);
+
+      i = 0;
+#ifdef __SSE__
+      for (; i + 4 <= chunk; i += 4) {
+         const float *row[4];
+         int offset[4];
+         int j;
+
+         for (j = 0; j < 4; j++) {
+            row[j] = sinc_row(bank, taps, err, phase_scale);
+            offset[j] = pos - pos0;
+            ADVANCE_POSITION;
+         }
+         for (c = 0; c < maxc; c++) {
+            float sums[4];
+            _mm_storeu_ps(sums, dot_product4(row, scratch[c], offset, taps));
+            for (j = 0; j < 4; j++)
+               out[j * maxc + c] = sums[j];
+         }
+         out += 4 * maxc;
+      }
+#endif
+      for (; i < chunk; i++) {
+         const float *row = sinc_row(bank, taps, err, phase_scale);
+         const int offset = pos - pos0;
+         for (c = 0; c < maxc; c++)
+            out[c] = dot_product(row, scratch[c] + offset, taps);
+         out += maxc;
+         ADVANCE_POSITION;
+      }
+
+      spl->pos = pos;
+      spl->pos_bresenham_error = err;
+      done += chunk;
+   }
+
+   return n;
+}
+
+
+/* mix_block:
+ *  Multiply n frames of maxc channels by the sample's channel matrix and add
+ *  them to the dest_maxc channel mixer buffer.  Mono and stereo sources into
+ *  a stereo mixer, by far the most common cases, get their own loops.
+ */
+static void mix_block(const float *in, float *out, int n, int maxc,
+   int dest_maxc, const float *matrix)
+{
+   int i = 0, c, k;
+
+   if (dest_maxc == 2 && maxc == 1) {
+      const float m0 = matrix[0];
+      const float m1 = matrix[1];
+#ifdef __SSE__
+      const __m128 mv = _mm_setr_ps(m0, m1, m0, m1);
+      for (; i + 4 <= n; i += 4) {
+         const __m128 x = _mm_loadu_ps(in + i);
+         __m128 lo = _mm_loadu_ps(out + 2*i);
+         __m128 hi = _mm_loadu_ps(out + 2*i + 4);
+         lo = _mm_add_ps(lo, _mm_mul_ps(_mm_unpacklo_ps(x, x), mv));
+         hi = _mm_add_ps(hi, _mm_mul_ps(_mm_unpackhi_ps(x, x), mv));
+         _mm_storeu_ps(out + 2*i, lo);
+         _mm_storeu_ps(out + 2*i + 4, hi);
+      }
+#endif
+      for (; i < n; i++) {
+         out[2*i + 0] += in[i] * m0;
+         out[2*i + 1] += in[i] * m1;
+      }
+      return;
+   }
+
+   if (dest_maxc == 2 && maxc == 2) {
+      const float m00 = matrix[0], m01 = matrix[1];
+      const float m10 = matrix[2], m11 = matrix[3];
+#ifdef __SSE__
+      const __m128 ml = _mm_setr_ps(m00, m10, m00, m10);
+      const __m128 mr = _mm_setr_ps(m01, m11, m01, m11);
+      for (; i + 2 <= n; i += 2) {
+         const __m128 x = _mm_loadu_ps(in + 2*i);
+         const __m128 l = _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 2, 0, 0));
+         const __m128 r = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 1, 1));
+         __m128 y = _mm_loadu_ps(out + 2*i);
+         y = _mm_add_ps(y, _mm_add_ps(_mm_mul_ps(l, ml), _mm_mul_ps(r, mr)));
+         _mm_storeu_ps(out + 2*i, y);
+      }
+#endif
+      for (; i < n; i++) {
+         const float l = in[2*i + 0];
+         const float r = in[2*i + 1];
+         out[2*i + 0] += l * m00 + r * m01;
+         out[2*i + 1] += l * m10 + r * m11;
+      }
+      return;
+   }
+
+   for (; i < n; i++) {
+      for (c = 0; c < dest_maxc; c++) {
+         const float *row = matrix + c * maxc;
+         float acc = 0.0f;
+         for (k = 0; k < maxc; k++)
+            acc += in[k] * row[k];
+         out[c] += acc;
+      }
+      in += maxc;
+      out += dest_maxc;
+   }
+}
+
+
+/* mix_unity_block:
+ *  Mix n frames of a sample playing at the mixer's rate through a diagonal
+ *  matrix.  No resampling or channel conversion is needed, so this is a
+ *  straight multiply-add over contiguous frames.  Returns false if the
+ *  sample depth has no such path.
+ */
+static bool mix_unity_block(ALLEGRO_SAMPLE_INSTANCE *spl, float *out, int n,
+   int maxc, int lag)
+{
+   float gain[ALLEGRO_MAX_CHANNELS];
+   const int count = n * maxc;
+   int i = 0, c;
+
+   for (c = 0; c < maxc; c++)
+      gain[c] = spl->matrix[c*maxc + c];
+
+   switch (spl->spl_data.depth) {
+      case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
+         const float *src = spl->spl_data.buffer.f32 + (spl->pos - lag) * maxc;
+#ifdef __SSE__
+         if (4 % maxc == 0) {
+            const __m128 g = _mm_setr_ps(gain[0], gain[1 % maxc],
+               gain[2 % maxc], gain[3 % maxc]);
+            for (; i + 4 <= count; i += 4) {
+               __m128 y = _mm_loadu_ps(out + i);
+               y = _mm_add_ps(y, _mm_mul_ps(_mm_loadu_ps(src + i), g));
+               _mm_storeu_ps(out + i, y);
+            }
+         }
+#endif
+         for (; i < count; i += maxc) {
+            for (c = 0; c < maxc; c++)
+               out[i + c] += src[i + c] * gain[c];
+         }
+         break;
+      }
+
+      case ALLEGRO_AUDIO_DEPTH_INT16: {
+         const int16_t *src =
+            spl->spl_data.buffer.s16 + (spl->pos - lag) * maxc;
+         const float scale = 1.0f / ((float)0x7FFF + 0.5f);
+         for (c = 0; c < maxc; c++)
+            gain[c] *= scale;
+         for (; i < count; i += maxc) {
+            for (c = 0; c < maxc; c++)
+               out[i + c] += (float)src[i + c] * gain[c];
+         }
+         break;
+      }
+
+      default:
+         return false;
+   }
+
+   spl->pos += n;
+   return true;
+}
+
+
+/* mix_float_blocks:
+ *  The body of the float stream readers.  Implements stream_reader_t
+ *  together with the wrappers below.  stream_lag is how many frames the
+ *  interpolator trails the position by when reading from a stream.
+ */
+static void mix_float_blocks(ALLEGRO_SAMPLE_INSTANCE *spl, float *buf,
+   size_t samples, size_t dest_maxc, block_render_t render,
+   next_sample_t next, int stream_lag)
+{
+   const int maxc = al_get_channel_count(spl->spl_data.chan_conf);
+   float scratch[MIX_BLOCK_FRAMES * ALLEGRO_MAX_CHANNELS];
+   size_t samples_l = samples;
+   int delta, delta_error;
+
+   BRESENHAM;
+
+   if (!spl->is_playing)
+      return;
+
+   while (samples_l > 0) {
+      int old_step = spl->step;
+      int max = (samples_l < MIX_BLOCK_FRAMES) ?
+         (int)samples_l : MIX_BLOCK_FRAMES;
+      int n, done;
+
+      if (!fix_looped_position(spl))
+         return;
+      if (old_step != spl->step) {
+         BRESENHAM;
+      }
+
+      n = frames_before_boundary(spl, max);
+      if (n < 1)
+         n = 1;
+
+      /* At unity rate every interpolator returns the frames unchanged. */
+      if (spl->step == spl->step_denom && spl->pos_bresenham_error == 0 &&
+            spl->matrix_is_diagonal && (int)dest_maxc == maxc) {
+         const int lag = (spl->loop == _ALLEGRO_PLAYMODE_STREAM_ONCE ||
+            spl->loop == _ALLEGRO_PLAYMODE_STREAM_ONEDIR) ? stream_lag : 0;
+         if (mix_unity_block(spl, buf, n, maxc, lag)) {
+            buf += n * dest_maxc;
+            samples_l -= n;
+            continue;
+         }
+      }
+
+      done = render(spl, scratch, n, maxc, delta, delta_error);
+      if (done < n) {
+         render_generic(spl, scratch + done * maxc, n - done, maxc,
+            delta, delta_error, next);
+      }
+
+      mix_block(scratch, buf, n, maxc, dest_maxc, spl->matrix);
+
+      buf += n * dest_maxc;
+      samples_l -= n;
+   }
+   fix_looped_position(spl);
+}
+
+
+static void read_to_mixer_point_float_32(void *source, void **vbuf,
+   unsigned int *samples, ALLEGRO_AUDIO_DEPTH buffer_depth, size_t dest_maxc)
+{
+   mix_float_blocks(source, *vbuf, *samples, dest_maxc,
+      render_point_block, point_spl32, 0);
+   (void)buffer_depth;
+}
+
+
+static void read_to_mixer_linear_float_32(void *source, void **vbuf,
+   unsigned int *samples, ALLEGRO_AUDIO_DEPTH buffer_depth, size_t dest_maxc)
+{
+   mix_float_blocks(source, *vbuf, *samples, dest_maxc,
+      render_linear_block, linear_spl32, 1);
+   (void)buffer_depth;
+}
+
+
+static void read_to_mixer_cubic_float_32(void *source, void **vbuf,
+   unsigned int *samples, ALLEGRO_AUDIO_DEPTH buffer_depth, size_t dest_maxc)
+{
+   mix_float_blocks(source, *vbuf, *samples, dest_maxc,
+      render_cubic_block, cubic_spl32, 2);
+   (void)buffer_depth;
+}
+
+
+static void read_to_mixer_sinc_float_32(void *source, void **vbuf,
+   unsigned int *samples, ALLEGRO_AUDIO_DEPTH buffer_depth, size_t dest_maxc)
+{
+   ALLEGRO_SAMPLE_INSTANCE *spl = source;
+
+   /* Looked up once per read rather than for every frame. */
+   spl->sinc_taps = _al_kcm_get_sinc_taps();
+   spl->sinc_filter = _al_kcm_get_sinc_filter(spl->step, spl->step_denom);
+
+   mix_float_blocks(spl, *vbuf, *samples, dest_maxc,
+      render_sinc_block, sinc_spl32, spl->sinc_taps / 2);
+   (void)buffer_depth;
+}
+
+#undef ADVANCE_POSITION
+
+
+/* Worker threads shared by all mixers which render their attached mixers
+ * in parallel.  Created on first use.
+ */
+static ALLEGRO_THREAD_POOL *mixer_pool = NULL;
+static _AL_MUTEX mixer_pool_mutex = _AL_MUTEX_UNINITED;
+static bool mixer_pool_mutex_inited = false;
+
+
+static bool render_mixer(ALLEGRO_MIXER *m, unsigned int *samples);
+
+
+/* add_mixer_to_buffer:
+ *  Add a rendered mixer's buffer to its parent's buffer.
+ *  Currently we only support mixers of the same audio depth doing this.
+ */
+static void add_mixer_to_buffer(const ALLEGRO_MIXER *mixer, void *buf,
+   int samples_l)
+{
+   switch (mixer->ss.spl_data.depth) {
+      case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
+         /* We don't need to clamp in the mixer yet. */
+         float *lbuf = buf;
+         float *src = mixer->ss.spl_data.buffer.f32;
+         while (samples_l-- > 0) {
+            *lbuf += *src;
+            lbuf++;
+            src++;
+         }
+         break;
+      }
+
+      case ALLEGRO_AUDIO_DEPTH_INT16: {
+         int16_t *lbuf = buf;
+         int16_t *src = mixer->ss.spl_data.buffer.s16;
+         while (samples_l-- > 0) {
+            int32_t x = *lbuf + *src;
+            if (x < -32768)
+               x = -32768;
+            else if (x > 32767)
+               x = 32767;
+            *lbuf = (int16_t)x;
+            lbuf++;
+            src++;
+         }
+         break;
+      }
+
+      case ALLEGRO_AUDIO_DEPTH_INT8:
+      case ALLEGRO_AUDIO_DEPTH_INT24:
+      case ALLEGRO_AUDIO_DEPTH_UINT8:
+      case ALLEGRO_AUDIO_DEPTH_UINT16:
+      case ALLEGRO_AUDIO_DEPTH_UINT24:
+         /* Unsupported mixer depths. */
+         ASSERT(false);
+         break;
+   }
+}
+
+
+/* read_frames:
+ *  Mix frames [from, to) of the mixer's buffer from one attached stream.
+ */
+static void read_frames(ALLEGRO_MIXER *m, ALLEGRO_SAMPLE_INSTANCE *spl,
+   unsigned int from, unsigned int to, int maxc)
+{
+   char *buf = (char *)m->ss.spl_data.buffer.ptr +
+      from * maxc * al_get_audio_depth_size(m->ss.spl_data.depth);
+   unsigned int n = to - from;
+
+   if (n > 0)
+      spl->spl_read(spl, (void **) &buf, &n, m->ss.spl_data.depth, maxc);
+}
+
+
+/* read_stream:
+ *  Mix one attached stream into the mixer's buffer.  Sample instances start
+ *  and stop at the frames they were scheduled for, even in the middle of
+ *  the buffer.  Frames already past take effect at its start.
+ */
+static void read_stream(ALLEGRO_MIXER *m, ALLEGRO_SAMPLE_INSTANCE *spl,
+   unsigned int *samples, int maxc)
+{
+   const uint64_t clock = m->frame_clock;
+   const uint64_t end = clock + *samples;
+   unsigned int done = 0;
+
+   ASSERT(spl->spl_read);
+
+   if (!spl->play_scheduled && !spl->stop_scheduled) {
+      spl->spl_read(spl, (void **) &m->ss.spl_data.buffer.ptr, samples,
+         m->ss.spl_data.depth, maxc);
+      return;
+   }
+
+   for (;;) {
+      bool play = spl->play_scheduled && spl->play_frame < end;
+      bool stop = spl->stop_scheduled && spl->stop_frame < end;
+      uint64_t frame;
+      unsigned int at;
+
+      /* Take the earlier change first.  Stopping goes last in a tie. */
+      if (play && stop) {
+         if (spl->stop_frame < spl->play_frame)
+            play = false;
+         else
+            stop = false;
+      }
+      if (!play && !stop)
+         break;
+
+      frame = play ? spl->play_frame : spl->stop_frame;
+      at = (frame > clock) ? (unsigned int)(frame - clock) : 0;
+      read_frames(m, spl, done, at, maxc);
+      done = at;
+
+      if (play) {
+         spl->play_scheduled = false;
+         spl->is_playing = true;
+      }
+      else {
+         spl->stop_scheduled = false;
+         spl->is_playing = false;
+         spl->pos = 0;
+      }
+   }
+
+   read_frames(m, spl, done, *samples, maxc);
+}
+
 
-#undef MAKE_MIXER
+/* render_mixer_task:
+ *  Thread pool task rendering an attached mixer into its own buffer.
+ */
+static void render_mixer_task(void *arg)
+{
+   ALLEGRO_MIXER *mixer = arg;
 
+   mixer->rendered = render_mixer(mixer, &mixer->render_samples);
+}
 
-/* _al_kcm_mixer_read:
- *  Mixes the streams attached to the mixer and writes additively to the
- *  specified buffer (or if *buf is NULL, indicating a voice, convert it and
- *  set it to the buffer pointer).
+
+/* mix_streams_parallel:
+ *  Mix the streams attached to the mixer, rendering attached mixers on the
+ *  mixer thread pool while this thread mixes everything else.
  */
-void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
-   ALLEGRO_AUDIO_DEPTH buffer_depth, size_t dest_maxc)
+static void mix_streams_parallel(ALLEGRO_MIXER *m, unsigned int *samples,
+   int maxc)
+{
+   int i;
+
+   for (i = _al_vector_size(&m->streams) - 1; i >= 0; i--) {
+      ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&m->streams, i);
+      ALLEGRO_MIXER *child = (ALLEGRO_MIXER *)*slot;
+
+      if (!child->ss.is_mixer)
+         continue;
+      child->rendered = false;
+      if (!child->ss.is_playing)
+         continue;
+      child->render_samples = *samples;
+      if (!al_submit_task(mixer_pool, m->task_group, render_mixer_task, child))
+         render_mixer_task(child);
+   }
+
+   for (i = _al_vector_size(&m->streams) - 1; i >= 0; i--) {
+      ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&m->streams, i);
+      ALLEGRO_SAMPLE_INSTANCE *spl = *slot;
+      if (!spl->is_mixer)
+         read_stream(m, spl, samples, maxc);
+   }
+
+   /* The calling thread helps out with any renders still queued. */
+   al_wait_for_task_group(m->task_group);
+
+   /* Sum in a fixed order, so the result doesn't depend on which render
+    * finished first.
+    */
+   for (i = _al_vector_size(&m->streams) - 1; i >= 0; i--) {
+      ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&m->streams, i);
+      ALLEGRO_MIXER *child = (ALLEGRO_MIXER *)*slot;
+      if (child->ss.is_mixer && child->rendered) {
+         add_mixer_to_buffer(child, m->ss.spl_data.buffer.ptr,
+            *samples * al_get_channel_count(child->ss.spl_data.chan_conf));
+      }
+   }
+}
+
+
+/* render_mixer_buffer:
+ *  Mix the streams attached to the mixer into its own buffer and apply the
+ *  DSP nodes, post-processing callback and gain.  Returns false if there is
+ *  nothing to use.
+ */
+static bool render_mixer_buffer(ALLEGRO_MIXER *m, unsigned int *samples)
 {
    const ALLEGRO_MIXER *mixer;
-   ALLEGRO_MIXER *m = (ALLEGRO_MIXER *)source;
    int maxc = al_get_channel_count(m->ss.spl_data.chan_conf);
    int samples_l = *samples;
    int i;
 
-   if (!m->ss.is_playing)
-      return;
-
    /* Make sure the mixer buffer is big enough. */
    if (m->ss.spl_data.len*maxc < samples_l*maxc) {
       al_free(m->ss.spl_data.buffer.ptr);
@@ -370,7 +1407,7 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
          _al_set_error(ALLEGRO_GENERIC_ERROR,
             "Out of memory allocating mixer buffer");
          m->ss.spl_data.len = 0;
-         return;
+         return false;
       }
       m->ss.spl_data.len = samples_l;
    }
@@ -381,14 +1418,18 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
    memset(mixer->ss.spl_data.buffer.ptr, 0, samples_l * maxc * al_get_audio_depth_size(mixer->ss.spl_data.depth));
 
    /* Mix the streams into the mixer buffer. */
-   for (i = _al_vector_size(&mixer->streams) - 1; i >= 0; i--) {
-      ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&mixer->streams, i);
-      ALLEGRO_SAMPLE_INSTANCE *spl = *slot;
-      ASSERT(spl->spl_read);
-      spl->spl_read(spl, (void **) &mixer->ss.spl_data.buffer.ptr, samples,
-         m->ss.spl_data.depth, maxc);
+   if (m->task_group) {
+      mix_streams_parallel(m, samples, maxc);
+   }
+   else {
+      for (i = _al_vector_size(&mixer->streams) - 1; i >= 0; i--) {
+         ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&mixer->streams, i);
+         read_stream(m, *slot, samples, maxc);
+      }
    }
 
+   _al_kcm_mixer_run_dsp(m, *samples);
+
    /* Call the post-processing callback. */
    if (mixer->postprocess_callback) {
       mixer->postprocess_callback(mixer->ss.spl_data.buffer.ptr,
@@ -430,48 +1471,56 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
       }
    }
 
-   /* Feeding to a non-voice.
-    * Currently we only support mixers of the same audio depth doing this.
-    */
-   if (*buf) {
-      switch (m->ss.spl_data.depth) {
-         case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
-            /* We don't need to clamp in the mixer yet. */
-            float *lbuf = *buf;
-            float *src = mixer->ss.spl_data.buffer.f32;
-            while (samples_l-- > 0) {
-               *lbuf += *src;
-               lbuf++;
-               src++;
-            }
-            break;
+   return true;
+}
 
-         case ALLEGRO_AUDIO_DEPTH_INT16: {
-            int16_t *lbuf = *buf;
-            int16_t *src = mixer->ss.spl_data.buffer.s16;
-            while (samples_l-- > 0) {
-               int32_t x = *lbuf + *src;
-               if (x < -32768)
-                  x = -32768;
-               else if (x > 32767)
-                  x = 32767;
-               *lbuf = (int16_t)x;
-               lbuf++;
-               src++;
-            }
-            break;
-         }
 
-         case ALLEGRO_AUDIO_DEPTH_INT8:
-         case ALLEGRO_AUDIO_DEPTH_INT24:
-         case ALLEGRO_AUDIO_DEPTH_UINT8:
-         case ALLEGRO_AUDIO_DEPTH_UINT16:
-         case ALLEGRO_AUDIO_DEPTH_UINT24:
-            /* Unsupported mixer depths. */
-            ASSERT(false);
-            break;
-         }
-      }
+/* render_mixer:
+ *  Render the mixer's buffer, keeping track of the time it takes, and
+ *  advance its clock.
+ */
+static bool render_mixer(ALLEGRO_MIXER *m, unsigned int *samples)
+{
+   const double t0 = al_get_time();
+   bool ret = render_mixer_buffer(m, samples);
+   const double t = al_get_time() - t0;
+
+   m->frame_clock += *samples;
+
+   m->stats.renders++;
+   m->stats.frames += *samples;
+   m->stats.render_time += t;
+   if (t > m->stats.max_render_time)
+      m->stats.max_render_time = t;
+
+   return ret;
+}
+
+
+/* _al_kcm_mixer_read:
+ *  Mixes the streams attached to the mixer and writes additively to the
+ *  specified buffer (or if *buf is NULL, indicating a voice, convert it and
+ *  set it to the buffer pointer).
+ */
+void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
+   ALLEGRO_AUDIO_DEPTH buffer_depth, size_t dest_maxc)
+{
+   const ALLEGRO_MIXER *mixer;
+   ALLEGRO_MIXER *m = (ALLEGRO_MIXER *)source;
+   int maxc = al_get_channel_count(m->ss.spl_data.chan_conf);
+   int samples_l = *samples * maxc;
+
+   if (!m->ss.is_playing)
+      return;
+
+   if (!render_mixer(m, samples))
+      return;
+
+   mixer = m;
+
+   /* Feeding to a non-voice. */
+   if (*buf) {
+      add_mixer_to_buffer(mixer, *buf, samples_l);
       return;
    }
 
@@ -479,123 +1528,40 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
     * Clamp and convert the mixed data for the voice.
     */
    *buf = mixer->ss.spl_data.buffer.ptr;
-   switch (buffer_depth & ~ALLEGRO_AUDIO_DEPTH_UNSIGNED) {
+   switch (mixer->ss.spl_data.depth) {
 
       case ALLEGRO_AUDIO_DEPTH_FLOAT32:
-         /* Do we need to clamp? */
-         break;
-
-      case ALLEGRO_AUDIO_DEPTH_INT24:
-         switch (mixer->ss.spl_data.depth) {
-            case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
-               int32_t off = ((buffer_depth & ALLEGRO_AUDIO_DEPTH_UNSIGNED)
-                              ? 0x800000 : 0);
-               int32_t *lbuf = mixer->ss.spl_data.buffer.s24;
-               float *src = mixer->ss.spl_data.buffer.f32;
-
-               while (samples_l > 0) {
-                  *lbuf = clamp(*(src++) * ((float)0x7FFFFF + 0.5f),
-                     ~0x7FFFFF, 0x7FFFFF);
-                  *lbuf += off;
-                  lbuf++;
-                  samples_l--;
-               }
-               break;
-            }
-
-            case ALLEGRO_AUDIO_DEPTH_INT16:
-               /* XXX not yet implemented */
-               ASSERT(false);
-               break;
-
-            case ALLEGRO_AUDIO_DEPTH_INT8:
-            case ALLEGRO_AUDIO_DEPTH_INT24:
-            case ALLEGRO_AUDIO_DEPTH_UINT8:
-            case ALLEGRO_AUDIO_DEPTH_UINT16:
-            case ALLEGRO_AUDIO_DEPTH_UINT24:
-               /* Unsupported mixer depths. */
-               ASSERT(false);
-               break;
+         if (buffer_depth != ALLEGRO_AUDIO_DEPTH_FLOAT32) {
+            _al_kcm_convert_from_float(m->ss.spl_data.buffer.ptr,
+               buffer_depth, m->ss.spl_data.buffer.f32, samples_l,
+               m->dither ? &m->dither_state : NULL);
          }
          break;
 
       case ALLEGRO_AUDIO_DEPTH_INT16:
-         switch (mixer->ss.spl_data.depth) {
-            case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
-               int16_t off = ((buffer_depth & ALLEGRO_AUDIO_DEPTH_UNSIGNED)
-                              ? 0x8000 : 0);
-               int16_t *lbuf = mixer->ss.spl_data.buffer.s16;
-               float *src = mixer->ss.spl_data.buffer.f32;
-
-               while (samples_l > 0) {
-                  *lbuf = clamp(*(src++) * ((float)0x7FFF + 0.5f), ~0x7FFF, 0x7FFF);
-                  *lbuf += off;
-                  lbuf++;
-                  samples_l--;
-               }
-               break;
-            }
-
+         switch (buffer_depth) {
             case ALLEGRO_AUDIO_DEPTH_INT16:
-               /* Handle signedness differences. */
-               if (buffer_depth != ALLEGRO_AUDIO_DEPTH_INT16) {
-                  int16_t *lbuf = mixer->ss.spl_data.buffer.s16;
-                  while (samples_l > 0) {
-                     *lbuf++ ^= 0x8000;
-                     samples_l--;
-                  }
-               }
-               break;
-
-            case ALLEGRO_AUDIO_DEPTH_INT8:
-            case ALLEGRO_AUDIO_DEPTH_INT24:
-            case ALLEGRO_AUDIO_DEPTH_UINT8:
-            case ALLEGRO_AUDIO_DEPTH_UINT16:
-            case ALLEGRO_AUDIO_DEPTH_UINT24:
-               /* Unsupported mixer depths. */
-               ASSERT(false);
                break;
-         }
-         break;
-
-      /* Ugh, do we really want to support 8-bit output? */
-      case ALLEGRO_AUDIO_DEPTH_INT8:
-         switch (mixer->ss.spl_data.depth) {
-            case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
-               int8_t off = ((buffer_depth & ALLEGRO_AUDIO_DEPTH_UNSIGNED)
-                              ? 0x80 : 0);
-               int8_t *lbuf = mixer->ss.spl_data.buffer.s8;
-               float *src = mixer->ss.spl_data.buffer.f32;
 
+            case ALLEGRO_AUDIO_DEPTH_UINT16: {
+               /* Handle signedness differences. */
+               int16_t *lbuf = mixer->ss.spl_data.buffer.s16;
                while (samples_l > 0) {
-                  *lbuf = clamp(*(src++) * ((float)0x7F + 0.5f), ~0x7F, 0x7F);
-                  *lbuf += off;
-                  lbuf++;
+                  *lbuf++ ^= 0x8000;
                   samples_l--;
                }
                break;
             }
 
-            case ALLEGRO_AUDIO_DEPTH_INT16:
+            default:
                /* XXX not yet implemented */
                ASSERT(false);
                break;
-
-            case ALLEGRO_AUDIO_DEPTH_INT8:
-            case ALLEGRO_AUDIO_DEPTH_INT24:
-            case ALLEGRO_AUDIO_DEPTH_UINT8:
-            case ALLEGRO_AUDIO_DEPTH_UINT16:
-            case ALLEGRO_AUDIO_DEPTH_UINT24:
-               /* Unsupported mixer depths. */
-               ASSERT(false);
-               break;
          }
          break;
 
-      case ALLEGRO_AUDIO_DEPTH_UINT8:
-      case ALLEGRO_AUDIO_DEPTH_UINT16:
-      case ALLEGRO_AUDIO_DEPTH_UINT24:
-         /* Impossible. */
+      default:
+         /* Unsupported mixer depths. */
          ASSERT(false);
          break;
    }
@@ -631,6 +1597,10 @@ ALLEGRO_MIXER *al_create_mixer(unsigned int freq,
             ALLEGRO_INFO("Cubic interpolation\n");
             default_mixer_quality = ALLEGRO_MIXER_QUALITY_CUBIC;
          }
+         else if (!_al_stricmp(p, "sinc")) {
+            ALLEGRO_INFO("Sinc interpolation\n");
+            default_mixer_quality = ALLEGRO_MIXER_QUALITY_SINC;
+         }
       }
    }
 
@@ -666,11 +1636,21 @@ ALLEGRO_MIXER *al_create_mixer(unsigned int freq,
    mixer->ss.is_mixer = true;
    mixer->ss.spl_read = NULL;
 
+   if (default_mixer_quality == ALLEGRO_MIXER_QUALITY_SINC &&
+         !_al_kcm_init_sinc_filters()) {
+      ALLEGRO_WARN("Falling back to linear interpolation\n");
+      default_mixer_quality = ALLEGRO_MIXER_QUALITY_LINEAR;
+   }
    mixer->quality = default_mixer_quality;
 
    _al_vector_init(&mixer->streams, sizeof(ALLEGRO_SAMPLE_INSTANCE *));
+   _al_vector_init(&mixer->dsp_nodes, sizeof(ALLEGRO_DSP_NODE *));
 
-   _al_kcm_register_destructor(mixer, (void (*)(void *)) al_destroy_mixer);
+   mixer->dither = _al_kcm_get_dither_config();
+   _al_kcm_init_dither(&mixer->dither_state);
+
+   mixer->ss.dtor_item = _al_kcm_register_destructor(mixer,
+      (void (*)(void *)) al_destroy_mixer);
 
    return mixer;
 }
@@ -681,7 +1661,7 @@ ALLEGRO_MIXER *al_create_mixer(unsigned int freq,
 void al_destroy_mixer(ALLEGRO_MIXER *mixer)
 {
    if (mixer) {
-      _al_kcm_unregister_destructor(mixer);
+      _al_kcm_unregister_destructor(mixer->ss.dtor_item);
       _al_kcm_destroy_sample(&mixer->ss, false);
    }
 }
@@ -748,6 +1728,9 @@ bool al_attach_sample_instance_to_mixer(ALLEGRO_SAMPLE_INSTANCE *spl,
                case ALLEGRO_MIXER_QUALITY_CUBIC:
                   spl->spl_read = read_to_mixer_cubic_float_32;
                   break;
+               case ALLEGRO_MIXER_QUALITY_SINC:
+                  spl->spl_read = read_to_mixer_sinc_float_32;
+                  break;
             }
             break;
 
@@ -757,6 +1740,7 @@ bool al_attach_sample_instance_to_mixer(ALLEGRO_SAMPLE_INSTANCE *spl,
                   spl->spl_read = read_to_mixer_point_int16_t_16;
                   break;
                case ALLEGRO_MIXER_QUALITY_CUBIC:
+               case ALLEGRO_MIXER_QUALITY_SINC:
                   ALLEGRO_WARN("Falling back to linear interpolation\n");
                   /* fallthrough */
                case ALLEGRO_MIXER_QUALITY_LINEAR:
@@ -943,6 +1927,12 @@ bool al_set_mixer_quality(ALLEGRO_MIXER *mixer, ALLEGRO_MIXER_QUALITY new_qualit
    if (mixer->quality == new_quality) {
       ret = true;
    }
+   else if (new_quality == ALLEGRO_MIXER_QUALITY_SINC &&
+         !_al_kcm_init_sinc_filters()) {
+      _al_set_error(ALLEGRO_GENERIC_ERROR,
+         "Out of memory allocating the sinc filters");
+      ret = false;
+   }
    else if (_al_vector_size(&mixer->streams) == 0) {
       mixer->quality = new_quality;
       ret = true;
@@ -1006,4 +1996,193 @@ bool al_detach_mixer(ALLEGRO_MIXER *mixer)
 }
 
 
+/* get_mixer_pool:
+ *  Return the mixer thread pool, creating it if necessary.  Its size is
+ *  taken from the mixer_threads configuration key, or the number of CPUs.
+ */
+static ALLEGRO_THREAD_POOL *get_mixer_pool(void)
+{
+   ALLEGRO_THREAD_POOL *pool;
+
+   _al_mutex_lock(&mixer_pool_mutex);
+
+   if (!mixer_pool) {
+      ALLEGRO_CONFIG *config = al_get_system_config();
+      int num_threads = 0;
+
+      if (config) {
+         const char *p = al_get_config_value(config, "audio", "mixer_threads");
+         if (p && p[0] != '\0')
+            num_threads = atoi(p);
+      }
+
+      /* The mixers using the pool are destroyed by al_uninstall_audio,
+       * after the system has destroyed ordinary thread pools.
+       */
+      mixer_pool = _al_create_internal_thread_pool(num_threads);
+   }
+
+   pool = mixer_pool;
+   _al_mutex_unlock(&mixer_pool_mutex);
+
+   return pool;
+}
+
+
+/* _al_kcm_init_mixer_pool:
+ *  Called by al_install_audio, so that mixers in different threads can be
+ *  made parallel at the same time.
+ */
+void _al_kcm_init_mixer_pool(void)
+{
+   if (!mixer_pool_mutex_inited) {
+      _al_mutex_init(&mixer_pool_mutex);
+      mixer_pool_mutex_inited = true;
+   }
+}
+
+
+/* _al_kcm_shutdown_mixer_pool:
+ *  Stop the mixer worker threads.  No mixer may be using them any more.
+ */
+void _al_kcm_shutdown_mixer_pool(void)
+{
+   if (mixer_pool) {
+      al_destroy_thread_pool(mixer_pool);
+      mixer_pool = NULL;
+   }
+
+   if (mixer_pool_mutex_inited) {
+      _al_mutex_destroy(&mixer_pool_mutex);
+      mixer_pool_mutex_inited = false;
+   }
+}
+
+
+/* Function: al_set_mixer_parallel
+ */
+bool al_set_mixer_parallel(ALLEGRO_MIXER *mixer, bool val)
+{
+   ALLEGRO_TASK_GROUP *group = NULL;
+   ALLEGRO_TASK_GROUP *old_group;
+
+   ASSERT(mixer);
+
+   if (val) {
+      if (mixer->task_group)
+         return true;
+
+      if (!get_mixer_pool()) {
+         _al_set_error(ALLEGRO_GENERIC_ERROR,
+            "Unable to create the mixer thread pool");
+         return false;
+      }
+
+      group = al_create_task_group(mixer_pool);
+      if (!group) {
+         _al_set_error(ALLEGRO_GENERIC_ERROR,
+            "Out of memory allocating mixer task group");
+         return false;
+      }
+   }
+
+   /* The group is only used while the mixer is being read, which happens
+    * with this mutex held.
+    */
+   maybe_lock_mutex(mixer->ss.mutex);
+   old_group = mixer->task_group;
+   mixer->task_group = group;
+   maybe_unlock_mutex(mixer->ss.mutex);
+
+   if (old_group)
+      al_destroy_task_group(old_group);
+
+   return true;
+}
+
+
+/* Function: al_get_mixer_parallel
+ */
+bool al_get_mixer_parallel(const ALLEGRO_MIXER *mixer)
+{
+   ASSERT(mixer);
+
+   return mixer->task_group != NULL;
+}
+
+
+/* Function: al_get_mixer_frame_clock
+ */
+uint64_t al_get_mixer_frame_clock(const ALLEGRO_MIXER *mixer)
+{
+   uint64_t clock;
+
+   ASSERT(mixer);
+
+   maybe_lock_mutex(mixer->ss.mutex);
+   clock = mixer->frame_clock;
+   maybe_unlock_mutex(mixer->ss.mutex);
+
+   return clock;
+}
+
+
+static void get_mixer_stats(const ALLEGRO_MIXER *mixer,
+   ALLEGRO_MIXER_STATS *stats)
+{
+   *stats = mixer->stats;
+   stats->load = 0.0;
+   if (stats->frames > 0) {
+      stats->load = stats->render_time * mixer->ss.spl_data.frequency /
+         stats->frames;
+   }
+}
+
+
+/* Function: al_get_mixer_stats
+ */
+void al_get_mixer_stats(const ALLEGRO_MIXER *mixer, ALLEGRO_MIXER_STATS *stats)
+{
+   ASSERT(mixer);
+   ASSERT(stats);
+
+   maybe_lock_mutex(mixer->ss.mutex);
+   get_mixer_stats(mixer, stats);
+   maybe_unlock_mutex(mixer->ss.mutex);
+}
+
+
+/* Function: al_reset_mixer_stats
+ */
+void al_reset_mixer_stats(ALLEGRO_MIXER *mixer)
+{
+   ASSERT(mixer);
+
+   maybe_lock_mutex(mixer->ss.mutex);
+   memset(&mixer->stats, 0, sizeof(mixer->stats));
+   maybe_unlock_mutex(mixer->ss.mutex);
+}
+
+
+/* _al_kcm_log_mixer_stats:
+ *  Log the statistics of a mixer and of everything attached to it.  The
+ *  caller must hold the mixer's mutex.
+ */
+void _al_kcm_log_mixer_stats(ALLEGRO_MIXER *mixer, int indent)
+{
+   ALLEGRO_MIXER_STATS stats;
+   unsigned int i;
+
+   get_mixer_stats(mixer, &stats);
+   ALLEGRO_INFO("%*smixer %p: %.1f%% load, %.3f ms max render, "
+      "%lu renders\n", indent, "", (void *)mixer, stats.load * 100.0,
+      stats.max_render_time * 1000.0, (unsigned long)stats.renders);
+
+   for (i = 0; i < _al_vector_size(&mixer->streams); i++) {
+      ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&mixer->streams, i);
+      _al_kcm_log_instance_stats(*slot, indent + 2);
+   }
+}
+
+
 /* vim: set sts=3 sw=3 et: */
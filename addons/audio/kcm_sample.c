@@ -18,6 +18,8 @@
 /* Title: Sample audio interface
  */
 
+#include <math.h>
+
 #include "allegro5/allegro.h"
 #include "allegro5/allegro_audio.h"
 #include "allegro5/internal/aintern.h"
@@ -31,14 +33,49 @@ static ALLEGRO_VOICE *allegro_voice = NULL;
 static ALLEGRO_MIXER *allegro_mixer = NULL;
 static ALLEGRO_MIXER *default_mixer = NULL;
 
+/* The depth of default_mixer, or -1 if there is none.  Decoders may ask for
+ * it from other threads while the main thread replaces or destroys the
+ * mixer, so it is published separately instead of being read through the
+ * mixer pointer.
+ */
+static volatile _AL_ATOMIC default_mixer_depth = -1;
+
+/* Bookkeeping for each of the reserved sample instances.  Idle slots are
+ * chained in a free list.  Busy slots sit in two heaps: one ordered by when
+ * they are expected to finish, so that finished slots can be reclaimed
+ * without scanning, and one ordered by importance, so that the least
+ * important sound can be stolen.
+ */
+typedef struct AUTO_SLOT {
+   int id;
+   int priority;
+   float distance;
+   double end_time;
+   int next_free;
+   int heap_pos[2];
+} AUTO_SLOT;
+
+enum {
+   FINISH_HEAP = 0,
+   STEAL_HEAP  = 1
+};
+
 static _AL_VECTOR auto_samples = _AL_VECTOR_INITIALIZER(ALLEGRO_SAMPLE_INSTANCE *);
-static _AL_VECTOR auto_sample_ids = _AL_VECTOR_INITIALIZER(int);
+static _AL_VECTOR auto_slots = _AL_VECTOR_INITIALIZER(AUTO_SLOT);
+static _AL_VECTOR slot_heaps[2] = {
+   _AL_VECTOR_INITIALIZER(int),
+   _AL_VECTOR_INITIALIZER(int)
+};
+static int first_free_slot = -1;
+static int next_id = 0;
 
 
 static bool create_default_mixer(void);
 static bool do_play_sample(ALLEGRO_SAMPLE_INSTANCE *spl, ALLEGRO_SAMPLE *data,
       float gain, float pan, float speed, ALLEGRO_PLAYMODE loop);
 static void free_sample_vector(void);
+static void reset_slots(void);
+static void release_stopped_slots(void);
 
 
 static int string_to_depth(const char *s)
@@ -152,12 +189,134 @@ ALLEGRO_SAMPLE *al_create_sample(void *buf, unsigned int samples,
    spl->buffer.ptr = buf;
    spl->free_buf = free_buf;
 
-   _al_kcm_register_destructor(spl, (void (*)(void *)) al_destroy_sample);
+   spl->dtor_item = _al_kcm_register_destructor(spl,
+      (void (*)(void *)) al_destroy_sample);
+
+   return spl;
+}
+
+
+/* _al_kcm_create_paged_sample:
+ *  Create a sample with no data.  The pager makes the data resident when
+ *  the sample is about to be played, and its owner may free it again when
+ *  _al_kcm_sample_in_use says nothing refers to it.
+ */
+ALLEGRO_SAMPLE *_al_kcm_create_paged_sample(const _AL_SAMPLE_PAGER *pager,
+   void *pager_data)
+{
+   ALLEGRO_SAMPLE *spl;
+
+   ASSERT(pager);
+
+   spl = al_calloc(1, sizeof(*spl));
+   if (!spl) {
+      _al_set_error(ALLEGRO_GENERIC_ERROR,
+         "Out of memory allocating sample data object");
+      return NULL;
+   }
+
+   spl->pager = pager;
+   spl->pager_data = pager_data;
+
+   spl->dtor_item = _al_kcm_register_destructor(spl,
+      (void (*)(void *)) al_destroy_sample);
 
    return spl;
 }
 
 
+/* _al_kcm_page_in_sample:
+ *  Make sure the sample's data is resident before an instance copies it.
+ */
+bool _al_kcm_page_in_sample(ALLEGRO_SAMPLE *spl)
+{
+   ASSERT(spl);
+
+   if (!spl->pager)
+      return true;
+   return spl->pager->page_in(spl);
+}
+
+
+typedef struct SAMPLE_USERS {
+   void *buffer;
+   int count;
+} SAMPLE_USERS;
+
+
+static void count_sample_users(void *object, void (*func)(void *),
+   void *userdata)
+{
+   ALLEGRO_SAMPLE_INSTANCE *splinst = object;
+   SAMPLE_USERS *users = userdata;
+
+   if (func == (void (*)(void *)) al_destroy_sample_instance
+         && splinst->spl_data.buffer.ptr == users->buffer) {
+      users->count++;
+   }
+}
+
+
+/* _al_kcm_sample_in_use:
+ *  Return whether any sample instance refers to the sample's data, so that
+ *  it can't be freed.  Idle instances of al_play_sample are made to forget
+ *  the data instead, as they are always given a sample again before they
+ *  play.
+ */
+bool _al_kcm_sample_in_use(ALLEGRO_SAMPLE *spl)
+{
+   SAMPLE_USERS users;
+   unsigned int i;
+
+   ASSERT(spl);
+
+   if (!spl->buffer.ptr)
+      return false;
+
+   for (i = 0; i < _al_vector_size(&auto_samples); i++) {
+      ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&auto_samples, i);
+      ALLEGRO_SAMPLE_INSTANCE *splinst = *slot;
+      if (splinst->spl_data.buffer.ptr == spl->buffer.ptr &&
+            !al_get_sample_instance_playing(splinst)) {
+         splinst->spl_data.buffer.ptr = NULL;
+      }
+   }
+   release_stopped_slots();
+
+   users.buffer = spl->buffer.ptr;
+   users.count = 0;
+   _al_kcm_foreach_destructor(count_sample_users, &users);
+
+   return users.count > 0;
+}
+
+
+/* _al_kcm_move_sample_data:
+ *  Move the format and data of `src' to `dest', and free `src'.  Unlike
+ *  al_destroy_sample this doesn't look at any instances, so it may be used
+ *  from any thread, but no instance may refer to `src'.
+ */
+void _al_kcm_move_sample_data(ALLEGRO_SAMPLE *dest, ALLEGRO_SAMPLE *src)
+{
+   ASSERT(dest);
+   ASSERT(src);
+   ASSERT(!src->pager);
+
+   _al_kcm_unregister_destructor(src->dtor_item);
+
+   dest->depth = src->depth;
+   dest->chan_conf = src->chan_conf;
+   dest->frequency = src->frequency;
+   dest->len = src->len;
+   dest->buffer = src->buffer;
+   dest->free_buf = src->free_buf;
+   dest->mapping = src->mapping;
+   dest->mapping_size = src->mapping_size;
+
+   al_free(src);
+}
+
+
 /* Stop any sample instances which are still playing a sample buffer which
  * is about to be destroyed.
  */
@@ -183,11 +342,16 @@ void al_destroy_sample(ALLEGRO_SAMPLE *spl)
    if (spl) {
       _al_kcm_foreach_destructor(stop_sample_instances_helper,
          al_get_sample_data(spl));
-      _al_kcm_unregister_destructor(spl);
+      release_stopped_slots();
+      _al_kcm_unregister_destructor(spl->dtor_item);
 
+      if (spl->pager) {
+         spl->pager->destroy(spl);
+      }
       if (spl->free_buf && spl->buffer.ptr) {
          al_free(spl->buffer.ptr);
       }
+      _al_kcm_unmap_sample(spl);
       spl->buffer.ptr = NULL;
       spl->free_buf = false;
       al_free(spl);
@@ -217,8 +381,8 @@ bool al_reserve_samples(int reserve_samples)
       /* We need to reserve more samples than currently are reserved. */
       for (i = 0; i < reserve_samples - current_samples_count; i++) {
          ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_alloc_back(&auto_samples);
-         int *id = _al_vector_alloc_back(&auto_sample_ids);
-         *id = 0;
+         AUTO_SLOT *info = _al_vector_alloc_back(&auto_slots);
+         info->id = 0;
          *slot = al_create_sample_instance(NULL);
          if (!*slot) {
             ALLEGRO_ERROR("al_create_sample failed\n");
@@ -233,11 +397,15 @@ bool al_reserve_samples(int reserve_samples)
    else if (current_samples_count > reserve_samples) {
       /* We need to reserve fewer samples than currently are reserved. */
       while (current_samples_count-- > reserve_samples) {
+         ALLEGRO_SAMPLE_INSTANCE **slot =
+            _al_vector_ref(&auto_samples, current_samples_count);
+         al_destroy_sample_instance(*slot);
          _al_vector_delete_at(&auto_samples, current_samples_count);
-         _al_vector_delete_at(&auto_sample_ids, current_samples_count);
+         _al_vector_delete_at(&auto_slots, current_samples_count);
       }
    }
 
+   reset_slots();
    return true;
 
  Error:
@@ -247,6 +415,14 @@ bool al_reserve_samples(int reserve_samples)
 }
 
 
+static void set_default_mixer(ALLEGRO_MIXER *mixer)
+{
+   default_mixer = mixer;
+   _al_atomic_store_release(&default_mixer_depth,
+      mixer ? (_AL_ATOMIC)al_get_mixer_depth(mixer) : -1);
+}
+
+
 /* Function: al_get_default_mixer
  */
 ALLEGRO_MIXER *al_get_default_mixer(void)
@@ -264,15 +440,15 @@ bool al_set_default_mixer(ALLEGRO_MIXER *mixer)
    if (mixer != default_mixer) {
       int i;
 
-      default_mixer = mixer;
+      set_default_mixer(mixer);
 
       /* Destroy all current sample instances, recreate them, and
        * attach them to the new mixer */
       for (i = 0; i < (int) _al_vector_size(&auto_samples); i++) {
          ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&auto_samples, i);
-         int *id = _al_vector_ref(&auto_sample_ids, i);
+         AUTO_SLOT *info = _al_vector_ref(&auto_slots, i);
 
-         *id = 0;
+         info->id = 0;
          al_destroy_sample_instance(*slot);
 
          *slot = al_create_sample_instance(NULL);
@@ -285,13 +461,14 @@ bool al_set_default_mixer(ALLEGRO_MIXER *mixer)
             goto Error;
          }
       }      
+      reset_slots();
    }
 
    return true;
 
 Error:
    free_sample_vector();
-   default_mixer = NULL;   
+   set_default_mixer(NULL);
    return false;
 }
 
@@ -310,14 +487,247 @@ bool al_restore_default_mixer(void)
 }
 
 
-/* Function: al_play_sample
+static AUTO_SLOT *slot_ref(int i)
+{
+   return _al_vector_ref(&auto_slots, i);
+}
+
+
+/* Whether the sound in slot a should give way before the one in slot b:
+ * lower priority first, then further away, then older.
  */
-bool al_play_sample(ALLEGRO_SAMPLE *spl, float gain, float pan, float speed,
-   ALLEGRO_PLAYMODE loop, ALLEGRO_SAMPLE_ID *ret_id)
+static bool less_important(const AUTO_SLOT *a, const AUTO_SLOT *b)
+{
+   if (a->priority != b->priority)
+      return a->priority < b->priority;
+   if (a->distance != b->distance)
+      return a->distance > b->distance;
+   return a->id < b->id;
+}
+
+
+static bool heap_before(int heap, int a, int b)
+{
+   const AUTO_SLOT *sa = slot_ref(a);
+   const AUTO_SLOT *sb = slot_ref(b);
+
+   if (heap == FINISH_HEAP)
+      return sa->end_time < sb->end_time;
+   return less_important(sa, sb);
+}
+
+
+static void heap_set(int heap, int pos, int i)
+{
+   *(int *)_al_vector_ref(&slot_heaps[heap], pos) = i;
+   slot_ref(i)->heap_pos[heap] = pos;
+}
+
+
+static int heap_get(int heap, int pos)
+{
+   return *(int *)_al_vector_ref(&slot_heaps[heap], pos);
+}
+
+
+static void heap_sift(int heap, int pos)
+{
+   const int size = _al_vector_size(&slot_heaps[heap]);
+   const int i = heap_get(heap, pos);
+
+   while (pos > 0) {
+      const int parent = (pos - 1) / 2;
+      const int p = heap_get(heap, parent);
+      if (!heap_before(heap, i, p))
+         break;
+      heap_set(heap, pos, p);
+      pos = parent;
+   }
+
+   for (;;) {
+      int child = 2 * pos + 1;
+      int c;
+      if (child >= size)
+         break;
+      c = heap_get(heap, child);
+      if (child + 1 < size && heap_before(heap, heap_get(heap, child + 1), c)) {
+         child++;
+         c = heap_get(heap, child);
+      }
+      if (!heap_before(heap, c, i))
+         break;
+      heap_set(heap, pos, c);
+      pos = child;
+   }
+
+   heap_set(heap, pos, i);
+}
+
+
+static bool heap_push(int heap, int i)
+{
+   int *item = _al_vector_alloc_back(&slot_heaps[heap]);
+   if (!item)
+      return false;
+   *item = i;
+   heap_sift(heap, _al_vector_size(&slot_heaps[heap]) - 1);
+   return true;
+}
+
+
+static void heap_remove(int heap, int i)
+{
+   AUTO_SLOT *info = slot_ref(i);
+   const int pos = info->heap_pos[heap];
+   const int last = _al_vector_size(&slot_heaps[heap]) - 1;
+
+   ASSERT(pos >= 0);
+   info->heap_pos[heap] = -1;
+
+   if (pos != last) {
+      heap_set(heap, pos, heap_get(heap, last));
+      _al_vector_delete_at(&slot_heaps[heap], last);
+      heap_sift(heap, pos);
+   }
+   else {
+      _al_vector_delete_at(&slot_heaps[heap], last);
+   }
+}
+
+
+static void push_free_slot(int i)
+{
+   slot_ref(i)->next_free = first_free_slot;
+   first_free_slot = i;
+}
+
+
+/* Take a busy slot out of the heaps and put it on the free list. */
+static void release_slot(int i)
+{
+   heap_remove(FINISH_HEAP, i);
+   heap_remove(STEAL_HEAP, i);
+   push_free_slot(i);
+}
+
+
+/* Rebuild the free list and the heaps from the state of the instances. */
+static void reset_slots(void)
+{
+   int i;
+
+   _al_vector_free(&slot_heaps[FINISH_HEAP]);
+   _al_vector_free(&slot_heaps[STEAL_HEAP]);
+   first_free_slot = -1;
+
+   for (i = _al_vector_size(&auto_slots) - 1; i >= 0; i--) {
+      ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&auto_samples, i);
+      AUTO_SLOT *info = slot_ref(i);
+
+      info->heap_pos[FINISH_HEAP] = -1;
+      info->heap_pos[STEAL_HEAP] = -1;
+
+      /* Playing instances keep their place. */
+      if (*slot && al_get_sample_instance_playing(*slot) &&
+            heap_push(FINISH_HEAP, i)) {
+         if (heap_push(STEAL_HEAP, i))
+            continue;
+         heap_remove(FINISH_HEAP, i);
+         al_stop_sample_instance(*slot);
+      }
+      push_free_slot(i);
+   }
+}
+
+
+/* Put the busy slots whose instances were stopped behind our back, such as
+ * by destroying their sample, back on the free list.
+ */
+static void release_stopped_slots(void)
 {
-   static int next_id = 0;
    unsigned int i;
-   
+
+   for (i = 0; i < _al_vector_size(&auto_slots); i++) {
+      ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&auto_samples, i);
+      if (slot_ref(i)->heap_pos[FINISH_HEAP] >= 0 &&
+            !al_get_sample_instance_playing(*slot)) {
+         release_slot(i);
+      }
+   }
+}
+
+
+static int pop_free_slot(void)
+{
+   const int i = first_free_slot;
+
+   if (i >= 0)
+      first_free_slot = slot_ref(i)->next_free;
+   return i;
+}
+
+
+/* Find a slot to play a new sound in: an idle one, else the one which
+ * finished first, else, if allowed, the least important sound playing if
+ * it matters less than the new one.
+ */
+static int allocate_slot(int priority, float distance, bool steal)
+{
+   int i;
+
+   if (first_free_slot >= 0)
+      return pop_free_slot();
+
+   if (_al_vector_is_empty(&slot_heaps[FINISH_HEAP]))
+      return -1;
+
+   i = heap_get(FINISH_HEAP, 0);
+   if (!al_get_sample_instance_playing(
+         *(ALLEGRO_SAMPLE_INSTANCE **)_al_vector_ref(&auto_samples, i))) {
+      heap_remove(FINISH_HEAP, i);
+      heap_remove(STEAL_HEAP, i);
+      return i;
+   }
+
+   /* The end times are only estimates.  If the first one has passed and its
+    * instance is still playing, others may have stopped out of order, so
+    * look for them before stealing or giving up.
+    */
+   if (slot_ref(i)->end_time <= al_get_time()) {
+      release_stopped_slots();
+      if (first_free_slot >= 0)
+         return pop_free_slot();
+   }
+
+   if (steal) {
+      AUTO_SLOT candidate;
+      candidate.priority = priority;
+      candidate.distance = distance;
+      candidate.id = next_id + 1;
+
+      i = heap_get(STEAL_HEAP, 0);
+      if (less_important(slot_ref(i), &candidate)) {
+         ALLEGRO_DEBUG("Stealing sample instance %d\n", i);
+         heap_remove(FINISH_HEAP, i);
+         heap_remove(STEAL_HEAP, i);
+         al_stop_sample_instance(
+            *(ALLEGRO_SAMPLE_INSTANCE **)_al_vector_ref(&auto_samples, i));
+         return i;
+      }
+   }
+
+   return -1;
+}
+
+
+static bool play_sample(ALLEGRO_SAMPLE *spl, float gain, float pan,
+   float speed, ALLEGRO_PLAYMODE loop, int priority, float distance,
+   bool steal, ALLEGRO_SAMPLE_ID *ret_id)
+{
+   ALLEGRO_SAMPLE_INSTANCE *splinst;
+   AUTO_SLOT *info;
+   int i;
+
    ASSERT(spl);
 
    if (ret_id != NULL) {
@@ -325,29 +735,68 @@ bool al_play_sample(ALLEGRO_SAMPLE *spl, float gain, float pan, float speed,
       ret_id->_index = 0;
    }
 
-   for (i = 0; i < _al_vector_size(&auto_samples); i++) {
-      ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&auto_samples, i);
-      ALLEGRO_SAMPLE_INSTANCE *splinst = (*slot);
+   i = allocate_slot(priority, distance, steal);
+   if (i < 0)
+      return false;
 
-      if (!al_get_sample_instance_playing(splinst)) {
-         int *id = _al_vector_ref(&auto_sample_ids, i);
+   splinst = *(ALLEGRO_SAMPLE_INSTANCE **)_al_vector_ref(&auto_samples, i);
+   info = slot_ref(i);
 
-         if (!do_play_sample(splinst, spl, gain, pan, speed, loop))
-            break;
+   if (!do_play_sample(splinst, spl, gain, pan, speed, loop))
+      goto Error;
 
-         if (ret_id != NULL) {
-            ret_id->_index = (int) i;
-            ret_id->_id = *id = ++next_id;
-         }
+   info->id = ++next_id;
+   info->priority = priority;
+   info->distance = distance;
+   if (loop == ALLEGRO_PLAYMODE_ONCE && speed != 0.0f) {
+      info->end_time = al_get_time() +
+         spl->len / (spl->frequency * fabs(speed));
+   }
+   else {
+      info->end_time = HUGE_VAL;
+   }
 
-         return true;
-      }
+   if (!heap_push(FINISH_HEAP, i))
+      goto Error;
+   if (!heap_push(STEAL_HEAP, i)) {
+      heap_remove(FINISH_HEAP, i);
+      goto Error;
+   }
+
+   if (ret_id != NULL) {
+      ret_id->_index = i;
+      ret_id->_id = info->id;
    }
 
+   return true;
+
+Error:
+   al_stop_sample_instance(splinst);
+   push_free_slot(i);
    return false;
 }
 
 
+/* Function: al_play_sample
+ */
+bool al_play_sample(ALLEGRO_SAMPLE *spl, float gain, float pan, float speed,
+   ALLEGRO_PLAYMODE loop, ALLEGRO_SAMPLE_ID *ret_id)
+{
+   return play_sample(spl, gain, pan, speed, loop, 0, 0.0f, false, ret_id);
+}
+
+
+/* Function: al_play_sample_ex
+ */
+bool al_play_sample_ex(ALLEGRO_SAMPLE *spl, float gain, float pan,
+   float speed, ALLEGRO_PLAYMODE loop, int priority, float distance,
+   ALLEGRO_SAMPLE_ID *ret_id)
+{
+   return play_sample(spl, gain, pan, speed, loop, priority, distance, true,
+      ret_id);
+}
+
+
 static bool do_play_sample(ALLEGRO_SAMPLE_INSTANCE *splinst,
    ALLEGRO_SAMPLE *spl, float gain, float pan, float speed, ALLEGRO_PLAYMODE loop)
 {
@@ -376,18 +825,20 @@ static bool do_play_sample(ALLEGRO_SAMPLE_INSTANCE *splinst,
  */
 void al_stop_sample(ALLEGRO_SAMPLE_ID *spl_id)
 {
-   int *id;
+   AUTO_SLOT *info;
 
    ASSERT(spl_id->_id != -1);
    ASSERT(spl_id->_index < (int) _al_vector_size(&auto_samples));
-   ASSERT(spl_id->_index < (int) _al_vector_size(&auto_sample_ids));
+   ASSERT(spl_id->_index < (int) _al_vector_size(&auto_slots));
 
-   id = _al_vector_ref(&auto_sample_ids, spl_id->_index);
-   if (*id == spl_id->_id) {
+   info = _al_vector_ref(&auto_slots, spl_id->_index);
+   if (info->id == spl_id->_id) {
       ALLEGRO_SAMPLE_INSTANCE **slot, *spl;
       slot = _al_vector_ref(&auto_samples, spl_id->_index);
       spl = (*slot);
       al_stop_sample_instance(spl);
+      if (info->heap_pos[FINISH_HEAP] >= 0)
+         release_slot(spl_id->_index);
    }
 }
 
@@ -403,6 +854,7 @@ void al_stop_samples(void)
       ALLEGRO_SAMPLE_INSTANCE *spl = (*slot);
       al_stop_sample_instance(spl);
    }
+   reset_slots();
 }
 
 
@@ -466,19 +918,45 @@ static void free_sample_vector(void)
       al_destroy_sample_instance(*slot);
    }
    _al_vector_free(&auto_samples);
-   _al_vector_free(&auto_sample_ids);
+   _al_vector_free(&auto_slots);
+   _al_vector_free(&slot_heaps[FINISH_HEAP]);
+   _al_vector_free(&slot_heaps[STEAL_HEAP]);
+   first_free_slot = -1;
+}
+
+
+/* Return the depth of the default mixer, or the depth it would be created
+ * with.  Decoders use it to pick the depth which the mixer won't have to
+ * convert.
+ */
+ALLEGRO_AUDIO_DEPTH _al_kcm_get_default_mixer_depth(void)
+{
+   ALLEGRO_CONFIG *config;
+   _AL_ATOMIC depth = _al_atomic_load_acquire(&default_mixer_depth);
+
+   if (depth != -1)
+      return (ALLEGRO_AUDIO_DEPTH)depth;
+
+   config = al_get_system_config();
+   if (config) {
+      const char *p = al_get_config_value(config, "audio",
+         "primary_mixer_depth");
+      if (p && p[0] != '\0')
+         return string_to_depth(p);
+   }
+   return ALLEGRO_AUDIO_DEPTH_FLOAT32;
 }
 
 
 void _al_kcm_shutdown_default_mixer(void)
 {
+   set_default_mixer(NULL);
    free_sample_vector(); 
    al_destroy_mixer(allegro_mixer);
    al_destroy_voice(allegro_voice);
 
    allegro_mixer = NULL;
    allegro_voice = NULL;
-   default_mixer = NULL;
 }
 
 
@@ -0,0 +1,194 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      Polyphase windowed-sinc filter banks for the mixer.
+ *
+ *      See LICENSE.txt for copyright information.
+ */
+
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "allegro5/allegro.h"
+#include "allegro5/allegro_audio.h"
+#include "allegro5/internal/aintern_audio.h"
+
+ALLEGRO_DEBUG_CHANNEL("audio")
+
+#define DEFAULT_TAPS    16
+
+/* Each bank is designed for a cutoff, as a fraction of the source's Nyquist
+ * frequency.  A sample played faster than the mixer's rate uses the widest
+ * bank which doesn't let anything above the mixer's Nyquist frequency
+ * through, so it is band-limited instead of aliasing.
+ */
+static const float bank_cutoffs[] = {
+   1.0f, 0.95f, 0.9f, 0.85f, 0.8f, 0.7f, 0.6f, 0.5f, 0.4f, 1.0f/3, 0.25f
+};
+
+#define NUM_BANKS    (int)(sizeof(bank_cutoffs) / sizeof(bank_cutoffs[0]))
+
+static float *banks[NUM_BANKS];
+static int sinc_taps = 0;
+
+
+/* Zeroth order modified Bessel function of the first kind, for the Kaiser
+ * window.
+ */
+static double bessel_i0(double x)
+{
+   double sum = 1.0;
+   double term = 1.0;
+   int k;
+
+   for (k = 1; k < 50; k++) {
+      term *= (x / (2.0 * k)) * (x / (2.0 * k));
+      sum += term;
+      if (term < sum * 1e-12)
+         break;
+   }
+   return sum;
+}
+
+
+static float kaiser_beta(int taps)
+{
+   if (taps <= 8)
+      return 5.0f;
+   if (taps <= 16)
+      return 7.0f;
+   return 9.0f;
+}
+
+
+/* Fill a bank with _AL_SINC_PHASES + 1 rows of taps coefficients.  Row p
+ * holds the filter for an output frame p / _AL_SINC_PHASES of the way from
+ * input frame taps/2 - 1 to the next one.
+ */
+static void make_bank(float *bank, int taps, double cutoff)
+{
+   const double beta = kaiser_beta(taps);
+   const double i0_beta = bessel_i0(beta);
+   const double half = taps / 2.0;
+   int p, k;
+
+   for (p = 0; p <= _AL_SINC_PHASES; p++) {
+      const double t = (double)p / _AL_SINC_PHASES;
+      float *row = bank + p * taps;
+      double sum = 0.0;
+
+      for (k = 0; k < taps; k++) {
+         const double x = k - (half - 1.0) - t;
+         const double r = x / half;
+         double h, w;
+
+         if (x == 0.0)
+            h = cutoff;
+         else
+            h = sin(ALLEGRO_PI * cutoff * x) / (ALLEGRO_PI * x);
+
+         w = (r > -1.0 && r < 1.0) ?
+            bessel_i0(beta * sqrt(1.0 - r * r)) / i0_beta : 0.0;
+
+         row[k] = (float)(h * w);
+         sum += row[k];
+      }
+
+      /* Unity gain at DC for every phase, or the filter ripples. */
+      for (k = 0; k < taps; k++)
+         row[k] = (float)(row[k] / sum);
+   }
+}
+
+
+/* _al_kcm_init_sinc_filters:
+ *  Compute the filter banks, if not done already.  The number of taps is
+ *  read from the sinc_taps configuration key.
+ */
+bool _al_kcm_init_sinc_filters(void)
+{
+   ALLEGRO_CONFIG *config;
+   int taps = DEFAULT_TAPS;
+   int i;
+
+   if (sinc_taps)
+      return true;
+
+   config = al_get_system_config();
+   if (config) {
+      const char *p = al_get_config_value(config, "audio", "sinc_taps");
+      if (p && p[0] != '\0')
+         taps = atoi(p);
+   }
+   if (taps != 8 && taps != 16 && taps != 32) {
+      ALLEGRO_WARN("sinc_taps must be 8, 16 or 32, using %d\n", DEFAULT_TAPS);
+      taps = DEFAULT_TAPS;
+   }
+
+   for (i = 0; i < NUM_BANKS; i++) {
+      banks[i] = al_malloc((_AL_SINC_PHASES + 1) * taps * sizeof(float));
+      if (!banks[i]) {
+         _al_kcm_shutdown_sinc_filters();
+         return false;
+      }
+      make_bank(banks[i], taps, bank_cutoffs[i]);
+   }
+
+   ALLEGRO_INFO("Sinc interpolation with %d taps\n", taps);
+   sinc_taps = taps;
+   return true;
+}
+
+
+/* _al_kcm_shutdown_sinc_filters:
+ *  Free the filter banks.  No mixer may be using them any more.
+ */
+void _al_kcm_shutdown_sinc_filters(void)
+{
+   int i;
+
+   for (i = 0; i < NUM_BANKS; i++) {
+      al_free(banks[i]);
+      banks[i] = NULL;
+   }
+   sinc_taps = 0;
+}
+
+
+/* _al_kcm_get_sinc_taps:
+ *  Return the number of taps of each filter.
+ */
+int _al_kcm_get_sinc_taps(void)
+{
+   ASSERT(sinc_taps);
+   return sinc_taps;
+}
+
+
+/* _al_kcm_get_sinc_filter:
+ *  Return the bank to use for a sample played step / step_denom input frames
+ *  per output frame.
+ */
+const float *_al_kcm_get_sinc_filter(int step, int step_denom)
+{
+   const float ratio = (float)abs(step) / step_denom;
+   int i;
+
+   ASSERT(sinc_taps);
+
+   for (i = 0; i < NUM_BANKS - 1; i++) {
+      if (bank_cutoffs[i] * ratio <= 1.0f)
+         break;
+   }
+   return banks[i];
+}
+
+/* vim: set sts=3 sw=3 et: */
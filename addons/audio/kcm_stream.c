@@ -17,11 +17,14 @@
 ALLEGRO_DEBUG_CHANNEL("audio")
 
 /*
- * The highest quality interpolator is a cubic interpolator requiring
- * four sample points.  In the streaming case we lag the true sample
- * position by three.
+ * The highest quality interpolator is the sinc interpolator requiring up to
+ * _AL_SINC_MAX_TAPS sample points.  In the streaming case we lag the true
+ * sample position by one less than that.
  */
-#define MAX_LAG   (3)
+#define MAX_LAG   (_AL_SINC_MAX_TAPS - 1)
+
+
+static void schedule_stream_feeder(ALLEGRO_AUDIO_STREAM *stream, int count);
 
 
 static void maybe_lock_mutex(ALLEGRO_MUTEX *mutex)
@@ -40,6 +43,72 @@ static void maybe_unlock_mutex(ALLEGRO_MUTEX *mutex)
 }
 
 
+/* Fragment rings.  Fragments are filled by the user and played by the mixer,
+ * which may be running in the audio driver's thread.  Each ring has a single
+ * producer and a single consumer, so handing a fragment over is just a
+ * pointer store followed by publishing the new index.
+ */
+
+static void ring_init(_AL_FRAGMENT_RING *ring, void **bufs, int size)
+{
+   ring->bufs = bufs;
+   ring->size = size;
+   ring->read_pos = 0;
+   ring->write_pos = 0;
+}
+
+
+/* Any thread may ask, but the answer may be out of date by the time it is
+ * used unless the caller is the producer or the consumer.
+ */
+static unsigned int ring_count(const _AL_FRAGMENT_RING *ring)
+{
+   _AL_ATOMIC r = _al_atomic_load_acquire((volatile _AL_ATOMIC *)&ring->read_pos);
+   _AL_ATOMIC w = _al_atomic_load_acquire((volatile _AL_ATOMIC *)&ring->write_pos);
+
+   return (w - r + ring->size) % ring->size;
+}
+
+
+/* Called by the producer only. */
+static bool ring_push(_AL_FRAGMENT_RING *ring, void *buf)
+{
+   _AL_ATOMIC w = ring->write_pos;
+   _AL_ATOMIC next = (w + 1) % ring->size;
+
+   if (next == _al_atomic_load_acquire(&ring->read_pos))
+      return false;
+
+   ring->bufs[w] = buf;
+   _al_atomic_store_release(&ring->write_pos, next);
+   return true;
+}
+
+
+/* Called by the consumer only. */
+static void *ring_peek(_AL_FRAGMENT_RING *ring)
+{
+   _AL_ATOMIC r = ring->read_pos;
+
+   if (r == _al_atomic_load_acquire(&ring->write_pos))
+      return NULL;
+   return ring->bufs[r];
+}
+
+
+/* Called by the consumer only. */
+static void *ring_pop(_AL_FRAGMENT_RING *ring)
+{
+   void *buf = ring_peek(ring);
+
+   if (buf) {
+      _al_atomic_store_release(&ring->read_pos,
+         (ring->read_pos + 1) % ring->size);
+   }
+   return buf;
+}
+
+
 /* Function: al_create_audio_stream
  */
 ALLEGRO_AUDIO_STREAM *al_create_audio_stream(size_t fragment_count,
@@ -49,6 +118,7 @@ ALLEGRO_AUDIO_STREAM *al_create_audio_stream(size_t fragment_count,
    ALLEGRO_AUDIO_STREAM *stream;
    unsigned long bytes_per_sample;
    unsigned long bytes_per_frag_buf;
+   void **bufs;
    size_t i;
 
    if (!fragment_count) {
@@ -94,16 +164,27 @@ ALLEGRO_AUDIO_STREAM *al_create_audio_stream(size_t fragment_count,
    stream->spl.spl_data.len  = stream->spl.pos;
 
    stream->buf_count = fragment_count;
+   stream->stats.min_queued_fragments = fragment_count;
 
-   stream->used_bufs = al_calloc(1, fragment_count * sizeof(void *) * 2);
-   if (!stream->used_bufs) {
-      al_free(stream->used_bufs);
+   bufs = al_calloc(1, (fragment_count + 1) * sizeof(void *) * 2);
+   if (!bufs) {
       al_free(stream);
       _al_set_error(ALLEGRO_GENERIC_ERROR,
          "Out of memory allocating stream buffer pointers");
       return NULL;
    }
-   stream->pending_bufs = stream->used_bufs + fragment_count;
+   ring_init(&stream->used_bufs, bufs, fragment_count + 1);
+   ring_init(&stream->pending_bufs, bufs + fragment_count + 1,
+      fragment_count + 1);
+
+   stream->feed_mutex = al_create_mutex();
+   if (!stream->feed_mutex) {
+      al_free(bufs);
+      al_free(stream);
+      _al_set_error(ALLEGRO_GENERIC_ERROR,
+         "Out of memory allocating stream mutex");
+      return NULL;
+   }
 
    /* The main_buffer holds all the buffer fragments in contiguous memory.
     * To support interpolation across buffer fragments, we allocate extra
@@ -113,7 +194,8 @@ ALLEGRO_AUDIO_STREAM *al_create_audio_stream(size_t fragment_count,
    stream->main_buffer = al_calloc(1,
       (MAX_LAG * bytes_per_sample + bytes_per_frag_buf) * fragment_count);
    if (!stream->main_buffer) {
-      al_free(stream->used_bufs);
+      al_destroy_mutex(stream->feed_mutex);
+      al_free(bufs);
       al_free(stream);
       _al_set_error(ALLEGRO_GENERIC_ERROR,
          "Out of memory allocating stream buffer");
@@ -124,7 +206,7 @@ ALLEGRO_AUDIO_STREAM *al_create_audio_stream(size_t fragment_count,
       char *buffer = (char *)stream->main_buffer
          + i * (MAX_LAG * bytes_per_sample + bytes_per_frag_buf);
       al_fill_silence(buffer, MAX_LAG, depth, chan_conf);
-      stream->used_bufs[i] = buffer + MAX_LAG * bytes_per_sample;
+      ring_push(&stream->used_bufs, buffer + MAX_LAG * bytes_per_sample);
    }
 
    al_init_user_event_source(&stream->spl.es);
@@ -136,21 +218,58 @@ ALLEGRO_AUDIO_STREAM *al_create_audio_stream(size_t fragment_count,
 }
 
 
+/* Function: al_create_pull_audio_stream
+ */
+ALLEGRO_AUDIO_STREAM *al_create_pull_audio_stream(unsigned int frag_samples,
+   unsigned int freq, ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf,
+   unsigned int (*callback)(ALLEGRO_AUDIO_STREAM *stream, void *buf,
+      unsigned int samples, void *data),
+   void *data)
+{
+   ALLEGRO_AUDIO_STREAM *stream;
+
+   if (!callback) {
+      _al_set_error(ALLEGRO_INVALID_PARAM,
+         "Attempted to create pull stream with no callback");
+      return NULL;
+   }
+
+   /* The mixer needs a fragment to refill while it still holds the last few
+    * samples of the previous one for interpolation, so two are required.
+    */
+   stream = al_create_audio_stream(2, frag_samples, freq, depth, chan_conf);
+   if (!stream)
+      return NULL;
+
+   stream->pull_callback = callback;
+   stream->pull_data = data;
+
+   return stream;
+}
+
+
 /* Function: al_destroy_audio_stream
  */
 void al_destroy_audio_stream(ALLEGRO_AUDIO_STREAM *stream)
 {
    if (stream) {
-      if (stream->feed_thread) {
+      if (stream->feed_job) {
          stream->unload_feeder(stream);
       }
       /* See commented out call to _al_kcm_register_destructor. */
       /* _al_kcm_unregister_destructor(stream); */
       _al_kcm_detach_from_parent(&stream->spl);
+      /* A loaded pull stream is rendered by the mixer, so can only be
+       * unloaded once detached.
+       */
+      if (stream->pull_callback && stream->unload_feeder) {
+         stream->unload_feeder(stream);
+      }
 
       al_destroy_user_event_source(&stream->spl.es);
       al_free(stream->main_buffer);
-      al_free(stream->used_bufs);
+      al_free(stream->used_bufs.bufs);
+      al_destroy_mutex(stream->feed_mutex);
       al_free(stream);
    }
 }
@@ -211,12 +330,12 @@ unsigned int al_get_audio_stream_fragments(const ALLEGRO_AUDIO_STREAM *stream)
 unsigned int al_get_available_audio_stream_fragments(
    const ALLEGRO_AUDIO_STREAM *stream)
 {
-   unsigned int i;
    ASSERT(stream);
 
-   for (i = 0; i < stream->buf_count && stream->used_bufs[i]; i++)
-      ;
-   return i;
+   if (stream->pull_callback)
+      return 0;
+
+   return ring_count(&stream->used_bufs);
 }
 
 
@@ -326,27 +445,57 @@ uint64_t al_get_audio_stream_played_samples(const ALLEGRO_AUDIO_STREAM *stream)
 */
 void *al_get_audio_stream_fragment(const ALLEGRO_AUDIO_STREAM *stream)
 {
-   size_t i;
-   void *fragment;
    ASSERT(stream);
 
+   /* The mixer fills the fragments of pull streams itself. */
+   if (stream->pull_callback)
+      return NULL;
+
+   /* Returns NULL if no free fragments are available.  The mixer only adds
+    * to this ring, so there's no need to hold up the mixer.
+    */
+   return ring_pop((_AL_FRAGMENT_RING *)&stream->used_bufs);
+}
+
+
+/* Function: al_get_audio_stream_stats
+ */
+void al_get_audio_stream_stats(const ALLEGRO_AUDIO_STREAM *stream,
+   ALLEGRO_AUDIO_STREAM_STATS *stats)
+{
+   ASSERT(stream);
+   ASSERT(stats);
+
    maybe_lock_mutex(stream->spl.mutex);
+   *stats = stream->stats;
+   stats->queued_fragments = ring_count(&stream->pending_bufs);
+   maybe_unlock_mutex(stream->spl.mutex);
+}
 
-   if (!stream->used_bufs[0]) {
-      /* No free fragments are available. */
-      fragment = NULL;
-   }
-   else {
-      fragment = stream->used_bufs[0];
-      for (i = 0; i < stream->buf_count-1 && stream->used_bufs[i]; i++) {
-         stream->used_bufs[i] = stream->used_bufs[i+1];
-      }
-      stream->used_bufs[i] = NULL;
-   }
 
+/* Function: al_reset_audio_stream_stats
+ */
+void al_reset_audio_stream_stats(ALLEGRO_AUDIO_STREAM *stream)
+{
+   ASSERT(stream);
+
+   maybe_lock_mutex(stream->spl.mutex);
+   memset(&stream->stats, 0, sizeof(stream->stats));
+   stream->stats.min_queued_fragments = ring_count(&stream->pending_bufs);
    maybe_unlock_mutex(stream->spl.mutex);
+}
+
 
-   return fragment;
+/* _al_kcm_log_stream_stats:
+ *  Log the statistics of a stream.  The caller must hold its mutex.
+ */
+void _al_kcm_log_stream_stats(ALLEGRO_AUDIO_STREAM *stream, int indent)
+{
+   ALLEGRO_INFO("%*sstream %p: %u of %u fragments queued (min %u), "
+      "%lu starvations\n", indent, "", (void *)stream,
+      ring_count(&stream->pending_bufs), stream->buf_count,
+      stream->stats.min_queued_fragments,
+      (unsigned long)stream->stats.starvations);
 }
 
 
@@ -467,8 +616,8 @@ bool al_set_audio_stream_playmode(ALLEGRO_AUDIO_STREAM *stream,
    }
    else if (val == ALLEGRO_PLAYMODE_LOOP) {
       /* Only streams creating by al_load_audio_stream() support
-       * looping. */
-      if (!stream->feeder)
+       * looping, as they can be rewound. */
+      if (!stream->rewind_feeder)
          return false;
 
       stream->spl.loop = _ALLEGRO_PLAYMODE_STREAM_ONEDIR;
@@ -487,7 +636,8 @@ static void reset_stopped_stream(ALLEGRO_AUDIO_STREAM *stream)
       al_get_audio_depth_size(stream->spl.spl_data.depth);
    const int fragment_buffer_size =
       bytes_per_sample * (stream->spl.spl_data.len + MAX_LAG);
-   size_t i, n;
+   void *buf;
+   size_t i;
 
    /* Write silence to the "invisible" part in between fragment buffers to
     * avoid interpolation artifacts.  It's tempting to zero the complete
@@ -501,22 +651,17 @@ static void reset_stopped_stream(ALLEGRO_AUDIO_STREAM *stream)
          MAX_LAG, stream->spl.spl_data.depth, stream->spl.spl_data.chan_conf);
    }
 
-   /* Get the current number of entries in the used_buf list. */
-   for (n = 0; n < stream->buf_count && stream->used_bufs[n]; n++)
-      ;
-
-   /* Move everything from pending_bufs to used_bufs. */
-   i = 0;
-   while (i < stream->buf_count &&
-         n < stream->buf_count &&
-         stream->pending_bufs[i])
-   {
-      stream->used_bufs[n] = stream->pending_bufs[i];
-      stream->pending_bufs[i] = NULL;
-      n++;
-      i++;
+   /* Move everything from pending_bufs to used_bufs.  We hold the mixer's
+    * lock, so can stand in for the mixer at the other end of both rings.
+    */
+   while ((buf = ring_pop(&stream->pending_bufs))) {
+      ring_push(&stream->used_bufs, buf);
    }
 
+   /* A pull stream which ran out may be started again. */
+   if (stream->pull_callback)
+      stream->is_draining = false;
+
    /* No fragment buffer is currently playing. */
    stream->spl.spl_data.buffer.ptr = NULL;
    stream->spl.pos = stream->spl.spl_data.len;
@@ -552,6 +697,8 @@ bool al_set_audio_stream_playing(ALLEGRO_AUDIO_STREAM *stream, bool val)
    }
    else if (!val) {
       reset_stopped_stream(stream);
+      /* A feeder waiting for the stream to drain is done now. */
+      schedule_stream_feeder(stream, stream->buf_count);
    }
 
    maybe_unlock_mutex(stream->spl.mutex);
@@ -576,27 +723,59 @@ bool al_detach_audio_stream(ALLEGRO_AUDIO_STREAM *stream)
  */
 bool al_set_audio_stream_fragment(ALLEGRO_AUDIO_STREAM *stream, void *val)
 {
-   size_t i;
-   bool ret;
    ASSERT(stream);
 
-   maybe_lock_mutex(stream->spl.mutex);
-
-   for (i = 0; i < stream->buf_count && stream->pending_bufs[i] ; i++)
-      ;
-   if (i < stream->buf_count) {
-      stream->pending_bufs[i] = val;
-      ret = true;
+   if (stream->pull_callback) {
+      _al_set_error(ALLEGRO_INVALID_OBJECT,
+         "Attempted to set a fragment of a pull stream");
+      return false;
    }
-   else {
+
+   /* The mixer only takes from this ring, so there's no need to hold up
+    * the mixer.
+    */
+   if (!ring_push(&stream->pending_bufs, val)) {
       _al_set_error(ALLEGRO_INVALID_OBJECT,
          "Attempted to set a stream buffer with a full pending list");
-      ret = false;
+      return false;
    }
 
-   maybe_unlock_mutex(stream->spl.mutex);
+   return true;
+}
+
+
+/* pull_fragment:
+ *  Have the user's callback fill the next fragment of a pull stream, in the
+ *  mixer's thread.  A short fragment ends the stream once it has played.
+ */
+static void pull_fragment(ALLEGRO_AUDIO_STREAM *stream)
+{
+   ALLEGRO_SAMPLE_INSTANCE *spl = &stream->spl;
+   const unsigned int len = spl->spl_data.len;
+   void *buf;
+   unsigned int n;
 
-   return ret;
+   buf = ring_pop(&stream->used_bufs);
+   if (!buf)
+      return;
+
+   n = stream->pull_callback(stream, buf, len, stream->pull_data);
+   if (n > len)
+      n = len;
+
+   if (n < len) {
+      const int bytes_per_sample =
+         al_get_channel_count(spl->spl_data.chan_conf) *
+         al_get_audio_depth_size(spl->spl_data.depth);
+      al_fill_silence((char *)buf + n * bytes_per_sample, len - n,
+         spl->spl_data.depth, spl->spl_data.chan_conf);
+      stream->is_draining = true;
+   }
+
+   if (n > 0)
+      ring_push(&stream->pending_bufs, buf);
+   else
+      ring_push(&stream->used_bufs, buf);
 }
 
 
@@ -611,30 +790,40 @@ bool _al_kcm_refill_stream(ALLEGRO_AUDIO_STREAM *stream)
    ALLEGRO_SAMPLE_INSTANCE *spl = &stream->spl;
    void *old_buf = spl->spl_data.buffer.ptr;
    void *new_buf;
-   size_t i;
 
    if (old_buf) {
-      /* Slide the buffers down one position and put the
-       * completed buffer into the used array to be refilled.
-       */
-      for (i = 0;
-            i < stream->buf_count-1 && stream->pending_bufs[i];
-            i++) {
-         stream->pending_bufs[i] = stream->pending_bufs[i+1];
-      }
-      stream->pending_bufs[i] = NULL;
+      /* Put the completed buffer into the used ring to be refilled. */
+      void *buf = ring_pop(&stream->pending_bufs);
+      ASSERT(buf == old_buf);
+      (void)buf;
+      ring_push(&stream->used_bufs, old_buf);
+      stream->stats.fragments_played++;
+   }
 
-      for (i = 0; stream->used_bufs[i]; i++)
-         ;
-      stream->used_bufs[i] = old_buf;
+   if (stream->pull_callback && !stream->is_draining &&
+         ring_count(&stream->pending_bufs) == 0) {
+      pull_fragment(stream);
    }
 
-   new_buf = stream->pending_bufs[0];
+   new_buf = ring_peek(&stream->pending_bufs);
    stream->spl.spl_data.buffer.ptr = new_buf;
    if (!new_buf) {
-      ALLEGRO_WARN("Out of buffers\n");
+      /* Running dry at the end of a drained stream is no starvation. */
+      if (!stream->is_draining && !stream->starving) {
+         ALLEGRO_WARN("Out of buffers\n");
+         stream->stats.starvations++;
+         stream->starving = true;
+      }
+      stream->stats.min_queued_fragments = 0;
       return false;
    }
+   stream->starving = false;
+
+   {
+      const unsigned int queued = ring_count(&stream->pending_bufs);
+      if (queued < stream->stats.min_queued_fragments)
+         stream->stats.min_queued_fragments = queued;
+   }
 
    /* Copy the last MAX_LAG sample values to the front of the new buffer
     * for interpolation.
@@ -657,94 +846,474 @@ bool _al_kcm_refill_stream(ALLEGRO_AUDIO_STREAM *stream)
 }
 
 
-/* _al_kcm_feed_stream:
- * A routine running in another thread that feeds the stream buffers as
- * neccesary, usually getting data from some file reader backend.
+/* Streams loaded from files are refilled by a small set of feeder threads
+ * shared by all streams, rather than a thread per stream.  Whenever a stream
+ * has fragments to refill its job is queued, ordered by the time at which the
+ * stream would run out of buffered audio, so the stream closest to an
+ * underrun is always refilled first.
  */
-void *_al_kcm_feed_stream(ALLEGRO_THREAD *self, void *vstream)
+
+#define DEFAULT_FEEDER_THREADS   2
+#define MAX_FEEDER_THREADS       16
+
+enum {
+   FEED_JOB_FEEDING,
+   FEED_JOB_DRAINING,
+   FEED_JOB_DONE
+};
+
+typedef struct FEED_JOB {
+   ALLEGRO_AUDIO_STREAM *stream;
+   double deadline;
+   int heap_index;      /* -1 if not queued */
+   bool running;
+   bool rerun;
+   bool stopped;
+   int state;           /* Only touched by the thread running the job. */
+} FEED_JOB;
+
+static struct {
+   ALLEGRO_MUTEX *mutex;
+   ALLEGRO_COND *work_cond;
+   ALLEGRO_COND *done_cond;
+   ALLEGRO_THREAD *threads[MAX_FEEDER_THREADS];
+   int num_threads;
+   bool quit;
+   FEED_JOB **heap;
+   int heap_size;
+   int heap_capacity;
+   int num_jobs;
+} feeders;
+
+
+static void heap_swap(int i, int j)
 {
-   ALLEGRO_AUDIO_STREAM *stream = vstream;
-   ALLEGRO_EVENT_QUEUE *queue;
-   ALLEGRO_EVENT event;
-   (void)self;
+   FEED_JOB *tmp = feeders.heap[i];
+   feeders.heap[i] = feeders.heap[j];
+   feeders.heap[j] = tmp;
+   feeders.heap[i]->heap_index = i;
+   feeders.heap[j]->heap_index = j;
+}
 
-   ALLEGRO_DEBUG("Stream feeder thread started.\n");
 
-   queue = al_create_event_queue();
-   al_register_event_source(queue, &stream->spl.es);
+static void heap_sift_up(int i)
+{
+   while (i > 0) {
+      int parent = (i - 1) / 2;
+      if (feeders.heap[parent]->deadline <= feeders.heap[i]->deadline)
+         break;
+      heap_swap(i, parent);
+      i = parent;
+   }
+}
 
-   stream->quit_feed_thread = false;
 
-   while (!stream->quit_feed_thread) {
-      char *fragment;
-      ALLEGRO_EVENT event;
+static void heap_sift_down(int i)
+{
+   for (;;) {
+      int left = 2 * i + 1;
+      int right = left + 1;
+      int min = i;
+
+      if (left < feeders.heap_size &&
+            feeders.heap[left]->deadline < feeders.heap[min]->deadline)
+         min = left;
+      if (right < feeders.heap_size &&
+            feeders.heap[right]->deadline < feeders.heap[min]->deadline)
+         min = right;
+      if (min == i)
+         break;
+      heap_swap(i, min);
+      i = min;
+   }
+}
 
-      al_wait_for_event(queue, &event);
 
-      if (event.type == ALLEGRO_EVENT_AUDIO_STREAM_FRAGMENT
-          && !stream->is_draining) {
-         unsigned long bytes;
-         unsigned long bytes_written;
+static void destroy_feeders(void);
 
-         fragment = al_get_audio_stream_fragment(stream);
-         if (!fragment) {
-            /* This is not an error. */
-            continue;
-         }
 
-         bytes = (stream->spl.spl_data.len) *
-               al_get_channel_count(stream->spl.spl_data.chan_conf) *
-               al_get_audio_depth_size(stream->spl.spl_data.depth);
+static bool heap_push(FEED_JOB *job)
+{
+   if (feeders.heap_size == feeders.heap_capacity) {
+      int capacity = feeders.heap_capacity ? 2 * feeders.heap_capacity : 16;
+      FEED_JOB **heap = al_realloc(feeders.heap, capacity * sizeof(*heap));
+      if (!heap)
+         return false;
+      feeders.heap = heap;
+      feeders.heap_capacity = capacity;
+   }
 
-         maybe_lock_mutex(stream->spl.mutex);
-         bytes_written = stream->feeder(stream, fragment, bytes);
-         maybe_unlock_mutex(stream->spl.mutex);
+   job->heap_index = feeders.heap_size++;
+   feeders.heap[job->heap_index] = job;
+   heap_sift_up(job->heap_index);
+   return true;
+}
 
-        /* In case it reaches the end of the stream source, stream feeder will
-         * fill the remaining space with silence. If we should loop, rewind the
-         * stream and override the silence with the beginning.
-         * In extreme cases we need to repeat it multiple times.
-         */
-         while (bytes_written < bytes &&
-                  stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONEDIR) {
-            size_t bw;
-            al_rewind_audio_stream(stream);
-            maybe_lock_mutex(stream->spl.mutex);
-            bw = stream->feeder(stream, fragment + bytes_written,
-               bytes - bytes_written);
-            bytes_written += bw;
-            maybe_unlock_mutex(stream->spl.mutex);
-         }
 
-         if (!al_set_audio_stream_fragment(stream, fragment)) {
-            ALLEGRO_ERROR("Error setting stream buffer.\n");
-            continue;
-         }
+static void heap_remove(FEED_JOB *job)
+{
+   int i = job->heap_index;
 
-         /* The streaming source doesn't feed any more, drain buffers and quit. */
-         if (bytes_written != bytes &&
-            stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONCE) {
-            al_drain_audio_stream(stream);
-            stream->quit_feed_thread = true;
-         }
-      }
-      else if (event.type == _KCM_STREAM_FEEDER_QUIT_EVENT_TYPE) {
-         stream->quit_feed_thread = true;
+   ASSERT(i >= 0 && i < feeders.heap_size);
+
+   feeders.heap_size--;
+   if (i != feeders.heap_size) {
+      feeders.heap[i] = feeders.heap[feeders.heap_size];
+      feeders.heap[i]->heap_index = i;
+      heap_sift_up(i);
+      heap_sift_down(feeders.heap[i]->heap_index);
+   }
+   job->heap_index = -1;
+}
+
+
+/* Queue a job to run no later than the given deadline.
+ * The feeders mutex must be held.
+ */
+static void schedule_job(FEED_JOB *job, double deadline)
+{
+   if (job->stopped)
+      return;
+
+   if (job->running) {
+      /* Run it again as soon as the current run finishes. */
+      job->rerun = true;
+   }
+   else if (job->heap_index >= 0) {
+      if (deadline < job->deadline) {
+         job->deadline = deadline;
+         heap_sift_up(job->heap_index);
       }
    }
-   
+   else {
+      job->deadline = deadline;
+      if (heap_push(job))
+         al_signal_cond(feeders.work_cond);
+   }
+}
+
+
+static void finish_feed_job(FEED_JOB *job)
+{
+   ALLEGRO_AUDIO_STREAM *stream = job->stream;
+   ALLEGRO_EVENT event;
+
+   job->state = FEED_JOB_DONE;
+   stream->is_draining = false;
+
    event.user.type = ALLEGRO_EVENT_AUDIO_STREAM_FINISHED;
    event.user.timestamp = al_get_time();
    al_emit_user_event(&stream->spl.es, &event, NULL);
 
-   al_destroy_event_queue(queue);
+   ALLEGRO_DEBUG("Stream feeder finished.\n");
+}
+
+
+/* Refill every fragment of the stream which is available right now. */
+static void run_feed_job(FEED_JOB *job)
+{
+   ALLEGRO_AUDIO_STREAM *stream = job->stream;
+   unsigned long bytes;
+
+   if (job->state == FEED_JOB_DRAINING) {
+      /* The mixer or voice stops the stream once the last fragment has
+       * played, which is what we have been waiting for.
+       */
+      if (!stream->spl.is_playing)
+         finish_feed_job(job);
+      return;
+   }
+
+   /* Fragment events are only emitted while the stream plays, and the
+    * stream must not be refilled while the user drains it.
+    */
+   if (job->state != FEED_JOB_FEEDING || !stream->spl.is_playing
+         || stream->is_draining)
+      return;
+
+   bytes = (stream->spl.spl_data.len) *
+         al_get_channel_count(stream->spl.spl_data.chan_conf) *
+         al_get_audio_depth_size(stream->spl.spl_data.depth);
+
+   for (;;) {
+      char *fragment;
+      unsigned long bytes_written;
+
+      fragment = al_get_audio_stream_fragment(stream);
+      if (!fragment)
+         break;
+
+      al_lock_mutex(stream->feed_mutex);
+      bytes_written = stream->feeder(stream, fragment, bytes);
+      al_unlock_mutex(stream->feed_mutex);
+
+     /* In case it reaches the end of the stream source, stream feeder will
+      * fill the remaining space with silence. If we should loop, rewind the
+      * stream and override the silence with the beginning.
+      * In extreme cases we need to repeat it multiple times.
+      */
+      while (bytes_written < bytes &&
+               stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONEDIR) {
+         size_t bw;
+         al_rewind_audio_stream(stream);
+         al_lock_mutex(stream->feed_mutex);
+         bw = stream->feeder(stream, fragment + bytes_written,
+            bytes - bytes_written);
+         bytes_written += bw;
+         al_unlock_mutex(stream->feed_mutex);
+      }
+
+      if (!al_set_audio_stream_fragment(stream, fragment)) {
+         ALLEGRO_ERROR("Error setting stream buffer.\n");
+         break;
+      }
+
+      /* The streaming source doesn't feed any more, drain buffers and
+       * finish.  Rather than block this thread until the stream has
+       * played out, we get scheduled again when the stream stops.
+       */
+      if (bytes_written != bytes &&
+         stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONCE) {
+         if (!al_get_audio_stream_attached(stream)) {
+            al_set_audio_stream_playing(stream, false);
+            finish_feed_job(job);
+         }
+         else {
+            job->state = FEED_JOB_DRAINING;
+            stream->is_draining = true;
+         }
+         break;
+      }
+   }
+}
+
+
+static void *feeder_thread_proc(ALLEGRO_THREAD *thread, void *arg)
+{
+   (void)thread;
+   (void)arg;
 
-   ALLEGRO_DEBUG("Stream feeder thread finished.\n");
+   al_lock_mutex(feeders.mutex);
+
+   while (!feeders.quit) {
+      FEED_JOB *job;
+
+      if (feeders.heap_size == 0) {
+         al_wait_cond(feeders.work_cond, feeders.mutex);
+         continue;
+      }
+
+      job = feeders.heap[0];
+      heap_remove(job);
+      job->running = true;
+      job->rerun = false;
+      al_unlock_mutex(feeders.mutex);
+
+      run_feed_job(job);
+
+      al_lock_mutex(feeders.mutex);
+      job->running = false;
+      if (job->stopped) {
+         al_broadcast_cond(feeders.done_cond);
+      }
+      else if (job->rerun && job->state != FEED_JOB_DONE) {
+         job->rerun = false;
+         schedule_job(job, al_get_time());
+      }
+   }
+
+   al_unlock_mutex(feeders.mutex);
 
    return NULL;
 }
 
 
+/* Start the feeder threads if necessary.  The number of threads is taken
+ * from the stream_feeder_threads configuration key.
+ * The feeders mutex must be held.
+ */
+static bool start_feeder_threads(void)
+{
+   ALLEGRO_CONFIG *config;
+   int num_threads = DEFAULT_FEEDER_THREADS;
+
+   if (feeders.num_threads > 0)
+      return true;
+
+   config = al_get_system_config();
+   if (config) {
+      const char *p = al_get_config_value(config, "audio",
+         "stream_feeder_threads");
+      if (p && p[0] != '\0')
+         num_threads = atoi(p);
+   }
+   if (num_threads < 1)
+      num_threads = 1;
+   if (num_threads > MAX_FEEDER_THREADS)
+      num_threads = MAX_FEEDER_THREADS;
+
+   feeders.quit = false;
+   while (feeders.num_threads < num_threads) {
+      ALLEGRO_THREAD *thread = al_create_thread(feeder_thread_proc, NULL);
+      if (!thread)
+         break;
+      al_start_thread(thread);
+      feeders.threads[feeders.num_threads++] = thread;
+   }
+
+   ALLEGRO_DEBUG("Started %d stream feeder threads.\n", feeders.num_threads);
+
+   return feeders.num_threads > 0;
+}
+
+
+/* _al_kcm_start_stream_feeder:
+ *  Have the shared feeder threads refill the stream using its 'feeder'
+ *  callback, usually getting data from some file reader backend.
+ */
+bool _al_kcm_start_stream_feeder(ALLEGRO_AUDIO_STREAM *stream)
+{
+   FEED_JOB *job;
+
+   ASSERT(stream);
+   ASSERT(stream->feeder);
+   ASSERT(!stream->feed_job);
+
+   if (!feeders.mutex) {
+      feeders.mutex = al_create_mutex();
+      feeders.work_cond = al_create_cond();
+      feeders.done_cond = al_create_cond();
+      if (!feeders.mutex || !feeders.work_cond || !feeders.done_cond) {
+         destroy_feeders();
+         return false;
+      }
+   }
+
+   job = al_calloc(1, sizeof(*job));
+   if (!job)
+      return false;
+   job->stream = stream;
+   job->heap_index = -1;
+   job->state = FEED_JOB_FEEDING;
+
+   al_lock_mutex(feeders.mutex);
+   if (!start_feeder_threads()) {
+      al_unlock_mutex(feeders.mutex);
+      al_free(job);
+      return false;
+   }
+   stream->feed_job = job;
+   feeders.num_jobs++;
+   al_unlock_mutex(feeders.mutex);
+
+   return true;
+}
+
+
+/* _al_kcm_stop_stream_feeder:
+ *  Stop refilling the stream, waiting for a refill in progress to finish.
+ *  This is called when the stream is closed, so must be called without
+ *  holding the stream's mutex.
+ */
+void _al_kcm_stop_stream_feeder(ALLEGRO_AUDIO_STREAM *stream)
+{
+   FEED_JOB *job;
+   bool last;
+
+   ASSERT(stream);
+
+   if (!stream->feed_job)
+      return;
+
+   al_lock_mutex(feeders.mutex);
+   job = stream->feed_job;
+   stream->feed_job = NULL;
+   job->stopped = true;
+   if (job->heap_index >= 0)
+      heap_remove(job);
+   while (job->running)
+      al_wait_cond(feeders.done_cond, feeders.mutex);
+   last = (--feeders.num_jobs == 0 && feeders.quit);
+   al_unlock_mutex(feeders.mutex);
+
+   if (job->state != FEED_JOB_DONE)
+      finish_feed_job(job);
+
+   al_free(job);
+
+   /* The last stream outliving al_uninstall_audio cleans up. */
+   if (last)
+      destroy_feeders();
+}
+
+
+/* _al_kcm_shutdown_stream_feeders:
+ *  Stop the feeder threads.  Streams which are still being fed can be
+ *  destroyed afterwards, but aren't refilled any more.
+ */
+void _al_kcm_shutdown_stream_feeders(void)
+{
+   int i;
+
+   if (!feeders.mutex)
+      return;
+
+   al_lock_mutex(feeders.mutex);
+   feeders.quit = true;
+   al_broadcast_cond(feeders.work_cond);
+   al_unlock_mutex(feeders.mutex);
+
+   for (i = 0; i < feeders.num_threads; i++) {
+      al_destroy_thread(feeders.threads[i]);
+      feeders.threads[i] = NULL;
+   }
+   feeders.num_threads = 0;
+
+   /* Streams still being fed keep the mutex alive until they go. */
+   if (feeders.num_jobs == 0)
+      destroy_feeders();
+}
+
+
+static void destroy_feeders(void)
+{
+   al_destroy_cond(feeders.work_cond);
+   al_destroy_cond(feeders.done_cond);
+   al_destroy_mutex(feeders.mutex);
+   al_free(feeders.heap);
+   feeders.work_cond = NULL;
+   feeders.done_cond = NULL;
+   feeders.mutex = NULL;
+   feeders.heap = NULL;
+   feeders.heap_size = 0;
+   feeders.heap_capacity = 0;
+}
+
+
+/* Queue the stream's feeder job, if it has one.  When 'count' fragments are
+ * free the stream has the rest buffered, so that is the deadline by which
+ * the job has to run.
+ */
+static void schedule_stream_feeder(ALLEGRO_AUDIO_STREAM *stream, int count)
+{
+   double deadline;
+
+   if (!stream->feed_job)
+      return;
+
+   deadline = al_get_time();
+   if (stream->spl.spl_data.frequency > 0) {
+      deadline += (double)(stream->buf_count - count) *
+         stream->spl.spl_data.len / stream->spl.spl_data.frequency;
+   }
+
+   al_lock_mutex(feeders.mutex);
+   if (stream->feed_job)
+      schedule_job(stream->feed_job, deadline);
+   al_unlock_mutex(feeders.mutex);
+}
+
+
 void _al_kcm_emit_stream_events(ALLEGRO_AUDIO_STREAM *stream)
 {
    /* Emit one event for each stream fragment available right now.
@@ -758,7 +1327,25 @@ void _al_kcm_emit_stream_events(ALLEGRO_AUDIO_STREAM *stream)
     * Having said that, event queues are empty in the steady state so it is
     * relatively rare that this situation occurs.
     */
-   int count = al_get_available_audio_stream_fragments(stream);
+   int count;
+
+   if (stream->pull_callback) {
+      /* No fragments to hand out, but the user may want to know when the
+       * stream has played out.
+       */
+      if (!stream->spl.is_playing && stream->is_draining) {
+         ALLEGRO_EVENT event;
+         stream->is_draining = false;
+         event.user.type = ALLEGRO_EVENT_AUDIO_STREAM_FINISHED;
+         event.user.timestamp = al_get_time();
+         al_emit_user_event(&stream->spl.es, &event, NULL);
+      }
+      return;
+   }
+
+   count = al_get_available_audio_stream_fragments(stream);
+
+   schedule_stream_feeder(stream, count);
 
    while (count--) {
       ALLEGRO_EVENT event;
@@ -776,9 +1363,9 @@ bool al_rewind_audio_stream(ALLEGRO_AUDIO_STREAM *stream)
    bool ret;
 
    if (stream->rewind_feeder) {
-      maybe_lock_mutex(stream->spl.mutex);
+      al_lock_mutex(stream->feed_mutex);
       ret = stream->rewind_feeder(stream);
-      maybe_unlock_mutex(stream->spl.mutex);
+      al_unlock_mutex(stream->feed_mutex);
       return ret;
    }
 
@@ -793,9 +1380,9 @@ bool al_seek_audio_stream_secs(ALLEGRO_AUDIO_STREAM *stream, double time)
    bool ret;
 
    if (stream->seek_feeder) {
-      maybe_lock_mutex(stream->spl.mutex);
+      al_lock_mutex(stream->feed_mutex);
       ret = stream->seek_feeder(stream, time);
-      maybe_unlock_mutex(stream->spl.mutex);
+      al_unlock_mutex(stream->feed_mutex);
       return ret;
    }
 
@@ -810,9 +1397,9 @@ double al_get_audio_stream_position_secs(ALLEGRO_AUDIO_STREAM *stream)
    double ret;
 
    if (stream->get_feeder_position) {
-      maybe_lock_mutex(stream->spl.mutex);
+      al_lock_mutex(stream->feed_mutex);
       ret = stream->get_feeder_position(stream);
-      maybe_unlock_mutex(stream->spl.mutex);
+      al_unlock_mutex(stream->feed_mutex);
       return ret;
    }
 
@@ -827,9 +1414,9 @@ double al_get_audio_stream_length_secs(ALLEGRO_AUDIO_STREAM *stream)
    double ret;
 
    if (stream->get_feeder_length) {
-      maybe_lock_mutex(stream->spl.mutex);
+      al_lock_mutex(stream->feed_mutex);
       ret = stream->get_feeder_length(stream);
-      maybe_unlock_mutex(stream->spl.mutex);
+      al_unlock_mutex(stream->feed_mutex);
       return ret;
    }
 
@@ -848,9 +1435,9 @@ bool al_set_audio_stream_loop_secs(ALLEGRO_AUDIO_STREAM *stream,
       return false;
 
    if (stream->set_feeder_loop) {
-      maybe_lock_mutex(stream->spl.mutex);
+      al_lock_mutex(stream->feed_mutex);
       ret = stream->set_feeder_loop(stream, start, end);
-      maybe_unlock_mutex(stream->spl.mutex);
+      al_unlock_mutex(stream->feed_mutex);
       return ret;
    }
 
@@ -8,7 +8,10 @@
 /* Title: Voice functions
  */
 
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "allegro5/allegro_audio.h"
 #include "allegro5/internal/aintern_audio.h"
@@ -23,6 +26,59 @@ static void stream_read(void *source, void **vbuf, unsigned int *samples,
 
 
 
+static void get_voice_stats(const ALLEGRO_VOICE *voice,
+   ALLEGRO_VOICE_STATS *stats)
+{
+   *stats = voice->stats;
+   stats->mean_jitter = 0.0;
+   if (voice->jitter_count > 0)
+      stats->mean_jitter = voice->jitter_sum / voice->jitter_count;
+}
+
+
+static void log_voice_stats(ALLEGRO_VOICE *voice)
+{
+   ALLEGRO_VOICE_STATS stats;
+
+   get_voice_stats(voice, &stats);
+   ALLEGRO_INFO("voice %p: %lu callbacks, %.3f ms mean jitter, "
+      "%.3f ms max jitter, %lu underruns\n", (void *)voice,
+      (unsigned long)stats.callbacks, stats.mean_jitter * 1000.0,
+      stats.max_jitter * 1000.0, (unsigned long)stats.underruns);
+
+   if (voice->attached_stream)
+      _al_kcm_log_instance_stats(voice->attached_stream, 2);
+}
+
+
+/* Compare the time since the previous update with the length of the audio
+ * handed out then.  The driver should come back just as that runs out.
+ */
+static void update_voice_stats(ALLEGRO_VOICE *voice, unsigned int samples)
+{
+   const double now = al_get_time();
+
+   if (voice->last_update_time > 0.0) {
+      const double jitter =
+         fabs(now - voice->last_update_time - voice->expected_period);
+      voice->jitter_sum += jitter;
+      voice->jitter_count++;
+      if (jitter > voice->stats.max_jitter)
+         voice->stats.max_jitter = jitter;
+   }
+   voice->last_update_time = now;
+   voice->expected_period = (double)samples / voice->frequency;
+
+   voice->stats.callbacks++;
+   voice->stats.frames += samples;
+
+   if (voice->stats_log_interval > 0.0 && now >= voice->next_stats_log) {
+      log_voice_stats(voice);
+      voice->next_stats_log = now + voice->stats_log_interval;
+   }
+}
+
+
 /* _al_voice_update:
  *  Reads the attached stream and provides a buffer for the sound card. It is
  *  the driver's responsiblity to call this and to make sure any
@@ -54,18 +110,33 @@ const void *_al_voice_update(ALLEGRO_VOICE *voice, ALLEGRO_MUTEX *mutex,
       voice->attached_stream->spl_read(voice->attached_stream, &buf, samples,
          voice->depth, 0);
    }
+   update_voice_stats(voice, *samples);
    al_unlock_mutex(voice->mutex);
 
    return buf;
 }
 
 
+/* _al_voice_note_underrun:
+ *  Drivers call this when the device ran out of data to play.
+ */
+void _al_voice_note_underrun(ALLEGRO_VOICE *voice)
+{
+   ASSERT(voice);
+
+   al_lock_mutex(voice->mutex);
+   voice->stats.underruns++;
+   al_unlock_mutex(voice->mutex);
+}
+
+
 /* Function: al_create_voice
  */
 ALLEGRO_VOICE *al_create_voice(unsigned int freq,
    ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf)
 {
    ALLEGRO_VOICE *voice = NULL;
+   ALLEGRO_CONFIG *config;
 
    if (!freq) {
       _al_set_error(ALLEGRO_INVALID_PARAM, "Invalid Voice Frequency");
@@ -81,6 +152,14 @@ ALLEGRO_VOICE *al_create_voice(unsigned int freq,
    voice->chan_conf = chan_conf;
    voice->frequency = freq;
 
+   config = al_get_system_config();
+   if (config) {
+      const char *p = al_get_config_value(config, "audio",
+         "stats_log_interval");
+      if (p && p[0] != '\0')
+         voice->stats_log_interval = atof(p);
+   }
+
    voice->mutex = al_create_mutex();
    voice->cond = al_create_cond();
    /* XXX why is this needed? there should only be one active driver */
@@ -94,7 +173,8 @@ ALLEGRO_VOICE *al_create_voice(unsigned int freq,
       return NULL;
    }
 
-   _al_kcm_register_destructor(voice, (void (*)(void *)) al_destroy_voice);
+   voice->dtor_item = _al_kcm_register_destructor(voice,
+      (void (*)(void *)) al_destroy_voice);
 
    return voice;
 }
@@ -105,7 +185,7 @@ ALLEGRO_VOICE *al_create_voice(unsigned int freq,
 void al_destroy_voice(ALLEGRO_VOICE *voice)
 {
    if (voice) {
-      _al_kcm_unregister_destructor(voice);
+      _al_kcm_unregister_destructor(voice->dtor_item);
 
       al_detach_voice(voice);
       ASSERT(al_get_voice_playing(voice) == false);
@@ -213,15 +293,17 @@ static void stream_read(void *source, void **vbuf, unsigned int *samples,
 
    if (pos >= len) {
       _al_kcm_refill_stream(stream);
-      if (!stream->pending_bufs[0]) {
+      if (!stream->spl.spl_data.buffer.ptr) {
          if (stream->is_draining) {
             stream->spl.is_playing = false;
+            /* Let a draining feeder know the stream has finished. */
+            _al_kcm_emit_stream_events(stream);
          }
          *vbuf = NULL;
          *samples = 0;
          return;
       }
-      *vbuf = stream->pending_bufs[0];
+      *vbuf = stream->spl.spl_data.buffer.ptr;
       pos = *samples;
 
       _al_kcm_emit_stream_events(stream);
@@ -229,7 +311,7 @@ static void stream_read(void *source, void **vbuf, unsigned int *samples,
    else {
       int bytes = pos * al_get_channel_count(stream->spl.spl_data.chan_conf)
                       * al_get_audio_depth_size(stream->spl.spl_data.depth);
-      *vbuf = ((char *)stream->pending_bufs[0]) + bytes;
+      *vbuf = ((char *)stream->spl.spl_data.buffer.ptr) + bytes;
 
       if (pos + *samples > len)
          *samples = len - pos;
@@ -528,14 +610,45 @@ bool _al_kcm_set_voice_playing(ALLEGRO_VOICE *voice, ALLEGRO_MUTEX *mutex,
 
    al_lock_mutex(voice->mutex);
    // XXX change methods
-   if (val)
+   if (val) {
+      /* The pause is not a late update. */
+      voice->last_update_time = 0.0;
       ret = voice->driver->start_voice(voice) == 0;
-   else
+   }
+   else {
       ret = voice->driver->stop_voice(voice) == 0;
+   }
    al_unlock_mutex(voice->mutex);
 
    return ret;
 }
 
 
+/* Function: al_get_voice_stats
+ */
+void al_get_voice_stats(const ALLEGRO_VOICE *voice, ALLEGRO_VOICE_STATS *stats)
+{
+   ASSERT(voice);
+   ASSERT(stats);
+
+   al_lock_mutex(voice->mutex);
+   get_voice_stats(voice, stats);
+   al_unlock_mutex(voice->mutex);
+}
+
+
+/* Function: al_reset_voice_stats
+ */
+void al_reset_voice_stats(ALLEGRO_VOICE *voice)
+{
+   ASSERT(voice);
+
+   al_lock_mutex(voice->mutex);
+   memset(&voice->stats, 0, sizeof(voice->stats));
+   voice->jitter_sum = 0.0;
+   voice->jitter_count = 0;
+   al_unlock_mutex(voice->mutex);
+}
+
+
 /* vim: set sts=3 sw=3 et: */
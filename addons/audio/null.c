@@ -0,0 +1,441 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      Null sound driver, which plays to nowhere or to a WAV file.
+ *
+ *      See LICENSE.txt for copyright information.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "allegro5/allegro.h"
+#include "allegro5/allegro_audio.h"
+#include "allegro5/internal/aintern_audio.h"
+
+ALLEGRO_DEBUG_CHANNEL("null_audio")
+
+#define DEFAULT_BUFFER_SIZE   1024
+
+/* If the update thread falls further behind real time than this, it gives
+ * up catching up rather than mixing a burst.
+ */
+#define MAX_LATENESS          0.1
+
+/* Offsets of the sizes to patch in the WAV header. */
+#define RIFF_SIZE_OFFSET      4
+#define DATA_SIZE_OFFSET      40
+#define WAV_HEADER_SIZE       44
+
+typedef struct NULL_VOICE {
+   /* Copied from the parent ALLEGRO_VOICE. Used for convenience. */
+   unsigned int len; /* in frames */
+   unsigned int frame_size; /* in bytes */
+
+   volatile bool stopped;
+   volatile bool stop;
+
+   ALLEGRO_FILE *wav;
+   uint32_t wav_bytes;
+
+   ALLEGRO_THREAD *update_thread;
+} NULL_VOICE;
+
+static bool null_realtime = true;
+static unsigned int null_buffer_size = DEFAULT_BUFFER_SIZE;
+static char null_output[512];
+static bool output_in_use = false;
+
+
+static int null_open(void)
+{
+   ALLEGRO_CONFIG *config = al_get_system_config();
+
+   null_realtime = true;
+   null_buffer_size = DEFAULT_BUFFER_SIZE;
+   null_output[0] = '\0';
+
+   if (config) {
+      const char *val;
+
+      val = al_get_config_value(config, "null", "realtime");
+      if (val && val[0] != '\0')
+         null_realtime = strcmp(val, "no") ? true : false;
+
+      val = al_get_config_value(config, "null", "buffer_size");
+      if (val && val[0] != '\0') {
+         int n = atoi(val);
+         if (n > 0)
+            null_buffer_size = n;
+      }
+
+      val = al_get_config_value(config, "null", "output");
+      if (val && val[0] != '\0') {
+         strncpy(null_output, val, sizeof(null_output) - 1);
+         null_output[sizeof(null_output) - 1] = '\0';
+      }
+   }
+
+   ALLEGRO_INFO("Playing %s, %u frames at a time\n",
+      null_realtime ? "in real time" : "as fast as possible", null_buffer_size);
+
+   return 0;
+}
+
+
+static void null_close(void)
+{
+}
+
+
+/* Start a WAV file in the voice's format, leaving the sizes to be patched
+ * when the voice goes away.
+ */
+static bool open_wav(ALLEGRO_VOICE *voice, NULL_VOICE *ex_data)
+{
+   const int channels = al_get_channel_count(voice->chan_conf);
+   const int bits = al_get_audio_depth_size(voice->depth) * 8;
+   ALLEGRO_FILE *f;
+   int format;
+
+   switch (voice->depth) {
+      case ALLEGRO_AUDIO_DEPTH_UINT8:
+      case ALLEGRO_AUDIO_DEPTH_INT16:
+         format = 1; /* PCM */
+         break;
+      case ALLEGRO_AUDIO_DEPTH_FLOAT32:
+         format = 3; /* IEEE float */
+         break;
+      default:
+         ALLEGRO_WARN("Can't write voices of depth %d to WAV files.\n",
+            voice->depth);
+         return false;
+   }
+
+   f = al_fopen(null_output, "wb");
+   if (!f) {
+      ALLEGRO_ERROR("Failed to open '%s' for writing.\n", null_output);
+      return false;
+   }
+
+   al_fputs(f, "RIFF");
+   al_fwrite32le(f, 0);
+   al_fputs(f, "WAVE");
+
+   al_fputs(f, "fmt ");
+   al_fwrite32le(f, 16);
+   al_fwrite16le(f, format);
+   al_fwrite16le(f, channels);
+   al_fwrite32le(f, voice->frequency);
+   al_fwrite32le(f, voice->frequency * ex_data->frame_size);
+   al_fwrite16le(f, ex_data->frame_size);
+   al_fwrite16le(f, bits);
+
+   al_fputs(f, "data");
+   al_fwrite32le(f, 0);
+
+   if (al_ferror(f)) {
+      ALLEGRO_ERROR("Failed to write the header of '%s'.\n", null_output);
+      al_fclose(f);
+      return false;
+   }
+
+   ALLEGRO_INFO("Writing to '%s'\n", null_output);
+   ex_data->wav = f;
+   ex_data->wav_bytes = 0;
+   return true;
+}
+
+
+static void close_wav(NULL_VOICE *ex_data)
+{
+   ALLEGRO_FILE *f = ex_data->wav;
+
+   al_fseek(f, RIFF_SIZE_OFFSET, ALLEGRO_SEEK_SET);
+   al_fwrite32le(f, WAV_HEADER_SIZE - 8 + ex_data->wav_bytes);
+   al_fseek(f, DATA_SIZE_OFFSET, ALLEGRO_SEEK_SET);
+   al_fwrite32le(f, ex_data->wav_bytes);
+   al_fclose(f);
+
+   ex_data->wav = NULL;
+}
+
+
+static void null_output_frames(NULL_VOICE *ex_data, const void *data,
+   unsigned int frames)
+{
+   if (ex_data->wav) {
+      const size_t bytes = frames * ex_data->frame_size;
+      if (al_fwrite(ex_data->wav, data, bytes) != bytes) {
+         ALLEGRO_ERROR("Failed to write to '%s', giving up.\n", null_output);
+         al_fclose(ex_data->wav);
+         ex_data->wav = NULL;
+         return;
+      }
+      ex_data->wav_bytes += bytes;
+   }
+}
+
+
+static void null_output_silence(ALLEGRO_VOICE *voice, NULL_VOICE *ex_data,
+   unsigned int frames)
+{
+   char sil_buf[4096];
+
+   if (!ex_data->wav)
+      return;
+
+   while (frames > 0) {
+      unsigned int n = sizeof(sil_buf) / ex_data->frame_size;
+      if (n > frames)
+         n = frames;
+      al_fill_silence(sil_buf, n, voice->depth, voice->chan_conf);
+      null_output_frames(ex_data, sil_buf, n);
+      frames -= n;
+   }
+}
+
+
+static void null_deallocate_voice(ALLEGRO_VOICE *voice)
+{
+   NULL_VOICE *ex_data = voice->extra;
+
+   /* As in the OSS driver, the voice mutex is not held here so the update
+    * thread can finish its last _al_voice_update call.
+    */
+   al_join_thread(ex_data->update_thread, NULL);
+   al_destroy_thread(ex_data->update_thread);
+
+   if (ex_data->wav) {
+      close_wav(ex_data);
+      output_in_use = false;
+   }
+
+   al_free(voice->extra);
+   voice->extra = NULL;
+}
+
+
+static int null_start_voice(ALLEGRO_VOICE *voice)
+{
+   NULL_VOICE *ex_data = voice->extra;
+   ex_data->stop = false;
+   return 0;
+}
+
+
+static int null_stop_voice(ALLEGRO_VOICE *voice)
+{
+   NULL_VOICE *ex_data = voice->extra;
+
+   ex_data->stop = true;
+   if (!voice->is_streaming) {
+      voice->attached_stream->pos = 0;
+   }
+
+   while (!ex_data->stopped)
+      al_rest(0.001);
+
+   return 0;
+}
+
+
+static int null_load_voice(ALLEGRO_VOICE *voice, const void *data)
+{
+   NULL_VOICE *ex_data = voice->extra;
+
+   if (voice->attached_stream->loop == ALLEGRO_PLAYMODE_BIDIR) {
+      ALLEGRO_INFO("Backwards playing not supported by the driver.\n");
+      return -1;
+   }
+
+   voice->attached_stream->pos = 0;
+   ex_data->len = voice->attached_stream->spl_data.len;
+
+   return 0;
+   (void)data;
+}
+
+
+static void null_unload_voice(ALLEGRO_VOICE *voice)
+{
+   (void)voice;
+}
+
+
+static bool null_voice_is_playing(const ALLEGRO_VOICE *voice)
+{
+   NULL_VOICE *ex_data = voice->extra;
+   return !ex_data->stopped;
+}
+
+
+static unsigned int null_get_voice_position(const ALLEGRO_VOICE *voice)
+{
+   return voice->attached_stream->pos;
+}
+
+
+static int null_set_voice_position(ALLEGRO_VOICE *voice, unsigned int val)
+{
+   voice->attached_stream->pos = val;
+   return 0;
+}
+
+
+/* Play up to frames frames of a sample attached directly to the voice,
+ * returning how many were played.
+ */
+static unsigned int null_update_nonstream_voice(ALLEGRO_VOICE *voice,
+   NULL_VOICE *ex_data, unsigned int frames)
+{
+   ALLEGRO_SAMPLE_INSTANCE *spl = voice->attached_stream;
+   unsigned int pos = spl->pos;
+
+   if (pos + frames > ex_data->len)
+      frames = ex_data->len - pos;
+
+   null_output_frames(ex_data,
+      (const char *)spl->spl_data.buffer.ptr + pos * ex_data->frame_size,
+      frames);
+
+   pos += frames;
+   if (pos >= ex_data->len) {
+      pos = 0;
+      if (spl->loop == ALLEGRO_PLAYMODE_ONCE)
+         ex_data->stop = true;
+   }
+   spl->pos = pos;
+
+   return frames;
+}
+
+
+static void *null_update(ALLEGRO_THREAD *self, void *arg)
+{
+   ALLEGRO_VOICE *voice = arg;
+   NULL_VOICE *ex_data = voice->extra;
+   double next_time = al_get_time();
+
+   while (!al_get_thread_should_stop(self)) {
+      unsigned int frames = null_buffer_size;
+
+      if (ex_data->stop && !ex_data->stopped) {
+         ex_data->stopped = true;
+      }
+
+      if (!ex_data->stop && ex_data->stopped) {
+         ex_data->stopped = false;
+      }
+
+      if (!voice->is_streaming && !ex_data->stopped) {
+         frames = null_update_nonstream_voice(voice, ex_data, frames);
+      }
+      else if (voice->is_streaming && !ex_data->stopped) {
+         const void *data = _al_voice_update(voice, voice->mutex, &frames);
+         if (data)
+            null_output_frames(ex_data, data, frames);
+         else
+            null_output_silence(voice, ex_data, frames);
+      }
+      else if (null_realtime) {
+         /* Stopped voices still pass time in the output. */
+         null_output_silence(voice, ex_data, frames);
+      }
+      else {
+         /* Nothing to do until the voice is started. */
+         al_rest(0.001);
+         next_time = al_get_time();
+         continue;
+      }
+
+      if (null_realtime) {
+         double now = al_get_time();
+         next_time += (double)frames / voice->frequency;
+         if (next_time > now)
+            al_rest(next_time - now);
+         else if (now - next_time > MAX_LATENESS)
+            next_time = now;
+      }
+   }
+
+   return NULL;
+}
+
+
+static int null_allocate_voice(ALLEGRO_VOICE *voice)
+{
+   NULL_VOICE *ex_data = al_calloc(1, sizeof(NULL_VOICE));
+   if (!ex_data)
+      return 1;
+
+   ex_data->frame_size = al_get_channel_count(voice->chan_conf) *
+      al_get_audio_depth_size(voice->depth);
+   if (!ex_data->frame_size) {
+      al_free(ex_data);
+      return 1;
+   }
+
+   ex_data->stop = true;
+   ex_data->stopped = true;
+
+   if (null_output[0] != '\0') {
+      if (output_in_use) {
+         ALLEGRO_WARN("Only the first voice is written to '%s'.\n",
+            null_output);
+      }
+      else if (open_wav(voice, ex_data)) {
+         output_in_use = true;
+      }
+   }
+
+   voice->extra = ex_data;
+   ex_data->update_thread = al_create_thread(null_update, (void*)voice);
+   if (!ex_data->update_thread) {
+      if (ex_data->wav) {
+         close_wav(ex_data);
+         output_in_use = false;
+      }
+      voice->extra = NULL;
+      al_free(ex_data);
+      return 1;
+   }
+   al_start_thread(ex_data->update_thread);
+
+   return 0;
+}
+
+
+ALLEGRO_AUDIO_DRIVER _al_kcm_null_driver =
+{
+   "null",
+
+   null_open,
+   null_close,
+
+   null_allocate_voice,
+   null_deallocate_voice,
+
+   null_load_voice,
+   null_unload_voice,
+
+   null_start_voice,
+   null_stop_voice,
+
+   null_voice_is_playing,
+
+   null_get_voice_position,
+   null_set_voice_position,
+
+   NULL,
+   NULL
+};
+
+/* vim: set sts=3 sw=3 et: */
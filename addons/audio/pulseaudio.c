@@ -403,9 +403,7 @@ static void *pulse_audio_update_recorder(ALLEGRO_THREAD *t, void *data)
 {
    ALLEGRO_AUDIO_RECORDER *r = (ALLEGRO_AUDIO_RECORDER *) data;
    PULSEAUDIO_RECORDER *pa = (PULSEAUDIO_RECORDER *) r->extra;
-   ALLEGRO_EVENT user_event;
    uint8_t *null_buffer;
-   unsigned int fragment_i = 0;
    
    null_buffer = al_malloc(1024);
    if (!null_buffer) {
@@ -424,18 +422,14 @@ static void *pulse_audio_update_recorder(ALLEGRO_THREAD *t, void *data)
          pa_simple_read(pa->s, null_buffer, 1024, NULL);
       }
       else {
-         ALLEGRO_AUDIO_RECORDER_EVENT *e;
+         void *fragment = _al_kcm_get_recorder_fragment(r);
          al_unlock_mutex(r->mutex);
-         if (pa_simple_read(pa->s, r->fragments[fragment_i], r->fragment_size, NULL) >= 0) {
-            user_event.user.type = ALLEGRO_EVENT_AUDIO_RECORDER_FRAGMENT;
-            e = al_get_audio_recorder_event(&user_event);
-            e->buffer = r->fragments[fragment_i];
-            e->samples = r->samples;           
-            al_emit_user_event(&r->source, &user_event, NULL);
-         
-            if (++fragment_i == r->fragment_count) {
-               fragment_i = 0;
-            }
+         if (!fragment) {
+            /* Drop the audio rather than fall behind. */
+            pa_simple_read(pa->s, null_buffer, 1024, NULL);
+         }
+         else if (pa_simple_read(pa->s, fragment, r->fragment_size, NULL) >= 0) {
+            _al_kcm_emit_recorder_fragment(r, r->samples);
          }
       }
    }
@@ -13,26 +13,269 @@ ALLEGRO_STATIC_ASSERT(recorder,
    sizeof(ALLEGRO_AUDIO_RECORDER_EVENT) <= sizeof(ALLEGRO_EVENT));
 
 
-/* Function: al_create_audio_recorder
+/* Fragments of pooled recorders are handed to the user in reference counted
+ * events.  When the last queue holding the event lets go of it, the fragment
+ * goes back to its pool.  The pool outlives the recorder until every fragment
+ * has come back.
  */
-ALLEGRO_AUDIO_RECORDER *al_create_audio_recorder(size_t fragment_count,
-   unsigned int samples, unsigned int frequency,
-   ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf)
+
+typedef struct RECORDER_FRAGMENT RECORDER_FRAGMENT;
+
+struct RECORDER_FRAGMENT {
+   _AL_FRAGMENT_POOL *pool;
+   RECORDER_FRAGMENT *next;
+};
+
+/* Keeps the data after the header as aligned as the allocation. */
+#define FRAGMENT_HEADER_SIZE \
+   ((sizeof(RECORDER_FRAGMENT) + 15) & ~(size_t)15)
+
+#define FRAGMENT_DATA(frag) \
+   ((void *)((char *)(frag) + FRAGMENT_HEADER_SIZE))
+#define DATA_FRAGMENT(data) \
+   ((RECORDER_FRAGMENT *)((char *)(data) - FRAGMENT_HEADER_SIZE))
+
+struct _AL_FRAGMENT_POOL {
+   ALLEGRO_MUTEX *mutex;
+   RECORDER_FRAGMENT *free_list;
+   size_t fragment_size;
+   unsigned int count;        /* allocated and not yet freed */
+   bool orphaned;             /* the recorder has been destroyed */
+};
+
+
+/* Whoever leaves an orphaned pool empty destroys it, outside its lock. */
+static void destroy_pool(_AL_FRAGMENT_POOL *pool)
+{
+   al_destroy_mutex(pool->mutex);
+   al_free(pool);
+}
+
+
+/* Called by the recorder's thread only. */
+static void *pool_get(_AL_FRAGMENT_POOL *pool)
+{
+   RECORDER_FRAGMENT *frag;
+
+   al_lock_mutex(pool->mutex);
+   frag = pool->free_list;
+   if (frag) {
+      pool->free_list = frag->next;
+   }
+   al_unlock_mutex(pool->mutex);
+
+   if (!frag) {
+      frag = al_malloc(FRAGMENT_HEADER_SIZE + pool->fragment_size);
+      if (!frag)
+         return NULL;
+      frag->pool = pool;
+      al_lock_mutex(pool->mutex);
+      pool->count++;
+      ALLEGRO_DEBUG("Recorder pool grown to %u fragments\n", pool->count);
+      al_unlock_mutex(pool->mutex);
+   }
+
+   frag->next = NULL;
+   return FRAGMENT_DATA(frag);
+}
+
+
+static void pool_put(void *data)
+{
+   RECORDER_FRAGMENT *frag = DATA_FRAGMENT(data);
+   _AL_FRAGMENT_POOL *pool = frag->pool;
+   bool empty = false;
+
+   al_lock_mutex(pool->mutex);
+   if (pool->orphaned) {
+      pool->count--;
+      empty = (pool->count == 0);
+      al_free(frag);
+   }
+   else {
+      frag->next = pool->free_list;
+      pool->free_list = frag;
+   }
+   al_unlock_mutex(pool->mutex);
+
+   if (empty)
+      destroy_pool(pool);
+}
+
+
+static _AL_FRAGMENT_POOL *create_pool(size_t fragment_size,
+   size_t fragment_count)
+{
+   _AL_FRAGMENT_POOL *pool;
+   void **frags;
+   size_t i;
+
+   pool = al_calloc(1, sizeof(*pool));
+   if (!pool)
+      return NULL;
+   pool->fragment_size = fragment_size;
+   pool->mutex = al_create_mutex();
+   if (!pool->mutex) {
+      al_free(pool);
+      return NULL;
+   }
+
+   /* Take all the fragments first so that each one is a new allocation. */
+   frags = al_malloc(fragment_count * sizeof(void *));
+   if (!frags && fragment_count > 0) {
+      al_destroy_mutex(pool->mutex);
+      al_free(pool);
+      return NULL;
+   }
+   for (i = 0; i < fragment_count; i++) {
+      frags[i] = pool_get(pool);
+      if (!frags[i])
+         break;
+   }
+   while (i-- > 0) {
+      pool_put(frags[i]);
+   }
+   al_free(frags);
+
+   return pool;
+}
+
+
+static void orphan_pool(_AL_FRAGMENT_POOL *pool)
+{
+   bool empty;
+
+   al_lock_mutex(pool->mutex);
+   pool->orphaned = true;
+   while (pool->free_list) {
+      RECORDER_FRAGMENT *frag = pool->free_list;
+      pool->free_list = frag->next;
+      pool->count--;
+      al_free(frag);
+   }
+   empty = (pool->count == 0);
+   al_unlock_mutex(pool->mutex);
+
+   if (empty)
+      destroy_pool(pool);
+}
+
+
+static void fragment_event_dtor(ALLEGRO_USER_EVENT *event)
+{
+   pool_put(((ALLEGRO_AUDIO_RECORDER_EVENT *)event)->buffer);
+}
+
+
+/* _al_kcm_get_recorder_fragment:
+ *  Return the fragment the driver should record into next.  The same
+ *  fragment is returned until it is passed on with
+ *  _al_kcm_emit_recorder_fragment.  Returns NULL if a pooled recorder has no
+ *  free fragment and no memory for another; the driver should then drop the
+ *  audio.  Called by the recording thread only.
+ */
+void *_al_kcm_get_recorder_fragment(ALLEGRO_AUDIO_RECORDER *r)
+{
+   if (!r->pool)
+      return r->fragments[r->fragment_i];
+
+   if (!r->current_fragment) {
+      r->current_fragment = pool_get(r->pool);
+      if (!r->current_fragment) {
+         ALLEGRO_WARN("Out of memory for recorder fragments\n");
+      }
+   }
+   return r->current_fragment;
+}
+
+
+/* _al_kcm_emit_recorder_fragment:
+ *  Send the fragment returned by _al_kcm_get_recorder_fragment to the user,
+ *  holding the given number of samples, and move on to the next one.
+ */
+void _al_kcm_emit_recorder_fragment(ALLEGRO_AUDIO_RECORDER *r,
+   unsigned int samples)
+{
+   ALLEGRO_EVENT user_event;
+   ALLEGRO_AUDIO_RECORDER_EVENT *e;
+
+   user_event.user.type = ALLEGRO_EVENT_AUDIO_RECORDER_FRAGMENT;
+   e = al_get_audio_recorder_event(&user_event);
+   e->samples = samples;
+
+   if (!r->pool) {
+      e->buffer = r->fragments[r->fragment_i];
+      al_emit_user_event(&r->source, &user_event, NULL);
+      if (++r->fragment_i == r->fragment_count) {
+         r->fragment_i = 0;
+      }
+   }
+   else {
+      ASSERT(r->current_fragment);
+      e->buffer = r->current_fragment;
+      r->current_fragment = NULL;
+      al_emit_user_event(&r->source, &user_event, fragment_event_dtor);
+   }
+}
+
+
+static void free_fragments(ALLEGRO_AUDIO_RECORDER *r)
 {
    size_t i;
 
+   if (r->pool) {
+      if (r->current_fragment) {
+         pool_put(r->current_fragment);
+         r->current_fragment = NULL;
+      }
+      orphan_pool(r->pool);
+      r->pool = NULL;
+   }
+
+   if (r->fragments) {
+      for (i = 0; i < r->fragment_count; ++i) {
+         al_free(r->fragments[i]);
+      }
+      al_free(r->fragments);
+      r->fragments = NULL;
+   }
+}
+
+
+static bool alloc_fragment_ring(ALLEGRO_AUDIO_RECORDER *r)
+{
+   size_t i;
+
+   r->fragments = al_calloc(r->fragment_count, sizeof(uint8_t *));
+   if (!r->fragments)
+      return false;
+
+   for (i = 0; i < r->fragment_count; ++i) {
+      r->fragments[i] = al_malloc(r->fragment_size);
+      if (!r->fragments[i])
+         return false;
+   }
+
+   return true;
+}
+
+
+static ALLEGRO_AUDIO_RECORDER *create_recorder(size_t fragment_count,
+   unsigned int samples, unsigned int frequency,
+   ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf, bool pooled)
+{
    ALLEGRO_AUDIO_RECORDER *r;
    ASSERT(_al_kcm_driver);
    
    if (!_al_kcm_driver->allocate_recorder) {
       ALLEGRO_ERROR("Audio driver does not support recording.\n");
-      return false;
+      return NULL;
    }
    
    r = al_calloc(1, sizeof(*r));
    if (!r) {
       ALLEGRO_ERROR("Unable to allocate memory for ALLEGRO_AUDIO_RECORDER\n");
-      return false;
+      return NULL;
    }
    
    r->fragment_count = fragment_count;
@@ -42,32 +285,28 @@ ALLEGRO_AUDIO_RECORDER *al_create_audio_recorder(size_t fragment_count,
    r->chan_conf = chan_conf;
    
    r->sample_size = al_get_channel_count(chan_conf) * al_get_audio_depth_size(depth);
-
-   r->fragments = al_malloc(r->fragment_count * sizeof(uint8_t *));
-   if (!r->fragments) {
-      al_free(r);
-      ALLEGRO_ERROR("Unable to allocate memory for ALLEGRO_AUDIO_RECORDER fragments\n");
-      return false;
-   }
-
    r->fragment_size = r->samples * r->sample_size;
-   for (i = 0; i < fragment_count; ++i) {
-      r->fragments[i] = al_malloc(r->fragment_size);
-      if (!r->fragments[i]) {
-         size_t j;
-         for (j = 0; j < i; ++j) {
-            al_free(r->fragments[j]);
-         }
-         al_free(r->fragments);
 
+   if (pooled) {
+      r->pool = create_pool(r->fragment_size, fragment_count);
+      if (!r->pool) {
+         al_free(r);
          ALLEGRO_ERROR("Unable to allocate memory for ALLEGRO_AUDIO_RECORDER fragments\n");
-         return false;
+         return NULL;
       }
    }
+   else if (!alloc_fragment_ring(r)) {
+      free_fragments(r);
+      al_free(r);
+      ALLEGRO_ERROR("Unable to allocate memory for ALLEGRO_AUDIO_RECORDER fragments\n");
+      return NULL;
+   }
 
    if (_al_kcm_driver->allocate_recorder(r)) {
       ALLEGRO_ERROR("Failed to allocate recorder from driver\n");
-      return false;
+      free_fragments(r);
+      al_free(r);
+      return NULL;
    }
   
    r->is_recording = false;
@@ -82,7 +321,29 @@ ALLEGRO_AUDIO_RECORDER *al_create_audio_recorder(size_t fragment_count,
    }
    
    return r;  
-};
+}
+
+
+/* Function: al_create_audio_recorder
+ */
+ALLEGRO_AUDIO_RECORDER *al_create_audio_recorder(size_t fragment_count,
+   unsigned int samples, unsigned int frequency,
+   ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf)
+{
+   return create_recorder(fragment_count, samples, frequency, depth,
+      chan_conf, false);
+}
+
+
+/* Function: al_create_pooled_audio_recorder
+ */
+ALLEGRO_AUDIO_RECORDER *al_create_pooled_audio_recorder(size_t fragment_count,
+   unsigned int samples, unsigned int frequency,
+   ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf)
+{
+   return create_recorder(fragment_count, samples, frequency, depth,
+      chan_conf, true);
+}
 
 /* Function: al_start_audio_recorder
  */
@@ -161,6 +422,8 @@ void al_destroy_audio_recorder(ALLEGRO_AUDIO_RECORDER *r)
    al_destroy_user_event_source(&r->source);     
    al_destroy_mutex(r->mutex);
    al_destroy_cond(r->cond);
+
+   free_fragments(r);
    
    al_free(r);
 }
\ No newline at end of file
@@ -39,6 +39,7 @@ set(ALLEGRO_SRC_FILES
     src/pixels.c
     src/shader.c
     src/system.c
+    src/thread_pool.c
     src/threads.c
     src/timernu.c
     src/tls.c
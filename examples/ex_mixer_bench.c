@@ -0,0 +1,225 @@
+/*
+ *    Benchmark for the mixer: how many frames per second it can mix for a
+ *    number of voices, at each quality and depth, and what each kind of DSP
+ *    node costs.  Uses the null audio driver, so no sound card is needed.
+ *
+ *    Usage: ex_mixer_bench [voices] [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_audio.h>
+
+#include "common.c"
+
+#define MIXER_FREQUENCY    44100
+/* Different from the mixer's, so that every voice is resampled. */
+#define SAMPLE_FREQUENCY   48000
+
+static volatile unsigned long frames_mixed;
+
+
+static void count_frames(void *buf, unsigned int samples, void *data)
+{
+   (void)buf;
+   (void)data;
+   frames_mixed += samples;
+}
+
+
+static ALLEGRO_SAMPLE *create_test_sample(void)
+{
+   const unsigned int len = SAMPLE_FREQUENCY;
+   float *buf = al_malloc(len * sizeof(float));
+   unsigned int i;
+
+   if (!buf)
+      return NULL;
+   for (i = 0; i < len; i++)
+      buf[i] = 0.1f * sin(2 * ALLEGRO_PI * 441 * i / SAMPLE_FREQUENCY);
+
+   return al_create_sample(buf, len, SAMPLE_FREQUENCY,
+      ALLEGRO_AUDIO_DEPTH_FLOAT32, ALLEGRO_CHANNEL_CONF_1, true);
+}
+
+
+static void bench(ALLEGRO_SAMPLE *spl, int num_voices, double seconds,
+   ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_MIXER_QUALITY quality,
+   const char *name)
+{
+   ALLEGRO_SAMPLE_INSTANCE **instances;
+   ALLEGRO_VOICE *voice;
+   ALLEGRO_MIXER *mixer;
+   unsigned long frames;
+   double t0, t1;
+   int i;
+
+   voice = al_create_voice(MIXER_FREQUENCY, depth, ALLEGRO_CHANNEL_CONF_2);
+   mixer = al_create_mixer(MIXER_FREQUENCY, depth, ALLEGRO_CHANNEL_CONF_2);
+   if (!voice || !mixer) {
+      abort_example("Could not create voice or mixer.\n");
+   }
+   if (!al_set_mixer_quality(mixer, quality)) {
+      abort_example("Could not set mixer quality.\n");
+   }
+   al_set_mixer_postprocess_callback(mixer, count_frames, NULL);
+
+   instances = al_malloc(num_voices * sizeof(*instances));
+   for (i = 0; i < num_voices; i++) {
+      instances[i] = al_create_sample_instance(spl);
+      al_set_sample_instance_playmode(instances[i], ALLEGRO_PLAYMODE_LOOP);
+      al_set_sample_instance_gain(instances[i], 1.0f / num_voices);
+      al_attach_sample_instance_to_mixer(instances[i], mixer);
+      al_play_sample_instance(instances[i]);
+   }
+
+   frames_mixed = 0;
+   t0 = al_get_time();
+   if (!al_attach_mixer_to_voice(mixer, voice)) {
+      abort_example("Could not attach mixer to voice.\n");
+   }
+   al_rest(seconds);
+   frames = frames_mixed;
+   t1 = al_get_time();
+
+   al_destroy_voice(voice);
+   for (i = 0; i < num_voices; i++)
+      al_destroy_sample_instance(instances[i]);
+   al_free(instances);
+   al_destroy_mixer(mixer);
+
+   log_printf("%-8s %-7s %12.0f frames/s %8.1fx real time %8.1f Mvoice-frames/s\n",
+      depth == ALLEGRO_AUDIO_DEPTH_INT16 ? "int16" : "float32", name,
+      frames / (t1 - t0), frames / (t1 - t0) / MIXER_FREQUENCY,
+      frames * (double)num_voices / (t1 - t0) / 1e6);
+}
+
+
+static void bench_dsp(ALLEGRO_SAMPLE *spl, double seconds)
+{
+   enum { NUM_NODES = 5 };
+   static const char *names[NUM_NODES] = {
+      "biquad", "gain", "limiter", "delay", "reverb"
+   };
+   ALLEGRO_DSP_NODE *nodes[NUM_NODES];
+   ALLEGRO_SAMPLE_INSTANCE *instance;
+   ALLEGRO_VOICE *voice;
+   ALLEGRO_MIXER *mixer;
+   const unsigned int ir_len = MIXER_FREQUENCY * 2;
+   float *ir;
+   unsigned int i;
+   int j;
+
+   /* Two seconds of decaying noise make a passable hall. */
+   ir = al_malloc(ir_len * sizeof(float));
+   for (i = 0; i < ir_len; i++) {
+      ir[i] = (rand() / (float)RAND_MAX - 0.5f) *
+         exp(-3.0 * i / MIXER_FREQUENCY) * 0.05f;
+   }
+
+   nodes[0] = al_create_biquad_node(ALLEGRO_BIQUAD_LOWPASS, 5000, 0.707f, 0);
+   nodes[1] = al_create_gain_node(0.8f);
+   nodes[2] = al_create_limiter_node(0.9f, 0.1f);
+   nodes[3] = al_create_delay_node(0.25f, 0.4f, 0.3f);
+   nodes[4] = al_create_convolution_node(ir, ir_len, 0.3f);
+   al_free(ir);
+
+   voice = al_create_voice(MIXER_FREQUENCY, ALLEGRO_AUDIO_DEPTH_FLOAT32,
+      ALLEGRO_CHANNEL_CONF_2);
+   mixer = al_create_mixer(MIXER_FREQUENCY, ALLEGRO_AUDIO_DEPTH_FLOAT32,
+      ALLEGRO_CHANNEL_CONF_2);
+   if (!voice || !mixer) {
+      abort_example("Could not create voice or mixer.\n");
+   }
+   for (j = 0; j < NUM_NODES; j++) {
+      if (!nodes[j] || !al_attach_dsp_node_to_mixer(nodes[j], mixer)) {
+         abort_example("Could not attach %s node.\n", names[j]);
+      }
+   }
+
+   instance = al_create_sample_instance(spl);
+   al_set_sample_instance_playmode(instance, ALLEGRO_PLAYMODE_LOOP);
+   al_attach_sample_instance_to_mixer(instance, mixer);
+   al_play_sample_instance(instance);
+
+   if (!al_attach_mixer_to_voice(mixer, voice)) {
+      abort_example("Could not attach mixer to voice.\n");
+   }
+   al_rest(seconds);
+   al_destroy_voice(voice);
+
+   for (j = 0; j < NUM_NODES; j++) {
+      log_printf("%-8s %8.3f%% of real time\n", names[j],
+         al_get_dsp_node_load(nodes[j]) * 100.0);
+      al_destroy_dsp_node(nodes[j]);
+   }
+
+   al_destroy_sample_instance(instance);
+   al_destroy_mixer(mixer);
+}
+
+
+int main(int argc, char **argv)
+{
+   ALLEGRO_SAMPLE *spl;
+   int num_voices = 64;
+   double seconds = 1.0;
+
+   if (argc > 1)
+      num_voices = atoi(argv[1]);
+   if (argc > 2)
+      seconds = atof(argv[2]);
+   if (num_voices < 1 || seconds <= 0.0) {
+      abort_example("Usage: %s [voices] [seconds]\n", argv[0]);
+   }
+
+   if (!al_init()) {
+      abort_example("Could not init Allegro.\n");
+   }
+
+   open_log();
+
+   /* Mix as fast as possible, without a sound card. */
+   al_set_config_value(al_get_system_config(), "audio", "driver", "null");
+   al_set_config_value(al_get_system_config(), "null", "realtime", "no");
+
+   if (!al_install_audio()) {
+      abort_example("Could not init sound.\n");
+   }
+
+   spl = create_test_sample();
+   if (!spl) {
+      abort_example("Could not create sample.\n");
+   }
+
+   log_printf("Mixing %d voices for %g s at each setting...\n",
+      num_voices, seconds);
+
+   bench(spl, num_voices, seconds, ALLEGRO_AUDIO_DEPTH_FLOAT32,
+      ALLEGRO_MIXER_QUALITY_POINT, "point");
+   bench(spl, num_voices, seconds, ALLEGRO_AUDIO_DEPTH_FLOAT32,
+      ALLEGRO_MIXER_QUALITY_LINEAR, "linear");
+   bench(spl, num_voices, seconds, ALLEGRO_AUDIO_DEPTH_FLOAT32,
+      ALLEGRO_MIXER_QUALITY_CUBIC, "cubic");
+   bench(spl, num_voices, seconds, ALLEGRO_AUDIO_DEPTH_FLOAT32,
+      ALLEGRO_MIXER_QUALITY_SINC, "sinc");
+   /* int16 mixers only do point and linear interpolation. */
+   bench(spl, num_voices, seconds, ALLEGRO_AUDIO_DEPTH_INT16,
+      ALLEGRO_MIXER_QUALITY_POINT, "point");
+   bench(spl, num_voices, seconds, ALLEGRO_AUDIO_DEPTH_INT16,
+      ALLEGRO_MIXER_QUALITY_LINEAR, "linear");
+
+   log_printf("\nDSP nodes on a stereo float32 mixer:\n");
+   bench_dsp(spl, seconds);
+
+   al_destroy_sample(spl);
+   al_uninstall_audio();
+
+   close_log(true);
+
+   return 0;
+}
+
+/* vim: set sts=3 sw=3 et: */
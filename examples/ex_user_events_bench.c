@@ -0,0 +1,139 @@
+/*
+ *    Benchmark for fanning out user events to several event queues, each
+ *    drained by its own thread.
+ *
+ *    Usage: ex_user_events_bench [queues] [events]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <allegro5/allegro.h>
+
+#include "common.c"
+
+#define MAX_QUEUES         64
+#define BENCH_EVENT_TYPE   ALLEGRO_GET_EVENT_TYPE('b', 'n', 'c', 'h')
+#define QUIT_EVENT_TYPE    ALLEGRO_GET_EVENT_TYPE('q', 'u', 'i', 't')
+
+/* Don't let the queues grow without bound if the consumers fall behind. */
+#define MAX_IN_FLIGHT      4096
+
+static ALLEGRO_MUTEX *mutex;
+static ALLEGRO_COND *cond;
+static int num_destroyed;
+static int num_emitted;
+
+
+static void bench_event_dtor(ALLEGRO_USER_EVENT *event)
+{
+   (void)event;
+
+   al_lock_mutex(mutex);
+   num_destroyed++;
+   al_signal_cond(cond);
+   al_unlock_mutex(mutex);
+}
+
+
+static void *consumer_proc(ALLEGRO_THREAD *thread, void *arg)
+{
+   ALLEGRO_EVENT_QUEUE *queue = arg;
+   ALLEGRO_EVENT event;
+   (void)thread;
+
+   for (;;) {
+      al_wait_for_event(queue, &event);
+      if (event.type == QUIT_EVENT_TYPE)
+         break;
+      al_unref_user_event(&event.user);
+   }
+
+   return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+   ALLEGRO_EVENT_SOURCE source;
+   ALLEGRO_EVENT_QUEUE *queues[MAX_QUEUES];
+   ALLEGRO_THREAD *threads[MAX_QUEUES];
+   ALLEGRO_EVENT event;
+   int num_queues = 4;
+   int num_events = 200000;
+   double t0, t1;
+   int i;
+
+   if (argc > 1)
+      num_queues = atoi(argv[1]);
+   if (argc > 2)
+      num_events = atoi(argv[2]);
+   if (num_queues < 1 || num_queues > MAX_QUEUES || num_events < 1) {
+      abort_example("Usage: %s [queues (1-%d)] [events]\n", argv[0],
+         MAX_QUEUES);
+   }
+
+   if (!al_init()) {
+      abort_example("Could not init Allegro.\n");
+   }
+
+   open_log();
+
+   mutex = al_create_mutex();
+   cond = al_create_cond();
+   al_init_user_event_source(&source);
+
+   for (i = 0; i < num_queues; i++) {
+      queues[i] = al_create_event_queue();
+      al_register_event_source(queues[i], &source);
+      threads[i] = al_create_thread(consumer_proc, queues[i]);
+      al_start_thread(threads[i]);
+   }
+
+   log_printf("Emitting %d events to %d queues...\n", num_events, num_queues);
+
+   t0 = al_get_time();
+
+   for (i = 0; i < num_events; i++) {
+      al_lock_mutex(mutex);
+      while (num_emitted - num_destroyed >= MAX_IN_FLIGHT) {
+         al_wait_cond(cond, mutex);
+      }
+      num_emitted++;
+      al_unlock_mutex(mutex);
+
+      event.user.type = BENCH_EVENT_TYPE;
+      event.user.data1 = i;
+      al_emit_user_event(&source, &event, bench_event_dtor);
+   }
+
+   /* Wait until every queue has released every event. */
+   al_lock_mutex(mutex);
+   while (num_destroyed < num_events) {
+      al_wait_cond(cond, mutex);
+   }
+   al_unlock_mutex(mutex);
+
+   t1 = al_get_time();
+
+   event.user.type = QUIT_EVENT_TYPE;
+   al_emit_user_event(&source, &event, NULL);
+
+   for (i = 0; i < num_queues; i++) {
+      al_destroy_thread(threads[i]);
+      al_destroy_event_queue(queues[i]);
+   }
+
+   al_destroy_user_event_source(&source);
+   al_destroy_cond(cond);
+   al_destroy_mutex(mutex);
+
+   log_printf("Time = %g s\n", t1 - t0);
+   log_printf("%g events/s emitted, %g events/s delivered\n",
+      num_events / (t1 - t0), num_events * (double)num_queues / (t1 - t0));
+
+   close_log(true);
+
+   return 0;
+}
+
+/* vim: set sts=3 sw=3 et: */
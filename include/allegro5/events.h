@@ -49,7 +49,9 @@ enum
    ALLEGRO_EVENT_TOUCH_CANCEL                = 53,
    
    ALLEGRO_EVENT_DISPLAY_CONNECTED           = 60,
-   ALLEGRO_EVENT_DISPLAY_DISCONNECTED        = 61
+   ALLEGRO_EVENT_DISPLAY_DISCONNECTED        = 61,
+
+   ALLEGRO_EVENT_TASK_GROUP_FINISHED         = 70
 };
 
 
@@ -183,6 +185,16 @@ typedef struct ALLEGRO_TOUCH_EVENT
 
 
 
+/* Type: ALLEGRO_TASK_GROUP_EVENT
+ */
+typedef struct ALLEGRO_TASK_GROUP_EVENT
+{
+   _AL_EVENT_HEADER(struct ALLEGRO_THREAD_POOL)
+   struct ALLEGRO_TASK_GROUP *group;
+} ALLEGRO_TASK_GROUP_EVENT;
+
+
+
 /* Type: ALLEGRO_USER_EVENT
  */
 typedef struct ALLEGRO_USER_EVENT ALLEGRO_USER_EVENT;
@@ -218,6 +230,7 @@ union ALLEGRO_EVENT
    ALLEGRO_MOUSE_EVENT    mouse;
    ALLEGRO_TIMER_EVENT    timer;
    ALLEGRO_TOUCH_EVENT    touch;
+   ALLEGRO_TASK_GROUP_EVENT task_group;
    ALLEGRO_USER_EVENT     user;
 };
 
@@ -236,6 +249,18 @@ AL_FUNC(void, al_unref_user_event, (ALLEGRO_USER_EVENT *));
 AL_FUNC(void, al_set_event_source_data, (ALLEGRO_EVENT_SOURCE*, intptr_t data));
 AL_FUNC(intptr_t, al_get_event_source_data, (const ALLEGRO_EVENT_SOURCE*));
 
+/* Type: ALLEGRO_EVENT_SOURCE_STATS
+ */
+typedef struct ALLEGRO_EVENT_SOURCE_STATS
+{
+   uint64_t num_emitted;
+   uint64_t num_dropped;
+} ALLEGRO_EVENT_SOURCE_STATS;
+
+AL_FUNC(void, al_get_event_source_stats, (ALLEGRO_EVENT_SOURCE*,
+                                          ALLEGRO_EVENT_SOURCE_STATS *stats));
+AL_FUNC(void, al_reset_event_source_stats, (ALLEGRO_EVENT_SOURCE*));
+
 
 
 /* Event queues */
@@ -244,6 +269,20 @@ AL_FUNC(intptr_t, al_get_event_source_data, (const ALLEGRO_EVENT_SOURCE*));
  */
 typedef struct ALLEGRO_EVENT_QUEUE ALLEGRO_EVENT_QUEUE;
 
+#define ALLEGRO_EVENT_LATENCY_BUCKETS  24
+
+/* Type: ALLEGRO_EVENT_QUEUE_STATS
+ */
+typedef struct ALLEGRO_EVENT_QUEUE_STATS
+{
+   unsigned int high_water_mark;
+   uint64_t num_dequeued;
+   uint64_t num_dropped;
+   double total_latency;
+   double max_latency;
+   uint64_t latency_histogram[ALLEGRO_EVENT_LATENCY_BUCKETS];
+} ALLEGRO_EVENT_QUEUE_STATS;
+
 AL_FUNC(ALLEGRO_EVENT_QUEUE*, al_create_event_queue, (void));
 AL_FUNC(void, al_destroy_event_queue, (ALLEGRO_EVENT_QUEUE*));
 AL_FUNC(void, al_register_event_source, (ALLEGRO_EVENT_QUEUE*, ALLEGRO_EVENT_SOURCE*));
@@ -263,6 +302,13 @@ AL_FUNC(bool, al_wait_for_event_timed, (ALLEGRO_EVENT_QUEUE*,
 AL_FUNC(bool, al_wait_for_event_until, (ALLEGRO_EVENT_QUEUE *queue,
                                         ALLEGRO_EVENT *ret_event,
                                         ALLEGRO_TIMEOUT *timeout));
+AL_FUNC(bool, al_set_event_queue_filter, (ALLEGRO_EVENT_QUEUE*,
+                                          const ALLEGRO_EVENT_TYPE *types,
+                                          int num_types));
+AL_FUNC(void, al_enable_event_queue_stats, (ALLEGRO_EVENT_QUEUE*, bool));
+AL_FUNC(bool, al_get_event_queue_stats, (ALLEGRO_EVENT_QUEUE*,
+                                         ALLEGRO_EVENT_QUEUE_STATS *stats));
+AL_FUNC(void, al_reset_event_queue_stats, (ALLEGRO_EVENT_QUEUE*));
 
 #ifdef __cplusplus
    }
@@ -1,22 +1,34 @@
 #ifndef __al_included_allegro5_aintern_atomicops_h
 #define __al_included_allegro5_aintern_atomicops_h
 
-#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1)
+#if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
 
-   /* gcc 4.1 and above have builtin atomic operations. */
+   /* gcc 4.7 and above, and clang, have builtins for the C11 memory model. */
 
    typedef int _AL_ATOMIC;
 
    AL_INLINE(_AL_ATOMIC,
       _al_fetch_and_add1, (volatile _AL_ATOMIC *ptr),
    {
-      return __sync_fetch_and_add(ptr, 1);
+      return __atomic_fetch_add(ptr, 1, __ATOMIC_SEQ_CST);
    })
 
    AL_INLINE(_AL_ATOMIC,
       _al_sub1_and_fetch, (volatile _AL_ATOMIC *ptr),
    {
-      return __sync_sub_and_fetch(ptr, 1);
+      return __atomic_sub_fetch(ptr, 1, __ATOMIC_SEQ_CST);
+   })
+
+   AL_INLINE(_AL_ATOMIC,
+      _al_atomic_load_acquire, (volatile _AL_ATOMIC *ptr),
+   {
+      return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+   })
+
+   AL_INLINE(void,
+      _al_atomic_store_release, (volatile _AL_ATOMIC *ptr, _AL_ATOMIC value),
+   {
+      __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
    })
 
 #elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
@@ -49,23 +61,99 @@
       return old - 1;
    })
 
-#elif defined(_MSC_VER) && _M_IX86 >= 400
+   /* x86 doesn't reorder loads with older loads or stores with older
+    * stores, so only the compiler needs to be kept in order.
+    */
+   AL_INLINE(_AL_ATOMIC,
+      _al_atomic_load_acquire, (volatile _AL_ATOMIC *ptr),
+   {
+      _AL_ATOMIC value = *ptr;
+      __asm__ __volatile__ ("" : : : "memory");
+      return value;
+   })
 
-   /* MSVC, x86 */
-   /* MinGW supports these too, but we already have asm code above. */
+   AL_INLINE(void,
+      _al_atomic_store_release, (volatile _AL_ATOMIC *ptr, _AL_ATOMIC value),
+   {
+      __asm__ __volatile__ ("" : : : "memory");
+      *ptr = value;
+   })
+
+#elif __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1)
 
-   typedef LONG _AL_ATOMIC;
+   /* gcc 4.1 to 4.6 have builtin atomic operations, but only full
+    * barriers.
+    */
+
+   typedef int _AL_ATOMIC;
 
    AL_INLINE(_AL_ATOMIC,
       _al_fetch_and_add1, (volatile _AL_ATOMIC *ptr),
    {
-      return InterlockedIncrement(ptr) - 1;
+      return __sync_fetch_and_add(ptr, 1);
    })
 
    AL_INLINE(_AL_ATOMIC,
       _al_sub1_and_fetch, (volatile _AL_ATOMIC *ptr),
    {
-      return InterlockedDecrement(ptr);
+      return __sync_sub_and_fetch(ptr, 1);
+   })
+
+   AL_INLINE(_AL_ATOMIC,
+      _al_atomic_load_acquire, (volatile _AL_ATOMIC *ptr),
+   {
+      _AL_ATOMIC value = *ptr;
+      __sync_synchronize();
+      return value;
+   })
+
+   AL_INLINE(void,
+      _al_atomic_store_release, (volatile _AL_ATOMIC *ptr, _AL_ATOMIC value),
+   {
+      __sync_synchronize();
+      *ptr = value;
+   })
+
+#elif defined(_MSC_VER)
+
+   /* MSVC */
+   /* MinGW supports these too, but we already have asm code above.
+    * Use the compiler intrinsics so that this header does not need
+    * windows.h.
+    */
+
+   #include <intrin.h>
+   #pragma intrinsic(_InterlockedIncrement, _InterlockedDecrement)
+   #pragma intrinsic(_InterlockedCompareExchange, _InterlockedExchange)
+
+   typedef long _AL_ATOMIC;
+
+   AL_INLINE(_AL_ATOMIC,
+      _al_fetch_and_add1, (volatile _AL_ATOMIC *ptr),
+   {
+      return _InterlockedIncrement(ptr) - 1;
+   })
+
+   AL_INLINE(_AL_ATOMIC,
+      _al_sub1_and_fetch, (volatile _AL_ATOMIC *ptr),
+   {
+      return _InterlockedDecrement(ptr);
+   })
+
+   /* Plain volatile accesses only have acquire and release semantics with
+    * /volatile:ms, which is not the default on ARM, so use interlocked
+    * operations, which are full barriers everywhere.
+    */
+   AL_INLINE(_AL_ATOMIC,
+      _al_atomic_load_acquire, (volatile _AL_ATOMIC *ptr),
+   {
+      return _InterlockedCompareExchange(ptr, 0, 0);
+   })
+
+   AL_INLINE(void,
+      _al_atomic_store_release, (volatile _AL_ATOMIC *ptr, _AL_ATOMIC value),
+   {
+      _InterlockedExchange(ptr, value);
    })
 
 #elif defined(ALLEGRO_HAVE_OSATOMIC_H)
@@ -93,28 +181,41 @@
       return OSAtomicDecrement32Barrier((_AL_ATOMIC *)ptr);
    })
 
-
-#else
-
-   /* Hope for the best? */
-   #warning Atomic operations undefined for your compiler/architecture.
-
-   typedef int _AL_ATOMIC;
-
    AL_INLINE(_AL_ATOMIC,
-      _al_fetch_and_add1, (volatile _AL_ATOMIC *ptr),
+      _al_atomic_load_acquire, (volatile _AL_ATOMIC *ptr),
    {
-      return (*ptr)++;
+      _AL_ATOMIC value = *ptr;
+      OSMemoryBarrier();
+      return value;
    })
 
-   AL_INLINE(_AL_ATOMIC,
-      _al_sub1_and_fetch, (volatile _AL_ATOMIC *ptr),
+   AL_INLINE(void,
+      _al_atomic_store_release, (volatile _AL_ATOMIC *ptr, _AL_ATOMIC value),
    {
-      return --(*ptr);
+      OSMemoryBarrier();
+      *ptr = value;
    })
 
+
+#else
+
+   /* No atomic operations known for this compiler or architecture, so
+    * they all take a global lock.  See threads.c.
+    */
+   #define ALLEGRO_ATOMICOPS_USE_MUTEX
+
+   typedef int _AL_ATOMIC;
+
+   AL_FUNC(_AL_ATOMIC, _al_fetch_and_add1, (volatile _AL_ATOMIC *ptr));
+   AL_FUNC(_AL_ATOMIC, _al_sub1_and_fetch, (volatile _AL_ATOMIC *ptr));
+   AL_FUNC(_AL_ATOMIC, _al_atomic_load_acquire, (volatile _AL_ATOMIC *ptr));
+   AL_FUNC(void, _al_atomic_store_release, (volatile _AL_ATOMIC *ptr,
+      _AL_ATOMIC value));
+
 #endif
 
+void _al_init_atomicops(void);
+
 #endif
 
 /* vim: set sts=3 sw=3 et: */
@@ -6,6 +6,7 @@
 #include "allegro5/display.h"
 #include "allegro5/render_state.h"
 #include "allegro5/transformations.h"
+#include "allegro5/internal/aintern_list.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -96,6 +97,9 @@ struct ALLEGRO_BITMAP
 
    /* set_target_bitmap and lock_bitmap mark bitmaps as dirty for preservation */
    bool dirty;
+
+   /* Destructor list entry, or NULL if the bitmap is not registered. */
+   _AL_LIST_ITEM *dtor_item;
 };
 
 struct ALLEGRO_BITMAP_INTERFACE
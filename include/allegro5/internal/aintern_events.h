@@ -1,6 +1,7 @@
 #ifndef __al_included_allegro5_aintern_events_h
 #define __al_included_allegro5_aintern_events_h
 
+#include "allegro5/internal/aintern_atomicops.h"
 #include "allegro5/internal/aintern_thread.h"
 #include "allegro5/internal/aintern_vector.h"
 
@@ -16,17 +17,17 @@ struct ALLEGRO_EVENT_SOURCE_REAL
    _AL_MUTEX mutex;
    _AL_VECTOR queues;
    intptr_t data;
+   uint64_t num_emitted;   /* protected by mutex */
+   uint64_t num_dropped;
 };
 
 typedef struct ALLEGRO_USER_EVENT_DESCRIPTOR
 {
    void (*dtor)(ALLEGRO_USER_EVENT *event);
-   int refcount;
+   _AL_ATOMIC refcount;
 } ALLEGRO_USER_EVENT_DESCRIPTOR;
 
 
-void _al_init_events(void);
-
 void _al_event_source_init(ALLEGRO_EVENT_SOURCE*);
 void _al_event_source_free(ALLEGRO_EVENT_SOURCE*);
 void _al_event_source_lock(ALLEGRO_EVENT_SOURCE*);
@@ -35,8 +36,13 @@ void _al_event_source_on_registration_to_queue(ALLEGRO_EVENT_SOURCE*, ALLEGRO_EV
 void _al_event_source_on_unregistration_from_queue(ALLEGRO_EVENT_SOURCE*, ALLEGRO_EVENT_QUEUE*);
 bool _al_event_source_needs_to_generate_event(ALLEGRO_EVENT_SOURCE*);
 void _al_event_source_emit_event(ALLEGRO_EVENT_SOURCE *, ALLEGRO_EVENT*);
+void _al_event_source_discard_events(ALLEGRO_EVENT_SOURCE *,
+   bool (*match)(const ALLEGRO_EVENT *, const void *), const void *);
 
-void _al_event_queue_push_event(ALLEGRO_EVENT_QUEUE*, const ALLEGRO_EVENT*);
+bool _al_event_queue_push_event(ALLEGRO_EVENT_QUEUE*, const ALLEGRO_EVENT*);
+void _al_event_queue_discard_events(ALLEGRO_EVENT_QUEUE *,
+   const ALLEGRO_EVENT_SOURCE *,
+   bool (*match)(const ALLEGRO_EVENT *, const void *), const void *);
 
 
 #ifdef __cplusplus
@@ -6,7 +6,7 @@
 #endif
 
 
-extern const ALLEGRO_FILE_INTERFACE _al_file_interface_stdio;
+AL_VAR(const ALLEGRO_FILE_INTERFACE, _al_file_interface_stdio);
 
 #define ALLEGRO_UNGETC_SIZE 16
 
@@ -0,0 +1,24 @@
+#ifndef __al_included_allegro5_aintern_thread_pool_h
+#define __al_included_allegro5_aintern_thread_pool_h
+
+#ifdef __cplusplus
+   extern "C" {
+#endif
+
+void _al_init_thread_pools(void);
+
+/* The process-wide pool which library subsystems share instead of spawning
+ * their own threads.  It is created on first use and sized to the machine.
+ */
+AL_FUNC(ALLEGRO_THREAD_POOL *, _al_get_shared_thread_pool, (void));
+
+AL_FUNC(ALLEGRO_THREAD_POOL *, _al_create_internal_thread_pool,
+   (int num_threads));
+
+#ifdef __cplusplus
+   }
+#endif
+
+#endif
+
+/* vim: set sts=3 sw=3 et: */
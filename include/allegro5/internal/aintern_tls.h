@@ -10,6 +10,8 @@ void _al_tls_init_once(void);
 
 int *_al_tls_get_dtor_owner_count(void);
 
+void **_al_tls_get_thread_pool_worker(void);
+
 
 #ifdef __cplusplus
    }
@@ -17,6 +17,7 @@
 #define __al_included_allegro5_threads_h
 
 #include "allegro5/altime.h"
+#include "allegro5/events.h"
 
 #ifdef __cplusplus
    extern "C" {
@@ -58,6 +59,30 @@ AL_FUNC(int, al_wait_cond_until, (ALLEGRO_COND *cond, ALLEGRO_MUTEX *mutex,
 AL_FUNC(void, al_broadcast_cond, (ALLEGRO_COND *cond));
 AL_FUNC(void, al_signal_cond, (ALLEGRO_COND *cond));
 
+/* Type: ALLEGRO_THREAD_POOL
+ */
+typedef struct ALLEGRO_THREAD_POOL ALLEGRO_THREAD_POOL;
+
+/* Type: ALLEGRO_TASK_GROUP
+ */
+typedef struct ALLEGRO_TASK_GROUP ALLEGRO_TASK_GROUP;
+
+AL_FUNC(ALLEGRO_THREAD_POOL *, al_create_thread_pool, (int num_threads));
+AL_FUNC(void, al_destroy_thread_pool, (ALLEGRO_THREAD_POOL *pool));
+AL_FUNC(int, al_get_thread_pool_size, (const ALLEGRO_THREAD_POOL *pool));
+AL_FUNC(ALLEGRO_EVENT_SOURCE *, al_get_thread_pool_event_source,
+   (ALLEGRO_THREAD_POOL *pool));
+AL_FUNC(bool, al_submit_task, (ALLEGRO_THREAD_POOL *pool,
+   ALLEGRO_TASK_GROUP *group, void (*proc)(void *arg), void *arg));
+
+AL_FUNC(ALLEGRO_TASK_GROUP *, al_create_task_group,
+   (ALLEGRO_THREAD_POOL *pool));
+AL_FUNC(void, al_destroy_task_group, (ALLEGRO_TASK_GROUP *group));
+AL_FUNC(void, al_wait_for_task_group, (ALLEGRO_TASK_GROUP *group));
+AL_FUNC(bool, al_is_task_group_finished, (ALLEGRO_TASK_GROUP *group));
+AL_FUNC(void, al_set_task_group_then, (ALLEGRO_TASK_GROUP *group,
+   void (*proc)(ALLEGRO_TASK_GROUP *group, void *arg), void *arg));
+
 #ifdef __cplusplus
    }
 #endif
@@ -181,7 +181,7 @@ ALLEGRO_BITMAP *al_create_bitmap(int w, int h)
    bitmap = _al_create_bitmap_params(al_get_current_display(), w, h,
       al_get_new_bitmap_format(), al_get_new_bitmap_flags());
    if (bitmap) {
-      _al_register_destructor(_al_dtor_list, bitmap,
+      bitmap->dtor_item = _al_register_destructor(_al_dtor_list, bitmap,
          (void (*)(void *))al_destroy_bitmap);
    }
 
@@ -210,7 +210,7 @@ void al_destroy_bitmap(ALLEGRO_BITMAP *bitmap)
 
    _al_set_bitmap_shader_field(bitmap, NULL);
 
-   _al_unregister_destructor(_al_dtor_list, bitmap);
+   _al_unregister_destructor(_al_dtor_list, bitmap->dtor_item);
 
    if (!al_is_sub_bitmap(bitmap)) {
       ALLEGRO_DISPLAY* disp = _al_get_bitmap_display(bitmap);
@@ -436,7 +436,7 @@ ALLEGRO_BITMAP *al_create_sub_bitmap(ALLEGRO_BITMAP *parent,
    bitmap->yofs = y;
    bitmap->memory = NULL;
 
-   _al_register_destructor(_al_dtor_list, bitmap,
+   bitmap->dtor_item = _al_register_destructor(_al_dtor_list, bitmap,
       (void (*)(void *))al_destroy_bitmap);
 
    return bitmap;
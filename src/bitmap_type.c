@@ -86,6 +86,7 @@ static void swap_bitmaps(ALLEGRO_BITMAP *bitmap, ALLEGRO_BITMAP *other)
 {
    ALLEGRO_BITMAP temp;
    ALLEGRO_DISPLAY *bitmap_display, *other_display;
+   _AL_LIST_ITEM *bitmap_dtor_item, *other_dtor_item;
 
    _al_unregister_convert_bitmap(bitmap);
    _al_unregister_convert_bitmap(other);
@@ -95,10 +96,19 @@ static void swap_bitmaps(ALLEGRO_BITMAP *bitmap, ALLEGRO_BITMAP *other)
    if (bitmap->shader)
       _al_unregister_shader_bitmap(bitmap->shader, bitmap);
 
+   /* The destructor entries refer to the bitmap objects themselves, not to
+    * their contents, so they must stay where they are.
+    */
+   bitmap_dtor_item = bitmap->dtor_item;
+   other_dtor_item = other->dtor_item;
+
    temp = *bitmap;
    *bitmap = *other;
    *other = temp;
 
+   bitmap->dtor_item = bitmap_dtor_item;
+   other->dtor_item = other_dtor_item;
+
    bitmap_display = _al_get_bitmap_display(bitmap);
    other_display = _al_get_bitmap_display(other);
 
@@ -22,17 +22,30 @@
  */
 
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "allegro5/allegro.h"
 #include "allegro5/internal/aintern.h"
 #include "allegro5/internal/aintern_dtor.h"
-#include "allegro5/internal/aintern_exitfunc.h"
 #include "allegro5/internal/aintern_events.h"
 #include "allegro5/internal/aintern_system.h"
 
+ALLEGRO_DEBUG_CHANNEL("events")
 
 
+
+/* Event types below this are looked up in a bitmap, the rest in a list. */
+#define FILTER_BITMAP_TYPES   1024
+
+typedef struct EVENT_FILTER
+{
+   uint32_t bitmap[FILTER_BITMAP_TYPES / 32];
+   int num_other_types;
+   ALLEGRO_EVENT_TYPE *other_types;
+} EVENT_FILTER;
+
 struct ALLEGRO_EVENT_QUEUE
 {
    _AL_VECTOR sources;  /* vector of (ALLEGRO_EVENT_SOURCE *) */
@@ -40,47 +53,28 @@ struct ALLEGRO_EVENT_QUEUE
    unsigned int events_head;  /* write end of circular array */
    unsigned int events_tail;  /* read end of circular array */
    bool paused;
+   EVENT_FILTER *filter;      /* NULL to accept every event type */
    _AL_MUTEX mutex;
    _AL_COND cond;
+   _AL_LIST_ITEM *dtor_item;
+   ALLEGRO_EVENT_QUEUE_STATS *stats;   /* NULL unless enabled */
+   double stats_interval;              /* seconds between log dumps, or 0 */
+   double stats_last_dump;
 };
 
 
 
-/* to prevent concurrent modification of user event reference counts */
-static _AL_MUTEX user_event_refcount_mutex = _AL_MUTEX_UNINITED;
-
-
-
 /* forward declarations */
-static void shutdown_events(void);
 static bool do_wait_for_event(ALLEGRO_EVENT_QUEUE *queue,
    ALLEGRO_EVENT *ret_event, ALLEGRO_TIMEOUT *timeout);
 static void copy_event(ALLEGRO_EVENT *dest, const ALLEGRO_EVENT *src);
 static void ref_if_user_event(ALLEGRO_EVENT *event);
 static void unref_if_user_event(ALLEGRO_EVENT *event);
 static void discard_events_of_source(ALLEGRO_EVENT_QUEUE *queue,
-   const ALLEGRO_EVENT_SOURCE *source);
-
-
-
-/* _al_init_events:
- *  Initialise globals for the event system.
- */
-void _al_init_events(void)
-{
-   _al_mutex_init(&user_event_refcount_mutex);
-   _al_add_exit_func(shutdown_events, "shutdown_events");
-}
-
-
-
-/* shutdown_events:
- *  Clean up after _al_init_events.
- */
-static void shutdown_events(void)
-{
-   _al_mutex_destroy(&user_event_refcount_mutex);
-}
+   const ALLEGRO_EVENT_SOURCE *source,
+   bool (*match)(const ALLEGRO_EVENT *event, const void *data),
+   const void *data);
+static unsigned int num_queued_events(const ALLEGRO_EVENT_QUEUE *queue);
 
 
 
@@ -100,12 +94,14 @@ ALLEGRO_EVENT_QUEUE *al_create_event_queue(void)
       queue->events_head = 0;
       queue->events_tail = 0;
       queue->paused = false;
+      queue->filter = NULL;
+      queue->stats = NULL;
 
       _AL_MARK_MUTEX_UNINITED(queue->mutex);
       _al_mutex_init(&queue->mutex);
       _al_cond_init(&queue->cond);
 
-      _al_register_destructor(_al_dtor_list, queue,
+      queue->dtor_item = _al_register_destructor(_al_dtor_list, queue,
          (void (*)(void *)) al_destroy_event_queue);
    }
 
@@ -120,7 +116,7 @@ void al_destroy_event_queue(ALLEGRO_EVENT_QUEUE *queue)
 {
    ASSERT(queue);
 
-   _al_unregister_destructor(_al_dtor_list, queue);
+   _al_unregister_destructor(_al_dtor_list, queue->dtor_item);
 
    /* Unregister any event sources registered with this queue.  */
    while (_al_vector_is_nonempty(&queue->sources)) {
@@ -134,9 +130,12 @@ void al_destroy_event_queue(ALLEGRO_EVENT_QUEUE *queue)
    ASSERT(queue->events_head == queue->events_tail);
    _al_vector_free(&queue->events);
 
+   al_free(queue->filter);
+
    _al_cond_destroy(&queue->cond);
    _al_mutex_destroy(&queue->mutex);
 
+   al_free(queue->stats);
    al_free(queue);
 }
 
@@ -182,7 +181,7 @@ void al_unregister_event_source(ALLEGRO_EVENT_QUEUE *queue,
 
       /* Drop all the events in the queue that belonged to the source. */
       _al_mutex_lock(&queue->mutex);
-      discard_events_of_source(queue, source);
+      discard_events_of_source(queue, source, NULL, NULL);
       _al_mutex_unlock(&queue->mutex);
    }
 }
@@ -213,6 +212,129 @@ bool al_is_event_queue_paused(const ALLEGRO_EVENT_QUEUE *queue)
 
 
 
+/* Function: al_set_event_queue_filter
+ */
+bool al_set_event_queue_filter(ALLEGRO_EVENT_QUEUE *queue,
+   const ALLEGRO_EVENT_TYPE *types, int num_types)
+{
+   EVENT_FILTER *filter = NULL;
+   EVENT_FILTER *old_filter;
+   int i;
+   ASSERT(queue);
+   ASSERT(num_types >= 0);
+
+   if (types) {
+      filter = al_calloc(1, sizeof(*filter) +
+         num_types * sizeof(ALLEGRO_EVENT_TYPE));
+      if (!filter) {
+         al_set_errno(ENOMEM);
+         return false;
+      }
+      filter->other_types = (ALLEGRO_EVENT_TYPE *)(filter + 1);
+
+      for (i = 0; i < num_types; i++) {
+         const ALLEGRO_EVENT_TYPE type = types[i];
+         if (type < FILTER_BITMAP_TYPES)
+            filter->bitmap[type / 32] |= 1u << (type % 32);
+         else
+            filter->other_types[filter->num_other_types++] = type;
+      }
+   }
+
+   /* Event sources only look at the filter with the queue locked, so the
+    * old one can be freed as soon as it is swapped out.
+    */
+   _al_mutex_lock(&queue->mutex);
+   old_filter = queue->filter;
+   queue->filter = filter;
+   _al_mutex_unlock(&queue->mutex);
+
+   al_free(old_filter);
+
+   return true;
+}
+
+
+
+/* Function: al_enable_event_queue_stats
+ */
+void al_enable_event_queue_stats(ALLEGRO_EVENT_QUEUE *queue, bool enable)
+{
+   ALLEGRO_EVENT_QUEUE_STATS *old_stats = NULL;
+   ALLEGRO_EVENT_QUEUE_STATS *new_stats = NULL;
+   double interval = 0.0;
+   ASSERT(queue);
+
+   if (enable) {
+      ALLEGRO_CONFIG *config = al_get_system_config();
+      const char *value;
+
+      new_stats = al_calloc(1, sizeof(*new_stats));
+      if (!new_stats) {
+         al_set_errno(ENOMEM);
+         return;
+      }
+
+      value = config ?
+         al_get_config_value(config, "trace", "event_stats_interval") : NULL;
+      if (value)
+         interval = atof(value);
+   }
+
+   _al_mutex_lock(&queue->mutex);
+   if (enable && queue->stats) {
+      /* Already enabled; keep the existing figures. */
+      old_stats = new_stats;
+   }
+   else {
+      old_stats = queue->stats;
+      queue->stats = new_stats;
+      queue->stats_interval = interval;
+      queue->stats_last_dump = al_get_time();
+   }
+   _al_mutex_unlock(&queue->mutex);
+
+   al_free(old_stats);
+}
+
+
+
+/* Function: al_get_event_queue_stats
+ */
+bool al_get_event_queue_stats(ALLEGRO_EVENT_QUEUE *queue,
+   ALLEGRO_EVENT_QUEUE_STATS *stats)
+{
+   bool enabled;
+   ASSERT(queue);
+   ASSERT(stats);
+
+   _al_mutex_lock(&queue->mutex);
+   enabled = (queue->stats != NULL);
+   if (enabled)
+      *stats = *queue->stats;
+   _al_mutex_unlock(&queue->mutex);
+
+   return enabled;
+}
+
+
+
+/* Function: al_reset_event_queue_stats
+ */
+void al_reset_event_queue_stats(ALLEGRO_EVENT_QUEUE *queue)
+{
+   ASSERT(queue);
+
+   _al_mutex_lock(&queue->mutex);
+   if (queue->stats) {
+      memset(queue->stats, 0, sizeof(*queue->stats));
+      queue->stats->high_water_mark = num_queued_events(queue);
+   }
+   _al_mutex_unlock(&queue->mutex);
+}
+
+
+
 static void heartbeat(void)
 {
    ALLEGRO_SYSTEM *system = al_get_system_driver();
@@ -252,6 +374,103 @@ static unsigned int circ_array_next(const _AL_VECTOR *vector, unsigned int i)
 
 
 
+/* num_queued_events:
+ *  Return the number of events in the queue.  The queue must be locked.
+ */
+static unsigned int num_queued_events(const ALLEGRO_EVENT_QUEUE *queue)
+{
+   const unsigned int size = _al_vector_size(&queue->events);
+
+   return (queue->events_head + size - queue->events_tail) % size;
+}
+
+
+
+/* latency_bucket:
+ *  Map a latency in seconds to a histogram bucket.  Bucket 0 holds
+ *  latencies under one microsecond, bucket i those in [2^(i-1), 2^i)
+ *  microseconds, and the last bucket everything longer.
+ */
+static int latency_bucket(double latency)
+{
+   double us = latency * 1.0e6;
+   int bucket = 0;
+
+   while (bucket < ALLEGRO_EVENT_LATENCY_BUCKETS - 1 && us >= 1.0) {
+      us *= 0.5;
+      bucket++;
+   }
+
+   return bucket;
+}
+
+
+
+/* log_event_queue_stats:
+ *  Dump a queue's statistics to the log.  The queue must be locked.
+ */
+static void log_event_queue_stats(ALLEGRO_EVENT_QUEUE *queue)
+{
+   const ALLEGRO_EVENT_QUEUE_STATS *stats = queue->stats;
+   char hist[ALLEGRO_EVENT_LATENCY_BUCKETS * 24];
+   size_t len = 0;
+   int i;
+
+   hist[0] = '\0';
+   for (i = 0; i < ALLEGRO_EVENT_LATENCY_BUCKETS; i++) {
+      if (stats->latency_histogram[i] > 0) {
+         /* Each entry needs at most 24 characters. */
+         len += sprintf(hist + len, " %d:%llu", i,
+            (unsigned long long)stats->latency_histogram[i]);
+      }
+   }
+
+   ALLEGRO_INFO("queue %p: %llu dequeued, %llu dropped, high-water mark %u, "
+      "latency mean %.3f ms max %.3f ms, histogram (log2 us):%s\n",
+      (void *)queue,
+      (unsigned long long)stats->num_dequeued,
+      (unsigned long long)stats->num_dropped,
+      stats->high_water_mark,
+      stats->num_dequeued ?
+         1000.0 * stats->total_latency / stats->num_dequeued : 0.0,
+      1000.0 * stats->max_latency,
+      hist);
+}
+
+
+
+/* record_dequeue:
+ *  Account for an event leaving the queue.  The queue must be locked and
+ *  have statistics enabled.
+ */
+static void record_dequeue(ALLEGRO_EVENT_QUEUE *queue,
+   const ALLEGRO_EVENT *event)
+{
+   ALLEGRO_EVENT_QUEUE_STATS *stats = queue->stats;
+   double now = al_get_time();
+
+   stats->num_dequeued++;
+
+   /* Not every driver stamps its events. */
+   if (event->any.timestamp > 0.0) {
+      double latency = now - event->any.timestamp;
+      if (latency < 0.0)
+         latency = 0.0;
+      stats->total_latency += latency;
+      if (latency > stats->max_latency)
+         stats->max_latency = latency;
+      stats->latency_histogram[latency_bucket(latency)]++;
+   }
+
+   if (queue->stats_interval > 0.0 &&
+         now - queue->stats_last_dump >= queue->stats_interval) {
+      log_event_queue_stats(queue);
+      queue->stats_last_dump = now;
+   }
+}
+
+
+
 /* get_next_event_if_any: [primary thread]
  *  Helper function.  It returns a pointer to the next event in the
  *  queue, or NULL.  Optionally the event is removed from the queue.
@@ -271,6 +490,8 @@ static ALLEGRO_EVENT *get_next_event_if_any(ALLEGRO_EVENT_QUEUE *queue,
    event = _al_vector_ref(&queue->events, queue->events_tail);
    if (delete) {
       queue->events_tail = circ_array_next(&queue->events, queue->events_tail);
+      if (queue->stats)
+         record_dequeue(queue, event);
    }
    return event;
 }
@@ -545,9 +766,7 @@ static void ref_if_user_event(ALLEGRO_EVENT *event)
    if (ALLEGRO_EVENT_TYPE_IS_USER(event->type)) {
       ALLEGRO_USER_EVENT_DESCRIPTOR *descr = event->user.__internal__descr;
       if (descr) {
-         _al_mutex_lock(&user_event_refcount_mutex);
-         descr->refcount++;
-         _al_mutex_unlock(&user_event_refcount_mutex);
+         _al_fetch_and_add1(&descr->refcount);
       }
    }
 }
@@ -566,46 +785,100 @@ static void unref_if_user_event(ALLEGRO_EVENT *event)
 
 
 
+/* filter_accepts:
+ *  Return true if the filter lets events of the given type through.
+ */
+static bool filter_accepts(const EVENT_FILTER *filter, ALLEGRO_EVENT_TYPE type)
+{
+   int i;
+
+   if (type < FILTER_BITMAP_TYPES)
+      return (filter->bitmap[type / 32] & (1u << (type % 32))) != 0;
+
+   for (i = 0; i < filter->num_other_types; i++) {
+      if (filter->other_types[i] == type)
+         return true;
+   }
+   return false;
+}
+
+
+
 /* Internal function: _al_event_queue_push_event
  *  Event sources call this function when they have something to add to
  *  the queue.  If a queue cannot accept the event, the event's
- *  refcount will not be incremented.
+ *  refcount will not be incremented and false is returned.  Events
+ *  rejected by the queue's type filter are not considered dropped.
  *
  *  If no event queues can accept the event, the event should be
  *  returned to the event source's list of recyclable events.
  */
-void _al_event_queue_push_event(ALLEGRO_EVENT_QUEUE *queue,
+bool _al_event_queue_push_event(ALLEGRO_EVENT_QUEUE *queue,
    const ALLEGRO_EVENT *orig_event)
 {
    ALLEGRO_EVENT *new_event;
    ASSERT(queue);
    ASSERT(orig_event);
 
-   if (queue->paused)
-      return;
-
    _al_mutex_lock(&queue->mutex);
    {
+      if (queue->filter && !filter_accepts(queue->filter,
+            orig_event->any.type)) {
+         _al_mutex_unlock(&queue->mutex);
+         return true;
+      }
+
+      if (queue->paused) {
+         if (queue->stats)
+            queue->stats->num_dropped++;
+         _al_mutex_unlock(&queue->mutex);
+         return false;
+      }
+
       new_event = alloc_event(queue);
       copy_event(new_event, orig_event);
       ref_if_user_event(new_event);
 
+      if (queue->stats) {
+         unsigned int n = num_queued_events(queue);
+         if (n > queue->stats->high_water_mark)
+            queue->stats->high_water_mark = n;
+      }
+
       /* Wake up threads that are waiting for an event to be placed in
        * the queue.
        */
       _al_cond_broadcast(&queue->cond);
    }
    _al_mutex_unlock(&queue->mutex);
+
+   return true;
+}
+
+
+
+/* is_event_of_source:
+ *  Return true iff the event is from the given source and, if `match' is
+ *  not NULL, `match' returns true for it.
+ */
+static bool is_event_of_source(const ALLEGRO_EVENT *event,
+   const ALLEGRO_EVENT_SOURCE *source,
+   bool (*match)(const ALLEGRO_EVENT *event, const void *data),
+   const void *data)
+{
+   return event->any.source == source && (!match || match(event, data));
 }
 
 
 
 /* contains_event_of_source:
- *  Return true iff the event queue contains an event from the given source.
- *  The queue must be locked.
+ *  Return true iff the event queue contains an event from the given source
+ *  which `match' accepts.  The queue must be locked.
  */
 static bool contains_event_of_source(const ALLEGRO_EVENT_QUEUE *queue,
-   const ALLEGRO_EVENT_SOURCE *source)
+   const ALLEGRO_EVENT_SOURCE *source,
+   bool (*match)(const ALLEGRO_EVENT *event, const void *data),
+   const void *data)
 {
    ALLEGRO_EVENT *event;
    unsigned int i;
@@ -613,7 +886,7 @@ static bool contains_event_of_source(const ALLEGRO_EVENT_QUEUE *queue,
    i = queue->events_tail;
    while (i != queue->events_head) {
       event = _al_vector_ref(&queue->events, i);
-      if (event->any.source == source) {
+      if (is_event_of_source(event, source, match, data)) {
          return true;
       }
       i = circ_array_next(&queue->events, i);
@@ -635,11 +908,14 @@ static int pot(int x)
 
 
 /* discard_events_of_source:
- *  Discard all the events in the queue that belong to the source.
+ *  Discard all the events in the queue that belong to the source, or only
+ *  those which `match' returns true for if it is not NULL.
  *  The queue must be locked.
  */
 static void discard_events_of_source(ALLEGRO_EVENT_QUEUE *queue,
-   const ALLEGRO_EVENT_SOURCE *source)
+   const ALLEGRO_EVENT_SOURCE *source,
+   bool (*match)(const ALLEGRO_EVENT *event, const void *data),
+   const void *data)
 {
    _AL_VECTOR old_events;
    ALLEGRO_EVENT *old_event;
@@ -648,7 +924,7 @@ static void discard_events_of_source(ALLEGRO_EVENT_QUEUE *queue,
    size_t new_size;
    unsigned int i;
 
-   if (!contains_event_of_source(queue, source)) {
+   if (!contains_event_of_source(queue, source, match, data)) {
       return;
    }
 
@@ -659,7 +935,7 @@ static void discard_events_of_source(ALLEGRO_EVENT_QUEUE *queue,
    i = queue->events_tail;
    while (i != queue->events_head) {
       old_event = _al_vector_ref(&old_events, i);
-      if (old_event->any.source != source) {
+      if (!is_event_of_source(old_event, source, match, data)) {
          new_event = _al_vector_alloc_back(&queue->events);
          copy_event(new_event, old_event);
       }
@@ -684,6 +960,21 @@ static void discard_events_of_source(ALLEGRO_EVENT_QUEUE *queue,
 
 
 
+/* Internal function: _al_event_queue_discard_events
+ *  Discard the queued events of the source which `match' returns true for.
+ */
+void _al_event_queue_discard_events(ALLEGRO_EVENT_QUEUE *queue,
+   const ALLEGRO_EVENT_SOURCE *source,
+   bool (*match)(const ALLEGRO_EVENT *event, const void *data),
+   const void *data)
+{
+   _al_mutex_lock(&queue->mutex);
+   discard_events_of_source(queue, source, match, data);
+   _al_mutex_unlock(&queue->mutex);
+}
+
+
+
 /* Function: al_unref_user_event
  */
 void al_unref_user_event(ALLEGRO_USER_EVENT *event)
@@ -695,10 +986,8 @@ void al_unref_user_event(ALLEGRO_USER_EVENT *event)
 
    descr = event->__internal__descr;
    if (descr) {
-      _al_mutex_lock(&user_event_refcount_mutex);
       ASSERT(descr->refcount > 0);
-      refcount = --descr->refcount;
-      _al_mutex_unlock(&user_event_refcount_mutex);
+      refcount = _al_sub1_and_fetch(&descr->refcount);
 
       if (refcount == 0) {
          (descr->dtor)(event);
@@ -172,6 +172,7 @@ void _al_event_source_emit_event(ALLEGRO_EVENT_SOURCE *es, ALLEGRO_EVENT *event)
    ALLEGRO_EVENT_SOURCE_REAL *this = (ALLEGRO_EVENT_SOURCE_REAL *)es;
 
    event->any.source = es;
+   this->num_emitted++;
 
    /* Push the event to all the queues that this event source is
     * registered to.
@@ -183,13 +184,39 @@ void _al_event_source_emit_event(ALLEGRO_EVENT_SOURCE *es, ALLEGRO_EVENT *event)
 
       for (i = 0; i < num_queues; i++) {
          slot = _al_vector_ref(&this->queues, i);
-         _al_event_queue_push_event(*slot, event);
+         if (!_al_event_queue_push_event(*slot, event))
+            this->num_dropped++;
       }
    }
 }
 
 
 
+/* Internal function: _al_event_source_discard_events
+ *  Discard the events of the source which are still waiting in its queues
+ *  and which `match' returns true for.
+ */
+void _al_event_source_discard_events(ALLEGRO_EVENT_SOURCE *es,
+   bool (*match)(const ALLEGRO_EVENT *event, const void *data),
+   const void *data)
+{
+   _al_event_source_lock(es);
+   {
+      ALLEGRO_EVENT_SOURCE_REAL *this = (ALLEGRO_EVENT_SOURCE_REAL *)es;
+      size_t num_queues = _al_vector_size(&this->queues);
+      unsigned int i;
+      ALLEGRO_EVENT_QUEUE **slot;
+
+      for (i = 0; i < num_queues; i++) {
+         slot = _al_vector_ref(&this->queues, i);
+         _al_event_queue_discard_events(*slot, es, match, data);
+      }
+   }
+   _al_event_source_unlock(es);
+}
+
+
+
 /* Function: al_init_user_event_source
  */
 void al_init_user_event_source(ALLEGRO_EVENT_SOURCE *src)
@@ -226,7 +253,11 @@ bool al_emit_user_event(ALLEGRO_EVENT_SOURCE *src,
 
    if (dtor) {
       ALLEGRO_USER_EVENT_DESCRIPTOR *descr = al_malloc(sizeof(*descr));
-      descr->refcount = 0;
+      /* The emitter holds a reference until the event has been copied into
+       * every queue.  Otherwise a consumer could release the event and run
+       * the destructor while later queues are still being filled.
+       */
+      descr->refcount = 1;
       descr->dtor = dtor;
       event->user.__internal__descr = descr;
    }
@@ -250,9 +281,9 @@ bool al_emit_user_event(ALLEGRO_EVENT_SOURCE *src,
    }
    _al_event_source_unlock(src);
 
-   if (dtor && !rc) {
-      dtor(&event->user);
-      al_free(event->user.__internal__descr);
+   /* If no queue took a copy this runs the destructor immediately. */
+   if (dtor) {
+      al_unref_user_event(&event->user);
    }
 
    return rc;
@@ -280,6 +311,38 @@ intptr_t al_get_event_source_data(const ALLEGRO_EVENT_SOURCE *source)
 
 
 
+/* Function: al_get_event_source_stats
+ */
+void al_get_event_source_stats(ALLEGRO_EVENT_SOURCE *source,
+   ALLEGRO_EVENT_SOURCE_STATS *stats)
+{
+   ALLEGRO_EVENT_SOURCE_REAL *const rsource = (ALLEGRO_EVENT_SOURCE_REAL *)source;
+   ASSERT(source);
+   ASSERT(stats);
+
+   _al_event_source_lock(source);
+   stats->num_emitted = rsource->num_emitted;
+   stats->num_dropped = rsource->num_dropped;
+   _al_event_source_unlock(source);
+}
+
+
+
+/* Function: al_reset_event_source_stats
+ */
+void al_reset_event_source_stats(ALLEGRO_EVENT_SOURCE *source)
+{
+   ALLEGRO_EVENT_SOURCE_REAL *const rsource = (ALLEGRO_EVENT_SOURCE_REAL *)source;
+   ASSERT(source);
+
+   _al_event_source_lock(source);
+   rsource->num_emitted = 0;
+   rsource->num_dropped = 0;
+   _al_event_source_unlock(source);
+}
+
+
+
 /*
  * Local Variables:
  * c-basic-offset: 3
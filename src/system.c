@@ -25,6 +25,7 @@
 #include "allegro5/internal/aintern_opengl.h"
 #endif
 #include ALLEGRO_INTERNAL_HEADER
+#include "allegro5/internal/aintern_atomicops.h"
 #include "allegro5/internal/aintern_bitmap.h"
 #include "allegro5/internal/aintern_debug.h"
 #include "allegro5/internal/aintern_dtor.h"
@@ -32,6 +33,7 @@
 #include "allegro5/internal/aintern_pixels.h"
 #include "allegro5/internal/aintern_system.h"
 #include "allegro5/internal/aintern_thread.h"
+#include "allegro5/internal/aintern_thread_pool.h"
 #include "allegro5/internal/aintern_timer.h"
 #include "allegro5/internal/aintern_tls.h"
 #include "allegro5/internal/aintern_vector.h"
@@ -265,9 +267,9 @@ bool al_install_system(int version, int (*atexit_ptr)(void (*)(void)))
 
    _al_add_exit_func(shutdown_system_driver, "shutdown_system_driver");
 
-   _al_dtor_list = _al_init_destructors();
+   _al_init_atomicops();
 
-   _al_init_events();
+   _al_dtor_list = _al_init_destructors();
 
    _al_init_pixels();
 
@@ -277,6 +279,8 @@ bool al_install_system(int version, int (*atexit_ptr)(void (*)(void)))
 
    _al_init_timers();
 
+   _al_init_thread_pools();
+
 #ifdef ALLEGRO_CFG_SHADER_GLSL
    _al_glsl_init_shaders();
 #endif
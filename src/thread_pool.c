@@ -0,0 +1,900 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      Thread pools and task groups.
+ *
+ *      See readme.txt for copyright information.
+ */
+
+
+#include "allegro5/allegro.h"
+#include "allegro5/internal/aintern.h"
+#include "allegro5/internal/aintern_dtor.h"
+#include "allegro5/internal/aintern_events.h"
+#include "allegro5/internal/aintern_exitfunc.h"
+#include "allegro5/internal/aintern_system.h"
+#include "allegro5/internal/aintern_thread.h"
+#include "allegro5/internal/aintern_thread_pool.h"
+#include "allegro5/internal/aintern_tls.h"
+
+#if defined(ALLEGRO_WINDOWS)
+   #include <windows.h>
+#elif defined(ALLEGRO_UNIX) || defined(ALLEGRO_MACOSX)
+   #include <unistd.h>
+#endif
+
+ALLEGRO_DEBUG_CHANNEL("threads")
+
+
+/* Upper bound on the number of workers in one pool, whatever the caller or
+ * the machine asks for.
+ */
+#define MAX_WORKERS        64
+
+/* Initial capacity of each worker's deque.  Must be a power of two. */
+#define INITIAL_DEQUE_SIZE 64
+
+
+typedef struct TASK
+{
+   void (*proc)(void *arg);
+   void *arg;
+   ALLEGRO_TASK_GROUP *group;
+} TASK;
+
+
+/* A double ended queue of tasks.  The owning worker pushes and pops at the
+ * back, idle workers steal from the front so they take the oldest (and
+ * usually largest) pieces of work.
+ */
+typedef struct TASK_DEQUE
+{
+   _AL_MUTEX mutex;
+   TASK *tasks;
+   unsigned int capacity;
+   unsigned int head;
+   unsigned int count;
+} TASK_DEQUE;
+
+
+typedef struct WORKER
+{
+   ALLEGRO_THREAD_POOL *pool;
+   ALLEGRO_THREAD *thread;
+   TASK_DEQUE deque;
+   int index;
+
+   /* Signalled when there may be work.  `idle' and `wake' are protected by
+    * the deque's mutex.
+    */
+   _AL_COND cond;
+   bool idle;
+   bool wake;
+} WORKER;
+
+
+struct ALLEGRO_THREAD_POOL
+{
+   ALLEGRO_EVENT_SOURCE es;
+
+   /* Number of workers which are idle or about to be, so that submitting a
+    * task needs to look for one to wake only if this is non-zero.
+    */
+   _AL_ATOMIC idle_workers;
+   _AL_ATOMIC next_worker;
+   bool quit;
+
+   int num_workers;
+   WORKER *workers;
+
+   _AL_LIST_ITEM *dtor_item;
+};
+
+
+struct ALLEGRO_TASK_GROUP
+{
+   ALLEGRO_THREAD_POOL *pool;
+
+   /* Protects the fields below.  Waiters sleep on `cond'. */
+   _AL_MUTEX mutex;
+   _AL_COND cond;
+   unsigned int pending;
+   unsigned int submitted;
+   void (*then_proc)(ALLEGRO_TASK_GROUP *group, void *arg);
+   void *then_arg;
+};
+
+
+static _AL_MUTEX shared_pool_mutex = _AL_MUTEX_UNINITED;
+static ALLEGRO_THREAD_POOL *shared_pool = NULL;
+
+
+
+/* get_cpu_count:
+ *  Return the number of processors available to the process.
+ */
+static int get_cpu_count(void)
+{
+#if defined(ALLEGRO_WINDOWS)
+   SYSTEM_INFO info;
+   GetSystemInfo(&info);
+   return info.dwNumberOfProcessors;
+#elif (defined(ALLEGRO_UNIX) || defined(ALLEGRO_MACOSX)) && \
+   defined(_SC_NPROCESSORS_ONLN)
+   long n = sysconf(_SC_NPROCESSORS_ONLN);
+   return (n > 0) ? (int)n : 1;
+#else
+   return 1;
+#endif
+}
+
+
+
+static bool deque_init(TASK_DEQUE *deque)
+{
+   _AL_MARK_MUTEX_UNINITED(deque->mutex);
+   deque->tasks = al_malloc(INITIAL_DEQUE_SIZE * sizeof(TASK));
+   if (!deque->tasks)
+      return false;
+   _al_mutex_init(&deque->mutex);
+   deque->capacity = INITIAL_DEQUE_SIZE;
+   deque->head = 0;
+   deque->count = 0;
+   return true;
+}
+
+
+
+static void deque_destroy(TASK_DEQUE *deque)
+{
+   ASSERT(deque->count == 0);
+   _al_mutex_destroy(&deque->mutex);
+   al_free(deque->tasks);
+   deque->tasks = NULL;
+}
+
+
+
+/* deque_push_back:
+ *  Append a task, doubling the ring when it is full.
+ */
+static bool deque_push_back(TASK_DEQUE *deque, const TASK *task)
+{
+   bool ret = true;
+
+   _al_mutex_lock(&deque->mutex);
+
+   if (deque->count == deque->capacity) {
+      unsigned int new_capacity = deque->capacity * 2;
+      TASK *tasks = al_malloc(new_capacity * sizeof(TASK));
+      unsigned int i;
+
+      if (tasks) {
+         for (i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) & (deque->capacity - 1)];
+         }
+         al_free(deque->tasks);
+         deque->tasks = tasks;
+         deque->capacity = new_capacity;
+         deque->head = 0;
+      }
+      else {
+         ret = false;
+      }
+   }
+
+   if (ret) {
+      deque->tasks[(deque->head + deque->count) & (deque->capacity - 1)] =
+         *task;
+      deque->count++;
+   }
+
+   _al_mutex_unlock(&deque->mutex);
+
+   return ret;
+}
+
+
+
+static bool deque_pop_back(TASK_DEQUE *deque, TASK *task)
+{
+   bool ret = false;
+
+   _al_mutex_lock(&deque->mutex);
+   if (deque->count > 0) {
+      deque->count--;
+      *task = deque->tasks[(deque->head + deque->count) & (deque->capacity - 1)];
+      ret = true;
+   }
+   _al_mutex_unlock(&deque->mutex);
+
+   return ret;
+}
+
+
+
+static bool deque_steal_front(TASK_DEQUE *deque, TASK *task)
+{
+   bool ret = false;
+
+   _al_mutex_lock(&deque->mutex);
+   if (deque->count > 0) {
+      *task = deque->tasks[deque->head];
+      deque->head = (deque->head + 1) & (deque->capacity - 1);
+      deque->count--;
+      ret = true;
+   }
+   _al_mutex_unlock(&deque->mutex);
+
+   return ret;
+}
+
+
+
+/* deque_take_group:
+ *  Take the newest task of `group', wherever it is in the deque.
+ */
+static bool deque_take_group(TASK_DEQUE *deque, ALLEGRO_TASK_GROUP *group,
+   TASK *task)
+{
+   const unsigned int mask = deque->capacity - 1;
+   bool ret = false;
+   unsigned int i, j;
+
+   _al_mutex_lock(&deque->mutex);
+   for (i = deque->count; i-- > 0; ) {
+      if (deque->tasks[(deque->head + i) & mask].group == group) {
+         *task = deque->tasks[(deque->head + i) & mask];
+         for (j = i + 1; j < deque->count; j++) {
+            deque->tasks[(deque->head + j - 1) & mask] =
+               deque->tasks[(deque->head + j) & mask];
+         }
+         deque->count--;
+         ret = true;
+         break;
+      }
+   }
+   _al_mutex_unlock(&deque->mutex);
+
+   return ret;
+}
+
+
+
+static bool deque_is_empty(TASK_DEQUE *deque)
+{
+   bool ret;
+
+   _al_mutex_lock(&deque->mutex);
+   ret = (deque->count == 0);
+   _al_mutex_unlock(&deque->mutex);
+
+   return ret;
+}
+
+
+
+/* find_task:
+ *  Fetch a task, first from the back of worker `first', then by stealing
+ *  from the front of the other workers.  If `group' is not NULL, only tasks
+ *  of that group are taken.  Returns false if there is none.
+ */
+static bool find_task(ALLEGRO_THREAD_POOL *pool, int first,
+   ALLEGRO_TASK_GROUP *group, TASK *task)
+{
+   int i;
+
+   if (group) {
+      for (i = 0; i < pool->num_workers; i++) {
+         WORKER *worker = &pool->workers[(first + i) % pool->num_workers];
+         if (deque_take_group(&worker->deque, group, task))
+            return true;
+      }
+      return false;
+   }
+
+   if (deque_pop_back(&pool->workers[first].deque, task))
+      return true;
+
+   for (i = 1; i < pool->num_workers; i++) {
+      WORKER *victim = &pool->workers[(first + i) % pool->num_workers];
+      if (deque_steal_front(&victim->deque, task))
+         return true;
+   }
+
+   return false;
+}
+
+
+
+static bool has_tasks(ALLEGRO_THREAD_POOL *pool)
+{
+   int i;
+
+   for (i = 0; i < pool->num_workers; i++) {
+      if (!deque_is_empty(&pool->workers[i].deque))
+         return true;
+   }
+
+   return false;
+}
+
+
+
+/* wake_idle_worker:
+ *  Called after a task was queued, to wake an idle worker, starting with
+ *  worker `first', so that the task is not left waiting behind a busy one.
+ */
+static void wake_idle_worker(ALLEGRO_THREAD_POOL *pool, int first)
+{
+   int i;
+
+   if (_al_atomic_load_acquire(&pool->idle_workers) == 0)
+      return;
+
+   for (i = 0; i < pool->num_workers; i++) {
+      WORKER *worker = &pool->workers[(first + i) % pool->num_workers];
+      bool woken = false;
+
+      _al_mutex_lock(&worker->deque.mutex);
+      if (worker->idle && !worker->wake) {
+         worker->wake = true;
+         _al_cond_signal(&worker->cond);
+         woken = true;
+      }
+      _al_mutex_unlock(&worker->deque.mutex);
+
+      if (woken)
+         return;
+   }
+}
+
+
+
+/* wait_for_work:
+ *  Sleep until a task may have been queued.  Returns false if the pool is
+ *  quitting and there is nothing left to do.
+ */
+static bool wait_for_work(WORKER *worker)
+{
+   ALLEGRO_THREAD_POOL *pool = worker->pool;
+   bool found;
+   bool quit;
+
+   /* Announce that we are idle before looking once more.  A task queued
+    * after the look will see the announcement and wake us.
+    */
+   _al_mutex_lock(&worker->deque.mutex);
+   worker->idle = true;
+   _al_mutex_unlock(&worker->deque.mutex);
+   _al_fetch_and_add1(&pool->idle_workers);
+
+   found = has_tasks(pool);
+
+   _al_mutex_lock(&worker->deque.mutex);
+   if (!found && !worker->wake && !pool->quit) {
+      _al_cond_wait(&worker->cond, &worker->deque.mutex);
+   }
+   quit = pool->quit;
+   worker->idle = false;
+   worker->wake = false;
+   _al_mutex_unlock(&worker->deque.mutex);
+   _al_sub1_and_fetch(&pool->idle_workers);
+
+   /* Drain the remaining tasks before quitting. */
+   return found || !quit;
+}
+
+
+
+static void emit_task_group_finished_event(ALLEGRO_THREAD_POOL *pool,
+   ALLEGRO_TASK_GROUP *group)
+{
+   ALLEGRO_EVENT event;
+
+   _al_event_source_lock(&pool->es);
+   if (_al_event_source_needs_to_generate_event(&pool->es)) {
+      event.task_group.type = ALLEGRO_EVENT_TASK_GROUP_FINISHED;
+      event.task_group.timestamp = al_get_time();
+      event.task_group.group = group;
+      _al_event_source_emit_event(&pool->es, &event);
+   }
+   _al_event_source_unlock(&pool->es);
+}
+
+
+
+static bool is_finished_event_of_group(const ALLEGRO_EVENT *event,
+   const void *group)
+{
+   return event->type == ALLEGRO_EVENT_TASK_GROUP_FINISHED &&
+      event->task_group.group == group;
+}
+
+
+
+/* release_group:
+ *  Account for a completed task of `group'.  When none are left the
+ *  continuation, if any, runs before the group is reported as finished, if
+ *  `report' is true.  The continuation may submit more tasks to the same
+ *  group, which then keeps the group alive.
+ */
+static void release_group(ALLEGRO_THREAD_POOL *pool, ALLEGRO_TASK_GROUP *group,
+   bool report)
+{
+   _al_mutex_lock(&group->mutex);
+
+   ASSERT(group->pending > 0);
+   group->pending--;
+
+   while (group->pending == 0 && group->then_proc) {
+      void (*proc)(ALLEGRO_TASK_GROUP *, void *) = group->then_proc;
+      void *arg = group->then_arg;
+
+      group->then_proc = NULL;
+      group->then_arg = NULL;
+      /* Keep waiters blocked while the continuation runs. */
+      group->pending++;
+      _al_mutex_unlock(&group->mutex);
+
+      proc(group, arg);
+
+      _al_mutex_lock(&group->mutex);
+      group->pending--;
+   }
+
+   if (group->pending == 0) {
+      /* Waiters cannot observe the group as finished (and free it) until the
+       * mutex is released, so it is still safe to refer to it here.
+       */
+      if (report)
+         emit_task_group_finished_event(pool, group);
+      _al_cond_broadcast(&group->cond);
+   }
+
+   _al_mutex_unlock(&group->mutex);
+}
+
+
+
+static void run_task(ALLEGRO_THREAD_POOL *pool, TASK *task)
+{
+   task->proc(task->arg);
+
+   if (task->group)
+      release_group(pool, task->group, true);
+}
+
+
+
+/* get_current_worker:
+ *  Return the worker of `pool' running in the calling thread, if any.
+ */
+static WORKER *get_current_worker(ALLEGRO_THREAD_POOL *pool)
+{
+   WORKER *worker = *_al_tls_get_thread_pool_worker();
+
+   if (worker && worker->pool == pool)
+      return worker;
+   return NULL;
+}
+
+
+
+static void *worker_proc(ALLEGRO_THREAD *thread, void *arg)
+{
+   WORKER *worker = arg;
+   ALLEGRO_THREAD_POOL *pool = worker->pool;
+   TASK task;
+   (void)thread;
+
+   *_al_tls_get_thread_pool_worker() = worker;
+
+   for (;;) {
+      if (find_task(pool, worker->index, NULL, &task)) {
+         run_task(pool, &task);
+      }
+      else if (!wait_for_work(worker)) {
+         break;
+      }
+   }
+
+   return NULL;
+}
+
+
+
+static void destroy_pool(ALLEGRO_THREAD_POOL *pool)
+{
+   int i;
+
+   pool->quit = true;
+   for (i = 0; i < pool->num_workers; i++) {
+      WORKER *worker = &pool->workers[i];
+      if (worker->deque.tasks) {
+         _al_mutex_lock(&worker->deque.mutex);
+         _al_cond_signal(&worker->cond);
+         _al_mutex_unlock(&worker->deque.mutex);
+      }
+   }
+
+   for (i = 0; i < pool->num_workers; i++) {
+      if (pool->workers[i].thread) {
+         al_join_thread(pool->workers[i].thread, NULL);
+         al_destroy_thread(pool->workers[i].thread);
+      }
+   }
+
+   for (i = 0; i < pool->num_workers; i++) {
+      if (pool->workers[i].deque.tasks) {
+         deque_destroy(&pool->workers[i].deque);
+         _al_cond_destroy(&pool->workers[i].cond);
+      }
+   }
+
+   _al_event_source_free(&pool->es);
+   al_free(pool->workers);
+   al_free(pool);
+}
+
+
+
+static ALLEGRO_THREAD_POOL *create_pool(int num_threads)
+{
+   ALLEGRO_THREAD_POOL *pool;
+   int i;
+
+   if (num_threads <= 0)
+      num_threads = get_cpu_count();
+   if (num_threads > MAX_WORKERS)
+      num_threads = MAX_WORKERS;
+
+   pool = al_calloc(1, sizeof *pool);
+   if (!pool) {
+      al_set_errno(ENOMEM);
+      return NULL;
+   }
+
+   pool->workers = al_calloc(num_threads, sizeof(WORKER));
+   if (!pool->workers) {
+      al_set_errno(ENOMEM);
+      al_free(pool);
+      return NULL;
+   }
+
+   _al_event_source_init(&pool->es);
+   pool->num_workers = num_threads;
+
+   for (i = 0; i < num_threads; i++) {
+      WORKER *worker = &pool->workers[i];
+      worker->pool = pool;
+      worker->index = i;
+      if (!deque_init(&worker->deque)) {
+         al_set_errno(ENOMEM);
+         destroy_pool(pool);
+         return NULL;
+      }
+      _al_cond_init(&worker->cond);
+   }
+
+   for (i = 0; i < num_threads; i++) {
+      WORKER *worker = &pool->workers[i];
+      worker->thread = al_create_thread(worker_proc, worker);
+      if (!worker->thread) {
+         destroy_pool(pool);
+         return NULL;
+      }
+      al_start_thread(worker->thread);
+   }
+
+   ALLEGRO_DEBUG("Created thread pool with %d workers\n", num_threads);
+
+   return pool;
+}
+
+
+
+/* Function: al_create_thread_pool
+ */
+ALLEGRO_THREAD_POOL *al_create_thread_pool(int num_threads)
+{
+   ALLEGRO_THREAD_POOL *pool = create_pool(num_threads);
+
+   if (pool) {
+      pool->dtor_item = _al_register_destructor(_al_dtor_list, pool,
+         (void (*)(void *)) al_destroy_thread_pool);
+   }
+
+   return pool;
+}
+
+
+
+/* Function: al_destroy_thread_pool
+ */
+void al_destroy_thread_pool(ALLEGRO_THREAD_POOL *pool)
+{
+   if (pool) {
+      ASSERT(pool != shared_pool);
+      _al_unregister_destructor(_al_dtor_list, pool->dtor_item);
+      destroy_pool(pool);
+   }
+}
+
+
+
+/* Function: al_get_thread_pool_size
+ */
+int al_get_thread_pool_size(const ALLEGRO_THREAD_POOL *pool)
+{
+   ASSERT(pool);
+
+   return pool->num_workers;
+}
+
+
+
+/* Function: al_get_thread_pool_event_source
+ */
+ALLEGRO_EVENT_SOURCE *al_get_thread_pool_event_source(
+   ALLEGRO_THREAD_POOL *pool)
+{
+   ASSERT(pool);
+
+   return &pool->es;
+}
+
+
+
+/* Function: al_submit_task
+ */
+bool al_submit_task(ALLEGRO_THREAD_POOL *pool, ALLEGRO_TASK_GROUP *group,
+   void (*proc)(void *arg), void *arg)
+{
+   TASK task;
+   WORKER *worker;
+
+   ASSERT(pool);
+   ASSERT(proc);
+   ASSERT(!group || group->pool == pool);
+
+   task.proc = proc;
+   task.arg = arg;
+   task.group = group;
+
+   /* A worker keeps the tasks it submits, which are likely to use data it
+    * has just touched.  Other threads deal them out in turn.
+    */
+   worker = get_current_worker(pool);
+   if (!worker) {
+      unsigned int n = (unsigned int)_al_fetch_and_add1(&pool->next_worker);
+      worker = &pool->workers[n % pool->num_workers];
+   }
+
+   if (group) {
+      _al_mutex_lock(&group->mutex);
+      group->pending++;
+      _al_mutex_unlock(&group->mutex);
+   }
+
+   if (!deque_push_back(&worker->deque, &task)) {
+      if (group) {
+         _al_mutex_lock(&group->mutex);
+         group->pending--;
+         if (group->pending == 0)
+            _al_cond_broadcast(&group->cond);
+         _al_mutex_unlock(&group->mutex);
+      }
+      al_set_errno(ENOMEM);
+      return false;
+   }
+
+   if (group) {
+      /* Threads waiting for the group help with its tasks. */
+      _al_mutex_lock(&group->mutex);
+      group->submitted++;
+      _al_cond_broadcast(&group->cond);
+      _al_mutex_unlock(&group->mutex);
+   }
+
+   wake_idle_worker(pool, worker->index);
+
+   return true;
+}
+
+
+
+/* Function: al_create_task_group
+ */
+ALLEGRO_TASK_GROUP *al_create_task_group(ALLEGRO_THREAD_POOL *pool)
+{
+   ALLEGRO_TASK_GROUP *group;
+
+   ASSERT(pool);
+
+   group = al_calloc(1, sizeof *group);
+   if (!group) {
+      al_set_errno(ENOMEM);
+      return NULL;
+   }
+
+   group->pool = pool;
+   _AL_MARK_MUTEX_UNINITED(group->mutex);
+   _al_mutex_init(&group->mutex);
+   _al_cond_init(&group->cond);
+   return group;
+}
+
+
+
+/* Function: al_destroy_task_group
+ */
+void al_destroy_task_group(ALLEGRO_TASK_GROUP *group)
+{
+   if (group) {
+      al_wait_for_task_group(group);
+      /* Don't leave events pointing to freed memory in the queues. */
+      _al_event_source_discard_events(&group->pool->es,
+         is_finished_event_of_group, group);
+      _al_cond_destroy(&group->cond);
+      _al_mutex_destroy(&group->mutex);
+      al_free(group);
+   }
+}
+
+
+
+/* Function: al_wait_for_task_group
+ */
+void al_wait_for_task_group(ALLEGRO_TASK_GROUP *group)
+{
+   ALLEGRO_THREAD_POOL *pool;
+   WORKER *worker;
+   TASK task;
+
+   ASSERT(group);
+   pool = group->pool;
+   worker = get_current_worker(pool);
+
+   /* Rather than just sleeping, the waiting thread runs queued tasks of the
+    * group itself.  This means tasks may wait for nested groups without
+    * deadlocking the pool, and the wait is not held up by unrelated work.
+    */
+   _al_mutex_lock(&group->mutex);
+   while (group->pending > 0) {
+      unsigned int submitted = group->submitted;
+      _al_mutex_unlock(&group->mutex);
+
+      if (find_task(pool, worker ? worker->index : 0, group, &task)) {
+         run_task(pool, &task);
+         _al_mutex_lock(&group->mutex);
+         continue;
+      }
+
+      _al_mutex_lock(&group->mutex);
+      /* The remaining tasks are running elsewhere, unless more were
+       * submitted since we looked.
+       */
+      if (group->pending > 0 && group->submitted == submitted) {
+         _al_cond_wait(&group->cond, &group->mutex);
+      }
+   }
+   _al_mutex_unlock(&group->mutex);
+}
+
+
+
+/* Function: al_is_task_group_finished
+ */
+bool al_is_task_group_finished(ALLEGRO_TASK_GROUP *group)
+{
+   bool ret;
+
+   ASSERT(group);
+
+   _al_mutex_lock(&group->mutex);
+   ret = (group->pending == 0);
+   _al_mutex_unlock(&group->mutex);
+
+   return ret;
+}
+
+
+
+/* Function: al_set_task_group_then
+ */
+void al_set_task_group_then(ALLEGRO_TASK_GROUP *group,
+   void (*proc)(ALLEGRO_TASK_GROUP *group, void *arg), void *arg)
+{
+   bool finished;
+
+   ASSERT(group);
+
+   _al_mutex_lock(&group->mutex);
+   group->then_proc = proc;
+   group->then_arg = arg;
+   finished = (group->pending == 0);
+   if (finished && proc) {
+      /* Hold the group as if a task were running, then finish it here. */
+      group->pending++;
+   }
+   _al_mutex_unlock(&group->mutex);
+
+   /* The group was reported finished already, so don't report it again
+    * unless the continuation submits more tasks.
+    */
+   if (finished && proc)
+      release_group(group->pool, group, false);
+}
+
+
+
+static void shutdown_thread_pools(void)
+{
+   if (shared_pool) {
+      destroy_pool(shared_pool);
+      shared_pool = NULL;
+   }
+
+   _al_mutex_destroy(&shared_pool_mutex);
+}
+
+
+
+/* Internal function: _al_init_thread_pools
+ */
+void _al_init_thread_pools(void)
+{
+   _al_mutex_init(&shared_pool_mutex);
+   _al_add_exit_func(shutdown_thread_pools, "shutdown_thread_pools");
+}
+
+
+
+/* Internal function: _al_create_internal_thread_pool
+ *  Like al_create_thread_pool, but the pool is not destroyed along with
+ *  user objects when the system shuts down.  For addons whose own objects
+ *  use the pool and are destroyed later; the pool must be freed with
+ *  al_destroy_thread_pool.
+ */
+ALLEGRO_THREAD_POOL *_al_create_internal_thread_pool(int num_threads)
+{
+   return create_pool(num_threads);
+}
+
+
+
+/* Internal function: _al_get_shared_thread_pool
+ *  The size can be overridden with the [system] thread_pool_size key.
+ */
+ALLEGRO_THREAD_POOL *_al_get_shared_thread_pool(void)
+{
+   _al_mutex_lock(&shared_pool_mutex);
+
+   if (!shared_pool) {
+      ALLEGRO_CONFIG *config = al_get_system_config();
+      const char *value = NULL;
+      int num_threads = 0;
+
+      if (config)
+         value = al_get_config_value(config, "system", "thread_pool_size");
+      if (value)
+         num_threads = atoi(value);
+
+      shared_pool = create_pool(num_threads);
+   }
+
+   _al_mutex_unlock(&shared_pool_mutex);
+
+   return shared_pool;
+}
+
+
+/* vim: set sts=3 sw=3 et: */
@@ -18,6 +18,8 @@
 
 #include "allegro5/allegro.h"
 #include "allegro5/internal/aintern.h"
+#include "allegro5/internal/aintern_atomicops.h"
+#include "allegro5/internal/aintern_exitfunc.h"
 #include "allegro5/internal/aintern_thread.h"
 #include "allegro5/internal/aintern_system.h"
 
@@ -400,4 +402,80 @@ void al_signal_cond(ALLEGRO_COND *cond)
 }
 
 
+/* Internal function: _al_init_atomicops
+ *  Called by al_install_system.  Only does anything if there are no atomic
+ *  operations for this platform and they are emulated with a lock.
+ */
+#ifdef ALLEGRO_ATOMICOPS_USE_MUTEX
+
+static _AL_MUTEX atomicops_mutex = _AL_MUTEX_UNINITED;
+static bool atomicops_inited = false;
+
+
+static void shutdown_atomicops(void)
+{
+   _al_mutex_destroy(&atomicops_mutex);
+   atomicops_inited = false;
+}
+
+
+void _al_init_atomicops(void)
+{
+   if (!atomicops_inited) {
+      _al_mutex_init(&atomicops_mutex);
+      atomicops_inited = true;
+      _al_add_exit_func(shutdown_atomicops, "shutdown_atomicops");
+   }
+}
+
+
+_AL_ATOMIC _al_fetch_and_add1(volatile _AL_ATOMIC *ptr)
+{
+   _AL_ATOMIC old;
+
+   _al_mutex_lock(&atomicops_mutex);
+   old = (*ptr)++;
+   _al_mutex_unlock(&atomicops_mutex);
+   return old;
+}
+
+
+_AL_ATOMIC _al_sub1_and_fetch(volatile _AL_ATOMIC *ptr)
+{
+   _AL_ATOMIC new_value;
+
+   _al_mutex_lock(&atomicops_mutex);
+   new_value = --(*ptr);
+   _al_mutex_unlock(&atomicops_mutex);
+   return new_value;
+}
+
+
+_AL_ATOMIC _al_atomic_load_acquire(volatile _AL_ATOMIC *ptr)
+{
+   _AL_ATOMIC value;
+
+   _al_mutex_lock(&atomicops_mutex);
+   value = *ptr;
+   _al_mutex_unlock(&atomicops_mutex);
+   return value;
+}
+
+
+void _al_atomic_store_release(volatile _AL_ATOMIC *ptr, _AL_ATOMIC value)
+{
+   _al_mutex_lock(&atomicops_mutex);
+   *ptr = value;
+   _al_mutex_unlock(&atomicops_mutex);
+}
+
+#else
+
+void _al_init_atomicops(void)
+{
+}
+
+#endif
+
+
 /* vim: set sts=3 sw=3 et: */
@@ -100,6 +100,9 @@ typedef struct thread_local_state {
 
    /* Destructor ownership count */
    int dtor_owner_count;
+
+   /* Thread pool worker running in this thread, if any */
+   void *thread_pool_worker;
 } thread_local_state;
 
 
@@ -869,4 +872,14 @@ int *_al_tls_get_dtor_owner_count(void)
 
 
 
+void **_al_tls_get_thread_pool_worker(void)
+{
+   thread_local_state *tls;
+
+   tls = tls_get();
+   return &tls->thread_pool_worker;
+}
+
+
+
 /* vim: set sts=3 sw=3 et: */